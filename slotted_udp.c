@@ -9,12 +9,21 @@
    Slotted UDP Multicast Header File
 */
 
+#define _GNU_SOURCE
 #include "slotted_udp.h"
+#include "slotted_udp_lz.h"
 #include <unistd.h>
+#include <stdlib.h>
 #include <memory.h>
 #include <stdio.h>
 #include <endian.h>
 #include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <limits.h>
+#include <sched.h>
+#include <sys/mman.h>
 
 
 // Slot           - uint32_t
@@ -25,11 +34,111 @@
 	 sizeof(uint64_t) +     \
 	 sizeof(uint64_t))
 
+// Flags          - uint8_t
+// Slot           - uint8_t
+// Transaction ID - uint16_t, or uint32_t if S_UDP_FLAG_SEQ32 is set.
+// Clock offset   - uint32_t
+#define _S_UDP_COMPACT16_HEADER_LENGTH \
+	(sizeof(uint8_t) +               \
+	 sizeof(uint8_t) +               \
+	 sizeof(uint16_t) +              \
+	 sizeof(uint32_t))
+
+#define _S_UDP_COMPACT32_HEADER_LENGTH \
+	(_S_UDP_COMPACT16_HEADER_LENGTH + sizeof(uint16_t))
+
+// Number of MSG_ZEROCOPY sends that can be in flight before the
+// sender has to reap completions. Each has its own header buffer,
+// since the kernel may read the header after sendmsg() has returned.
+#define _S_UDP_ZEROCOPY_RING 256
+
+// Schedule announcement appended to master packets.
+//   version (uint32_t), slot_width (uint32_t), switch (uint64_t), epoch (uint64_t)
+#define _S_UDP_SCHEDULE_LENGTH 24
+
+// Payload of a S_UDP_CONTROL_REPORT packet.
+//   interval, packets, bytes, peak_bytes (all uint32_t)
+#define _S_UDP_REPORT_LENGTH 16
+
+// Payload of a S_UDP_CONTROL_LEASE_REQUEST packet.
+//   slot, bandwidth (both uint32_t)
+#define _S_UDP_LEASE_REQUEST_LENGTH 8
+
+// Payload of a S_UDP_CONTROL_LEASE_GRANT packet.
+//   slot, duration (both uint32_t)
+#define _S_UDP_LEASE_GRANT_LENGTH 8
+
+// Length of each message in a S_UDP_FLAG_COALESCED payload.
+//   length (uint16_t), followed by length bytes of message
+#define _S_UDP_MESSAGE_PREFIX_LENGTH 2
+
+// Stack touched by s_udp_attach_channel() when locking memory, so
+// that the I/O path does not page fault on stack growth.
+#define _S_UDP_PREFAULT_STACK (128*1024)
+
+// Older headers lack the busy poll options.
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+#ifndef IP_MULTICAST_ALL
+#define IP_MULTICAST_ALL 49
+#endif
+
+// Packets read per s_udp_drain() call by s_udp_wait_for_channel_ready().
+#define _S_UDP_DRAIN_BUDGET 64
+
+// How often, in usec, s_udp_wait_for_channel_ready() checks channels
+// whose transport has no descriptor to wait on.
+#define _S_UDP_READY_POLL_INTERVAL 1000
+
+// How often, in usec, s_udp_wait_for_channel_ready() repeats the
+// join request while there is no master clock.
+#define _S_UDP_JOIN_RETRY 250000
+
+// Address prefix that selects the shared memory transport.
+#define _S_UDP_SHM_SCHEME "shm:"
+
+// Address prefix that selects the redundant dual path transport.
+#define _S_UDP_DUAL_SCHEME "dual:"
+
+// Transaction IDs remembered per slot to filter out the second copy
+// of packets on a redundant channel, and the number of slots that
+// are remembered. Receivers on S_UDP_ALL_SLOTS share an entry
+// between slots that are _S_UDP_DEDUPE_SLOTS apart.
+#define _S_UDP_DEDUPE_WINDOW 256
+#define _S_UDP_DEDUPE_SLOTS 64
+
+typedef struct _s_udp_dedupe_t {
+	uint32_t slot;           // Slot of the entry. 0 if unused.
+	uint64_t top;            // Highest transaction ID received.
+	uint64_t top_clock;      // Send time of the packet that set top.
+	uint64_t last[S_UDP_MAX_PATHS]; // Highest transaction ID received per path.
+	uint64_t seen[S_UDP_MAX_PATHS][_S_UDP_DEDUPE_WINDOW / 64]; // Bit tid % window, per path.
+} s_udp_dedupe_t;
+
 // Convert a struct filled out by clock_gettime(CLOCK_MONOTONIC,
 // struct timespec*) to microseconds.
 #define timespec2usec(tp) (((uint64_t) tp.tv_sec) * 1000000LL + \
 						   ((uint64_t) tp.tv_nsec) / 1000LL)
 
+#define timespec2nsec(tp) (((uint64_t) tp.tv_sec) * 1000000000LL + \
+						   ((uint64_t) tp.tv_nsec))
+
+// Slot timing trace. Build with -DS_UDP_DEBUG to enable.
+#ifdef S_UDP_DEBUG
+#define _debug(...) printf(__VA_ARGS__)
+#else
+#define _debug(...) do { if (0) printf(__VA_ARGS__); } while(0)
+#endif
+
+// Local clock of channel, in usec.
+#define _local_clock(channel) ((channel)->clock->now((channel)->clock_ctx))
+
 
 
 
@@ -47,11 +156,15 @@
 //
 // Each cycle starts when:
 //
-//   master_clock mod cycle_duration == 0
+//   (master_clock - cycle_epoch) mod cycle_duration == 0
 //
 //   - master_clock =  Our local real time clock, slaved to master's
 //                     clock, in usec since arbitrary start time.
 //
+//   - cycle_epoch  =  Master clock that the current schedule took
+//                     effect at. 0 until the master changes schedule.
+//                     See s_udp_set_schedule().
+//
 // Example:
 // If slot_count==10 and slot_width == 100 usec, then
 // cycle_duration == slot_count[10] * slot_width[100] == 1000 usec
@@ -84,45 +197,176 @@
 // If that is the case, slot_start will be postponed cycle_duration usecs,
 // starting at the same point in the next send cycle.
 //
+// Since the master clock only moves forward, most lookups land in
+// the same cycle as the previous one, or in the next. The start of
+// the last cycle is kept in channel->schedule, so those take a
+// compare or an add. Other lookups divide by cycle_duration with a
+// shift, if it is a power of two, or a multiply by its reciprocal.
+//
+// Building with S_UDP_FIXED_SLOT_WIDTH and S_UDP_FIXED_SLOT_COUNT
+// defined makes cycle_duration a constant, which lets the compiler
+// do the division. Schedule changes are then not supported.
+//
+#if defined(S_UDP_FIXED_SLOT_WIDTH) && defined(S_UDP_FIXED_SLOT_COUNT)
+#define _S_UDP_FIXED_CYCLE_DURATION ((uint64_t) S_UDP_FIXED_SLOT_WIDTH * S_UDP_FIXED_SLOT_COUNT)
+#endif
+
+// Return the schedule of channel, rebuilt if the parameters that
+// it was built from have changed.
+static inline s_udp_schedule_t* _get_schedule(s_udp_channel_t* channel)
+{
+	s_udp_schedule_t* sched = &channel->schedule;
+	uint64_t cycle_duration = (uint64_t) channel->slot_width * channel->slot_count;
+
+	if (sched->slot_width == channel->slot_width &&
+		sched->slot_count == channel->slot_count &&
+		sched->cycle_epoch == channel->cycle_epoch)
+		return sched;
+
+#ifdef _S_UDP_FIXED_CYCLE_DURATION
+	if (cycle_duration && cycle_duration != _S_UDP_FIXED_CYCLE_DURATION)
+		fprintf(stderr, "_get_schedule(): Master cycle of %lu usec does not match fixed %lu usec\n",
+				cycle_duration, _S_UDP_FIXED_CYCLE_DURATION);
+	cycle_duration = _S_UDP_FIXED_CYCLE_DURATION;
+#endif
+
+	sched->slot_width = channel->slot_width;
+	sched->slot_count = channel->slot_count;
+	sched->cycle_epoch = channel->cycle_epoch;
+	sched->cycle_duration = cycle_duration;
+	sched->power_of_two = cycle_duration && !(cycle_duration & (cycle_duration - 1));
+	sched->cycle_shift = sched->power_of_two?__builtin_ctzll(cycle_duration):0;
+	sched->reciprocal = (cycle_duration && !sched->power_of_two)?UINT64_MAX / cycle_duration:0;
+
+	// The epoch is the start of a cycle, so lookups can step from there.
+	sched->cycle_start = channel->cycle_epoch;
+	return sched;
+}
+
+
+// Number of whole send cycles in delta usec.
+static inline uint64_t _get_cycle_count(const s_udp_schedule_t* sched, uint64_t delta)
+{
+#ifdef _S_UDP_FIXED_CYCLE_DURATION
+	return delta / _S_UDP_FIXED_CYCLE_DURATION;
+#else
+	uint64_t cycles = 0;
+
+	if (sched->power_of_two)
+		return delta >> sched->cycle_shift;
+
+#ifdef __SIZEOF_INT128__
+	// The reciprocal is rounded down, so this is exact or one short.
+	cycles = (uint64_t) (((unsigned __int128) delta * sched->reciprocal) >> 64);
+	if (delta - cycles * sched->cycle_duration >= sched->cycle_duration)
+		cycles++;
+#else
+	cycles = delta / sched->cycle_duration;
+#endif
+	return cycles;
+#endif
+}
+
+
 static uint64_t _get_cycle_start(s_udp_channel_t* channel, uint64_t master_clock)
 {
-	uint64_t cycle_duration = channel->slot_width * channel->slot_count;
+	s_udp_schedule_t* sched = _get_schedule(channel);
+	uint64_t cycle_duration = sched->cycle_duration;
+	uint64_t cycle_start = sched->cycle_start;
+
+	// No schedule from master yet.
+	if (!cycle_duration)
+		return sched->cycle_epoch;
+
+	// Same or next cycle as the last lookup.
+	if (master_clock >= cycle_start) {
+		if (master_clock - cycle_start < cycle_duration)
+			return cycle_start;
+
+		if (master_clock - cycle_start < 2 * cycle_duration)
+			return sched->cycle_start = cycle_start + cycle_duration;
+	}
+
+	// Clock moved back across a schedule switch. Count backwards.
+	if (master_clock < sched->cycle_epoch)
+		return sched->cycle_epoch -
+			_get_cycle_count(sched, sched->cycle_epoch - master_clock + cycle_duration - 1) * cycle_duration;
+
+	cycle_start = sched->cycle_epoch +
+		_get_cycle_count(sched, master_clock - sched->cycle_epoch) * cycle_duration;
+
+	sched->cycle_start = cycle_start;
+	return cycle_start;
+}
+
+
+// Switch to an announced schedule once master_clock has reached it.
+static void _update_schedule(s_udp_channel_t* channel, uint64_t master_clock)
+{
+	if (!channel->schedule_switch || master_clock < channel->schedule_switch)
+		return;
+
+	channel->slot_width = channel->next_slot_width;
+	channel->cycle_epoch = channel->schedule_switch;
+}
+
+
+// Master clock of channel, after switching to a pending schedule
+// that is due. Only used where the library waits for, checks or
+// announces windows, so that s_udp_get_master_clock() stays a
+// plain read and the schedule changes at known points.
+static uint64_t _get_schedule_clock(s_udp_channel_t* channel)
+{
+	uint64_t master_clock = s_udp_get_master_clock(channel);
 
-	return master_clock / cycle_duration * cycle_duration;
+	if (master_clock)
+		_update_schedule(channel, master_clock);
+
+	return master_clock;
 }
 
 
-static uint64_t _get_slot_start(s_udp_channel_t* channel, uint64_t master_clock)
+static uint64_t _get_slot_start(s_udp_channel_t* channel,
+								uint32_t slot,
+								uint64_t master_clock)
 {
 	// When does our slot window start
 	uint64_t slot_start = 0;
-	uint64_t cycle_duration = channel->slot_width * channel->slot_count;
+	uint64_t cycle_duration = 0;
 	
-	slot_start = _get_cycle_start(channel, master_clock) + channel->slot_width * channel->slot;
+	slot_start = _get_cycle_start(channel, master_clock) + channel->slot_width * slot;
+	cycle_duration = channel->schedule.cycle_duration;
 
 	// Have we already passed our send start window?
 	// Then wait until next cycle
 	if (slot_start < master_clock)
 		slot_start += cycle_duration;
 
+	// Windows after a pending schedule switch are those of the
+	// first cycle of the new schedule.
+	if (channel->schedule_switch > master_clock && slot_start >= channel->schedule_switch)
+		slot_start = channel->schedule_switch + channel->next_slot_width * slot;
+
 	return slot_start;
 }
 
 
 
-static uint8_t _is_in_slot_window(s_udp_channel_t* channel, uint64_t master_clock)
+static uint8_t _is_in_slot_window(s_udp_channel_t* channel,
+								  uint32_t slot,
+								  uint64_t master_clock)
 {
 	uint64_t slot_start = 0;
 	
-	slot_start = _get_cycle_start(channel, master_clock) + channel->slot_width * channel->slot;
+	slot_start = _get_cycle_start(channel, master_clock) + channel->slot_width * slot;
 
-	printf("offset[%lu] start[%lu] now[%lu] stop[%lu]\n",
+	_debug("offset[%lu] start[%lu] now[%lu] stop[%lu]\n",
 		   channel->master_clock_offset,
 		   slot_start,
 		   master_clock,
 		   slot_start + channel->slot_width);
 
-	if (slot_start < master_clock && slot_start + channel->slot_width > master_clock)
+	if (slot_start <= master_clock && slot_start + channel->slot_width > master_clock)
 		return 1;
 
 	return 0;
@@ -141,16 +385,16 @@ s_udp_err_t s_udp_get_sleep_duration(s_udp_channel_t* channel,
 		return S_UDP_ILLEGAL_ARGUMENT;
 	
 
-	master_clock = s_udp_get_master_clock(channel);
+	master_clock = _get_schedule_clock(channel);
 	// When did the current cycle start
 	cycle_start = _get_cycle_start(channel, master_clock);
 
-	slot_start = _get_slot_start(channel, master_clock);
+	slot_start = _get_slot_start(channel, channel->slot, master_clock);
 
 	*slot_wait = slot_start - master_clock;
 
 
-	printf("offset[%lu] master_clock[%lu] cycle_start[%lu] slot_width[%u] slot_start[%u|%lu] slot_wait[%lu]\n",
+	_debug("offset[%lu] master_clock[%lu] cycle_start[%lu] slot_width[%u] slot_start[%u|%lu] slot_wait[%lu]\n",
 		   channel->master_clock_offset,
 		   master_clock,
 		   cycle_start,
@@ -166,16 +410,112 @@ s_udp_err_t s_udp_get_sleep_duration(s_udp_channel_t* channel,
 
 
 
+uint64_t s_udp_get_cycle_start(s_udp_channel_t* channel,
+							   uint64_t master_clock)
+{
+	return _get_cycle_start(channel, master_clock);
+}
+
+
+// Group that the data packets of slot are sent to.
+// See s_udp_set_slot_groups().
+static struct in_addr _get_slot_group(s_udp_channel_t* channel, uint32_t slot)
+{
+	struct in_addr group = channel->address.sin_addr;
+
+	if (channel->slots_per_group && slot != 0 && slot != S_UDP_ALL_SLOTS)
+		group.s_addr = htonl(ntohl(group.s_addr) + 1 + (slot - 1) / channel->slots_per_group);
+
+	return group;
+}
+
+
+// Join the groups of slots first_slot up to, but not including,
+// last_slot, once per group. Returns the number of slots joined,
+// which is short of last_slot if a join failed.
+static uint32_t _join_slot_groups(s_udp_channel_t* channel,
+								  uint32_t first_slot,
+								  uint32_t last_slot)
+{
+	struct ip_mreq mreq;
+	uint32_t slot = 0;
+
+	for (slot = first_slot; slot < last_slot; ++slot) {
+		// One join per group.
+		if (slot != first_slot && (slot - 1) % channel->slots_per_group)
+			continue;
+
+		mreq.imr_multiaddr = _get_slot_group(channel, slot);
+		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+
+		if (setsockopt(channel->socket_des, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0 &&
+			errno != EADDRINUSE) {
+			fprintf(stderr, "s_udp_attach_channel(): Slot %u: %s: ",
+					slot, inet_ntoa(mreq.imr_multiaddr));
+			perror("setsockopt(IP_ADD_MEMBERSHIP)");
+			return slot;
+		}
+	}
+
+	return last_slot;
+}
+
+
+// Take up a slot granted by the master, if it was granted to us.
+static s_udp_err_t _process_grant(s_udp_channel_t* channel,
+								  const s_udp_header_t* header,
+								  const uint8_t* payload,
+								  uint32_t length)
+{
+	uint32_t slot = 0;
+	uint32_t duration = 0;
+
+	if (!channel->node_id || !channel->is_sender ||
+		header->transaction_id != channel->node_id ||
+		length < _S_UDP_LEASE_GRANT_LENGTH)
+		return S_UDP_OK;
+
+	slot = be32toh(*((uint32_t*) payload));
+	duration = be32toh(*((uint32_t*) (payload + 4)));
+
+	// No slot free. Keep asking.
+	if (slot == 0 || slot > S_UDP_SLOT_MASK || !duration) {
+		channel->lease_expires = 0;
+		return S_UDP_OK;
+	}
+
+	if (slot != channel->slot)
+		_debug("_process_grant(): Slot %u leased for %u usec\n", slot, duration);
+
+	channel->slot = slot;
+	channel->slot_address.sin_addr = _get_slot_group(channel, slot);
+	channel->lease_duration = duration;
+	channel->lease_expires = header->clock + duration;
+	channel->lease_renew_at = header->clock + duration / 2;
+	return S_UDP_OK;
+}
+
+
 // Process information received from slotted_udp_master program
 // on slot 0.
 // See slotted_udp_master.c:send_clock() for encoding details
 //
 static s_udp_err_t _process_master(s_udp_channel_t* channel,
-								   uint64_t transaction_id,	
-								   uint64_t master_clock)
+								   const s_udp_header_t* header,
+								   const uint8_t* payload,
+								   uint32_t length)
 {
-	uint64_t local_clock = s_udp_get_local_clock();
+	uint64_t local_clock = _local_clock(channel);
 	uint64_t local_master_clock = 0;
+	uint64_t transaction_id = header->transaction_id;
+	uint64_t master_clock = header->clock;
+
+	if ((header->flags & S_UDP_CONTROL_MASK) == S_UDP_CONTROL_LEASE_GRANT)
+		return _process_grant(channel, header, payload, length);
+
+	// Reports and requests from other nodes are for the master only.
+	if ((header->flags & S_UDP_CONTROL_MASK) != S_UDP_CONTROL_SYNC)
+		return S_UDP_OK;
 
 	// Extract slot count
 	channel->slot_count = be32toh(transaction_id >> 32);
@@ -183,17 +523,39 @@ static s_udp_err_t _process_master(s_udp_channel_t* channel,
 	// Extract slot width (in usec)
 	channel->slot_width = be32toh((uint32_t) (transaction_id & 0x00000000FFFFFFFF));
 
+	// Receivers of all slots learn which groups to join from the master.
+	// A join that failed is not retried.
+	if (channel->slots_per_group && channel->slot == S_UDP_ALL_SLOTS &&
+		!channel->is_sender && channel->socket_des != -1 &&
+		channel->joined_slots < channel->slot_count) {
+		if (_join_slot_groups(channel, channel->joined_slots?channel->joined_slots:1,
+							  channel->slot_count) < channel->slot_count)
+			fprintf(stderr, "_process_master(): Not all slot groups joined\n");
+
+		channel->joined_slots = channel->slot_count;
+	}
+
 	// If this is the first time we receive master clock,
 	// update offset to delta between self and master clock.
 	// Master clock will always be less than local time.
 	//
 	if (!channel->master_clock_offset) {
 		channel->master_clock_offset = local_clock - master_clock;
-		printf("_process_master(): Clock offset set to: %lu\n", channel->master_clock_offset);
+		_debug("_process_master(): Clock offset set to: %lu\n", channel->master_clock_offset);
+
+	}
 
+	// Latest schedule announced by master.
+	// The slot width above is the one in effect when the packet was
+	// sent, which may be before the switch.
+	if (length >= _S_UDP_SCHEDULE_LENGTH) {
+		channel->schedule_version = be32toh(*((uint32_t*) payload));
+		channel->next_slot_width = be32toh(*((uint32_t*) (payload + 4)));
+		channel->schedule_switch = be64toh(*((uint64_t*) (payload + 8)));
+		channel->cycle_epoch = be64toh(*((uint64_t*) (payload + 16)));
 	}
 
-	local_master_clock = s_udp_get_master_clock(channel);
+	local_master_clock = _get_schedule_clock(channel);
 //	printf ("l_master[%ld] - r_master[%ld] = %ld offset[%ld]\n",
 //			local_master_clock, master_clock, master_clock - local_master_clock,
 //			channel->master_clock_offset);
@@ -210,7 +572,7 @@ static s_udp_err_t _process_master(s_udp_channel_t* channel,
 	// Remember this in channel->master_clock_offset
 	//
 	if (master_clock < local_master_clock) {
-		printf("_process_master(): Improved latency by [%lu] usec\n",
+		_debug("_process_master(): Improved latency by [%lu] usec\n",
 			   local_master_clock - master_clock);
 		channel->master_clock_offset+=10;
 	}
@@ -238,41 +600,139 @@ static s_udp_err_t _encode_header(uint8_t* header_buf,
 }
 
 
-static s_udp_err_t _decode_header(uint8_t*  packet,
-								  uint32_t  packet_length,
-								  s_udp_channel_t* channel,
-								  uint32_t* latency,
-								  uint8_t*  packet_loss_detected,
-								  uint8_t*  master_packet_processed)
+// destination must be at least _S_UDP_COMPACT32_HEADER_LENGTH big.
+// Returns the number of bytes encoded.
+static uint32_t _encode_compact_header(uint8_t* header_buf,
+									   uint32_t flags,
+									   uint32_t slot,
+									   uint64_t transaction_id,
+									   uint32_t clock_offset)
 {
-	uint64_t transaction_id = 0;
-	uint32_t slot = 0;
-	uint64_t clock = 0;
-	uint64_t master_clock = 0;
-	*master_packet_processed = 0;
+	uint8_t* ptr = header_buf;
+
+	*ptr++ = (uint8_t) ((flags | S_UDP_FLAG_COMPACT) >> 24);
+	*ptr++ = (uint8_t) slot;
+
+	if (flags & S_UDP_FLAG_SEQ32) {
+		*ptr++ = (uint8_t) (transaction_id >> 24);
+		*ptr++ = (uint8_t) (transaction_id >> 16);
+	}
+	*ptr++ = (uint8_t) (transaction_id >> 8);
+	*ptr++ = (uint8_t) transaction_id;
+
+	*ptr++ = (uint8_t) (clock_offset >> 24);
+	*ptr++ = (uint8_t) (clock_offset >> 16);
+	*ptr++ = (uint8_t) (clock_offset >> 8);
+	*ptr++ = (uint8_t) clock_offset;
+
+	return ptr - header_buf;
+}
+
+
+// Extend a wrapping transaction ID of the given bit width to 64 bits
+// by picking the value closest to the last received transaction ID.
+static uint64_t _extend_transaction_id(uint64_t last_transaction_id,
+									   uint32_t transaction_id,
+									   uint32_t bits)
+{
+	uint64_t mask = (1ULL << bits) - 1;
+	uint64_t delta = (transaction_id - last_transaction_id) & mask;
+
+	// Is delta a step backwards? (sign bit set)
+	if (delta & (1ULL << (bits - 1)))
+		return last_transaction_id - ((mask + 1) - delta);
+
+	return last_transaction_id + delta;
+}
 
 
-	// Do we have enough data to carry a header?
+// Convert a compact header clock offset, relative to the start of the
+// cycle it was sent in, to an absolute master clock.
+// The cycle closest to master_clock is assumed.
+static uint64_t _expand_clock_offset(s_udp_channel_t* channel,
+									 uint64_t master_clock,
+									 uint32_t clock_offset)
+{
+	uint64_t clock = _get_cycle_start(channel, master_clock) + clock_offset;
+	uint64_t cycle_duration = channel->schedule.cycle_duration;
+
+	if (clock > master_clock + cycle_duration / 2)
+		clock -= cycle_duration;
+	else if (clock + cycle_duration / 2 < master_clock)
+		clock += cycle_duration;
+
+	return clock;
+}
+
+
+// Decode the header fields of a packet without applying any channel logic.
+// Compact headers are returned with a wrapping transaction ID and
+// a clock relative to the start of the send cycle.
+static s_udp_err_t _parse_header(const uint8_t* packet,
+								 uint32_t packet_length,
+								 s_udp_header_t* header)
+{
+	// Do we have enough data to carry the smallest header?
+	if (packet_length < _S_UDP_COMPACT16_HEADER_LENGTH)
+		return S_UDP_MALFORMED_PACKET;
+
+	if (packet[0] & (S_UDP_FLAG_COMPACT >> 24)) {
+		uint32_t sequence = 0;
+
+		// ----
+		// Decode compact flags and slot
+		// ----
+		header->flags = ((uint32_t) packet[0]) << 24;
+		header->slot = packet[1];
+		packet += 2;
+
+		header->header_length = (header->flags & S_UDP_FLAG_SEQ32)?
+			_S_UDP_COMPACT32_HEADER_LENGTH:_S_UDP_COMPACT16_HEADER_LENGTH;
+
+		// Slot 0 (master) always uses the standard header.
+		if (packet_length < header->header_length || !header->slot)
+			return S_UDP_MALFORMED_PACKET;
+
+		// ----
+		// Decode wrapping transaction id
+		// ----
+		if (header->flags & S_UDP_FLAG_SEQ32) {
+			sequence = ((uint32_t) packet[0] << 24) | ((uint32_t) packet[1] << 16);
+			packet += 2;
+		}
+		sequence |= (packet[0] << 8) | packet[1];
+		packet += 2;
+
+		header->transaction_id = sequence;
+
+		// ----
+		// Decode clock offset.
+		// ----
+		header->clock = ((uint32_t) packet[0] << 24) | ((uint32_t) packet[1] << 16) |
+			((uint32_t) packet[2] << 8) | packet[3];
+
+		return S_UDP_OK;
+	}
+
 	if (packet_length < _S_UDP_HEADER_LENGTH)
 		return S_UDP_MALFORMED_PACKET;
 
+	header->header_length = _S_UDP_HEADER_LENGTH;
+
 	// ----
-	// Decode slot
+	// Decode slot and flags
 	// ----
-	slot = be32toh(*((uint32_t*) packet));
+	header->slot = be32toh(*((uint32_t*) packet));
 	packet += sizeof(uint32_t);
-		
 
-		
-	// Is this packet the right slot?
-	if (slot != channel->slot && slot != 0)
-		return S_UDP_SLOT_MISMATCH;
+	header->flags = header->slot & ~S_UDP_SLOT_MASK;
+	header->slot &= S_UDP_SLOT_MASK;
 
 
 	// ----
 	// Decode transaction id
 	// ----
-	transaction_id = be64toh(*((uint64_t*) packet));
+	header->transaction_id = be64toh(*((uint64_t*) packet));
 
 	packet += sizeof(uint64_t);
 
@@ -280,13 +740,141 @@ static s_udp_err_t _decode_header(uint8_t*  packet,
 	// ----
 	// Decode clock
 	// ----
-	clock = be64toh(*((uint64_t*) packet));
+	header->clock = be64toh(*((uint64_t*) packet));
+
+	return S_UDP_OK;
+}
+
+
+// Record a copy of packet transaction_id in slot, sent at clock and
+// received on channel->rx_path with latency usec. Returns 1 if a copy
+// of it has already been received. Sets *restarted if the sender has
+// restarted its transaction IDs.
+//
+// Each path has its own bitmap of the last _S_UDP_DEDUPE_WINDOW
+// transaction IDs. A packet that leaves the window with its bit set
+// on one path only was lost on the other.
+static uint8_t _is_duplicate(s_udp_channel_t* channel,
+							 uint32_t slot,
+							 uint64_t transaction_id,
+							 uint64_t clock,
+							 uint32_t latency,
+							 uint8_t* restarted)
+{
+	s_udp_dedupe_t* entry = 0;
+	uint32_t path = channel->rx_path;
+	uint32_t steps = 0;
+	uint32_t ind = 0;
+	uint32_t bit = 0;
+	uint32_t other = 0;
+	uint8_t duplicate = 0;
+
+	*restarted = 0;
+	if (path >= channel->path_count)
+		return 0;
+
+	// Without memory for the window, every copy is delivered.
+	if (!channel->dedupe &&
+		!(channel->dedupe = calloc(_S_UDP_DEDUPE_SLOTS, sizeof(s_udp_dedupe_t)))) {
+		perror("s_udp_receive_packet(): calloc()");
+		return 0;
+	}
+
+	channel->path_stats[path].received++;
+	channel->path_stats[path].latency_sum += latency;
+	if (latency > channel->path_stats[path].latency_max)
+		channel->path_stats[path].latency_max = latency;
+
+	entry = &channel->dedupe[slot % _S_UDP_DEDUPE_SLOTS];
+	if (entry->slot != slot) {
+		memset(entry, 0, sizeof(*entry));
+		entry->slot = slot;
+		entry->top = transaction_id;
+		entry->top_clock = clock;
+	}
+
+	// Slide the window up to transaction_id, settling the packets
+	// that drop out of it.
+	if (transaction_id > entry->top) {
+		steps = (transaction_id - entry->top < _S_UDP_DEDUPE_WINDOW)?
+			transaction_id - entry->top:_S_UDP_DEDUPE_WINDOW;
+
+		for (ind = 1; ind <= steps; ++ind) {
+			bit = (entry->top + ind) % _S_UDP_DEDUPE_WINDOW;
+
+			for (other = 0; other < channel->path_count; ++other)
+				if (!(entry->seen[other][bit / 64] & (1ULL << (bit % 64))) &&
+					(entry->seen[other ^ 1][bit / 64] & (1ULL << (bit % 64))))
+					channel->path_stats[other].lost++;
+
+			for (other = 0; other < channel->path_count; ++other)
+				entry->seen[other][bit / 64] &= ~(1ULL << (bit % 64));
+		}
+		entry->top = transaction_id;
+		entry->top_clock = clock;
+	}
+
+	// Far below the window. A copy from a path that lags behind the
+	// other was sent before the packet that set top, and is dropped,
+	// as it can not be told from one that has already been delivered.
+	// A packet sent after it means that the sender restarted its
+	// transaction IDs. Start over from that packet, rather than drop
+	// everything the sender sends until it passes the old top.
+	if (entry->top - transaction_id >= _S_UDP_DEDUPE_WINDOW) {
+		if (clock <= entry->top_clock)
+			return 1;
+
+		memset(entry->seen, 0, sizeof(entry->seen));
+		memset(entry->last, 0, sizeof(entry->last));
+		entry->top = transaction_id;
+		entry->top_clock = clock;
+		*restarted = 1;
+	}
+
+	bit = transaction_id % _S_UDP_DEDUPE_WINDOW;
+	for (other = 0; other < channel->path_count; ++other)
+		if (entry->seen[other][bit / 64] & (1ULL << (bit % 64)))
+			duplicate = 1;
+
+	entry->seen[path][bit / 64] |= 1ULL << (bit % 64);
+	if (transaction_id > entry->last[path])
+		entry->last[path] = transaction_id;
+
+	if (!duplicate)
+		channel->path_stats[path].first++;
+
+	return duplicate;
+}
+
+
+static s_udp_err_t _decode_header(uint8_t*  packet,
+								  uint32_t  packet_length,
+								  s_udp_channel_t* channel,
+								  uint32_t* latency,
+								  uint8_t*  packet_loss_detected,
+								  uint8_t*  master_packet,
+								  s_udp_header_t* header)
+{
+	s_udp_err_t res = S_UDP_OK;
+	uint64_t master_clock = 0;
+	*master_packet = 0;
+
+	if ((res = _parse_header(packet, packet_length, header)) != S_UDP_OK)
+		return res;
+
+	// Is this packet the right slot?
+	if (header->slot != channel->slot && header->slot != 0 &&
+		channel->slot != S_UDP_ALL_SLOTS) {
+		channel->stats.foreign_packets++;
+		return S_UDP_SLOT_MISMATCH;
+	}
 
 	// Is this a clock sync?
-	// If so decode and update channel
-	if (!slot) {
-		*master_packet_processed = 1;
-		return _process_master(channel, transaction_id, clock);
+	// Caller updates channel once the payload, which may carry a
+	// schedule, is in place.
+	if (!header->slot) {
+		*master_packet = 1;
+		return S_UDP_OK;
 	}
 
 	// If we are the sender, we can safely dump any remaining packet
@@ -296,7 +884,7 @@ static s_udp_err_t _decode_header(uint8_t*  packet,
 
 
 	// Was this packet received within its slot send window?
-	master_clock = s_udp_get_master_clock(channel);
+	master_clock = _get_schedule_clock(channel);
 
 	// If we don't have a clock sync yet from master, we cannot
 	// determine if we are in the send window.
@@ -304,38 +892,132 @@ static s_udp_err_t _decode_header(uint8_t*  packet,
 		return S_UDP_TRY_AGAIN;
 	}
 
-	if (!_is_in_slot_window(channel, master_clock))
+	if (header->flags & S_UDP_FLAG_COMPACT) {
+		header->clock = _expand_clock_offset(channel, master_clock, (uint32_t) header->clock);
+
+		// Without a previously received packet there is nothing to extend from.
+		if (channel->transaction_id && channel->slot != S_UDP_ALL_SLOTS)
+			header->transaction_id = _extend_transaction_id(channel->transaction_id,
+															header->transaction_id,
+															(header->flags & S_UDP_FLAG_SEQ32)?32:16);
+	}
+
+	// Drop the second copy of a packet sent on redundant paths,
+	// whenever it arrives. Receivers on all slots extend compact
+	// transaction IDs from those seen in the slot.
+	if (channel->path_count > 1) {
+		uint64_t transaction_id = header->transaction_id;
+		uint8_t restarted = 0;
+		s_udp_dedupe_t* entry = channel->dedupe?
+			&channel->dedupe[header->slot % _S_UDP_DEDUPE_SLOTS]:0;
+
+		if ((header->flags & S_UDP_FLAG_COMPACT) && channel->slot == S_UDP_ALL_SLOTS &&
+			entry && entry->slot == header->slot)
+			transaction_id = _extend_transaction_id(entry->top, transaction_id,
+													(header->flags & S_UDP_FLAG_SEQ32)?32:16);
+
+		// Clock estimates of sender and receiver can differ by a
+		// few usec, in either direction.
+		if (_is_duplicate(channel, header->slot, transaction_id, header->clock,
+						  (master_clock > header->clock)?master_clock - header->clock:0,
+						  &restarted))
+			return S_UDP_TRY_AGAIN;
+
+		// Pick up loss detection from the first packet after a restart,
+		// which would otherwise be taken as filling a gap.
+		if (restarted && channel->slot != S_UDP_ALL_SLOTS)
+			channel->transaction_id = 0;
+	}
+
+	if (!_is_in_slot_window(channel, header->slot, master_clock))
 		return S_UDP_OUT_OF_SYNC;
 
+	// Packets from all slots share channel->transaction_id when
+	// receiving with S_UDP_ALL_SLOTS, making loss detection impossible.
+	if (channel->slot == S_UDP_ALL_SLOTS)
+		*packet_loss_detected = 0;
+
+	// A copy from a slower path may fill a gap behind the last
+	// packet, which has already been reported as loss.
+	else if (channel->path_count > 1 &&
+			 header->transaction_id < channel->transaction_id) {
+		*packet_loss_detected = 0;
+		*latency = master_clock - header->clock;
+		return S_UDP_OK;
+	}
+
 	// Check if we have packet loss.
 	// Detection can only be made if we have previously received a packet
 	// that we compare with, which is indicated by channel->transaction_id != 0.
-	if (channel->transaction_id != 0 &&
-		transaction_id != channel->transaction_id + 1)
+	else if (channel->transaction_id != 0 &&
+		header->transaction_id != channel->transaction_id + 1)
 		*packet_loss_detected = 1;
 	else
 		*packet_loss_detected = 0;
 
 	// Update last received transaction to detect future packet loss.
-	channel->transaction_id = transaction_id;
+	channel->transaction_id = header->transaction_id;
 
 	// Calculate latency
-	*latency = s_udp_get_master_clock(channel) - clock;
+	*latency = s_udp_get_master_clock(channel) - header->clock;
 
-	// printf("decode: slot:     %d\n",   slot);
-	// printf("decode: tid:      %lu\n", transaction_id);
-	// printf("decode: clock:    %lu\n", clock);
+	// printf("decode: slot:     %d\n",   header->slot);
+	// printf("decode: tid:      %lu\n", header->transaction_id);
+	// printf("decode: clock:    %lu\n", header->clock);
 	// printf("decode: latency:  %u\n",  *latency);
 	return S_UDP_OK;
 }
 
 
+s_udp_err_t s_udp_decode_header(s_udp_channel_t* channel,
+								const uint8_t* packet,
+								uint32_t packet_length,
+								s_udp_header_t* header)
+{
+	s_udp_err_t res = S_UDP_OK;
+	uint64_t master_clock = 0;
+
+	if (!packet || !header) {
+		fprintf(stderr, "s_udp_decode_header(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if ((res = _parse_header(packet, packet_length, header)) != S_UDP_OK)
+		return res;
+
+	if (channel && (header->flags & S_UDP_FLAG_COMPACT) &&
+		(master_clock = s_udp_get_master_clock(channel)) != 0)
+		header->clock = _expand_clock_offset(channel, master_clock, (uint32_t) header->clock);
+
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_process_master_packet(s_udp_channel_t* channel,
+										const s_udp_header_t* header,
+										const uint8_t* payload,
+										uint32_t length)
+{
+	if (!channel || !header || header->slot != 0 || (length && !payload)) {
+		fprintf(stderr, "s_udp_process_master_packet(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	return _process_master(channel, header, payload, length);
+}
+
+
 s_udp_err_t s_udp_init_channel(s_udp_channel_t* channel,
 							   uint8_t is_sender,
 							   const char* address,
 							   in_port_t port,
 							   uint32_t slot)
 {
+	char shm_name[NAME_MAX];
+	char dual_paths[2][NAME_MAX];
+	char dual_group[NAME_MAX];
+	const char* group = 0;
+
 	if (!channel || !address) {
 		fprintf(stderr, "s_udp_init_channel(): Illegal argument\n");
 		return S_UDP_ILLEGAL_ARGUMENT;
@@ -343,6 +1025,47 @@ s_udp_err_t s_udp_init_channel(s_udp_channel_t* channel,
 	
 	channel->socket_des = -1;
 
+	// shm:NAME[@address] selects the shared memory transport, with
+	// senders also multicasting to address if it is given.
+	shm_name[0] = 0;
+	dual_paths[0][0] = 0;
+	if (!strncmp(address, _S_UDP_SHM_SCHEME, sizeof(_S_UDP_SHM_SCHEME) - 1)) {
+		address += sizeof(_S_UDP_SHM_SCHEME) - 1;
+		group = strchr(address, '@');
+
+		if ((group?group - address:strlen(address)) >= sizeof(shm_name)) {
+			fprintf(stderr, "s_udp_init_channel(): %s: Illegal address\n", address);
+			return S_UDP_ILLEGAL_ADDRESS;
+		}
+
+		strncpy(shm_name, address, sizeof(shm_name));
+		shm_name[group?group - address:strlen(address)] = 0;
+		address = group?group + 1:"0.0.0.0";
+	}
+
+	// dual:PATH,PATH selects redundant paths. The channel address
+	// is the group of the first.
+	if (!strncmp(address, _S_UDP_DUAL_SCHEME, sizeof(_S_UDP_DUAL_SCHEME) - 1)) {
+		address += sizeof(_S_UDP_DUAL_SCHEME) - 1;
+		group = strchr(address, ',');
+
+		if (!group || group - address >= sizeof(dual_paths[0]) ||
+			strlen(group + 1) >= sizeof(dual_paths[1])) {
+			fprintf(stderr, "s_udp_init_channel(): %s: Illegal address\n", address);
+			return S_UDP_ILLEGAL_ADDRESS;
+		}
+
+		memcpy(dual_paths[0], address, group - address);
+		dual_paths[0][group - address] = 0;
+		strcpy(dual_paths[1], group + 1);
+
+		strcpy(dual_group, dual_paths[0]);
+		if (strchr(dual_group, '%'))
+			*strchr(dual_group, '%') = 0;
+
+		address = dual_group;
+	}
+
 	if (is_sender)
 		channel->is_sender = 1;
 	else
@@ -366,164 +1089,2138 @@ s_udp_err_t s_udp_init_channel(s_udp_channel_t* channel,
 	channel->slot_width = 0;      // Will be set by master
 	channel->transaction_id = 0;
 	channel->master_clock_offset = 0; // Will be calculated based on master clock
+	channel->compression = 0;
+	channel->header_format = S_UDP_HEADER_STANDARD;
+	channel->lz_buffer = 0;
+	channel->gather_buffer = 0;
+	channel->zerocopy = 0;
+	channel->zc_headers = 0;
+	channel->zc_sent = 0;
+	channel->zc_completed = 0;
+	memset(&channel->stats, 0, sizeof(channel->stats));
+	channel->pool = 0;
+	channel->transport = &s_udp_socket_transport;
+	channel->transport_ctx = 0;
+	channel->clock = &s_udp_monotonic_clock;
+	channel->clock_ctx = 0;
+	s_udp_init_rt_config(&channel->rt_config);
+	channel->schedule_version = 0;
+	channel->next_slot_width = 0;
+	channel->schedule_switch = 0;
+	channel->cycle_epoch = 0;
+	memset(&channel->schedule, 0, sizeof(channel->schedule));
+	channel->report_interval = 0;
+	channel->report_start = 0;
+	channel->report_cycle = 0;
+	channel->report_packets = 0;
+	channel->report_bytes = 0;
+	channel->report_peak_bytes = 0;
+	channel->report_window_bytes = 0;
+	channel->coalesce_length = 0;
+	channel->coalesce_buffer = 0;
+	channel->coalesce_used = 0;
+	channel->unpack_buffer = 0;
+	channel->unpack_length = 0;
+	channel->unpack_offset = 0;
+	channel->unpack_latency = 0;
+	channel->path_count = 1;
+	channel->rx_path = 0;
+	channel->dedupe = 0;
+	memset(channel->path_stats, 0, sizeof(channel->path_stats));
+	channel->slots_per_group = 0;
+	channel->slot_address = channel->address;
+	channel->joined_slots = 0;
+	channel->node_id = 0;
+	channel->lease_bandwidth = 0;
+	channel->lease_duration = 0;
+	channel->lease_expires = 0;
+	channel->lease_renew_at = 0;
+	channel->owned_slots = 0;
+	channel->owned_slot_count = 0;
+
+	if (shm_name[0])
+		return s_udp_shm_init(channel, shm_name, group?1:0);
+
+	if (dual_paths[0][0])
+		return s_udp_dual_init(channel, dual_paths[0], dual_paths[1]);
 
 	return S_UDP_OK;
 }
 
 
-s_udp_err_t s_udp_attach_channel(s_udp_channel_t* channel)
+// Make sure that channel->lz_buffer and channel->gather_buffer
+// are allocated
+static s_udp_err_t _alloc_lz_buffer(s_udp_channel_t* channel)
 {
-	struct ip_mreq mreq;
-	struct sockaddr_in local_address;
-	uint32_t flag = 0;
+	if (!channel->lz_buffer)
+		channel->lz_buffer = malloc(S_UDP_MAX_PAYLOAD);
 
-	if (!channel) {
-		fprintf(stderr, "s_udp_attach_channel(): Illegal argument\n");
-		return S_UDP_ILLEGAL_ARGUMENT;
+	if (!channel->gather_buffer)
+		channel->gather_buffer = malloc(S_UDP_MAX_PAYLOAD);
+
+	if (!channel->lz_buffer || !channel->gather_buffer) {
+		perror("_alloc_lz_buffer(): malloc()");
+		return S_UDP_BUFFER_TOO_SMALL;
 	}
 
-	channel->socket_des = socket(AF_INET, SOCK_DGRAM, 0);
+	return S_UDP_OK;
+}
 
-	flag = 1;
-	if (setsockopt(channel->socket_des,
-				   SOL_SOCKET,
-				   SO_REUSEADDR,
-				   &flag,
-				   sizeof(flag)) < 0) {
-		perror("s_udp_attach_channel(): setsockopt(REUSEADDR)");
-		return S_UDP_SUBSCRIPTION_FAILURE;
-	}
 
-	// We are subscribers. Bind local addresss
-	memset(&local_address, 0 , sizeof(local_address));
-	local_address.sin_family = AF_INET;
-	local_address.sin_addr.s_addr = htonl(INADDR_ANY);
-	local_address.sin_port = channel->address.sin_port;
+// Copy length bytes held by the buffers in iov, starting offset
+// bytes in, to data.
+static void _iov_gather(const struct iovec* iov,
+						uint32_t iov_count,
+						uint32_t offset,
+						uint8_t* data,
+						uint32_t length)
+{
+	uint32_t ind = 0;
 
-	if (bind(channel->socket_des,
-			 (struct sockaddr *) &local_address, sizeof(local_address)) < 0) {
-		perror("s_udp_attach_channel(): bind()");
-		return S_UDP_SUBSCRIPTION_FAILURE;
+	for (ind = 0; ind < iov_count && length > 0; ++ind) {
+		uint32_t chunk = 0;
+
+		if (offset >= iov[ind].iov_len) {
+			offset -= iov[ind].iov_len;
+			continue;
+		}
+
+		chunk = iov[ind].iov_len - offset;
+		if (chunk > length)
+			chunk = length;
+
+		memcpy(data, (uint8_t*) iov[ind].iov_base + offset, chunk);
+		data += chunk;
+		length -= chunk;
+		offset = 0;
 	}
-	
-	// Add subscription.
-	mreq.imr_multiaddr.s_addr = channel->address.sin_addr.s_addr;         
-	mreq.imr_interface.s_addr = htonl(INADDR_ANY);         
+}
 
-	if (setsockopt(channel->socket_des, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
-		perror("s_udp_attach_channel(): setsockopt(IP_ADD_MEMBERSHIP)");
-		return S_UDP_SUBSCRIPTION_FAILURE;
+
+// Copy length bytes of data out to the buffers in iov, starting
+// offset bytes in.
+static void _iov_scatter(const struct iovec* iov,
+						 uint32_t iov_count,
+						 uint32_t offset,
+						 const uint8_t* data,
+						 uint32_t length)
+{
+	uint32_t ind = 0;
+
+	for (ind = 0; ind < iov_count && length > 0; ++ind) {
+		uint32_t chunk = 0;
+
+		if (offset >= iov[ind].iov_len) {
+			offset -= iov[ind].iov_len;
+			continue;
+		}
+
+		chunk = iov[ind].iov_len - offset;
+		if (chunk > length)
+			chunk = length;
+
+		memcpy((uint8_t*) iov[ind].iov_base + offset, data, chunk);
+		data += chunk;
+		length -= chunk;
+		offset = 0;
 	}
-	  
-	return S_UDP_OK;
 }
 
 
-s_udp_err_t s_udp_wait_for_channel_ready(s_udp_channel_t* channel)
+// Move the first length bytes held by iov distance bytes further
+// out, toward the end of the buffers. Same as memmove() on a
+// single buffer. Caller guarantees that length + distance fit.
+static void _iov_shift(const struct iovec* iov,
+					   uint32_t iov_count,
+					   uint32_t length,
+					   uint32_t distance)
 {
-	uint8_t buffer[1024];
-	ssize_t length = 0;
-	uint32_t latency = 0;
-	uint8_t packet_loss_detected = 0;
+	uint8_t chunk[_S_UDP_HEADER_LENGTH];
 
-	while(s_udp_is_channel_ready(channel) != S_UDP_OK) {
-		puts("Waiting for master");
-		s_udp_receive_packet(channel,
-							 buffer,
-							 sizeof(buffer),
-							 &length,
-							 &latency,
-							 &packet_loss_detected);
-		
-		usleep(500000);
+	if (iov_count == 1) {
+		memmove((uint8_t*) iov[0].iov_base + distance, iov[0].iov_base, length);
+		return;
+	}
+
+	// Work backwards, one chunk at a time, so that nothing is
+	// overwritten before it has been moved. distance is never
+	// larger than a header, so each chunk fits on the stack.
+	while(length > 0) {
+		uint32_t size = (length < distance)?length:distance;
+
+		_iov_gather(iov, iov_count, length - size, chunk, size);
+		_iov_scatter(iov, iov_count, length - size + distance, chunk, size);
+		length -= size;
 	}
-	puts("We have master clock");
-	return S_UDP_OK;
 }
 
 
-s_udp_err_t s_udp_is_channel_ready(s_udp_channel_t* channel)
+s_udp_err_t s_udp_set_compression(s_udp_channel_t* channel,
+								  uint8_t enabled)
 {
+	s_udp_err_t res = S_UDP_OK;
+
 	if (!channel) {
-		fprintf(stderr, "s_udp_attach_channel(): Illegal argument\n");
+		fprintf(stderr, "s_udp_set_compression(): Illegal argument\n");
 		return S_UDP_ILLEGAL_ARGUMENT;
 	}
 
-	if (channel->master_clock_offset == 0)
-		return S_UDP_NO_MASTER_CLOCK;
+	// Allocate up front to keep malloc() out of the send path.
+	if (enabled && (res = _alloc_lz_buffer(channel)) != S_UDP_OK)
+		return res;
 
+	channel->compression = enabled?1:0;
 	return S_UDP_OK;
 }
 
 
-s_udp_err_t s_udp_get_socket_descriptor(s_udp_channel_t* channel, int32_t* result)
+s_udp_err_t s_udp_set_header_format(s_udp_channel_t* channel,
+									s_udp_header_format_t format)
 {
-	if (!result) {
-		fprintf(stderr, "s_udp_get_socket_descriptor(): Illegal argument\n");
+	if (!channel || format > S_UDP_HEADER_COMPACT32) {
+		fprintf(stderr, "s_udp_set_header_format(): Illegal argument\n");
 		return S_UDP_ILLEGAL_ARGUMENT;
 	}
 
-	if (channel->socket_des == -1) {
-		return S_UDP_NOT_CONNECTED;
+	// Compact headers carry an 8 bit slot.
+	if (format != S_UDP_HEADER_STANDARD &&
+		(channel->slot == 0 || channel->slot > 0xFF)) {
+		fprintf(stderr, "s_udp_set_header_format(): Slot %u cannot use a compact header\n",
+				channel->slot);
+		return S_UDP_ILLEGAL_ARGUMENT;
 	}
-		
+
+	channel->header_format = format;
+	return S_UDP_OK;
+}
+
+
+uint32_t s_udp_get_header_length(s_udp_header_format_t format)
+{
+	switch(format) {
+	case S_UDP_HEADER_COMPACT16:
+		return _S_UDP_COMPACT16_HEADER_LENGTH;
+
+	case S_UDP_HEADER_COMPACT32:
+		return _S_UDP_COMPACT32_HEADER_LENGTH;
+
+	default:
+		return _S_UDP_HEADER_LENGTH;
+	}
+}
+
+
+s_udp_err_t s_udp_get_stats(s_udp_channel_t* channel,
+							s_udp_stats_t* result)
+{
+	if (!channel || !result) {
+		fprintf(stderr, "s_udp_get_stats(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	*result = channel->stats;
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_set_slot_groups(s_udp_channel_t* channel,
+								  uint32_t slots_per_group)
+{
+	if (!channel || channel->socket_des != -1 ||
+		channel->transport == &s_udp_dual_transport) {
+		fprintf(stderr, "s_udp_set_slot_groups(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	channel->slots_per_group = slots_per_group;
+	channel->slot_address = channel->address;
+	channel->slot_address.sin_addr = _get_slot_group(channel, channel->slot);
+
+	// Groups of slots announced later are checked when joined.
+	if (!IN_MULTICAST(ntohl(channel->slot_address.sin_addr.s_addr))) {
+		fprintf(stderr, "s_udp_set_slot_groups(): %s: Slot group is not a multicast group\n",
+				inet_ntoa(channel->slot_address.sin_addr));
+		channel->slots_per_group = 0;
+		channel->slot_address = channel->address;
+		return S_UDP_ILLEGAL_ADDRESS;
+	}
+
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_get_slot_address(s_udp_channel_t* channel,
+								   uint32_t slot,
+								   struct sockaddr_in* result)
+{
+	if (!channel || !result || slot > S_UDP_SLOT_MASK) {
+		fprintf(stderr, "s_udp_get_slot_address(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	*result = channel->address;
+	result->sin_addr = _get_slot_group(channel, slot);
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_get_path_stats(s_udp_channel_t* channel,
+								 uint32_t path,
+								 s_udp_path_stats_t* result)
+{
+	s_udp_dedupe_t* entry = 0;
+	uint64_t transaction_id = 0;
+	uint64_t oldest = 0;
+	uint32_t bit = 0;
+
+	if (!channel || !result || path >= channel->path_count) {
+		fprintf(stderr, "s_udp_get_path_stats(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	*result = channel->path_stats[path];
+
+	// Packets still in the window are lost on path if it has since
+	// delivered a later one.
+	for (entry = channel->dedupe;
+		 entry && entry < channel->dedupe + _S_UDP_DEDUPE_SLOTS; ++entry) {
+		if (!entry->slot)
+			continue;
+
+		oldest = (entry->top >= _S_UDP_DEDUPE_WINDOW)?
+			entry->top - _S_UDP_DEDUPE_WINDOW + 1:0;
+
+		for (transaction_id = oldest; transaction_id < entry->last[path]; ++transaction_id) {
+			bit = transaction_id % _S_UDP_DEDUPE_WINDOW;
+
+			if (!(entry->seen[path][bit / 64] & (1ULL << (bit % 64))) &&
+				(entry->seen[path ^ 1][bit / 64] & (1ULL << (bit % 64))))
+				result->lost++;
+		}
+	}
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_init_rt_config(s_udp_rt_config_t* config)
+{
+	if (!config) {
+		fprintf(stderr, "s_udp_init_rt_config(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	config->cpu = -1;
+	config->priority = 0;
+	config->lock_memory = 0;
+	config->busy_poll = 0;
+	config->rcvbuf = 0;
+	config->sndbuf = 0;
+	config->socket_priority = -1;
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_parse_rt_config(const char* spec,
+								  s_udp_rt_config_t* config)
+{
+	const char* setting = spec;
+	const char* end = 0;
+	const char* value = 0;
+	char* value_end = 0;
+	uint32_t name_length = 0;
+	long number = 0;
+
+	if (!spec || !config) {
+		fprintf(stderr, "s_udp_parse_rt_config(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	while(*setting) {
+		end = strchr(setting, ',');
+		if (!end)
+			end = setting + strlen(setting);
+
+		value = memchr(setting, '=', end - setting);
+		name_length = (value?value:end) - setting;
+
+		if (value) {
+			number = strtol(++value, &value_end, 0);
+			if (value_end != end || value == end) {
+				fprintf(stderr, "s_udp_parse_rt_config(): %.*s: Illegal value\n",
+						(int) (end - setting), setting);
+				return S_UDP_ILLEGAL_ARGUMENT;
+			}
+		}
+
+#define _setting_is(name) (name_length == sizeof(name) - 1 && \
+						   !strncmp(setting, name, name_length))
+
+		if (_setting_is("mlock") && !value)
+			config->lock_memory = 1;
+		else if (_setting_is("cpu") && value && number >= 0 && number < CPU_SETSIZE)
+			config->cpu = number;
+		else if (_setting_is("fifo") && value && number >= 1 && number <= 99)
+			config->priority = number;
+		else if (_setting_is("busy_poll") && value && number >= 0 && number <= INT_MAX)
+			config->busy_poll = number;
+		else if (_setting_is("rcvbuf") && value && number >= 0 && number <= INT_MAX)
+			config->rcvbuf = number;
+		else if (_setting_is("sndbuf") && value && number >= 0 && number <= INT_MAX)
+			config->sndbuf = number;
+		else if (_setting_is("prio") && value && number >= 0 && number <= INT_MAX)
+			config->socket_priority = number;
+		else {
+			fprintf(stderr, "s_udp_parse_rt_config(): %.*s: Illegal setting\n",
+					(int) (end - setting), setting);
+			return S_UDP_ILLEGAL_ARGUMENT;
+		}
+#undef _setting_is
+
+		setting = *end?end + 1:end;
+	}
+
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_set_rt_config(s_udp_channel_t* channel,
+								const s_udp_rt_config_t* config)
+{
+	if (!channel || !config) {
+		fprintf(stderr, "s_udp_set_rt_config(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	channel->rt_config = *config;
+	return S_UDP_OK;
+}
+
+
+// Touch _S_UDP_PREFAULT_STACK bytes of stack below the caller,
+// one page at a time.
+static void _prefault_stack(void)
+{
+	volatile uint8_t stack[_S_UDP_PREFAULT_STACK];
+	uint32_t ind = 0;
+
+	for (ind = 0; ind < sizeof(stack); ind += 4096)
+		stack[ind] = 0;
+}
+
+
+// Set a socket buffer size, beyond net.core.[rw]mem_max if we are
+// allowed to.
+static s_udp_err_t _set_buffer_size(int socket_des,
+									int option,
+									int force_option,
+									int size,
+									const char* name)
+{
+	if (setsockopt(socket_des, SOL_SOCKET, force_option, &size, sizeof(size)) == 0)
+		return S_UDP_OK;
+
+	if (setsockopt(socket_des, SOL_SOCKET, option, &size, sizeof(size)) == 0)
+		return S_UDP_OK;
+
+	fprintf(stderr, "s_udp_attach_channel(): setsockopt(%s): %s\n", name, strerror(errno));
+	return S_UDP_RT_FAILURE;
+}
+
+
+// Apply channel->rt_config to the calling thread, the process
+// and the channel socket.
+static s_udp_err_t _apply_rt_config(s_udp_channel_t* channel)
+{
+	const s_udp_rt_config_t* config = &channel->rt_config;
+	struct sched_param param;
+	cpu_set_t cpus;
+	s_udp_err_t res = S_UDP_OK;
+
+	// pid 0 is the calling thread, not the whole process.
+	if (config->cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(config->cpu, &cpus);
+
+		if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+			perror("s_udp_attach_channel(): sched_setaffinity()");
+			return S_UDP_RT_FAILURE;
+		}
+	}
+
+	if (config->priority > 0) {
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = config->priority;
+
+		if (sched_setscheduler(0, SCHED_FIFO, &param) == -1) {
+			perror("s_udp_attach_channel(): sched_setscheduler(SCHED_FIFO)");
+			return S_UDP_RT_FAILURE;
+		}
+	}
+
+	if (config->lock_memory) {
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+			perror("s_udp_attach_channel(): mlockall()");
+			return S_UDP_RT_FAILURE;
+		}
+
+		// With MCL_FUTURE, new mappings are faulted in as they are
+		// made. Allocate the scratch buffer now rather than on the
+		// first compressed packet, and grow the stack up front.
+		if ((res = _alloc_lz_buffer(channel)) != S_UDP_OK)
+			return res;
+
+		_prefault_stack();
+	}
+
+	// Shared memory and simulated channels have no socket. Redundant
+	// channels apply the options to their sockets when attached.
+	if (channel->socket_des == -1 || channel->transport == &s_udp_dual_transport)
+		return S_UDP_OK;
+
+	return s_udp_apply_socket_config(channel, channel->socket_des);
+}
+
+
+s_udp_err_t s_udp_apply_socket_config(s_udp_channel_t* channel,
+									  int32_t socket_des)
+{
+	const s_udp_rt_config_t* config = 0;
+	int value = 0;
+
+	if (!channel || socket_des == -1) {
+		fprintf(stderr, "s_udp_apply_socket_config(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	config = &channel->rt_config;
+
+	if (config->rcvbuf &&
+		_set_buffer_size(socket_des, SO_RCVBUF, SO_RCVBUFFORCE,
+						 config->rcvbuf, "SO_RCVBUF") != S_UDP_OK)
+		return S_UDP_RT_FAILURE;
+
+	if (config->sndbuf &&
+		_set_buffer_size(socket_des, SO_SNDBUF, SO_SNDBUFFORCE,
+						 config->sndbuf, "SO_SNDBUF") != S_UDP_OK)
+		return S_UDP_RT_FAILURE;
+
+	if (config->socket_priority >= 0 &&
+		setsockopt(socket_des, SOL_SOCKET, SO_PRIORITY,
+				   &config->socket_priority, sizeof(config->socket_priority)) == -1) {
+		perror("s_udp_attach_channel(): setsockopt(SO_PRIORITY)");
+		return S_UDP_RT_FAILURE;
+	}
+
+	if (config->busy_poll) {
+		value = config->busy_poll;
+		if (setsockopt(socket_des, SOL_SOCKET, SO_BUSY_POLL,
+					   &value, sizeof(value)) == -1) {
+			perror("s_udp_attach_channel(): setsockopt(SO_BUSY_POLL)");
+			return S_UDP_RT_FAILURE;
+		}
+
+		// Linux 5.11 and later. Busy polling works without it,
+		// but may be preempted by interrupt processing.
+		value = 1;
+		if (setsockopt(socket_des, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+					   &value, sizeof(value)) == -1)
+			perror("s_udp_attach_channel(): setsockopt(SO_PREFER_BUSY_POLL) (ignored)");
+	}
+
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_attach_channel(s_udp_channel_t* channel)
+{
+	s_udp_err_t res = S_UDP_OK;
+
+	if (!channel) {
+		fprintf(stderr, "s_udp_attach_channel(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	res = channel->transport->attach(channel->transport_ctx, channel);
+	if (res != S_UDP_OK)
+		return res;
+
+	res = _apply_rt_config(channel);
+	if (res != S_UDP_OK)
+		return res;
+
+	// Ask the master for a burst of master packets, rather than
+	// waiting for its next broadcast. The master itself uses slot 0.
+	// A lost request is repeated by s_udp_wait_for_channel_ready().
+	if (channel->slot != 0)
+		s_udp_send_join(channel);
+
+	if (channel->node_id)
+		s_udp_send_lease_request(channel);
+
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_set_transport(s_udp_channel_t* channel,
+								const s_udp_transport_t* transport,
+								void* ctx)
+{
+	if (!channel || !transport) {
+		fprintf(stderr, "s_udp_set_transport(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	channel->transport = transport;
+	channel->transport_ctx = ctx;
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_set_clock(s_udp_channel_t* channel,
+							const s_udp_clock_t* clock,
+							void* ctx)
+{
+	if (!channel || !clock) {
+		fprintf(stderr, "s_udp_set_clock(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	channel->clock = clock;
+	channel->clock_ctx = ctx;
+	return S_UDP_OK;
+}
+
+
+// ----
+// Default transport. A UDP socket subscribed to the channel
+// multicast address.
+// ----
+static s_udp_err_t _socket_attach(void* ctx, s_udp_channel_t* channel)
+{
+	struct ip_mreq mreq;
+	struct sockaddr_in local_address;
+	uint32_t flag = 0;
+
+	// Non-blocking, so that s_udp_drain() never waits. Blocking
+	// reads and writes wait in poll() instead.
+	channel->socket_des = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (channel->socket_des == -1) {
+		perror("s_udp_attach_channel(): socket()");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	flag = 1;
+	if (setsockopt(channel->socket_des,
+				   SOL_SOCKET,
+				   SO_REUSEADDR,
+				   &flag,
+				   sizeof(flag)) < 0) {
+		perror("s_udp_attach_channel(): setsockopt(REUSEADDR)");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	// We are subscribers. Bind local addresss
+	memset(&local_address, 0 , sizeof(local_address));
+	local_address.sin_family = AF_INET;
+	local_address.sin_addr.s_addr = htonl(INADDR_ANY);
+	local_address.sin_port = channel->address.sin_port;
+
+	if (bind(channel->socket_des,
+			 (struct sockaddr *) &local_address, sizeof(local_address)) < 0) {
+		perror("s_udp_attach_channel(): bind()");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+	
+	// Add subscription.
+	mreq.imr_multiaddr.s_addr = channel->address.sin_addr.s_addr;         
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);         
+
+	if (setsockopt(channel->socket_des, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+		perror("s_udp_attach_channel(): setsockopt(IP_ADD_MEMBERSHIP)");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	if (!channel->slots_per_group)
+		return S_UDP_OK;
+
+	// Only receive the groups joined above and below, not those
+	// joined by other sockets on the host.
+	flag = 0;
+	if (setsockopt(channel->socket_des, IPPROTO_IP, IP_MULTICAST_ALL, &flag, sizeof(flag)) < 0) {
+		perror("s_udp_attach_channel(): setsockopt(IP_MULTICAST_ALL)");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	// Senders only need the control group. Receivers of all slots
+	// join when the master has announced the slot count.
+	channel->joined_slots = 0;
+	if (channel->is_sender || channel->slot == 0 || channel->slot == S_UDP_ALL_SLOTS)
+		return S_UDP_OK;
+
+	if (_join_slot_groups(channel, channel->slot, channel->slot + 1) != channel->slot + 1)
+		return S_UDP_SUBSCRIPTION_FAILURE;
+
+	return S_UDP_OK;
+}
+
+
+// Wait for events on a non-blocking socket after it failed
+// with EAGAIN. Returns -1, with errno set, if the operation should
+// not be retried.
+static int _socket_wait(int socket_des, short events, int flags)
+{
+	struct pollfd pfd;
+
+	if ((errno != EAGAIN && errno != EWOULDBLOCK) || (flags & MSG_DONTWAIT))
+		return -1;
+
+	pfd.fd = socket_des;
+	pfd.events = events;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, -1) == -1)
+		return -1;
+
+	return 0;
+}
+
+
+static ssize_t _socket_sendmsg(void* ctx,
+							   s_udp_channel_t* channel,
+							   const struct msghdr* message,
+							   int flags)
+{
+	ssize_t res = 0;
+
+	while((res = sendmsg(channel->socket_des, message, flags)) == -1 &&
+		  _socket_wait(channel->socket_des, POLLOUT, flags) == 0)
+		;
+
+	return res;
+}
+
+
+static ssize_t _socket_recvmsg(void* ctx,
+							   s_udp_channel_t* channel,
+							   struct msghdr* message,
+							   int flags)
+{
+	ssize_t res = 0;
+
+	while((res = recvmsg(channel->socket_des, message, flags)) == -1 &&
+		  _socket_wait(channel->socket_des, POLLIN, flags) == 0)
+		;
+
+	return res;
+}
+
+
+static void _socket_detach(void* ctx, s_udp_channel_t* channel)
+{
+	if (channel->socket_des != -1)
+		close(channel->socket_des);
+
+	channel->socket_des = -1;
+}
+
+
+const s_udp_transport_t s_udp_socket_transport = {
+	_socket_attach,
+	_socket_sendmsg,
+	_socket_recvmsg,
+	_socket_detach
+};
+
+
+static uint64_t _monotonic_now(void* ctx)
+{
+	return s_udp_get_local_clock();
+}
+
+
+static void _monotonic_sleep(void* ctx, uint64_t usec)
+{
+	usleep(usec);
+}
+
+
+const s_udp_clock_t s_udp_monotonic_clock = {
+	_monotonic_now,
+	_monotonic_sleep
+};
+
+
+s_udp_err_t s_udp_wait_for_channel_ready(s_udp_channel_t* channel,
+										 int32_t timeout_msec)
+{
+	uint64_t deadline = 0;
+	uint64_t join_at = 0;
+	uint64_t wake_at = 0;
+	uint64_t now = 0;
+	int32_t wait_msec = 0;
+	struct pollfd pfd;
+	s_udp_err_t res = S_UDP_OK;
+
+	if (!channel) {
+		fprintf(stderr, "s_udp_wait_for_channel_ready(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	now = _local_clock(channel);
+	deadline = now + (uint64_t) timeout_msec * 1000;
+	join_at = now + _S_UDP_JOIN_RETRY;
+
+	while(1) {
+		// Process everything queued. The first master packet
+		// makes the channel ready.
+		do {
+			res = s_udp_drain(channel, _S_UDP_DRAIN_BUDGET, 0, 0, 0);
+
+			if (s_udp_is_channel_ready(channel) == S_UDP_OK)
+				return S_UDP_OK;
+		} while(res == S_UDP_OK);
+
+		if (res != S_UDP_TRY_AGAIN)
+			return res;
+
+		now = _local_clock(channel);
+		if (timeout_msec >= 0 && now >= deadline)
+			return channel->master_clock_offset?S_UDP_NO_LEASE:S_UDP_NO_MASTER_CLOCK;
+
+		// The join request sent on attach may have been lost, or
+		// sent before the master was up. The same goes for lease
+		// requests, which are also repeated when no slot was free.
+		if (now >= join_at) {
+			if (channel->slot != 0 && !channel->master_clock_offset)
+				s_udp_send_join(channel);
+
+			if (channel->node_id &&
+				s_udp_is_channel_ready(channel) == S_UDP_NO_LEASE)
+				s_udp_send_lease_request(channel);
+
+			join_at = now + _S_UDP_JOIN_RETRY;
+		}
+
+		// Wake up for the next join request too.
+		wake_at = (timeout_msec < 0 || join_at < deadline)?join_at:deadline;
+
+		// Transports without a descriptor cannot be waited on.
+		if (channel->socket_des == -1) {
+			channel->clock->sleep(channel->clock_ctx,
+								  (wake_at - now > _S_UDP_READY_POLL_INTERVAL)?
+								  _S_UDP_READY_POLL_INTERVAL:wake_at - now);
+			continue;
+		}
+
+		wait_msec = (int32_t) ((wake_at - now + 999) / 1000);
+
+		pfd.fd = channel->socket_des;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, wait_msec) == -1 && errno != EINTR) {
+			perror("s_udp_wait_for_channel_ready(): poll()");
+			return S_UDP_NETWORK_ERROR;
+		}
+	}
+}
+
+
+s_udp_err_t s_udp_is_channel_ready(s_udp_channel_t* channel)
+{
+	if (!channel) {
+		fprintf(stderr, "s_udp_attach_channel(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (channel->master_clock_offset == 0)
+		return S_UDP_NO_MASTER_CLOCK;
+
+	if (channel->node_id &&
+		s_udp_get_master_clock(channel) >= channel->lease_expires)
+		return S_UDP_NO_LEASE;
+
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_get_socket_descriptor(s_udp_channel_t* channel, int32_t* result)
+{
+	if (!result) {
+		fprintf(stderr, "s_udp_get_socket_descriptor(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (channel->socket_des == -1) {
+		return S_UDP_NOT_CONNECTED;
+	}
+		
 	*result = channel->socket_des;
 	return S_UDP_OK;
 }
 
 
-s_udp_err_t s_udp_wait_and_send_packet(s_udp_channel_t* channel,
-									   const uint8_t* payload,
-									   uint32_t length) {
-	uint64_t sleep_duration = 0;
-	s_udp_err_t res = S_UDP_OK;
+s_udp_err_t s_udp_wait_and_send_packet(s_udp_channel_t* channel,
+									   const uint8_t* payload,
+									   uint32_t length) {
+	uint64_t sleep_duration = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	if (!channel) {
+		fprintf(stderr, "s_udp_send_packet(): Illegal argument (channel == 0)\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	// Retrieve number of microseconds to sleep
+	res = s_udp_get_sleep_duration(channel,
+								   &sleep_duration);
+
+	if (res != S_UDP_OK) {
+		fprintf(stderr, "s_udp_send_packet(): s_udp_get_sleep_duration(): %s\n",
+				s_udp_error_string(res));
+		return res;
+	}
+		   
+	channel->clock->sleep(channel->clock_ctx, sleep_duration);
+	return s_udp_send_packet_now(channel, payload, length);
+}
+
+
+s_udp_err_t s_udp_wait_and_send_packetv(s_udp_channel_t* channel,
+										const struct iovec* iov,
+										uint32_t iov_count)
+{
+	uint64_t sleep_duration = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	if (!channel) {
+		fprintf(stderr, "s_udp_send_packet(): Illegal argument (channel == 0)\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	res = s_udp_get_sleep_duration(channel,
+								   &sleep_duration);
+
+	if (res != S_UDP_OK) {
+		fprintf(stderr, "s_udp_send_packet(): s_udp_get_sleep_duration(): %s\n",
+				s_udp_error_string(res));
+		return res;
+	}
+		   
+	channel->clock->sleep(channel->clock_ctx, sleep_duration);
+	return s_udp_send_packetv_now(channel, iov, iov_count);
+}
+
+// Send an already encoded header followed by payload_count payload
+// buffers in a single datagram.
+// The datagram goes through the transport of channel, if given,
+// and straight to socket_des otherwise.
+static s_udp_err_t _send_packetv(s_udp_channel_t* channel,
+								 int socket_des,
+								 void *address,
+								 const uint8_t* header,
+								 uint32_t header_length,
+								 const struct iovec* payload,
+								 uint32_t payload_count,
+								 int send_flags)
+{
+	struct msghdr message;
+	struct iovec payload_array[S_UDP_MAX_IOV + 1];
+	ssize_t res = 0;
+
+	// Setup a message that sends both header and payload
+	// in one sendmsg() call.
+
+	// Header
+	payload_array[0].iov_base = (void*) header;
+	payload_array[0].iov_len = header_length;
+
+	// payload
+	memcpy(payload_array + 1, payload, payload_count * sizeof(struct iovec));
+
+	// Message struct that points out the payload_array.
+	message.msg_name = (struct sockaddr *) address;
+	message.msg_namelen = sizeof(struct sockaddr);
+	message.msg_iov = payload_array;
+	message.msg_iovlen = payload_count + 1;
+	message.msg_control = 0;
+	message.msg_controllen = 0;
+	message.msg_flags = 0;
+	
+	
+	if (channel) {
+		res = channel->transport->sendmsg(channel->transport_ctx, channel, &message, send_flags);
+	} else {
+		// Raw sends may be made on a channel socket, which is non-blocking.
+		while((res = sendmsg(socket_des, &message, send_flags)) == -1 &&
+			  _socket_wait(socket_des, POLLOUT, send_flags) == 0)
+			;
+	}
+
+	if (res < 0) {
+		// Out of socket memory for pinned zero copy pages.
+		if ((send_flags & MSG_ZEROCOPY) && errno == ENOBUFS)
+			return S_UDP_TRY_AGAIN;
+
+		perror("s_udp_send_packet(): sendmsg()");
+		return S_UDP_NETWORK_ERROR;
+	}
+
+	return S_UDP_OK;
+}
+
+
+// Send an already encoded header followed by payload in a single datagram.
+static s_udp_err_t _send_packet(s_udp_channel_t* channel,
+								int socket_des,
+								void *address,
+								const uint8_t* header,
+								uint32_t header_length,
+								const uint8_t* payload,
+								uint32_t length,
+								int send_flags)
+{
+	struct iovec payload_array[1];
+
+	if (!payload) {
+		fprintf(stderr, "s_udp_send_packet(): Illegal argument (payload == 0)\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	payload_array[0].iov_base = (void*) payload;
+	payload_array[0].iov_len = length;
+
+	return _send_packetv(channel, socket_des, address,
+						 header, header_length, payload_array, 1, send_flags);
+}
+
+
+// Account a sent data packet for the next report.
+static void _account_send(s_udp_channel_t* channel,
+						  uint64_t master_clock,
+						  uint32_t length)
+{
+	uint64_t cycle_start = _get_cycle_start(channel, master_clock);
+
+	if (!channel->report_start)
+		channel->report_start = master_clock;
+
+	// First packet of a new send window?
+	if (cycle_start != channel->report_cycle) {
+		channel->report_cycle = cycle_start;
+		channel->report_window_bytes = 0;
+	}
+
+	channel->report_window_bytes += length;
+	if (channel->report_window_bytes > channel->report_peak_bytes)
+		channel->report_peak_bytes = channel->report_window_bytes;
+
+	channel->report_packets++;
+	channel->report_bytes += length;
+}
+
+
+// Send the accumulated report to the master, and start a new one.
+static s_udp_err_t _send_report(s_udp_channel_t* channel,
+								uint64_t master_clock)
+{
+	uint8_t header[_S_UDP_HEADER_LENGTH];
+	uint8_t payload[_S_UDP_REPORT_LENGTH];
+
+	_encode_header(header, S_UDP_CONTROL_REPORT, channel->slot, master_clock);
+
+	*((uint32_t*) payload) = htobe32((uint32_t) (master_clock - channel->report_start));
+	*((uint32_t*) (payload + 4)) = htobe32(channel->report_packets);
+	*((uint32_t*) (payload + 8)) = htobe32(channel->report_bytes);
+	*((uint32_t*) (payload + 12)) = htobe32(channel->report_peak_bytes);
+
+	channel->report_start = master_clock;
+	channel->report_packets = 0;
+	channel->report_bytes = 0;
+	channel->report_peak_bytes = 0;
+
+	return _send_packet(channel,
+						channel->socket_des,
+						&channel->address,
+						header,
+						sizeof(header),
+						payload,
+						sizeof(payload),
+						0);
+}
+
+
+// Encode a header for the next transaction and send it, followed by
+// the payload in iov_count buffers. packet_flags are S_UDP_FLAG_XXX
+// bits that describe the payload.
+static s_udp_err_t _send_packetv_now(s_udp_channel_t* channel,
+									 const struct iovec* iov,
+									 uint32_t iov_count,
+									 uint32_t packet_flags)
+{
+	uint8_t stack_header[_S_UDP_HEADER_LENGTH];
+	uint8_t* header = stack_header;
+	uint32_t header_length = 0;
+	struct iovec lz_iov;
+	const struct iovec* wire_iov = iov;
+	uint32_t wire_count = iov_count;
+	uint32_t length = 0;
+	uint32_t wire_length = 0;
+	uint32_t flags = packet_flags;
+	uint32_t ind = 0;
+	uint64_t master_clock = 0;
+	uint64_t transaction_id = 0;
+	int send_flags = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	// Have we received a master clock yet?
+	if (!channel->master_clock_offset) 
+		return S_UDP_NO_MASTER_CLOCK;
+
+	// Are all zero copy header buffers still owned by the kernel?
+	// Caller needs to call s_udp_reap_zerocopy().
+	if (channel->zerocopy &&
+		channel->zc_sent - channel->zc_completed >= _S_UDP_ZEROCOPY_RING)
+		return S_UDP_TRY_AGAIN;
+
+	// Our slot may have gone to another sender.
+	if (channel->node_id &&
+		s_udp_get_master_clock(channel) >= channel->lease_expires)
+		return S_UDP_NO_LEASE;
+
+	for (ind = 0; ind < iov_count; ++ind)
+		length += iov[ind].iov_len;
+
+	wire_length = length;
+
+	transaction_id = ++channel->transaction_id;
+
+	_debug("s_udp_send_packet_raw(): master_clock[%lu]\n",
+		   s_udp_get_master_clock(channel));
+
+	if (channel->compression && length > 0 &&
+		(iov_count == 1 || length <= S_UDP_MAX_PAYLOAD)) {
+		struct timespec start;
+		struct timespec stop;
+		const uint8_t* input = iov[0].iov_base;
+		uint32_t lz_length = 0;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		// The compressor needs the payload in one piece.
+		if (iov_count > 1) {
+			_iov_gather(iov, iov_count, 0, channel->gather_buffer, length);
+			input = channel->gather_buffer;
+		}
+
+		lz_length = s_udp_lz_compress(input, length,
+									  channel->lz_buffer, S_UDP_MAX_PAYLOAD);
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+
+		channel->stats.compress_nsec += timespec2nsec(stop) - timespec2nsec(start);
+		channel->stats.compress_in_bytes += length;
+		channel->stats.compress_out_bytes += lz_length?lz_length:length;
+
+		// Send compressed payload if we gained anything.
+		if (lz_length) {
+			lz_iov.iov_base = channel->lz_buffer;
+			lz_iov.iov_len = lz_length;
+			wire_iov = &lz_iov;
+			wire_count = 1;
+			wire_length = lz_length;
+			flags |= S_UDP_FLAG_COMPRESSED;
+		}
+	}
+
+	// Compressed and coalesced payloads live in channel buffers,
+	// which are reused by the next send. Those always have to be copied.
+	if (channel->zerocopy && wire_iov == iov && !(flags & S_UDP_FLAG_COALESCED)) {
+		header = channel->zc_headers + (channel->zc_sent % _S_UDP_ZEROCOPY_RING) * _S_UDP_HEADER_LENGTH;
+		send_flags = MSG_ZEROCOPY;
+	}
+
+	master_clock = _get_schedule_clock(channel);
+
+	if (channel->header_format == S_UDP_HEADER_STANDARD) {
+		_encode_header(header,
+					   channel->slot | flags,
+					   transaction_id,
+					   master_clock);
+		header_length = _S_UDP_HEADER_LENGTH;
+	} else {
+		if (channel->header_format == S_UDP_HEADER_COMPACT32)
+			flags |= S_UDP_FLAG_SEQ32;
+
+		header_length = _encode_compact_header(header,
+											   flags,
+											   channel->slot,
+											   transaction_id,
+											   master_clock - _get_cycle_start(channel, master_clock));
+	}
+
+	res = _send_packetv(channel,
+						channel->socket_des,
+						&channel->slot_address,
+						header,
+						header_length,
+						wire_iov,
+						wire_count,
+						send_flags);
+
+	if (res == S_UDP_OK && send_flags) {
+		channel->zc_sent++;
+		channel->stats.zerocopy_sent++;
+	}
+
+	// Hand the transaction ID back if the kernel could not take the packet.
+	if (res == S_UDP_TRY_AGAIN)
+		channel->transaction_id--;
+
+	// Report while our send window is still open.
+	if (res == S_UDP_OK && channel->report_interval) {
+		_account_send(channel, master_clock, header_length + wire_length);
+
+		if (master_clock - channel->report_start >= channel->report_interval)
+			_send_report(channel, master_clock);
+	}
+
+	// Renew our lease in the same way. A lost request is repeated
+	// every eighth of the lease until the grant arrives.
+	if (res == S_UDP_OK && channel->node_id && master_clock >= channel->lease_renew_at) {
+		channel->lease_renew_at = master_clock + channel->lease_duration / 8;
+		s_udp_send_lease_request(channel);
+	}
+
+	return res;
+}
+
+
+s_udp_err_t s_udp_send_packet_now(s_udp_channel_t* channel,
+								  const uint8_t* payload,
+								  uint32_t length)
+{
+	struct iovec iov;
+
+	if (!channel) {
+		fprintf(stderr, "s_udp_send_packet(): Illegal argument (channel == 0)\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (!payload) {
+		fprintf(stderr, "s_udp_send_packet(): Illegal argument (payload == 0)\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	iov.iov_base = (void*) payload;
+	iov.iov_len = length;
+	return _send_packetv_now(channel, &iov, 1, 0);
+}
+
+
+s_udp_err_t s_udp_send_packetv_now(s_udp_channel_t* channel,
+								   const struct iovec* iov,
+								   uint32_t iov_count)
+{
+	if (!channel || !iov || !iov_count || iov_count > S_UDP_MAX_IOV) {
+		fprintf(stderr, "s_udp_send_packetv_now(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	return _send_packetv_now(channel, iov, iov_count, 0);
+}
+
+
+s_udp_err_t s_udp_send_queued(s_udp_channel_t* channel,
+							  s_udp_send_queue_t* queue,
+							  uint32_t budget,
+							  uint32_t* sent)
+{
+	s_udp_packet_t* packet = 0;
+	uint32_t count = 0;
+	s_udp_err_t res = S_UDP_TRY_AGAIN;
+
+	if (!channel || !queue || !budget || channel->zerocopy) {
+		fprintf(stderr, "s_udp_send_queued(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (!channel->master_clock_offset)
+		return S_UDP_NO_MASTER_CLOCK;
+
+	while(count < budget) {
+		// Leave the rest for the next window once this one has closed.
+		if (!_is_in_slot_window(channel, channel->slot, _get_schedule_clock(channel)))
+			break;
+
+		if (!(packet = s_udp_dequeue_packet(queue))) {
+			res = S_UDP_OK;
+			break;
+		}
+
+		res = s_udp_send_packet_now(channel, packet->payload, packet->length);
+
+		// Keep the packet if it can be sent later.
+		if (res == S_UDP_TRY_AGAIN ||
+			res == S_UDP_NO_MASTER_CLOCK ||
+			res == S_UDP_NO_LEASE) {
+			s_udp_requeue_packet(queue, packet);
+			break;
+		}
+
+		s_udp_release_packet(packet);
+
+		if (res != S_UDP_OK)
+			break;
+
+		count++;
+		res = S_UDP_TRY_AGAIN;
+	}
+
+	if (sent)
+		*sent = count;
+
+	return res;
+}
+
+// Owned slot of channel with the given slot number, or 0.
+static s_udp_owned_slot_t* _find_owned_slot(s_udp_channel_t* channel,
+											uint32_t slot)
+{
+	uint32_t ind = 0;
+
+	for (ind = 0; ind < channel->owned_slot_count; ++ind)
+		if (channel->owned_slots[ind].slot == slot)
+			return &channel->owned_slots[ind];
+
+	return 0;
+}
+
+
+s_udp_err_t s_udp_add_slot(s_udp_channel_t* channel,
+						   uint32_t slot)
+{
+	s_udp_owned_slot_t* owned = 0;
+
+	if (!channel || !channel->is_sender ||
+		slot == 0 || slot >= S_UDP_ALL_SLOTS) {
+		fprintf(stderr, "s_udp_add_slot(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (_find_owned_slot(channel, slot))
+		return S_UDP_OK;
+
+	if (channel->owned_slot_count == S_UDP_MAX_OWNED_SLOTS) {
+		fprintf(stderr, "s_udp_add_slot(): More than %d slots\n", S_UDP_MAX_OWNED_SLOTS);
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	// Send queues must stay put, so all entries are allocated
+	// at once, cache line aligned.
+	if (!channel->owned_slots &&
+		posix_memalign((void**) &channel->owned_slots, 64,
+					   S_UDP_MAX_OWNED_SLOTS * sizeof(s_udp_owned_slot_t))) {
+		channel->owned_slots = 0;
+		perror("s_udp_add_slot(): posix_memalign()");
+		return S_UDP_BUFFER_TOO_SMALL;
+	}
+
+	owned = &channel->owned_slots[channel->owned_slot_count];
+	s_udp_init_send_queue(&owned->queue);
+	owned->slot = slot;
+	owned->transaction_id = 0;
+	owned->sent = 0;
+	channel->owned_slot_count++;
+
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_enqueue_slot_packet(s_udp_channel_t* channel,
+									  uint32_t slot,
+									  s_udp_packet_t* packet)
+{
+	s_udp_owned_slot_t* owned = 0;
+
+	if (!channel || !packet || !(owned = _find_owned_slot(channel, slot))) {
+		fprintf(stderr, "s_udp_enqueue_slot_packet(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	return s_udp_enqueue_packet(&owned->queue, packet);
+}
+
+
+s_udp_err_t s_udp_get_next_owned_slot(s_udp_channel_t* channel,
+									  uint32_t* slot,
+									  uint64_t* slot_wait)
+{
+	uint64_t master_clock = 0;
+	uint64_t next_start = 0;
+	uint64_t slot_start = 0;
+	uint32_t ind = 0;
+
+	if (!channel || !slot || !slot_wait || !channel->owned_slot_count) {
+		fprintf(stderr, "s_udp_get_next_owned_slot(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (!channel->master_clock_offset)
+		return S_UDP_NO_MASTER_CLOCK;
+
+	master_clock = _get_schedule_clock(channel);
+
+	for (ind = 0; ind < channel->owned_slot_count; ++ind) {
+		slot_start = _get_slot_start(channel, channel->owned_slots[ind].slot, master_clock + 1);
+
+		if (!ind || slot_start < next_start) {
+			next_start = slot_start;
+			*slot = channel->owned_slots[ind].slot;
+		}
+	}
+
+	*slot_wait = next_start - master_clock;
+	return S_UDP_OK;
+}
+
+
+// Hand count messages to the transport. Stores the number sent in
+// done, which is short of count on failure.
+static s_udp_err_t _send_batch(s_udp_channel_t* channel,
+							   struct mmsghdr* messages,
+							   uint32_t count,
+							   uint32_t* done)
+{
+	int res = 0;
+
+	*done = 0;
+
+	// Other transports only take one message at a time.
+	if (channel->transport != &s_udp_socket_transport) {
+		for (; *done < count; ++*done)
+			if (channel->transport->sendmsg(channel->transport_ctx, channel,
+											&messages[*done].msg_hdr, 0) < 0) {
+				perror("s_udp_flush_slots(): sendmsg()");
+				return S_UDP_NETWORK_ERROR;
+			}
+
+		return S_UDP_OK;
+	}
+
+	while(*done < count) {
+		res = sendmmsg(channel->socket_des, messages + *done, count - *done, 0);
+
+		if (res == -1) {
+			if (_socket_wait(channel->socket_des, POLLOUT, 0) == 0)
+				continue;
+
+			perror("s_udp_flush_slots(): sendmmsg()");
+			return S_UDP_NETWORK_ERROR;
+		}
+
+		channel->stats.batch_calls++;
+		channel->stats.batch_packets += res;
+		*done += res;
+	}
+
+	return S_UDP_OK;
+}
+
+
+// Send up to budget packets queued for owned, while its window is
+// open. Adds the number of packets sent to sent.
+static s_udp_err_t _flush_owned_slot(s_udp_channel_t* channel,
+									 s_udp_owned_slot_t* owned,
+									 uint32_t budget,
+									 uint32_t* sent)
+{
+	uint8_t headers[S_UDP_SEND_BATCH][_S_UDP_HEADER_LENGTH];
+	struct iovec iov[S_UDP_SEND_BATCH][2];
+	struct mmsghdr messages[S_UDP_SEND_BATCH];
+	s_udp_packet_t* packets[S_UDP_SEND_BATCH];
+	struct sockaddr_in address;
+	uint64_t master_clock = 0;
+	uint32_t flags = 0;
+	uint32_t count = 0;
+	uint32_t batch = 0;
+	uint32_t done = 0;
+	uint32_t ind = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	address = channel->address;
+	address.sin_addr = _get_slot_group(channel, owned->slot);
+
+	if (channel->header_format == S_UDP_HEADER_COMPACT32)
+		flags = S_UDP_FLAG_SEQ32;
+
+	while(count < budget) {
+		master_clock = _get_schedule_clock(channel);
+
+		// Leave the rest for the next window once this one has closed.
+		if (!_is_in_slot_window(channel, owned->slot, master_clock))
+			break;
+
+		for (batch = 0; batch < S_UDP_SEND_BATCH && count + batch < budget; ++batch) {
+			s_udp_packet_t* packet = s_udp_dequeue_packet(&owned->queue);
+			uint64_t transaction_id = owned->transaction_id + batch + 1;
+
+			if (!packet)
+				break;
+
+			packets[batch] = packet;
+			iov[batch][0].iov_base = headers[batch];
+			iov[batch][1].iov_base = packet->payload;
+			iov[batch][1].iov_len = packet->length;
+
+			if (channel->header_format == S_UDP_HEADER_STANDARD) {
+				_encode_header(headers[batch], owned->slot, transaction_id, master_clock);
+				iov[batch][0].iov_len = _S_UDP_HEADER_LENGTH;
+			} else
+				iov[batch][0].iov_len =
+					_encode_compact_header(headers[batch], flags, owned->slot, transaction_id,
+										   master_clock - _get_cycle_start(channel, master_clock));
+
+			memset(&messages[batch], 0, sizeof(messages[batch]));
+			messages[batch].msg_hdr.msg_name = &address;
+			messages[batch].msg_hdr.msg_namelen = sizeof(address);
+			messages[batch].msg_hdr.msg_iov = iov[batch];
+			messages[batch].msg_hdr.msg_iovlen = 2;
+		}
+
+		if (!batch)
+			break;
+
+		res = _send_batch(channel, messages, batch, &done);
+
+		// Packets that could not be sent are dropped, and their
+		// transaction IDs reused by the next batch.
+		for (ind = 0; ind < batch; ++ind)
+			s_udp_release_packet(packets[ind]);
+
+		owned->transaction_id += done;
+		owned->sent += done;
+		count += done;
+
+		if (res != S_UDP_OK)
+			break;
+	}
+
+	*sent += count;
+	return res;
+}
+
+
+// Flush the owned slots whose window is open.
+static s_udp_err_t _flush_slots(s_udp_channel_t* channel,
+								uint32_t budget,
+								uint32_t* sent)
+{
+	uint32_t count = 0;
+	uint32_t ind = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	if (!channel->master_clock_offset)
+		return S_UDP_NO_MASTER_CLOCK;
+
+	for (ind = 0; ind < channel->owned_slot_count && res == S_UDP_OK; ++ind) {
+		s_udp_owned_slot_t* owned = &channel->owned_slots[ind];
+
+		res = _flush_owned_slot(channel, owned, budget, &count);
+	}
+
+	if (sent)
+		*sent = count;
+
+	return res;
+}
+
+
+s_udp_err_t s_udp_flush_slots(s_udp_channel_t* channel,
+							  uint32_t budget,
+							  uint32_t* sent)
+{
+	if (!channel || !budget) {
+		fprintf(stderr, "s_udp_flush_slots(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	return _flush_slots(channel, budget, sent);
+}
+
+
+s_udp_err_t s_udp_wait_and_flush_slots(s_udp_channel_t* channel,
+									   uint32_t budget,
+									   uint32_t* sent)
+{
+	uint64_t sleep_duration = 0;
+	uint32_t slot = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	if (!channel || !budget) {
+		fprintf(stderr, "s_udp_wait_and_flush_slots(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	res = s_udp_get_next_owned_slot(channel, &slot, &sleep_duration);
+	if (res != S_UDP_OK)
+		return res;
+
+	channel->clock->sleep(channel->clock_ctx, sleep_duration);
+	return _flush_slots(channel, budget, sent);
+}
+
+
+
+s_udp_err_t s_udp_set_coalescing(s_udp_channel_t* channel,
+								 uint32_t length)
+{
+	if (!channel || (length && (length <= _S_UDP_MESSAGE_PREFIX_LENGTH ||
+								length > S_UDP_MAX_PAYLOAD))) {
+		fprintf(stderr, "s_udp_set_coalescing(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	// Allocate up front to keep malloc() out of the send path.
+	if (length && !channel->coalesce_buffer &&
+		!(channel->coalesce_buffer = malloc(S_UDP_MAX_PAYLOAD))) {
+		perror("s_udp_set_coalescing(): malloc()");
+		return S_UDP_BUFFER_TOO_SMALL;
+	}
+
+	channel->coalesce_length = length;
+	channel->coalesce_used = 0;
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_queue_message(s_udp_channel_t* channel,
+								const uint8_t* data,
+								uint32_t length)
+{
+	uint8_t* ptr = 0;
+
+	if (!channel || !data || !channel->coalesce_length ||
+		length + _S_UDP_MESSAGE_PREFIX_LENGTH > channel->coalesce_length) {
+		fprintf(stderr, "s_udp_queue_message(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (channel->coalesce_used + _S_UDP_MESSAGE_PREFIX_LENGTH + length > S_UDP_MAX_PAYLOAD)
+		return S_UDP_TRY_AGAIN;
+
+	ptr = channel->coalesce_buffer + channel->coalesce_used;
+	*ptr++ = (uint8_t) (length >> 8);
+	*ptr++ = (uint8_t) length;
+	memcpy(ptr, data, length);
+	channel->coalesce_used += _S_UDP_MESSAGE_PREFIX_LENGTH + length;
+
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_flush_messages(s_udp_channel_t* channel,
+								 uint32_t* sent)
+{
+	uint32_t start = 0;
+	uint32_t count = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	if (!channel) {
+		fprintf(stderr, "s_udp_flush_messages(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	// Fill each packet with as many whole messages as fit, in order.
+	while(start < channel->coalesce_used) {
+		struct iovec iov;
+		uint32_t end = start;
+		uint32_t messages = 0;
+
+		// Leave the rest for the next window once this one has closed.
+		if (count && !_is_in_slot_window(channel, channel->slot,
+										 _get_schedule_clock(channel))) {
+			res = S_UDP_TRY_AGAIN;
+			break;
+		}
+
+		while(end < channel->coalesce_used) {
+			uint32_t next = end + _S_UDP_MESSAGE_PREFIX_LENGTH +
+				((channel->coalesce_buffer[end] << 8) | channel->coalesce_buffer[end + 1]);
+
+			if (next - start > channel->coalesce_length)
+				break;
+
+			end = next;
+			messages++;
+		}
+
+		iov.iov_base = channel->coalesce_buffer + start;
+		iov.iov_len = end - start;
+
+		if ((res = _send_packetv_now(channel, &iov, 1, S_UDP_FLAG_COALESCED)) != S_UDP_OK)
+			break;
+
+		channel->stats.coalesce_messages += messages;
+		channel->stats.coalesce_packets++;
+		start = end;
+		count++;
+	}
+
+	// Keep what could not be sent for the next flush.
+	memmove(channel->coalesce_buffer,
+			channel->coalesce_buffer + start,
+			channel->coalesce_used - start);
+	channel->coalesce_used -= start;
+
+	if (sent)
+		*sent = count;
+
+	return res;
+}
+
+
+s_udp_err_t s_udp_wait_and_flush_messages(s_udp_channel_t* channel,
+										  uint32_t* sent)
+{
+	uint64_t sleep_duration = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	if (!channel) {
+		fprintf(stderr, "s_udp_flush_messages(): Illegal argument (channel == 0)\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	res = s_udp_get_sleep_duration(channel,
+								   &sleep_duration);
+
+	if (res != S_UDP_OK) {
+		fprintf(stderr, "s_udp_flush_messages(): s_udp_get_sleep_duration(): %s\n",
+				s_udp_error_string(res));
+		return res;
+	}
+
+	channel->clock->sleep(channel->clock_ctx, sleep_duration);
+	return s_udp_flush_messages(channel, sent);
+}
+
+
+s_udp_err_t s_udp_next_message(const uint8_t* payload,
+							   uint32_t length,
+							   uint32_t* offset,
+							   const uint8_t** message,
+							   uint32_t* message_length)
+{
+	uint32_t message_start = 0;
+
+	if (!payload || !offset || !message || !message_length) {
+		fprintf(stderr, "s_udp_next_message(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (*offset >= length)
+		return S_UDP_TRY_AGAIN;
+
+	if (length - *offset < _S_UDP_MESSAGE_PREFIX_LENGTH)
+		return S_UDP_MALFORMED_PACKET;
+
+	*message_length = (payload[*offset] << 8) | payload[*offset + 1];
+	message_start = *offset + _S_UDP_MESSAGE_PREFIX_LENGTH;
+
+	if (*message_length > length - message_start)
+		return S_UDP_MALFORMED_PACKET;
+
+	*message = payload + message_start;
+	*offset = message_start + *message_length;
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_set_zerocopy(s_udp_channel_t* channel,
+							   uint8_t enabled)
+{
+	uint32_t flag = enabled?1:0;
+
+	if (!channel) {
+		fprintf(stderr, "s_udp_set_zerocopy(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (channel->transport != &s_udp_socket_transport) {
+		fprintf(stderr, "s_udp_set_zerocopy(): Requires a socket transport\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (channel->socket_des == -1)
+		return S_UDP_NOT_CONNECTED;
+
+	if (setsockopt(channel->socket_des,
+				   SOL_SOCKET,
+				   SO_ZEROCOPY,
+				   &flag,
+				   sizeof(flag)) < 0) {
+		perror("s_udp_set_zerocopy(): setsockopt(SO_ZEROCOPY)");
+		return S_UDP_NETWORK_ERROR;
+	}
+
+	if (enabled && !channel->zc_headers) {
+		channel->zc_headers = malloc(_S_UDP_ZEROCOPY_RING * _S_UDP_HEADER_LENGTH);
+
+		if (!channel->zc_headers) {
+			perror("s_udp_set_zerocopy(): malloc()");
+			return S_UDP_BUFFER_TOO_SMALL;
+		}
+	}
+
+	channel->zerocopy = enabled?1:0;
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_reap_zerocopy(s_udp_channel_t* channel,
+								int32_t timeout_msec,
+								uint32_t* pending)
+{
+	uint8_t control[CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+	struct msghdr message;
+	struct cmsghdr* cmsg = 0;
+
+	if (!channel || !pending) {
+		fprintf(stderr, "s_udp_reap_zerocopy(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	while(channel->zc_sent != channel->zc_completed) {
+		memset(&message, 0, sizeof(message));
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+
+		// Completions are queued on the socket error queue.
+		// Reading it never blocks.
+		if (recvmsg(channel->socket_des, &message, MSG_ERRQUEUE) < 0) {
+			struct pollfd pfd;
+			int res = 0;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("s_udp_reap_zerocopy(): recvmsg(MSG_ERRQUEUE)");
+				return S_UDP_NETWORK_ERROR;
+			}
+
+			if (!timeout_msec)
+				break;
+
+			// POLLERR is reported when the error queue has data.
+			pfd.fd = channel->socket_des;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			res = poll(&pfd, 1, timeout_msec);
+
+			if (res < 0 && errno != EINTR) {
+				perror("s_udp_reap_zerocopy(): poll()");
+				return S_UDP_NETWORK_ERROR;
+			}
+
+			if (res == 0)
+				break;
+
+			// The kernel does not complete a zero copy send until the
+			// copy looped back to our own socket has been consumed.
+			// Read and process it. Master packets update the channel.
+			if (pfd.revents & POLLIN) {
+				uint8_t scratch[256];
+				ssize_t length = 0;
+				uint32_t latency = 0;
+				uint8_t packet_loss_detected = 0;
+
+				s_udp_receive_packet(channel,
+									 scratch,
+									 sizeof(scratch),
+									 &length,
+									 &latency,
+									 &packet_loss_detected);
+			}
+			continue;
+		}
+
+		for (cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+			struct sock_extended_err* serr = 0;
+
+			if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR)
+				continue;
+
+			serr = (struct sock_extended_err*) CMSG_DATA(cmsg);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			// [ee_info, ee_data] is the range of completed sends.
+			if ((int32_t) (serr->ee_data + 1 - channel->zc_completed) > 0)
+				channel->zc_completed = serr->ee_data + 1;
+
+			// Did the kernel fall back to copying?
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				channel->stats.zerocopy_copied += serr->ee_data - serr->ee_info + 1;
+		}
+	}
+
+	*pending = channel->zc_sent - channel->zc_completed;
+	return S_UDP_OK;
+}
+
+s_udp_err_t s_udp_send_join(s_udp_channel_t* channel)
+{
+	uint8_t header[_S_UDP_HEADER_LENGTH];
+
+	if (!channel || channel->slot == 0) {
+		fprintf(stderr, "s_udp_send_join(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	// Slot of the joining node in place of the transaction ID.
+	// It has no master clock yet.
+	_encode_header(header, S_UDP_CONTROL_JOIN, channel->slot, 0);
+
+	return _send_packet(channel,
+						channel->socket_des,
+						&channel->address,
+						header,
+						sizeof(header),
+						header,
+						0,
+						0);
+}
+
+
+s_udp_err_t s_udp_send_lease_request(s_udp_channel_t* channel)
+{
+	uint8_t header[_S_UDP_HEADER_LENGTH];
+	uint8_t payload[_S_UDP_LEASE_REQUEST_LENGTH];
 
-	if (!channel) {
-		fprintf(stderr, "s_udp_send_packet(): Illegal argument (channel == 0)\n");
+	if (!channel || !channel->node_id) {
+		fprintf(stderr, "s_udp_send_lease_request(): Illegal argument\n");
 		return S_UDP_ILLEGAL_ARGUMENT;
 	}
 
-	// Retrieve number of microseconds to sleep
-	res = s_udp_get_sleep_duration(channel,
-								   &sleep_duration);
+	// The clock is 0 until we have a master clock.
+	_encode_header(header, S_UDP_CONTROL_LEASE_REQUEST, channel->node_id,
+				   channel->master_clock_offset?s_udp_get_master_clock(channel):0);
+
+	*((uint32_t*) payload) = htobe32(channel->slot);
+	*((uint32_t*) (payload + 4)) = htobe32(channel->lease_bandwidth);
+
+	return _send_packet(channel,
+						channel->socket_des,
+						&channel->address,
+						header,
+						sizeof(header),
+						payload,
+						sizeof(payload),
+						0);
+}
 
-	if (res != S_UDP_OK) {
-		fprintf(stderr, "s_udp_send_packet(): s_udp_get_sleep_duration(): %s\n",
-				s_udp_error_string(res));
-		return res;
+
+s_udp_err_t s_udp_send_master_clock(s_udp_channel_t* channel)
+{
+	uint8_t header[_S_UDP_HEADER_LENGTH];
+	uint8_t schedule[_S_UDP_SCHEDULE_LENGTH];
+	uint64_t slot_stats = 0;
+	uint64_t master_clock = 0;
+
+	if (!channel || channel->slot != 0) {
+		fprintf(stderr, "s_udp_send_master_clock(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
 	}
-		   
-	usleep(sleep_duration);
-	return s_udp_send_packet_now(channel, payload, length);
+
+	// Switches to a pending schedule, if it is due.
+	master_clock = _get_schedule_clock(channel);
+
+	// Transaction ID is replaced by total slot count (upper 32 bits)
+	// followed by slot_width in usec (lower 32 bits)
+	//
+	slot_stats = (uint64_t) ((((uint64_t) htobe32(channel->slot_count)) << 32) |
+							 htobe32(channel->slot_width));
+
+	_encode_header(header, S_UDP_CONTROL_SYNC, slot_stats, master_clock);
+
+	// Masters that never change schedule send no payload.
+	if (channel->schedule_version) {
+		*((uint32_t*) schedule) = htobe32(channel->schedule_version);
+		*((uint32_t*) (schedule + 4)) = htobe32(channel->next_slot_width);
+		*((uint64_t*) (schedule + 8)) = htobe64(channel->schedule_switch);
+		*((uint64_t*) (schedule + 16)) = htobe64(channel->cycle_epoch);
+	}
+
+	return _send_packet(channel,
+						channel->socket_des,
+						&channel->address,
+						header,
+						sizeof(header),
+						schedule,
+						channel->schedule_version?sizeof(schedule):0,
+						0);
 }
 
-s_udp_err_t s_udp_send_packet_now(s_udp_channel_t* channel,
-								  const uint8_t* payload,
-								  uint32_t length)
+
+s_udp_err_t s_udp_set_schedule(s_udp_channel_t* channel,
+							   uint32_t slot_width,
+							   uint64_t lead)
 {
-	if (!channel) {
-		fprintf(stderr, "s_udp_send_packet(): Illegal argument (channel == 0)\n");
+	uint64_t cycle_duration = 0;
+	uint64_t switch_clock = 0;
+
+	if (!channel || channel->slot != 0 || !slot_width || !channel->slot_count) {
+		fprintf(stderr, "s_udp_set_schedule(): Illegal argument\n");
 		return S_UDP_ILLEGAL_ARGUMENT;
 	}
 
-	// Have we received a master clock yet?
-	if (!channel->master_clock_offset) 
+#ifdef _S_UDP_FIXED_CYCLE_DURATION
+	fprintf(stderr, "s_udp_set_schedule(): Built with a fixed schedule\n");
+	return S_UDP_ILLEGAL_ARGUMENT;
+#endif
+
+	if (!channel->master_clock_offset)
 		return S_UDP_NO_MASTER_CLOCK;
-	
-  	channel->transaction_id++;
 
-	printf("s_udp_send_packet_raw(): master_clock[%lu]\n",
-		   s_udp_get_master_clock(channel));
+	// Only one switch can be pending, since nodes track one.
+	switch_clock = _get_schedule_clock(channel) + lead;
+	if (channel->schedule_switch > switch_clock - lead)
+		return S_UDP_TRY_AGAIN;
+
+	cycle_duration = _get_schedule(channel)->cycle_duration;
+	if (_get_cycle_start(channel, switch_clock) < switch_clock)
+		switch_clock = _get_cycle_start(channel, switch_clock) + cycle_duration;
+
+	channel->schedule_version++;
+	channel->next_slot_width = slot_width;
+	channel->schedule_switch = switch_clock;
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_set_report_interval(s_udp_channel_t* channel,
+									  uint32_t interval)
+{
+	if (!channel || !channel->is_sender || channel->slot == 0) {
+		fprintf(stderr, "s_udp_set_report_interval(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	channel->report_interval = interval;
+	channel->report_start = 0;
+	channel->report_packets = 0;
+	channel->report_bytes = 0;
+	channel->report_peak_bytes = 0;
+	channel->report_window_bytes = 0;
+	return S_UDP_OK;
+}
 
-	return s_udp_send_packet_raw(channel->socket_des,
-								 &channel->address,
-								 channel->slot,
-								 channel->transaction_id,
-								 s_udp_get_master_clock(channel),
-								 payload,
-								 length);
+
+s_udp_err_t s_udp_request_lease(s_udp_channel_t* channel,
+								uint32_t bandwidth)
+{
+	if (!channel || !channel->is_sender ||
+		channel->slot == 0 || channel->slot == S_UDP_ALL_SLOTS) {
+		fprintf(stderr, "s_udp_request_lease(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	// Unique enough to tell the senders on a bus apart.
+	channel->node_id = ((uint32_t) getpid() * 2654435761U) ^ (uint32_t) s_udp_get_local_clock();
+	if (!channel->node_id)
+		channel->node_id = 1;
+
+	channel->lease_bandwidth = bandwidth;
+	channel->lease_duration = 0;
+	channel->lease_expires = 0;
+	channel->lease_renew_at = 0;
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_decode_lease_request(const uint8_t* packet,
+									   uint32_t length,
+									   s_udp_lease_request_t* request)
+{
+	s_udp_header_t header;
+	const uint8_t* payload = 0;
+
+	if (!packet || !request) {
+		fprintf(stderr, "s_udp_decode_lease_request(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (_parse_header(packet, length, &header) != S_UDP_OK ||
+		header.slot != 0 ||
+		(header.flags & S_UDP_CONTROL_MASK) != S_UDP_CONTROL_LEASE_REQUEST ||
+		length < header.header_length + _S_UDP_LEASE_REQUEST_LENGTH)
+		return S_UDP_MALFORMED_PACKET;
+
+	payload = packet + header.header_length;
+	request->node_id = (uint32_t) header.transaction_id;
+	request->slot = be32toh(*((uint32_t*) payload));
+	request->bandwidth = be32toh(*((uint32_t*) (payload + 4)));
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_send_lease_grant(s_udp_channel_t* channel,
+								   uint32_t node_id,
+								   uint32_t slot,
+								   uint32_t duration)
+{
+	uint8_t header[_S_UDP_HEADER_LENGTH];
+	uint8_t payload[_S_UDP_LEASE_GRANT_LENGTH];
+
+	if (!channel || channel->slot != 0 || !node_id) {
+		fprintf(stderr, "s_udp_send_lease_grant(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	// Node ID in place of the transaction ID. The node counts the
+	// lease from the clock.
+	_encode_header(header, S_UDP_CONTROL_LEASE_GRANT, node_id,
+				   s_udp_get_master_clock(channel));
+
+	*((uint32_t*) payload) = htobe32(slot);
+	*((uint32_t*) (payload + 4)) = htobe32(duration);
+
+	return _send_packet(channel,
+						channel->socket_des,
+						&channel->address,
+						header,
+						sizeof(header),
+						payload,
+						sizeof(payload),
+						0);
+}
+
+
+s_udp_err_t s_udp_decode_report(const uint8_t* packet,
+								uint32_t length,
+								s_udp_report_t* report)
+{
+	s_udp_header_t header;
+	const uint8_t* payload = 0;
+
+	if (!packet || !report) {
+		fprintf(stderr, "s_udp_decode_report(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (_parse_header(packet, length, &header) != S_UDP_OK ||
+		header.slot != 0 ||
+		(header.flags & S_UDP_CONTROL_MASK) != S_UDP_CONTROL_REPORT ||
+		length < header.header_length + _S_UDP_REPORT_LENGTH)
+		return S_UDP_MALFORMED_PACKET;
+
+	payload = packet + header.header_length;
+	report->slot = (uint32_t) header.transaction_id;
+	report->interval = be32toh(*((uint32_t*) payload));
+	report->packets = be32toh(*((uint32_t*) (payload + 4)));
+	report->bytes = be32toh(*((uint32_t*) (payload + 8)));
+	report->peak_bytes = be32toh(*((uint32_t*) (payload + 12)));
+	return S_UDP_OK;
 }
 
+
 s_udp_err_t s_udp_send_packet_raw(int socket_des,
 								  void *address,
 								  uint32_t slot,
@@ -534,15 +3231,6 @@ s_udp_err_t s_udp_send_packet_raw(int socket_des,
 {
 	uint8_t header[_S_UDP_HEADER_LENGTH];
 	s_udp_err_t enc_res = S_UDP_OK;
-	struct msghdr message;
-	struct iovec payload_array[2];
-
-	if (!payload) {
-		fprintf(stderr, "s_udp_send_packet(): Illegal argument (payload == 0)\n");
-		return S_UDP_ILLEGAL_ARGUMENT;
-	}
-
-
 
 	enc_res =_encode_header(header, slot, transaction_id, clock);
 
@@ -552,50 +3240,121 @@ s_udp_err_t s_udp_send_packet_raw(int socket_des,
 		return enc_res;
 	}
 
-	// Setup a message that sends both header and payload
-	// in one sendmsg() call.
+	return _send_packet(0,
+						socket_des,
+						address,
+						header,
+						sizeof(header),
+						payload,
+						length,
+						0);
+}
 
-	// Header
-	payload_array[0].iov_base = (void*) header;
-	payload_array[0].iov_len = sizeof(header);
+// Decompress a received payload and update channel statistics.
+// The decompressed length is stored in result_length.
+static s_udp_err_t _decompress(s_udp_channel_t* channel,
+							   const uint8_t* payload,
+							   uint32_t length,
+							   uint8_t* data,
+							   uint32_t max_length,
+							   ssize_t* result_length)
+{
+	struct timespec start;
+	struct timespec stop;
+	s_udp_err_t res = S_UDP_OK;
+	int32_t lz_res = 0;
 
-	// payload
-	payload_array[1].iov_base = (void*) payload;
-	payload_array[1].iov_len = length;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	lz_res = s_udp_lz_decompress(payload, length, data, max_length);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
 
-	// Message struct that points out the payload_array.
-	message.msg_name = (struct sockaddr *) address;
-	message.msg_namelen = sizeof(struct sockaddr);
-	message.msg_iov = payload_array;
-	message.msg_iovlen = sizeof(payload_array) / sizeof(payload_array[0]);
-	message.msg_control = 0;
-	message.msg_controllen = 0;
-	message.msg_flags = 0;
-	
-	
-	if (sendmsg(socket_des, &message, 0) < 0) {
-		perror("s_udp_send_packet(): sendmsg()");
-		return S_UDP_NETWORK_ERROR;
+	if (lz_res < 0) {
+		res = (lz_res == S_UDP_LZ_ERR_OVERFLOW)?
+			S_UDP_BUFFER_TOO_SMALL:S_UDP_MALFORMED_PACKET;
+
+		fprintf(stderr, "s_udp_receive_packet(): s_udp_lz_decompress(): %s\n",
+				s_udp_error_string(res));
+		return res;
 	}
 
+	channel->stats.decompress_nsec += timespec2nsec(stop) - timespec2nsec(start);
+	channel->stats.decompress_in_bytes += length;
+	channel->stats.decompress_out_bytes += lz_res;
+	*result_length = lz_res;
+
 	return S_UDP_OK;
 }
 
-s_udp_err_t s_udp_receive_packet(s_udp_channel_t* channel,
-								 uint8_t* data,
-								 uint32_t max_length,
-								 ssize_t* length,
-								 uint32_t* latency,
-								 uint8_t* packet_loss_detected)
+
+// Hand the next message of the last coalesced packet received
+// to the caller.
+static s_udp_err_t _unpack_message(s_udp_channel_t* channel,
+								   const struct iovec* iov,
+								   uint32_t iov_count,
+								   uint32_t max_length,
+								   ssize_t* length,
+								   uint32_t* latency,
+								   uint8_t* packet_loss_detected)
+{
+	const uint8_t* message = 0;
+	uint32_t message_length = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	res = s_udp_next_message(channel->unpack_buffer,
+							 channel->unpack_length,
+							 &channel->unpack_offset,
+							 &message,
+							 &message_length);
+
+	// Drop the rest of a broken packet.
+	if (res != S_UDP_OK) {
+		channel->unpack_offset = channel->unpack_length;
+		*length = 0;
+
+		if (res != S_UDP_TRY_AGAIN)
+			fprintf(stderr, "s_udp_receive_packet(): s_udp_next_message(): %s\n",
+					s_udp_error_string(res));
+		return res;
+	}
+
+	*length = message_length;
+	*latency = channel->unpack_latency;
+	*packet_loss_detected = 0;
+
+	if (message_length > max_length) {
+		fprintf(stderr, "s_udp_receive_packet(): %s\n",
+				s_udp_error_string(S_UDP_BUFFER_TOO_SMALL));
+		return S_UDP_BUFFER_TOO_SMALL;
+	}
+
+	_iov_scatter(iov, iov_count, 0, message, message_length);
+	return S_UDP_OK;
+}
+
+
+// s_udp_receive_packetv(), with recvmsg() flags. If flags has
+// MSG_DONTWAIT and nothing is queued, S_UDP_TRY_AGAIN is returned
+// with *length set to -1.
+static s_udp_err_t _receive_packetv(s_udp_channel_t* channel,
+									const struct iovec* iov,
+									uint32_t iov_count,
+									ssize_t* length,
+									uint32_t* latency,
+									uint8_t* packet_loss_detected,
+									int flags)
 {
 	uint8_t header[_S_UDP_HEADER_LENGTH];
 	s_udp_err_t dec_res = S_UDP_OK;
 	struct msghdr message;
-	struct iovec payload_array[2];
+	struct iovec payload_array[S_UDP_MAX_IOV + 1];
 	struct sockaddr_in source_address;
-	uint8_t master_packet_processed = 0;
+	uint8_t master_packet = 0;
+	s_udp_header_t decoded;
+	uint32_t header_length = 0;
+	uint32_t max_length = 0;
+	uint32_t ind = 0;
 
-	if (!length || !latency || !data ||
+	if (!length || !latency || !iov || !iov_count || iov_count > S_UDP_MAX_IOV ||
 		!channel || !packet_loss_detected) {
 		fprintf(stderr, "s_udp_read_data(): Illegal argument\n");
 		return S_UDP_ILLEGAL_ARGUMENT;
@@ -603,21 +3362,28 @@ s_udp_err_t s_udp_receive_packet(s_udp_channel_t* channel,
 
 		
 	// Setup a receive message context that splits the received
-	// packet into a separate header and payload buffer.
+	// packet into a separate header and the caller's payload buffers.
 
 	// Header
 	payload_array[0].iov_base = (void*) &header;
 	payload_array[0].iov_len = sizeof(header);
 
 	// Data
-	payload_array[1].iov_base = (void*) data;
-	payload_array[1].iov_len = max_length;
+	memcpy(payload_array + 1, iov, iov_count * sizeof(struct iovec));
+
+	for (ind = 0; ind < iov_count; ++ind)
+		max_length += iov[ind].iov_len;
+
+	// Messages left from the last coalesced packet go first.
+	if (channel->unpack_offset < channel->unpack_length)
+		return _unpack_message(channel, iov, iov_count, max_length,
+							   length, latency, packet_loss_detected);
 
 	// Message context
 	message.msg_name = (struct sockaddr *) &source_address;
 	message.msg_namelen = sizeof(source_address);
 	message.msg_iov = payload_array;
-	message.msg_iovlen = sizeof(payload_array) / sizeof(payload_array[0]);
+	message.msg_iovlen = iov_count + 1;
 	message.msg_control = 0;
 	message.msg_controllen = 0;
 	message.msg_flags = 0;
@@ -625,22 +3391,29 @@ s_udp_err_t s_udp_receive_packet(s_udp_channel_t* channel,
 	// Continue to read until we get something else than
 	// a master (slot 0) packet.
 		
-	if ((*length = recvmsg(channel->socket_des, &message, 0)) < 0) {
+	if ((*length = channel->transport->recvmsg(channel->transport_ctx,
+												channel, &message, flags)) < 0) {
+		// Nothing queued on a transport that does not block.
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return S_UDP_TRY_AGAIN;
+
 		perror("s_udp_read_data(): recvfrom()");
 		return S_UDP_NETWORK_ERROR;
 	}
 
 	// Decode header.
-	master_packet_processed = 0;
+	master_packet = 0;
 	dec_res = _decode_header(header,
 							 *length,
 							 channel,
 							 latency,
 							 packet_loss_detected,
-							 &master_packet_processed);
+							 &master_packet,
+							 &decoded);
 
+	// Packets of other slots are counted in stats.foreign_packets.
 	if (dec_res != S_UDP_OK) {
-		if (dec_res != S_UDP_TRY_AGAIN)
+		if (dec_res != S_UDP_TRY_AGAIN && dec_res != S_UDP_SLOT_MISMATCH)
 			fprintf(stderr, "s_udp_receive_packet(): _decode_header(): %s\n",
 					s_udp_error_string(dec_res));
 		return dec_res;
@@ -648,36 +3421,355 @@ s_udp_err_t s_udp_receive_packet(s_udp_channel_t* channel,
 
 	// Subtract header length from received data to
 	// get payload length
-	*length -= _S_UDP_HEADER_LENGTH;
+	header_length = decoded.header_length;
+	*length -= header_length;
 
 	// If this was a regular slot packet (slot != 0)
 	// break out of read loop.
-	if (master_packet_processed) {
+	// Master packets always have a standard header, so their
+	// payload is in the data buffers.
+	if (master_packet) {
+		uint8_t schedule[_S_UDP_SCHEDULE_LENGTH];
+		uint32_t schedule_length = (*length < max_length)?*length:max_length;
+
+		if (iov_count == 1) {
+			_process_master(channel, &decoded, iov[0].iov_base, schedule_length);
+			return S_UDP_TRY_AGAIN;
+		}
+
+		if (schedule_length > sizeof(schedule))
+			schedule_length = sizeof(schedule);
+
+		_iov_gather(iov, iov_count, 0, schedule, schedule_length);
+		_process_master(channel, &decoded, schedule, schedule_length);
 		return S_UDP_TRY_AGAIN;
 	}
 
+	// A compact header is shorter than the header buffer that
+	// recvmsg() scattered into. Move the leading payload bytes that
+	// ended up in the header buffer to the data buffers.
+	if (header_length < sizeof(header)) {
+		uint32_t in_data = (*length > sizeof(header) - header_length)?
+			*length - (sizeof(header) - header_length):0;
+		uint32_t in_header = *length - in_data;
+
+		if (*length > max_length) {
+			fprintf(stderr, "s_udp_receive_packet(): %s\n",
+					s_udp_error_string(S_UDP_BUFFER_TOO_SMALL));
+			return S_UDP_BUFFER_TOO_SMALL;
+		}
+
+		_iov_shift(iov, iov_count, in_data, in_header);
+		_iov_scatter(iov, iov_count, 0, header + header_length, in_header);
+	}
+
+	if (decoded.flags & S_UDP_FLAG_COMPRESSED) {
+		// Move the compressed payload out of the way and
+		// decompress it into the caller's buffers.
+		if ((dec_res = _alloc_lz_buffer(channel)) != S_UDP_OK)
+			return dec_res;
+
+		_iov_gather(iov, iov_count, 0, channel->lz_buffer, *length);
+
+		// The decompressor needs one contiguous output buffer.
+		if (iov_count == 1)
+			dec_res = _decompress(channel, channel->lz_buffer, *length,
+								  iov[0].iov_base, max_length, length);
+		else if ((dec_res = _decompress(channel, channel->lz_buffer, *length,
+										channel->gather_buffer,
+										(max_length < S_UDP_MAX_PAYLOAD)?max_length:S_UDP_MAX_PAYLOAD,
+										length)) == S_UDP_OK)
+			_iov_scatter(iov, iov_count, 0, channel->gather_buffer, *length);
+
+		if (dec_res != S_UDP_OK)
+			return dec_res;
+	}
+
+	// Keep the messages of a coalesced packet, and hand out the
+	// first. Only that one is flagged with loss.
+	if (decoded.flags & S_UDP_FLAG_COALESCED) {
+		uint8_t loss = *packet_loss_detected;
+
+		if (!channel->unpack_buffer &&
+			!(channel->unpack_buffer = malloc(S_UDP_MAX_PAYLOAD))) {
+			perror("s_udp_receive_packet(): malloc()");
+			return S_UDP_BUFFER_TOO_SMALL;
+		}
+
+		_iov_gather(iov, iov_count, 0, channel->unpack_buffer, *length);
+		channel->unpack_length = *length;
+		channel->unpack_offset = 0;
+		channel->unpack_latency = *latency;
+
+		dec_res = _unpack_message(channel, iov, iov_count, max_length,
+								  length, latency, packet_loss_detected);
+		*packet_loss_detected = loss;
+		return dec_res;
+	}
+
 	// This was the master sending out an update, then
 	// Loop back and wait or the next package.
 	return S_UDP_OK;
 }
 
 
-s_udp_err_t s_udp_destroy_channel(s_udp_channel_t* channel)
+static s_udp_err_t _receive_packet(s_udp_channel_t* channel,
+								   uint8_t* data,
+								   uint32_t max_length,
+								   ssize_t* length,
+								   uint32_t* latency,
+								   uint8_t* packet_loss_detected,
+								   int flags)
 {
-	if (channel->socket_des != -1)
-		close(channel->socket_des);
+	struct iovec iov;
 
-	channel->socket_des = -1;
+	if (!data) {
+		fprintf(stderr, "s_udp_read_data(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	iov.iov_base = (void*) data;
+	iov.iov_len = max_length;
+
+	return _receive_packetv(channel, &iov, 1,
+							length, latency, packet_loss_detected, flags);
+}
+
+
+s_udp_err_t s_udp_receive_packet(s_udp_channel_t* channel,
+								 uint8_t* data,
+								 uint32_t max_length,
+								 ssize_t* length,
+								 uint32_t* latency,
+								 uint8_t* packet_loss_detected)
+{
+	return _receive_packet(channel, data, max_length,
+						   length, latency, packet_loss_detected, 0);
+}
+
+
+s_udp_err_t s_udp_receive_packetv(s_udp_channel_t* channel,
+								  const struct iovec* iov,
+								  uint32_t iov_count,
+								  ssize_t* length,
+								  uint32_t* latency,
+								  uint8_t* packet_loss_detected)
+{
+	return _receive_packetv(channel, iov, iov_count,
+							length, latency, packet_loss_detected, 0);
+}
+
+
+s_udp_err_t s_udp_drain(s_udp_channel_t* channel,
+						uint32_t budget,
+						s_udp_drain_cb_t callback,
+						void* user,
+						uint32_t* drained)
+{
+	uint8_t* data = 0;
+	ssize_t length = 0;
+	uint32_t latency = 0;
+	uint8_t packet_loss_detected = 0;
+	uint32_t count = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	if (!channel || !budget) {
+		fprintf(stderr, "s_udp_drain(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	// Receive into the gather buffer of the channel rather than onto
+	// the stack of what may be a real time thread. Receives into one
+	// buffer do not use it. Allocated on attach if memory is locked.
+	if ((res = _alloc_lz_buffer(channel)) != S_UDP_OK)
+		return res;
+
+	data = channel->gather_buffer;
+
+	while(count < budget) {
+		res = _receive_packet(channel, data, S_UDP_MAX_PAYLOAD, &length,
+							  &latency, &packet_loss_detected, MSG_DONTWAIT);
+
+		// Queue is empty.
+		if (res == S_UDP_TRY_AGAIN && length < 0)
+			break;
+
+		count++;
+
+		if (res == S_UDP_OK && callback)
+			(*callback)(channel, data, length, latency, packet_loss_detected, user);
+
+		// Master packets, and packets that fail slot or window
+		// checks, are consumed. Only transport errors end the drain.
+		if (res == S_UDP_NETWORK_ERROR) {
+			if (drained)
+				*drained = count;
+			return res;
+		}
+	}
+
+	if (drained)
+		*drained = count;
+
+	return (count < budget)?S_UDP_TRY_AGAIN:S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_set_pool(s_udp_channel_t* channel,
+						   s_udp_pool_t* pool)
+{
+	if (!channel) {
+		fprintf(stderr, "s_udp_set_pool(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	channel->pool = pool;
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_receive_packet_pooled(s_udp_channel_t* channel,
+										s_udp_packet_t** result)
+{
+	s_udp_packet_t* packet = 0;
+	s_udp_packet_t* plain = 0;
+	uint8_t master_packet = 0;
+	struct msghdr message;
+	struct iovec slab;
+	ssize_t length = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	if (!channel || !result || !channel->pool) {
+		fprintf(stderr, "s_udp_receive_packet_pooled(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (!(packet = s_udp_alloc_packet(channel->pool)))
+		return S_UDP_POOL_EXHAUSTED;
+
+	// Header and payload are received in one piece into the slab.
+	// MSG_TRUNC returns the full datagram length if it did not fit.
+	slab.iov_base = packet->slab;
+	slab.iov_len = channel->pool->slab_size;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &slab;
+	message.msg_iovlen = 1;
+
+	length = channel->transport->recvmsg(channel->transport_ctx, channel, &message, MSG_TRUNC);
+
+	if (length < 0) {
+		s_udp_release_packet(packet);
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return S_UDP_TRY_AGAIN;
+
+		perror("s_udp_receive_packet_pooled(): recvmsg()");
+		return S_UDP_NETWORK_ERROR;
+	}
+
+	if (length > channel->pool->slab_size) {
+		fprintf(stderr, "s_udp_receive_packet_pooled(): %s\n",
+				s_udp_error_string(S_UDP_BUFFER_TOO_SMALL));
+		s_udp_release_packet(packet);
+		return S_UDP_BUFFER_TOO_SMALL;
+	}
+
+	res = _decode_header(packet->slab,
+						 length,
+						 channel,
+						 &packet->latency,
+						 &packet->packet_loss_detected,
+						 &master_packet,
+						 &packet->header);
+
+	if (res == S_UDP_OK && master_packet)
+		_process_master(channel, &packet->header,
+						packet->slab + packet->header.header_length,
+						length - packet->header.header_length);
+
+	if (res != S_UDP_OK || master_packet) {
+		if (res != S_UDP_OK && res != S_UDP_TRY_AGAIN && res != S_UDP_SLOT_MISMATCH)
+			fprintf(stderr, "s_udp_receive_packet_pooled(): _decode_header(): %s\n",
+					s_udp_error_string(res));
+
+		s_udp_release_packet(packet);
+		return (res == S_UDP_OK)?S_UDP_TRY_AGAIN:res;
+	}
+
+	packet->payload = packet->slab + packet->header.header_length;
+	packet->length = length - packet->header.header_length;
+
+	// Decompress into a second slab and drop the compressed one.
+	if (packet->header.flags & S_UDP_FLAG_COMPRESSED) {
+		if (!(plain = s_udp_alloc_packet(channel->pool))) {
+			s_udp_release_packet(packet);
+			return S_UDP_POOL_EXHAUSTED;
+		}
+
+		res = _decompress(channel, packet->payload, packet->length,
+						  plain->slab, channel->pool->slab_size, &length);
+
+		plain->header = packet->header;
+		plain->latency = packet->latency;
+		plain->packet_loss_detected = packet->packet_loss_detected;
+		plain->length = length;
+		s_udp_release_packet(packet);
+		packet = plain;
+
+		if (res != S_UDP_OK) {
+			s_udp_release_packet(packet);
+			return res;
+		}
+	}
+
+	*result = packet;
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_destroy_channel(s_udp_channel_t* channel)
+{
+	s_udp_packet_t* packet = 0;
+	uint32_t ind = 0;
+
+	channel->transport->detach(channel->transport_ctx, channel);
+
+	free(channel->lz_buffer);
+	channel->lz_buffer = 0;
+	free(channel->gather_buffer);
+	channel->gather_buffer = 0;
+	free(channel->coalesce_buffer);
+	channel->coalesce_buffer = 0;
+	free(channel->unpack_buffer);
+	channel->unpack_buffer = 0;
+	free(channel->dedupe);
+	channel->dedupe = 0;
+
+	// Drop what is still queued for owned slots.
+	for (ind = 0; ind < channel->owned_slot_count; ++ind)
+		while((packet = s_udp_dequeue_packet(&channel->owned_slots[ind].queue)))
+			s_udp_release_packet(packet);
+
+	free(channel->owned_slots);
+	channel->owned_slots = 0;
+	channel->owned_slot_count = 0;
+
+	free(channel->zc_headers);
+	channel->zc_headers = 0;
+	channel->zerocopy = 0;
 
 	return S_UDP_OK;
 }
 
 uint64_t s_udp_get_master_clock(s_udp_channel_t* channel)
 {
+	uint64_t master_clock = 0;
+
 	if (!channel->master_clock_offset)
 		return 0L;
 	
-	return s_udp_get_local_clock() - channel->master_clock_offset;
+	master_clock = _local_clock(channel) - channel->master_clock_offset;
+	return master_clock;
 }
 
 uint64_t s_udp_get_local_clock()
@@ -707,6 +3799,9 @@ const char* s_udp_error_string(s_udp_err_t code)
 		"slot mismatch",            // S_UDP_SLOT_MISMATCH
 		"out of sync",              // S_UDP_OUT_OF_SYNC
 		"no master clock",              // S_UDP_OUT_OF_SYNC
+		"pool exhausted",           // S_UDP_POOL_EXHAUSTED
+		"real time setup failed",   // S_UDP_RT_FAILURE
+		"no lease",                 // S_UDP_NO_LEASE
 	};
 
 	return err_string[code];
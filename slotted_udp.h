@@ -9,27 +9,59 @@
    Slotted UDP Multicast Header File
 */
 
+#ifndef SLOTTED_UDP_H
+#define SLOTTED_UDP_H
+
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+// Typed C++ channels are in slotted_udp.hpp.
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 
-typedef struct _s_udp_channel_t {
-	struct sockaddr_in address; // Multicast address group.
-	uint32_t slot;    // Slot to use inside address:port
-	uint32_t slot_count;    // Number of slots maintained by this channel. Transmitted by master.
-	uint32_t slot_width;    // The duration, in usec, of each slot. Transmitted by master.
-	uint8_t is_sender;       // Are we sending or receiving on this channel.
-	int32_t socket_des;  // File descriptor
-	uint64_t transaction_id;      // Current transaction ID for sender.
-	                              // Last received transaction ID for receiver.
+// The upper 8 bits of the slot field in the packet header carry
+// per-packet flags. The lower 24 bits carry the slot number.
+#define S_UDP_SLOT_MASK       0x00FFFFFF
+#define S_UDP_FLAG_COMPACT    0x80000000 // Compact header. See s_udp_set_header_format().
+#define S_UDP_FLAG_COMPRESSED 0x40000000 // Payload is compressed. See s_udp_set_compression().
+#define S_UDP_FLAG_SEQ32      0x20000000 // Compact header carries a 32 bit transaction ID.
+#define S_UDP_FLAG_COALESCED  0x10000000 // Payload is length prefixed messages. See s_udp_set_coalescing().
 
-	uint64_t master_clock_offset; // Microsecnds that self's clock is ahead of master clock.
-	                              // Master clock, sent out by slotted_udp_master program, will
-	                              // always have a lower value than the local clock.
-} s_udp_channel_t;
+// The lower 4 flag bits of a slot 0 packet carry its control message type.
+#define S_UDP_CONTROL_MASK    0x0F000000
+#define S_UDP_CONTROL_SYNC    0x00000000 // Master clock and schedule. Sent by master.
+#define S_UDP_CONTROL_REPORT  0x01000000 // Slot utilization. Sent by senders. See s_udp_set_report_interval().
+#define S_UDP_CONTROL_JOIN    0x02000000 // Request for master packets. Sent by nodes. See s_udp_send_join().
+#define S_UDP_CONTROL_LEASE_REQUEST 0x03000000 // Request for a slot. Sent by senders. See s_udp_request_lease().
+#define S_UDP_CONTROL_LEASE_GRANT   0x04000000 // Slot granted to a sender. Sent by master.
+
+// Header formats that a sender can use.
+// Receivers decode all formats transparently.
+typedef enum _s_udp_header_format_t {
+	S_UDP_HEADER_STANDARD = 0,  // 20 bytes. 24 bit slot, 64 bit transaction ID, 64 bit clock.
+	S_UDP_HEADER_COMPACT16 = 1, // 8 bytes. 8 bit slot, 16 bit transaction ID, 32 bit clock offset.
+	S_UDP_HEADER_COMPACT32 = 2, // 10 bytes. 8 bit slot, 32 bit transaction ID, 32 bit clock offset.
+} s_udp_header_format_t;
+
+// Pass as slot to s_udp_init_channel() to receive packets from all
+// slots. Packet loss cannot be detected in this mode.
+#define S_UDP_ALL_SLOTS S_UDP_SLOT_MASK
+
+// Largest payload that fits in a single UDP/IP datagram after
+// the slotted udp header.
+#define S_UDP_MAX_PAYLOAD (65507 - 20)
+
+// Most payload buffers that the scatter-gather calls,
+// s_udp_send_packetv_now() and s_udp_receive_packetv(), take.
+#define S_UDP_MAX_IOV 16
+
+// Largest payload that fits in a 1500 byte Ethernet frame after
+// the IP/UDP and standard slotted udp headers.
+#define S_UDP_MTU_PAYLOAD (1500 - 28 - 20)
 
 typedef enum _s_udp_err_t {
 	S_UDP_OK = 0,
@@ -47,33 +79,571 @@ typedef enum _s_udp_err_t {
 	S_UDP_SLOT_MISMATCH = 12,
 	S_UDP_OUT_OF_SYNC = 13,
 	S_UDP_NO_MASTER_CLOCK = 14,
+	S_UDP_POOL_EXHAUSTED = 15,
+	S_UDP_RT_FAILURE = 16,
+	S_UDP_NO_LEASE = 17,
 } s_udp_err_t;
 
+typedef struct _s_udp_stats_t {
+	uint64_t compress_in_bytes;    // Payload bytes handed to the compressor.
+	uint64_t compress_out_bytes;   // Payload bytes sent, compressed or not, for the above.
+	uint64_t compress_nsec;        // Time spent compressing.
+	uint64_t decompress_in_bytes;  // Compressed payload bytes received.
+	uint64_t decompress_out_bytes; // Payload bytes delivered after decompression.
+	uint64_t decompress_nsec;      // Time spent decompressing.
+	uint64_t zerocopy_sent;        // Packets sent with MSG_ZEROCOPY.
+	uint64_t zerocopy_copied;      // Of those, packets that the kernel copied anyway.
+	uint64_t coalesce_messages;    // Messages sent in coalesced packets.
+	uint64_t coalesce_packets;     // Coalesced packets sent.
+	uint64_t foreign_packets;      // Packets of other slots read and dropped.
+	uint64_t batch_calls;          // sendmmsg() calls made by s_udp_flush_slots().
+	uint64_t batch_packets;        // Packets sent by those calls.
+} s_udp_stats_t;
+
+// Number of paths that a redundant channel sends each packet on.
+// See s_udp_dual_init().
+#define S_UDP_MAX_PATHS 2
+
+// Counters of one path of a redundant channel. See s_udp_get_path_stats().
+typedef struct _s_udp_path_stats_t {
+	uint64_t sent;           // Copies sent on the path.
+	uint64_t send_errors;    // Copies that could not be sent on the path.
+	uint64_t received;       // Copies received on the path, duplicates included.
+	uint64_t first;          // Copies that arrived before any other copy, and were delivered.
+	uint64_t lost;           // Packets that arrived on another path only.
+	uint64_t latency_sum;    // Latency of copies received, in usec. Divide by received for the mean.
+	uint32_t latency_max;
+} s_udp_path_stats_t;
+
+// Decoded packet header. See s_udp_decode_header().
+typedef struct _s_udp_header_t {
+	uint32_t slot;           // Slot the packet was sent in.
+	uint32_t flags;          // S_UDP_FLAG_XXX bits.
+	uint64_t transaction_id; // Transaction ID. Wraps for compact headers.
+	uint64_t clock;          // Master clock of sender. See s_udp_decode_header().
+	uint32_t header_length;  // Number of header bytes preceding the payload.
+} s_udp_header_t;
+
+// Slot utilization reported by a sender to the master.
+// See s_udp_set_report_interval() and s_udp_decode_report().
+typedef struct _s_udp_report_t {
+	uint32_t slot;           // Slot of the reporting sender.
+	uint32_t interval;       // Master clock usec covered by the report.
+	uint32_t packets;        // Packets sent during interval.
+	uint32_t bytes;          // Bytes sent during interval, headers included.
+	uint32_t peak_bytes;     // Most bytes sent within a single send window.
+} s_udp_report_t;
+
+// Slot lease request sent by a sender to the master.
+// See s_udp_request_lease() and s_udp_decode_lease_request().
+typedef struct _s_udp_lease_request_t {
+	uint32_t node_id;        // Random ID of the requesting sender.
+	uint32_t slot;           // Slot held, or preferred. 0 for any.
+	uint32_t bandwidth;      // Expected bytes/sec. 0 if unknown.
+} s_udp_lease_request_t;
+
+// Handle to a packet held in a slab of a s_udp_pool_t.
+// See s_udp_receive_packet_pooled().
+typedef struct _s_udp_packet_t {
+	s_udp_header_t header;        // Decoded header of a received packet.
+	uint8_t* payload;             // Payload, inside slab.
+	uint32_t length;              // Number of payload bytes.
+	uint32_t latency;             // See s_udp_receive_packet().
+	uint8_t packet_loss_detected; // See s_udp_receive_packet().
+
+	// Owned by the pool.
+	uint8_t* slab;                // Slab of pool->slab_size bytes.
+	struct _s_udp_pool_t* pool;   // Pool that slab belongs to.
+	uint32_t ref_count;           // Handle is returned to pool when this reaches 0.
+	uint32_t next_free;           // Free list link. Index + 1 of next free handle.
+	struct _s_udp_packet_t* next_queued; // Send queue link. See s_udp_enqueue_packet().
+} s_udp_packet_t;
+
+// Preallocated, fixed size slabs. See s_udp_init_pool().
+typedef struct _s_udp_pool_t {
+	uint8_t* memory;              // All slabs, in one mapping.
+	size_t memory_size;           // Size of mapping.
+	s_udp_packet_t* packets;      // One handle per slab.
+	uint32_t slab_size;           // Bytes per slab.
+	uint32_t slab_count;          // Number of slabs.
+	uint8_t huge_pages;           // Memory is backed by huge pages.
+	uint64_t free_head;           // Free list head. Tag (upper 32 bits) and index + 1.
+} s_udp_pool_t;
+
+// Packets waiting to be sent on one channel, queued by any number
+// of threads and sent by one. See s_udp_init_send_queue().
+// Producers and the consumer work on separate cache lines.
+typedef struct _s_udp_send_queue_t {
+	s_udp_packet_t* head;         // Last queued packet. Swapped in by producers.
+	s_udp_packet_t* tail __attribute__((aligned(64))); // Oldest packet. Consumer only.
+	s_udp_packet_t* front;        // Packet put back by the consumer. Consumer only.
+	s_udp_packet_t stub;          // Keeps the queue from ever being empty.
+} s_udp_send_queue_t;
+
+// Most slots that one channel can own. See s_udp_add_slot().
+#define S_UDP_MAX_OWNED_SLOTS 32
+
+// Most packets handed to the kernel per sendmmsg() call.
+#define S_UDP_SEND_BATCH 32
+
+// Slot owned by a multi-slot sender. See s_udp_add_slot().
+typedef struct _s_udp_owned_slot_t {
+	s_udp_send_queue_t queue;     // Packets waiting for the window of slot.
+	uint32_t slot;
+	uint64_t transaction_id;      // Last transaction ID sent in slot.
+	uint64_t sent;                // Packets sent in slot.
+} s_udp_owned_slot_t;
+
+// Real time execution profile of a channel. See s_udp_set_rt_config().
+typedef struct _s_udp_rt_config_t {
+	int32_t cpu;                  // CPU to pin the attaching thread to. -1 is any.
+	int32_t priority;             // SCHED_FIFO priority, 1-99. 0 keeps the current policy.
+	uint8_t lock_memory;          // mlockall() and prefault buffers and stack.
+	uint32_t busy_poll;           // SO_BUSY_POLL, in usec. 0 is off.
+	int32_t rcvbuf;               // SO_RCVBUF, in bytes. 0 is the system default.
+	int32_t sndbuf;               // SO_SNDBUF, in bytes. 0 is the system default.
+	int32_t socket_priority;      // SO_PRIORITY of sent packets. -1 is the system default.
+} s_udp_rt_config_t;
+
+// Send cycle arithmetic of a channel. Rebuilt from slot_width,
+// slot_count and cycle_epoch of the channel whenever those change.
+// See _get_cycle_start() in slotted_udp.c.
+typedef struct _s_udp_schedule_t {
+	uint32_t slot_width;          // Parameters that the schedule was built from.
+	uint32_t slot_count;
+	uint64_t cycle_epoch;
+	uint64_t cycle_duration;      // slot_width * slot_count, in usec.
+	uint8_t power_of_two;         // cycle_duration is a power of two.
+	uint32_t cycle_shift;         // log2(cycle_duration), if a power of two.
+	uint64_t reciprocal;          // (2^64 - 1) / cycle_duration, if not.
+	uint64_t cycle_start;         // Start of the cycle that was last looked up.
+} s_udp_schedule_t;
+
+struct _s_udp_channel_t;
+
+// Network backend of a channel. See s_udp_set_transport().
+// The default, s_udp_socket_transport, is a UDP multicast socket.
+//
+// sendmsg() and recvmsg() follow the semantics of the system calls
+// of the same name. msg_name is filled in by sendmsg() callers with
+// the channel address. recvmsg() fails with EAGAIN if nothing is
+// queued and the backend cannot block.
+typedef struct _s_udp_transport_t {
+	s_udp_err_t (*attach)(void* ctx, struct _s_udp_channel_t* channel);
+	ssize_t (*sendmsg)(void* ctx, struct _s_udp_channel_t* channel,
+					   const struct msghdr* message, int flags);
+	ssize_t (*recvmsg)(void* ctx, struct _s_udp_channel_t* channel,
+					   struct msghdr* message, int flags);
+	void (*detach)(void* ctx, struct _s_udp_channel_t* channel);
+} s_udp_transport_t;
+
+// Time source of a channel. See s_udp_set_clock().
+// The default, s_udp_monotonic_clock, is CLOCK_MONOTONIC.
+typedef struct _s_udp_clock_t {
+	uint64_t (*now)(void* ctx);              // Local clock, in usec.
+	void (*sleep)(void* ctx, uint64_t usec); // Wait usec.
+} s_udp_clock_t;
+
+extern const s_udp_transport_t s_udp_socket_transport;
+extern const s_udp_clock_t s_udp_monotonic_clock;
+
+// Clock that reads the TSC. ctx is a s_udp_tsc_t.
+// See slotted_udp_tsc.c and s_udp_tsc_init().
+extern const s_udp_clock_t s_udp_tsc_clock;
+
+// Conversion of TSC ticks to CLOCK_MONOTONIC nsec. See s_udp_tsc_t.
+typedef struct _s_udp_tsc_scale_t {
+	uint64_t base_tsc;            // TSC that base_nsec was read at.
+	uint64_t base_nsec;           // Clock at base_tsc.
+	uint64_t mult;                // nsec per tick, 32.32 fixed point.
+	uint64_t recalibrate_at;      // TSC that the scale runs out at.
+} s_udp_tsc_scale_t;
+
+// State of s_udp_tsc_clock. See s_udp_tsc_init().
+typedef struct _s_udp_tsc_t {
+	s_udp_tsc_scale_t scales[2];  // Scale in use, and the next one.
+	uint32_t current;             // Index of the scale in use.
+	uint32_t recalibrating;       // Set while a thread recalibrates.
+	uint64_t anchor_tsc;          // First calibration sample, that the rate is measured from.
+	uint64_t anchor_nsec;
+	uint64_t interval_nsec;       // Between recalibrations. 0 never recalibrates.
+	uint32_t spin_usec;           // Spin on the TSC for the last spin_usec of each sleep.
+	uint8_t fallback;             // TSC unusable. Reads CLOCK_MONOTONIC instead.
+	const char* fallback_reason;  // Why, if fallback is set.
+
+	uint64_t calibrations;        // Recalibrations done.
+	int64_t last_error_nsec;      // Clock minus CLOCK_MONOTONIC at the last recalibration.
+	uint64_t max_error_nsec;      // Largest error seen at a recalibration.
+} s_udp_tsc_t;
+
+// Shared memory transport for subscribers on the same host.
+// See slotted_udp_shm.c and s_udp_init_channel().
+extern const s_udp_transport_t s_udp_shm_transport;
+
+// Redundant transport that sends each packet on two paths.
+// See slotted_udp_dual.c and s_udp_dual_init().
+extern const s_udp_transport_t s_udp_dual_transport;
+
+typedef struct _s_udp_channel_t {
+	struct sockaddr_in address; // Multicast address group.
+	uint32_t slot;    // Slot to use inside address:port
+	uint32_t slot_count;    // Number of slots maintained by this channel. Transmitted by master.
+	uint32_t slot_width;    // The duration, in usec, of each slot. Transmitted by master.
+	uint8_t is_sender;       // Are we sending or receiving on this channel.
+	int32_t socket_des;  // File descriptor
+	uint64_t transaction_id;      // Current transaction ID for sender.
+	                              // Last received transaction ID for receiver.
+
+	uint64_t master_clock_offset; // Microsecnds that self's clock is ahead of master clock.
+	                              // Master clock, sent out by slotted_udp_master program, will
+	                              // always have a lower value than the local clock.
+
+	uint8_t compression;          // Compress outgoing payloads. See s_udp_set_compression().
+	uint8_t header_format;        // s_udp_header_format_t to send with. See s_udp_set_header_format().
+	uint8_t* lz_buffer;           // Scratch buffer for (de)compression. Allocated on demand.
+	uint8_t* gather_buffer;       // Contiguous copy of vectored payloads for (de)compression.
+	uint8_t zerocopy;             // Send with MSG_ZEROCOPY. See s_udp_set_zerocopy().
+	uint8_t* zc_headers;          // Header buffers for in flight zero copy sends.
+	uint32_t zc_sent;             // Number of zero copy sends issued. Wraps.
+	uint32_t zc_completed;        // Number of zero copy sends completed by kernel. Wraps.
+	s_udp_stats_t stats;          // Counters. See s_udp_get_stats().
+	s_udp_pool_t* pool;           // Pool to receive into. See s_udp_set_pool().
+	const s_udp_transport_t* transport; // Network backend. See s_udp_set_transport().
+	void* transport_ctx;
+	const s_udp_clock_t* clock;   // Time source. See s_udp_set_clock().
+	void* clock_ctx;
+	s_udp_rt_config_t rt_config;  // Applied by s_udp_attach_channel(). See s_udp_set_rt_config().
+
+	// Schedule announced by master. See s_udp_set_schedule().
+	uint32_t schedule_version;    // Incremented by master for each new schedule.
+	uint32_t next_slot_width;     // slot_width from schedule_switch and on.
+	uint64_t schedule_switch;     // Master clock that the schedule takes effect at. 0 if none.
+	uint64_t cycle_epoch;         // Master clock that send cycles are counted from.
+	s_udp_schedule_t schedule;    // Cached cycle arithmetic for the above.
+
+	// Sent bytes accounted for the next report. See s_udp_set_report_interval().
+	uint32_t report_interval;     // Master clock usec between reports. 0 is off.
+	uint64_t report_start;        // Master clock that the current report started at.
+	uint64_t report_cycle;        // Send cycle of report_window_bytes.
+	uint32_t report_packets;
+	uint32_t report_bytes;
+	uint32_t report_peak_bytes;
+	uint32_t report_window_bytes; // Bytes sent in the current send window.
+
+	// Message coalescing. See s_udp_set_coalescing().
+	uint32_t coalesce_length;     // Largest coalesced payload to send. 0 is off.
+	uint8_t* coalesce_buffer;     // Messages queued by s_udp_queue_message(), length prefixed.
+	uint32_t coalesce_used;       // Bytes queued in coalesce_buffer.
+	uint8_t* unpack_buffer;       // Payload of the last coalesced packet received.
+	uint32_t unpack_length;       // Bytes in unpack_buffer.
+	uint32_t unpack_offset;       // Next message to hand out from unpack_buffer.
+	uint32_t unpack_latency;      // Latency of the packet in unpack_buffer.
+
+	// Redundant paths. See s_udp_dual_init().
+	uint8_t path_count;           // Paths that each packet is sent on. 1 unless redundant.
+	uint8_t rx_path;              // Path of the last packet read. Set by the transport.
+	struct _s_udp_dedupe_t* dedupe; // Transaction IDs received per slot and path. Allocated on demand.
+	s_udp_path_stats_t path_stats[S_UDP_MAX_PATHS];
+
+	// Per slot multicast groups. See s_udp_set_slot_groups().
+	uint32_t slots_per_group;     // Slots that share a data group. 0 sends all slots to address.
+	struct sockaddr_in slot_address; // Group that data packets of slot are sent to.
+	uint32_t joined_slots;        // Slots whose groups are joined, for S_UDP_ALL_SLOTS receivers.
+
+	// Slot lease. See s_udp_request_lease().
+	uint32_t node_id;             // Identifies us to the master. 0 if slot is not leased.
+	uint32_t lease_bandwidth;     // Bandwidth hint sent with requests, bytes/sec.
+	uint32_t lease_duration;      // Usec of master clock that the master grants.
+	uint64_t lease_expires;       // Master clock that the lease runs out at. 0 if none.
+	uint64_t lease_renew_at;      // Master clock that the next request is due at.
+
+	// Multi-slot sender. See s_udp_add_slot().
+	s_udp_owned_slot_t* owned_slots; // S_UDP_MAX_OWNED_SLOTS entries. Allocated on demand.
+	uint32_t owned_slot_count;
+} s_udp_channel_t;
+
+// Data packet handed over by s_udp_drain(). payload is only valid
+// during the call, and lives in a buffer of the channel that sends
+// with scatter-gather compression also use. Arguments are as
+// returned by s_udp_receive_packet().
+typedef void (*s_udp_drain_cb_t)(s_udp_channel_t* channel,
+								 const uint8_t* payload,
+								 ssize_t length,
+								 uint32_t latency,
+								 uint8_t packet_loss_detected,
+								 void* user);
+
+
 
 
 // Return synchronized microseconds since arbitrary start point
 // At any given time, this function will return the same
 // value for all processes connected to same address/port.
 //
-// Driven by slotted_udp_master program.
+// Driven by slotted_udp_master program. Returns 0 until the first
+// master packet has been received. Does not change channel.
 extern uint64_t s_udp_get_master_clock(s_udp_channel_t* channel);
 
 // Return microseconds since arbitrary start point.
+// This is always CLOCK_MONOTONIC. Channels read their clock
+// through s_udp_set_clock().
 extern uint64_t s_udp_get_local_clock(void);
 
 extern const char* s_udp_error_string(s_udp_err_t code);
 
+// address is either a multicast address, shm:NAME[@address] to
+// use a shared memory ring named NAME, or dual:PATH,PATH to use two
+// redundant paths. See s_udp_dual_init().
+//
+// Receivers on a shm: address read packets from the ring. Senders
+// write packets to the ring, and if address is given, also multicast
+// them to network receivers as usual. Such senders hear the master
+// on the network and forward master packets to the ring, so that
+// ring receivers get the master clock.
+//
+// A channel belongs to one thread at a time. Threads that send on
+// the same channel must serialize their calls, or queue their
+// packets for the owning thread. See s_udp_init_send_queue().
 extern s_udp_err_t s_udp_init_channel(s_udp_channel_t* channel,
 									  uint8_t is_sender,
 									  const char* address,
 									  in_port_t port,
 									  uint32_t slot);
 								 
+// Open the transport of channel and apply its real time profile,
+// if one has been set with s_udp_set_rt_config(). Channels on slots
+// other than 0 then send a join request. See s_udp_send_join().
 extern s_udp_err_t s_udp_attach_channel(s_udp_channel_t* channel);
 
+// Set config to the defaults, which change nothing.
+extern s_udp_err_t s_udp_init_rt_config(s_udp_rt_config_t* config);
+
+// Parse a comma separated list of settings into config, leaving
+// settings that are not listed as they are:
+//
+//   cpu=N, fifo=PRIORITY, mlock, busy_poll=USEC,
+//   rcvbuf=BYTES, sndbuf=BYTES, prio=SO_PRIORITY
+//
+extern s_udp_err_t s_udp_parse_rt_config(const char* spec,
+										 s_udp_rt_config_t* config);
+
+// Use config when channel is attached. Must be called before
+// s_udp_attach_channel(), from the thread that will do channel I/O.
+//
+// CPU pinning and SCHED_FIFO apply to the thread calling
+// s_udp_attach_channel(), and are inherited by threads it creates
+// later. Memory locking applies to the whole process. Socket options
+// are only set on channels with a socket. SCHED_FIFO, mlockall(),
+// busy polling and buffers beyond the sysctl limits need
+// CAP_SYS_NICE, CAP_IPC_LOCK or CAP_NET_ADMIN. Attaching fails with
+// S_UDP_RT_FAILURE if a setting cannot be applied.
+extern s_udp_err_t s_udp_set_rt_config(s_udp_channel_t* channel,
+									   const s_udp_rt_config_t* config);
+
+// Apply the socket options of the real time profile of channel to
+// socket_des. Done by s_udp_attach_channel() for the channel socket.
+// Transports that open sockets of their own call this for those.
+extern s_udp_err_t s_udp_apply_socket_config(s_udp_channel_t* channel,
+											 int32_t socket_des);
+
+// Replace the network backend of a channel, before it is attached.
+// ctx is passed to all transport functions. Zero copy sends and
+// the socket descriptor are only available with s_udp_socket_transport.
+extern s_udp_err_t s_udp_set_transport(s_udp_channel_t* channel,
+									   const s_udp_transport_t* transport,
+									   void* ctx);
+
+// Make channel use the shared memory ring name. If network is set,
+// senders also use the channel address. Done by s_udp_init_channel()
+// for shm: addresses.
+extern s_udp_err_t s_udp_shm_init(s_udp_channel_t* channel,
+								  const char* name,
+								  uint8_t network);
+
+// Make channel send each packet on two paths, and have receivers
+// deliver the copy that arrives first. Done by s_udp_init_channel()
+// for dual: addresses. Each path is a multicast group, optionally
+// followed by %IFNAME to send and receive on interface IFNAME
+// rather than the one routed to, like "224.0.0.123%eth1". Both
+// paths use the port of channel.
+//
+// Copies are matched on slot and transaction ID, within the last
+// 256 transaction IDs of each slot. The socket descriptor of the
+// channel is an epoll descriptor that is readable when either path
+// is. Zero copy sends are not supported.
+extern s_udp_err_t s_udp_dual_init(s_udp_channel_t* channel,
+								   const char* path_a,
+								   const char* path_b);
+
+// Calibrate tsc against CLOCK_MONOTONIC, for use with
+// s_udp_set_clock(channel, &s_udp_tsc_clock, tsc). Takes about 20
+// msec. One tsc can be shared by any number of channels and threads.
+//
+// The TSC is only used if the CPU reports it as invariant, and two
+// calibrations agree. Otherwise, and on CPUs without a TSC,
+// tsc->fallback is set, with the cause in tsc->fallback_reason, and
+// the clock reads CLOCK_MONOTONIC. The scale is recalibrated every
+// recalibrate_msec, with the error found slewed out over the next
+// interval, so that the clock never steps. An error of more than
+// 0.1% of the interval, or a TSC that runs backwards, also makes
+// the clock fall back.
+//
+// Sleeps end with spin_usec of spinning on the TSC, for wakeups
+// more precise than usleep() alone. 0 does not spin.
+extern s_udp_err_t s_udp_tsc_init(s_udp_tsc_t* tsc,
+								  uint32_t recalibrate_msec,
+								  uint32_t spin_usec);
+
+// Current clock of tsc, in nsec.
+extern uint64_t s_udp_tsc_read_nsec(s_udp_tsc_t* tsc);
+
+// Send the data packets of each slot to a multicast group of their
+// own, so that the NIC, IGMP snooping switches and the kernel drop
+// packets of slots that a receiver has not subscribed to. Slot n
+// uses the group (n - 1) / slots_per_group + 1 addresses above the
+// channel address, which remains the control group for master
+// packets, reports and join requests. 0 turns this off.
+//
+// Receivers join the group of their slot when attached. Receivers
+// on S_UDP_ALL_SLOTS join the groups of all slots announced by the
+// master, which may need net.ipv4.igmp_max_memberships raised. All
+// nodes on the address must use the same slots_per_group. Must be
+// called before s_udp_attach_channel(). Not supported on dual:
+// channels. Shared memory receivers still read all slots from the ring.
+extern s_udp_err_t s_udp_set_slot_groups(s_udp_channel_t* channel,
+										 uint32_t slots_per_group);
+
+// Store the address that data packets of slot are sent to in result.
+extern s_udp_err_t s_udp_get_slot_address(s_udp_channel_t* channel,
+										  uint32_t slot,
+										  struct sockaddr_in* result);
+
+// Copy the counters of path, 0 or 1, of a redundant channel to result.
+extern s_udp_err_t s_udp_get_path_stats(s_udp_channel_t* channel,
+										uint32_t path,
+										s_udp_path_stats_t* result);
+
+// Replace the time source of a channel, before a master clock
+// has been received. ctx is passed to all clock functions.
+extern s_udp_err_t s_udp_set_clock(s_udp_channel_t* channel,
+								   const s_udp_clock_t* clock,
+								   void* ctx);
+
+// Enable or disable compression of payloads sent on the channel.
+// Each payload is compressed individually and sent with
+// S_UDP_FLAG_COMPRESSED set, unless compression would not make it
+// smaller. Receivers decompress transparently, regardless of
+// their own compression setting.
+extern s_udp_err_t s_udp_set_compression(s_udp_channel_t* channel,
+										 uint8_t enabled);
+
+// Sender only. Coalesce small messages into packets with at most
+// length payload bytes, or send each message in a packet of its own
+// if length is 0 (default). S_UDP_MTU_PAYLOAD keeps coalesced
+// packets within a single Ethernet frame.
+//
+// Messages are queued with s_udp_queue_message() and sent with
+// s_udp_flush_messages() in the send window. Each message is
+// prefixed with its length as a 16 bit big endian integer, and
+// packed in order into as few packets as possible. Packets are sent
+// with S_UDP_FLAG_COALESCED set, and compressed as a whole if
+// compression is enabled.
+//
+// Receivers unpack coalesced packets transparently, handing out
+// one message per s_udp_receive_packet() call. All messages of a
+// packet share its latency and transaction ID. Event loops should
+// use s_udp_drain(), so that all messages of a packet are read
+// before waiting on the socket again. Pooled receives return the
+// whole packet, which is unpacked with s_udp_next_message().
+//
+// Changing length drops all queued messages.
+extern s_udp_err_t s_udp_set_coalescing(s_udp_channel_t* channel,
+										uint32_t length);
+
+// Queue a message of length bytes, to be sent with the next
+// s_udp_flush_messages(). Messages can be at most the coalescing
+// length - 2 bytes. Returns S_UDP_TRY_AGAIN if S_UDP_MAX_PAYLOAD
+// bytes are already queued, in which case the messages need to be
+// flushed first.
+extern s_udp_err_t s_udp_queue_message(s_udp_channel_t* channel,
+									   const uint8_t* data,
+									   uint32_t length);
+
+// Send queued messages now, and store the number of packets sent
+// in sent, if not 0. Messages that could not be sent remain queued.
+// Returns S_UDP_TRY_AGAIN if the send window of channel closed
+// before all messages were sent.
+extern s_udp_err_t s_udp_flush_messages(s_udp_channel_t* channel,
+										uint32_t* sent);
+
+// Wait for the send window of channel, then s_udp_flush_messages().
+extern s_udp_err_t s_udp_wait_and_flush_messages(s_udp_channel_t* channel,
+												 uint32_t* sent);
+
+// Step through the messages of a coalesced payload of length bytes.
+// offset starts at 0 and is advanced past each message returned in
+// message and message_length. Returns S_UDP_TRY_AGAIN when there are
+// no more messages, and S_UDP_MALFORMED_PACKET if a message runs
+// past the end of payload.
+extern s_udp_err_t s_udp_next_message(const uint8_t* payload,
+									  uint32_t length,
+									  uint32_t* offset,
+									  const uint8_t** message,
+									  uint32_t* message_length);
+
+// Select the header format used for packets sent on the channel.
+// The compact formats require a slot in the range 1-255 and a
+// master clock, since the clock is sent as an offset from the start
+// of the current send cycle. Their transaction IDs wrap, which
+// receivers take into account when detecting packet loss.
+extern s_udp_err_t s_udp_set_header_format(s_udp_channel_t* channel,
+										   s_udp_header_format_t format);
+
+// Return the number of header bytes added to each packet by format.
+extern uint32_t s_udp_get_header_length(s_udp_header_format_t format);
+
+// Enable or disable MSG_ZEROCOPY sends on an attached channel.
+//
+// With zero copy enabled, the kernel reads the payload passed to
+// s_udp_send_packet_now() after the call has returned. The caller
+// must not modify or release payload memory until
+// s_udp_reap_zerocopy() reports that no sends are pending.
+// s_udp_send_packet_now() returns S_UDP_TRY_AGAIN when too many sends
+// are in flight. Compressed payloads are always copied.
+extern s_udp_err_t s_udp_set_zerocopy(s_udp_channel_t* channel,
+									  uint8_t enabled);
+
+// Process zero copy completions from the socket error queue.
+// Waits up to timeout_msec (-1 is forever, 0 is not at all) for
+// in flight sends to complete. The number of sends still in flight
+// is stored in pending.
+//
+// The kernel holds a completion until the packet copy looped back to
+// the channel's own socket has been read. While waiting, packets
+// queued on the channel are therefore read and processed as by
+// s_udp_receive_packet(), and their payload discarded.
+extern s_udp_err_t s_udp_reap_zerocopy(s_udp_channel_t* channel,
+									   int32_t timeout_msec,
+									   uint32_t* pending);
+
+// Copy the channel counters to result.
+extern s_udp_err_t s_udp_get_stats(s_udp_channel_t* channel,
+								   s_udp_stats_t* result);
+
+// Returns S_UDP_NO_MASTER_CLOCK until the first master packet has
+// arrived, and S_UDP_NO_LEASE while a slot requested with
+// s_udp_request_lease() is not leased.
 extern s_udp_err_t s_udp_is_channel_ready(s_udp_channel_t* channel);
 
-extern s_udp_err_t s_udp_wait_for_channel_ready(s_udp_channel_t* channel);
+// Wait up to timeout_msec (-1 is forever) for the first master
+// packet, processing everything queued on channel meanwhile.
+// Returns as soon as it has arrived, or S_UDP_NO_MASTER_CLOCK on
+// timeout. Channels without a socket are checked every millisecond.
+// The join request is repeated every 250 msec while waiting.
+// Channels that lease their slot also wait for the lease, repeating
+// the lease request, and return S_UDP_NO_LEASE on timeout without one.
+extern s_udp_err_t s_udp_wait_for_channel_ready(s_udp_channel_t* channel,
+												int32_t timeout_msec);
 
 
 extern s_udp_err_t s_udp_get_socket_descriptor(s_udp_channel_t* channel,
@@ -82,6 +652,12 @@ extern s_udp_err_t s_udp_get_socket_descriptor(s_udp_channel_t* channel,
 extern s_udp_err_t s_udp_get_sleep_duration(s_udp_channel_t* channel,
 											uint64_t* result_wait);
 
+// Return the master clock that the send cycle containing master_clock
+// started at. Slot n of that cycle starts slot_width * n usec later.
+// The channel must have received a master packet.
+extern uint64_t s_udp_get_cycle_start(s_udp_channel_t* channel,
+									  uint64_t master_clock);
+
 extern s_udp_err_t s_udp_wait_and_send_packet(s_udp_channel_t* channel,
 											  const uint8_t* data,
 											  uint32_t length);
@@ -90,6 +666,99 @@ extern s_udp_err_t s_udp_send_packet_now(s_udp_channel_t* channel,
 										 const uint8_t* data,
 										 uint32_t length);
 
+// Scatter-gather versions of s_udp_wait_and_send_packet() and
+// s_udp_send_packet_now(). The payload is the concatenation of
+// iov_count (1 - S_UDP_MAX_IOV) caller buffers. The header is
+// prepended as a separate buffer, so the payload is not copied,
+// unless it is compressed.
+extern s_udp_err_t s_udp_wait_and_send_packetv(s_udp_channel_t* channel,
+											   const struct iovec* iov,
+											   uint32_t iov_count);
+
+extern s_udp_err_t s_udp_send_packetv_now(s_udp_channel_t* channel,
+										  const struct iovec* iov,
+										  uint32_t iov_count);
+
+// Send a master (slot 0) packet carrying slot_count, slot_width
+// and the master clock of channel. Used by slotted_udp_master.
+//
+// Once a schedule has been set with s_udp_set_schedule(), it is
+// announced in every master packet.
+extern s_udp_err_t s_udp_send_master_clock(s_udp_channel_t* channel);
+
+// Ask the master to send master packets now, rather than at its
+// next broadcast. Sent as a slot 0 packet with the slot of channel
+// in place of the transaction ID. Done by s_udp_attach_channel().
+//
+// slotted_udp_master answers with a short burst of master packets,
+// one per send cycle, so that the clock of a node that has just
+// attached is set up within a few cycles. Bursts are rate limited,
+// so joins never raise the master packet rate much.
+extern s_udp_err_t s_udp_send_join(s_udp_channel_t* channel);
+
+// Ask the master to grant, or renew, the lease of a slot. Sent as a
+// slot 0 packet with the node ID of channel in place of the
+// transaction ID. See s_udp_request_lease(), which sends these as
+// needed.
+extern s_udp_err_t s_udp_send_lease_request(s_udp_channel_t* channel);
+
+// Master only. Change the slot width of all nodes to slot_width at
+// the first send cycle boundary at least lead usec from now.
+//
+// The schedule is given a new version and announced with each
+// following master packet. Nodes that have heard it switch on their
+// own at the same master clock, so lead should span a few master
+// packets. Nodes that miss the announcement pick the new width up
+// from the first master packet sent after the switch.
+extern s_udp_err_t s_udp_set_schedule(s_udp_channel_t* channel,
+									  uint32_t slot_width,
+									  uint64_t lead);
+
+// Sender only. Report slot utilization to the master every interval
+// usec of master clock, or never if interval is 0 (default).
+//
+// A report is sent as a slot 0 packet right after a data packet,
+// while the send window of the channel is still open. Nodes that
+// predate report packets mistake them for master packets, so only
+// enable reports when all nodes on the address support them.
+extern s_udp_err_t s_udp_set_report_interval(s_udp_channel_t* channel,
+											 uint32_t interval);
+
+// Sender only. Lease a slot from the master rather than using the
+// slot given to s_udp_init_channel(), which is asked for as the
+// preferred slot. bandwidth is the expected bytes/sec, or 0 if
+// unknown. Must be called before s_udp_attach_channel().
+//
+// The request is sent on attach, and repeated by
+// s_udp_wait_for_channel_ready(), which returns once both the
+// master clock and a lease have arrived. The granted slot replaces
+// channel->slot. The lease is renewed right after a data packet,
+// half way through its duration. Sends return S_UDP_NO_LEASE once
+// it has run out, after which s_udp_wait_for_channel_ready()
+// gets a new one.
+extern s_udp_err_t s_udp_request_lease(s_udp_channel_t* channel,
+									   uint32_t bandwidth);
+
+// Decode a raw datagram, as read by the master, into request.
+// Returns S_UDP_MALFORMED_PACKET if it is not a lease request.
+extern s_udp_err_t s_udp_decode_lease_request(const uint8_t* packet,
+											  uint32_t length,
+											  s_udp_lease_request_t* request);
+
+// Master only. Grant slot to node_id for duration usec of master
+// clock, counted from now. Slot 0 tells the node that no slot is free.
+extern s_udp_err_t s_udp_send_lease_grant(s_udp_channel_t* channel,
+										  uint32_t node_id,
+										  uint32_t slot,
+										  uint32_t duration);
+
+// Decode a raw datagram, as read by the master, into report.
+// Returns S_UDP_MALFORMED_PACKET if it is not a report.
+extern s_udp_err_t s_udp_decode_report(const uint8_t* packet,
+									   uint32_t length,
+									   s_udp_report_t* report);
+
+// slot may have S_UDP_FLAG_XXX bits set, which are sent as is.
 extern s_udp_err_t s_udp_send_packet_raw(int socket_des,
 										 void* address,
 										 uint32_t slot,
@@ -105,4 +774,198 @@ extern s_udp_err_t s_udp_receive_packet(s_udp_channel_t* channel,
 										uint32_t* latency,
 										uint8_t* packet_loss_detected);
 
+// s_udp_receive_packet(), with the payload scattered across
+// iov_count (1 - S_UDP_MAX_IOV) caller buffers, filled in order.
+// Lets a fixed size application header and the data that follows
+// it land in separate buffers without a copy. Compact header and
+// compressed packets are moved into place after they are read.
+extern s_udp_err_t s_udp_receive_packetv(s_udp_channel_t* channel,
+										 const struct iovec* iov,
+										 uint32_t iov_count,
+										 ssize_t* length,
+										 uint32_t* latency,
+										 uint8_t* packet_loss_detected);
+
+// Read and process packets queued on channel, without blocking,
+// until none are left or budget packets have been read. Master
+// packets update the channel as with s_udp_receive_packet(). Each
+// data packet that passes the checks of s_udp_receive_packet() is
+// handed to callback, if given, and discarded otherwise. Packets
+// that fail the checks are consumed and counted.
+//
+// The number of packets read is stored in drained, if given.
+// Returns S_UDP_TRY_AGAIN once the queue is empty, and S_UDP_OK if
+// budget ran out first, so that more may be queued.
+extern s_udp_err_t s_udp_drain(s_udp_channel_t* channel,
+							   uint32_t budget,
+							   s_udp_drain_cb_t callback,
+							   void* user,
+							   uint32_t* drained);
+
+// Decode the header of a raw datagram read from the channel socket.
+// No slot, send window or packet loss checks are made.
+//
+// Compact headers carry the clock relative to the start of the
+// send cycle. If channel is given and has a master clock, the clock
+// is expanded to an absolute master clock. Otherwise it is returned
+// as is.
+extern s_udp_err_t s_udp_decode_header(s_udp_channel_t* channel,
+									   const uint8_t* packet,
+									   uint32_t length,
+									   s_udp_header_t* header);
+
+// Update the channel clock and slot setup from a master (slot 0)
+// packet decoded with s_udp_decode_header(). payload and length
+// are those of the datagram after header->header_length bytes.
+// Slot 0 packets other than S_UDP_CONTROL_SYNC are ignored.
+extern s_udp_err_t s_udp_process_master_packet(s_udp_channel_t* channel,
+											   const s_udp_header_t* header,
+											   const uint8_t* payload,
+											   uint32_t length);
+
 extern s_udp_err_t s_udp_destroy_channel(s_udp_channel_t* channel);
+
+
+// Allocate slab_count slabs of (at least) slab_size bytes each.
+// A slab holds a complete datagram, header included.
+//
+// All memory is allocated and touched up front, so that no
+// allocation or page fault happens on the receive path. If
+// huge_pages is set, huge pages are tried first, falling back to
+// regular pages if none are available.
+extern s_udp_err_t s_udp_init_pool(s_udp_pool_t* pool,
+								   uint32_t slab_count,
+								   uint32_t slab_size,
+								   uint8_t huge_pages);
+
+// All packets must have been released.
+extern s_udp_err_t s_udp_destroy_pool(s_udp_pool_t* pool);
+
+// Take a free slab from pool, with a reference count of 1.
+// Returns 0 if all slabs are in use.
+//
+// Packets can be allocated, referenced and released from any
+// thread without locking.
+extern s_udp_packet_t* s_udp_alloc_packet(s_udp_pool_t* pool);
+
+// Add a reference to packet, typically before handing it to
+// another consumer. Each reference is dropped with
+// s_udp_release_packet().
+extern void s_udp_ref_packet(s_udp_packet_t* packet);
+
+// Drop a reference to packet. The slab is returned to the pool when
+// the last reference is dropped.
+extern void s_udp_release_packet(s_udp_packet_t* packet);
+
+// Use pool for s_udp_receive_packet_pooled() on channel.
+// A pool can be shared by several channels. The pool is not destroyed
+// with the channel.
+extern s_udp_err_t s_udp_set_pool(s_udp_channel_t* channel,
+								  s_udp_pool_t* pool);
+
+// Receive a packet into a slab of the channel pool, and return it
+// in result. Payload is decoded in place, without copying. Checks and
+// return codes are the same as for s_udp_receive_packet().
+//
+// Returns S_UDP_POOL_EXHAUSTED if no slab is free, and
+// S_UDP_BUFFER_TOO_SMALL if the datagram did not fit in a slab.
+// Release result with s_udp_release_packet() when done.
+extern s_udp_err_t s_udp_receive_packet_pooled(s_udp_channel_t* channel,
+											   s_udp_packet_t** result);
+
+// Setup an empty send queue. The queue must not be moved or copied
+// once set up.
+//
+// A send queue lets several producer threads share one slot
+// without a lock. Each producer fills a packet from a pool and
+// queues it. The thread that owns the channel sends queued packets
+// in its send window with s_udp_send_queued(). Packets are sent in
+// the order they were queued, so the packets of each producer keep
+// their order.
+extern s_udp_err_t s_udp_init_send_queue(s_udp_send_queue_t* queue);
+
+// Queue packet, allocated with s_udp_alloc_packet() and with payload
+// and length set, on queue. Can be called from any thread. The
+// reference of the caller is handed over to the queue.
+extern s_udp_err_t s_udp_enqueue_packet(s_udp_send_queue_t* queue,
+										s_udp_packet_t* packet);
+
+// Take the oldest packet off queue, or return 0 if there is none.
+// Only one thread at a time may dequeue. A packet that is being
+// queued by another thread may not show up until the next call.
+extern s_udp_packet_t* s_udp_dequeue_packet(s_udp_send_queue_t* queue);
+
+// Put packet, just taken off queue, back in front of it, so that the
+// next s_udp_dequeue_packet() returns it. Only the thread that
+// dequeues may call this, and only for one packet at a time.
+extern s_udp_err_t s_udp_requeue_packet(s_udp_send_queue_t* queue,
+										s_udp_packet_t* packet);
+
+// Send up to budget queued packets on channel with
+// s_udp_send_packet_now() while its send window is open, and release
+// them. The number of packets sent is stored in sent, if not 0.
+//
+// Returns S_UDP_OK once queue is empty, and S_UDP_TRY_AGAIN if
+// packets are left because budget was reached or the window closed.
+// A packet that fails with S_UDP_TRY_AGAIN, S_UDP_NO_MASTER_CLOCK or
+// S_UDP_NO_LEASE is kept at the front of queue for the next window,
+// and the error returned. Any other failure releases the packet and
+// returns the error.
+//
+// Call from the thread that owns channel, after waiting for its
+// send window. Cannot be used with s_udp_set_zerocopy(), since
+// packets are released right after they are sent.
+extern s_udp_err_t s_udp_send_queued(s_udp_channel_t* channel,
+									 s_udp_send_queue_t* queue,
+									 uint32_t budget,
+									 uint32_t* sent);
+
+// Make sender channel own slot, with a transaction ID counter and a
+// send queue of its own, so that one thread and one socket can serve
+// up to S_UDP_MAX_OWNED_SLOTS slots. Packets for an owned slot are
+// queued with s_udp_enqueue_slot_packet(), and sent in the window of
+// the slot by s_udp_flush_slots().
+//
+// Owned slots are sent as queued. Compression, zero copy, reports
+// and leases only apply to the slot given to s_udp_init_channel().
+// Do not send in that slot both ways, as each way counts
+// transaction IDs of its own.
+extern s_udp_err_t s_udp_add_slot(s_udp_channel_t* channel,
+								  uint32_t slot);
+
+// Queue packet, allocated with s_udp_alloc_packet() and with payload
+// and length set, for the next window of owned slot. Can be called
+// from any thread. See s_udp_enqueue_packet().
+extern s_udp_err_t s_udp_enqueue_slot_packet(s_udp_channel_t* channel,
+											 uint32_t slot,
+											 s_udp_packet_t* packet);
+
+// Store the owned slot whose window opens next in slot, and the usec
+// until it opens in slot_wait. A window that opens right now counts
+// as passed, so that a loop that flushes a window moves on to the
+// next one.
+extern s_udp_err_t s_udp_get_next_owned_slot(s_udp_channel_t* channel,
+											 uint32_t* slot,
+											 uint64_t* slot_wait);
+
+// Send up to budget queued packets for each owned slot whose window
+// is open, and store the number sent in sent. On socket channels,
+// the packets of a slot are handed to the kernel up to
+// S_UDP_SEND_BATCH at a time with sendmmsg(). Other transports send
+// one at a time. Packets are released once sent, or if they could
+// not be sent.
+extern s_udp_err_t s_udp_flush_slots(s_udp_channel_t* channel,
+									 uint32_t budget,
+									 uint32_t* sent);
+
+// Sleep until the next window of an owned slot opens, and flush
+// that slot. See s_udp_flush_slots().
+extern s_udp_err_t s_udp_wait_and_flush_slots(s_udp_channel_t* channel,
+											  uint32_t budget,
+											  uint32_t* sent);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SLOTTED_UDP_H
@@ -0,0 +1,192 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP typed channels for C++
+
+   Header only layer over the C API that carries one fixed size
+   message type per channel, without serializing it.
+
+   typed_channel<T>::send() hands the storage of the message
+   straight to s_udp_send_packetv_now(), so the message is not
+   copied before it reaches the transport. typed_channel<T>::receive()
+   receives into a slab of the channel pool with
+   s_udp_receive_packet_pooled(), and returns a message_view<T> that
+   points into the slab. The slab goes back to the pool when the
+   view is destroyed.
+
+   T must be trivially copyable, and is sent in host byte order and
+   layout. Both ends must agree on T, just as they would on a
+   hand written wire format.
+*/
+
+#ifndef SLOTTED_UDP_HPP
+#define SLOTTED_UDP_HPP
+
+#include "slotted_udp.h"
+#include <stdint.h>
+#include <sys/uio.h>
+#include <type_traits>
+
+namespace s_udp {
+
+// Alignment of the payload in a slab received with the standard
+// header. Slabs are cache line aligned, and the header is 20 bytes.
+// Compact headers are 8 and 10 bytes long, and may leave the
+// payload less aligned. See typed_channel<T>::receive().
+static const uint32_t payload_alignment = 4;
+
+// Length of the standard header. See S_UDP_MAX_PAYLOAD.
+static const uint32_t header_length = 20;
+
+
+// Message of type T received into a pool slab. Move only. Releases
+// the packet when destroyed or reset.
+template <typename T>
+class message_view {
+public:
+	message_view() : packet_(0) {}
+
+	explicit message_view(s_udp_packet_t* packet) : packet_(packet) {}
+
+	message_view(message_view&& other) : packet_(other.packet_)
+	{
+		other.packet_ = 0;
+	}
+
+	message_view& operator=(message_view&& other)
+	{
+		if (this != &other) {
+			reset(other.packet_);
+			other.packet_ = 0;
+		}
+		return *this;
+	}
+
+	message_view(const message_view&) = delete;
+	message_view& operator=(const message_view&) = delete;
+
+	~message_view() { reset(); }
+
+	const T* get() const
+	{
+		return packet_?reinterpret_cast<const T*>(packet_->payload):0;
+	}
+
+	const T& operator*() const { return *get(); }
+	const T* operator->() const { return get(); }
+	explicit operator bool() const { return packet_ != 0; }
+
+	// See s_udp_receive_packet().
+	uint32_t latency() const { return packet_->latency; }
+	bool packet_loss_detected() const { return packet_->packet_loss_detected; }
+	const s_udp_header_t& header() const { return packet_->header; }
+
+	// Release the packet held, if any, and hold packet instead.
+	void reset(s_udp_packet_t* packet = 0)
+	{
+		if (packet_)
+			s_udp_release_packet(packet_);
+
+		packet_ = packet;
+	}
+
+	// Hand the packet over to the caller, who must release it.
+	s_udp_packet_t* release()
+	{
+		s_udp_packet_t* packet = packet_;
+
+		packet_ = 0;
+		return packet;
+	}
+
+private:
+	s_udp_packet_t* packet_;
+};
+
+
+// Channel that sends and receives messages of type T. Does not own
+// the channel, which is set up, attached and destroyed through the
+// C API as usual. Receiving needs a pool. See s_udp_set_pool().
+//
+// All calls return the status code of the C call they wrap.
+template <typename T>
+class typed_channel {
+	static_assert(std::is_trivially_copyable<T>::value,
+				  "typed_channel: T must be trivially copyable");
+	static_assert(sizeof(T) <= S_UDP_MAX_PAYLOAD,
+				  "typed_channel: T does not fit in a packet");
+	static_assert(alignof(T) <= payload_alignment,
+				  "typed_channel: T must not need more than 4 byte alignment");
+
+public:
+	// Smallest slab_size for s_udp_init_pool() that holds a message.
+	static const uint32_t slab_size = header_length + sizeof(T);
+
+	explicit typed_channel(s_udp_channel_t* channel) : channel_(channel) {}
+
+	s_udp_channel_t* channel() const { return channel_; }
+
+	// See s_udp_send_packetv_now().
+	s_udp_err_t send(const T& message)
+	{
+		struct iovec iov = _iov(message);
+
+		return s_udp_send_packetv_now(channel_, &iov, 1);
+	}
+
+	// See s_udp_wait_and_send_packetv().
+	s_udp_err_t wait_and_send(const T& message)
+	{
+		struct iovec iov = _iov(message);
+
+		return s_udp_wait_and_send_packetv(channel_, &iov, 1);
+	}
+
+	// Receive the next message into result. The packet previously
+	// held by result is released first.
+	//
+	// Returns S_UDP_MALFORMED_PACKET, and drops the packet, if its
+	// payload is not sizeof(T) bytes, or is not aligned for T. The
+	// latter happens for 4 byte aligned types sent with
+	// S_UDP_HEADER_COMPACT32.
+	s_udp_err_t receive(message_view<T>& result)
+	{
+		s_udp_packet_t* packet = 0;
+		s_udp_err_t res = S_UDP_OK;
+
+		result.reset();
+
+		if ((res = s_udp_receive_packet_pooled(channel_, &packet)) != S_UDP_OK)
+			return res;
+
+		if (packet->length != sizeof(T) ||
+			reinterpret_cast<uintptr_t>(packet->payload) % alignof(T)) {
+			s_udp_release_packet(packet);
+			return S_UDP_MALFORMED_PACKET;
+		}
+
+		result.reset(packet);
+		return S_UDP_OK;
+	}
+
+private:
+	static struct iovec _iov(const T& message)
+	{
+		struct iovec iov;
+
+		iov.iov_base = const_cast<T*>(&message);
+		iov.iov_len = sizeof(T);
+		return iov;
+	}
+
+	s_udp_channel_t* channel_;
+};
+
+} // namespace s_udp
+
+#endif // SLOTTED_UDP_HPP
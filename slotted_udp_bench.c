@@ -0,0 +1,1447 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP benchmark program
+*/
+
+#include "slotted_udp.h"
+#include "slotted_udp_lz.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <endian.h>
+#include <errno.h>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+#define DEFAULT_PACKET_SIZE 1024
+#define DEFAULT_ITERATIONS 1000
+#define SYNTHETIC_DATA_SIZE (1024*1024)
+#define IP_UDP_HEADER_LENGTH 28 // IPv4 (20) + UDP (8)
+
+// Send timing is measured on a port next to the default channel
+// port, so as not to disturb nodes using the default.
+#define JITTER_ADDRESS "224.0.0.123"
+#define JITTER_PORT 49235
+#define JITTER_SLOT_COUNT 4
+#define JITTER_SLOT_WIDTH 250
+
+#define MPSC_MAX_PRODUCERS 16
+#define MPSC_POOL_SLABS 1024
+#define MPSC_BUDGET 64
+#define MPSC_SLOT_WIDTH 1000000000 // Long enough for the window to stay open.
+
+#define SLOTS_BENCH_SLOTS 12
+#define SLOTS_BENCH_WIDTH 1000
+#define SLOTS_BENCH_CYCLES 10
+
+#define CLOCK_BENCH_RECALIBRATE_MSEC 100
+
+#define DEDUPE_BENCH_LAG 512 // Packets that the second path lags, two dedupe windows.
+#define DEDUPE_BENCH_PACKET 64 // Room for header and a sequence number payload.
+
+typedef struct _bench_args_t {
+	uint8_t* data;         // Input data. Read from -f or synthetic.
+	uint32_t data_length;
+	uint32_t packet_size;  // Payload size to split data into.
+	uint32_t iterations;   // Number of passes over data
+	s_udp_rt_config_t rt_config; // Real time profile, from -X.
+} bench_args_t;
+
+typedef struct _bench_mode_t {
+	const char* name;
+	const char* description;
+	void (*run)(bench_args_t* args);
+} bench_mode_t;
+
+
+static uint64_t get_nsec(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return ((uint64_t) tp.tv_sec) * 1000000000LL + (uint64_t) tp.tv_nsec;
+}
+
+
+// CPU cycles, where there is a TSC to count them.
+static uint64_t get_cycles(void)
+{
+#if defined(__x86_64__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+
+// Produce telemetry-like text records, which is the payload
+// type that compression targets.
+static uint8_t* synthetic_data(uint32_t length)
+{
+	uint8_t* data = malloc(length + 128);
+	uint32_t ind = 0;
+	uint32_t seq = 0;
+
+	if (!data) {
+		perror("malloc");
+		exit(255);
+	}
+
+	while(ind < length) {
+		ind += sprintf((char*) data + ind,
+					   "seq=%u sensor=%u temp=%d.%.2u rpm=%u status=ok\n",
+					   seq,
+					   seq % 16,
+					   20 + (seq * 7) % 15,
+					   (seq * 13) % 100,
+					   800 + (seq * 37) % 6000);
+		seq++;
+	}
+	return data;
+}
+
+
+static uint8_t* read_file(const char* file_name, uint32_t* length)
+{
+	struct stat st;
+	uint8_t* data = 0;
+	ssize_t rd_len = 0;
+	uint32_t ind = 0;
+	int fd = open(file_name, O_RDONLY);
+
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(file_name);
+		exit(255);
+	}
+
+	data = malloc(st.st_size + 1);
+	if (!data) {
+		perror("malloc");
+		exit(255);
+	}
+
+	while(ind < st.st_size &&
+		  (rd_len = read(fd, data + ind, st.st_size - ind)) > 0)
+		ind += rd_len;
+
+	close(fd);
+	*length = ind;
+	return data;
+}
+
+
+// Compress and decompress data in packet_size chunks, the way
+// s_udp_send_packet_now() and s_udp_receive_packet() would.
+static void bench_lz(bench_args_t* args)
+{
+	uint8_t* lz_buf = malloc(S_UDP_MAX_PAYLOAD);
+	uint8_t* out_buf = malloc(S_UDP_MAX_PAYLOAD);
+	uint64_t in_bytes = 0;
+	uint64_t wire_bytes = 0;
+	uint64_t lz_in_bytes = 0;
+	uint64_t compress_nsec = 0;
+	uint64_t decompress_nsec = 0;
+	uint32_t packets = 0;
+	uint32_t compressed_packets = 0;
+	uint32_t iter = 0;
+
+	if (!lz_buf || !out_buf) {
+		perror("malloc");
+		exit(255);
+	}
+
+	for (iter = 0; iter < args->iterations; ++iter) {
+		uint32_t ind = 0;
+
+		for (ind = 0; ind < args->data_length; ind += args->packet_size) {
+			uint32_t length = args->data_length - ind;
+			uint32_t lz_length = 0;
+			int32_t out_length = 0;
+			uint64_t start = 0;
+
+			if (length > args->packet_size)
+				length = args->packet_size;
+
+			start = get_nsec();
+			lz_length = s_udp_lz_compress(args->data + ind, length,
+										  lz_buf, S_UDP_MAX_PAYLOAD);
+			compress_nsec += get_nsec() - start;
+
+			in_bytes += length;
+			wire_bytes += lz_length?lz_length:length;
+			packets++;
+
+			if (!lz_length)
+				continue;
+
+			compressed_packets++;
+			lz_in_bytes += length;
+
+			start = get_nsec();
+			out_length = s_udp_lz_decompress(lz_buf, lz_length,
+											 out_buf, S_UDP_MAX_PAYLOAD);
+			decompress_nsec += get_nsec() - start;
+
+			if (out_length != length || memcmp(out_buf, args->data + ind, length)) {
+				fprintf(stderr, "lz: Round trip failed at offset %u\n", ind);
+				exit(255);
+			}
+		}
+	}
+
+	printf("lz: packet_size[%u] packets[%u] compressed[%u]\n",
+		   args->packet_size, packets, compressed_packets);
+	printf("lz: payload[%lu] wire[%lu] ratio[%.3f]\n",
+		   in_bytes, wire_bytes,
+		   wire_bytes?(double) in_bytes / wire_bytes:0.0);
+	printf("lz: compress[%.3f ns/byte] decompress[%.3f ns/byte]\n",
+		   in_bytes?(double) compress_nsec / in_bytes:0.0,
+		   lz_in_bytes?(double) decompress_nsec / lz_in_bytes:0.0);
+
+	free(lz_buf);
+	free(out_buf);
+}
+
+
+// Compare per-packet byte overhead of the header formats for
+// typical small payloads and for packet_size.
+static void bench_header(bench_args_t* args)
+{
+	static const char* format_names[] = { "standard", "compact16", "compact32" };
+	uint32_t payload_sizes[] = { 16, 32, 64, args->packet_size };
+	uint32_t ind = 0;
+	uint32_t fmt = 0;
+
+	printf("header: %-8s", "payload");
+	for (fmt = S_UDP_HEADER_STANDARD; fmt <= S_UDP_HEADER_COMPACT32; ++fmt)
+		printf(" %20s", format_names[fmt]);
+	putchar('\n');
+
+	for (ind = 0; ind < sizeof(payload_sizes) / sizeof(payload_sizes[0]); ++ind) {
+		uint32_t payload = payload_sizes[ind];
+
+		printf("header: %-8u", payload);
+		for (fmt = S_UDP_HEADER_STANDARD; fmt <= S_UDP_HEADER_COMPACT32; ++fmt) {
+			uint32_t wire = payload + IP_UDP_HEADER_LENGTH + s_udp_get_header_length(fmt);
+
+			printf(" %6u bytes %5.1f%% ovh", wire, 100.0 * (wire - payload) / wire);
+		}
+		putchar('\n');
+	}
+}
+
+
+// Hand each received packet to FANOUT consumers, first by copying
+// the payload into a malloc()ed buffer per consumer, then by
+// referencing a pooled packet.
+#define FANOUT 4
+#define POOL_SLABS 64
+
+static void bench_pool(bench_args_t* args)
+{
+	s_udp_pool_t pool;
+	s_udp_packet_t* inflight[POOL_SLABS];
+	uint8_t* copies[FANOUT];
+	uint8_t* received = 0;
+	uint64_t copy_nsec = 0;
+	uint64_t pool_nsec = 0;
+	uint64_t start = 0;
+	uint32_t packets = 0;
+	uint32_t iter = 0;
+	uint32_t ind = 0;
+	uint32_t cons = 0;
+
+	if (s_udp_init_pool(&pool, POOL_SLABS, args->packet_size + 20, 0) != S_UDP_OK)
+		exit(255);
+
+	if (!(received = malloc(args->packet_size))) {
+		perror("malloc");
+		exit(255);
+	}
+
+	start = get_nsec();
+	for (iter = 0; iter < args->iterations; ++iter) {
+		for (ind = 0; ind + args->packet_size <= args->data_length; ind += args->packet_size) {
+			// The payload is written once by the receive, then
+			// copied for each consumer.
+			memcpy(received, args->data + ind, args->packet_size);
+
+			for (cons = 0; cons < FANOUT; ++cons) {
+				copies[cons] = malloc(args->packet_size);
+				memcpy(copies[cons], received, args->packet_size);
+			}
+			for (cons = 0; cons < FANOUT; ++cons)
+				free(copies[cons]);
+		}
+	}
+	copy_nsec = get_nsec() - start;
+
+	// Keep a window of packets in flight, as consumers
+	// would, so that the free list is not just one slab.
+	memset(inflight, 0, sizeof(inflight));
+	start = get_nsec();
+	for (iter = 0; iter < args->iterations; ++iter) {
+		for (ind = 0; ind + args->packet_size <= args->data_length; ind += args->packet_size) {
+			s_udp_packet_t** slot = &inflight[packets % POOL_SLABS];
+
+			if (*slot)
+				for (cons = 0; cons < FANOUT; ++cons)
+					s_udp_release_packet(*slot);
+
+			if (!(*slot = s_udp_alloc_packet(&pool))) {
+				fprintf(stderr, "pool: Pool exhausted\n");
+				exit(255);
+			}
+
+			// The payload is written once, by the receive.
+			memcpy((*slot)->payload, args->data + ind, args->packet_size);
+			(*slot)->length = args->packet_size;
+
+			for (cons = 1; cons < FANOUT; ++cons)
+				s_udp_ref_packet(*slot);
+			packets++;
+		}
+	}
+	pool_nsec = get_nsec() - start;
+
+	for (ind = 0; ind < POOL_SLABS; ++ind)
+		if (inflight[ind])
+			for (cons = 0; cons < FANOUT; ++cons)
+				s_udp_release_packet(inflight[ind]);
+
+	printf("pool: packet_size[%u] packets[%u] consumers[%u]\n",
+		   args->packet_size, packets, FANOUT);
+	printf("pool: copy[%.1f ns/packet] pooled[%.1f ns/packet]\n",
+		   packets?(double) copy_nsec / packets:0.0,
+		   packets?(double) pool_nsec / packets:0.0);
+
+	free(received);
+	s_udp_destroy_pool(&pool);
+}
+
+
+static int compare_uint32(const void* a, const void* b)
+{
+	uint32_t val_a = *((const uint32_t*) a);
+	uint32_t val_b = *((const uint32_t*) b);
+
+	return (val_a > val_b) - (val_a < val_b);
+}
+
+
+// Send iterations packet_size packets with s_udp_wait_and_send_packet(),
+// one per send cycle, and measure how late each send completes
+// relative to the start of its slot. The channel acts as its own
+// master, so no slotted_udp_master is needed. Run with and without
+// -X to see what a real time profile buys.
+static void bench_jitter(bench_args_t* args)
+{
+	s_udp_channel_t channel;
+	uint32_t* late = 0;
+	uint64_t late_total = 0;
+	uint64_t master_clock = 0;
+	uint64_t slot_start = 0;
+	uint32_t out_of_window = 0;
+	uint32_t iter = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	if (!args->iterations || args->packet_size > args->data_length) {
+		fprintf(stderr, "jitter: Need at least one iteration and packet_size of data\n");
+		exit(255);
+	}
+
+	if (!(late = malloc(args->iterations * sizeof(uint32_t)))) {
+		perror("malloc");
+		exit(255);
+	}
+
+	if (s_udp_init_channel(&channel, 1, JITTER_ADDRESS, JITTER_PORT, 1) != S_UDP_OK ||
+		s_udp_set_rt_config(&channel, &args->rt_config) != S_UDP_OK ||
+		s_udp_attach_channel(&channel) != S_UDP_OK)
+		exit(255);
+
+	// Master clock runs one usec behind the local clock.
+	channel.slot_count = JITTER_SLOT_COUNT;
+	channel.slot_width = JITTER_SLOT_WIDTH;
+	channel.master_clock_offset = 1;
+
+	for (iter = 0; iter < args->iterations; ++iter) {
+		master_clock = s_udp_get_master_clock(&channel);
+		slot_start = s_udp_get_cycle_start(&channel, master_clock) +
+			channel.slot * channel.slot_width;
+
+		if (slot_start < master_clock)
+			slot_start += JITTER_SLOT_COUNT * JITTER_SLOT_WIDTH;
+
+		res = s_udp_wait_and_send_packet(&channel, args->data, args->packet_size);
+		if (res != S_UDP_OK) {
+			fprintf(stderr, "jitter: s_udp_wait_and_send_packet(): %s\n",
+					s_udp_error_string(res));
+			exit(255);
+		}
+
+		late[iter] = s_udp_get_master_clock(&channel) - slot_start;
+		late_total += late[iter];
+		if (late[iter] >= JITTER_SLOT_WIDTH)
+			out_of_window++;
+	}
+
+	qsort(late, args->iterations, sizeof(uint32_t), compare_uint32);
+
+	printf("jitter: packet_size[%u] packets[%u] slot_width[%u] cpu[%d] fifo[%d] mlock[%u] busy_poll[%u]\n",
+		   args->packet_size, args->iterations, JITTER_SLOT_WIDTH,
+		   args->rt_config.cpu, args->rt_config.priority,
+		   args->rt_config.lock_memory, args->rt_config.busy_poll);
+	printf("jitter: late mean[%.1f usec] p50[%u] p99[%u] p99.9[%u] max[%u] out_of_window[%u]\n",
+		   (double) late_total / args->iterations,
+		   late[args->iterations / 2],
+		   late[(uint64_t) args->iterations * 99 / 100],
+		   late[(uint64_t) args->iterations * 999 / 1000],
+		   late[args->iterations - 1],
+		   out_of_window);
+
+	s_udp_destroy_channel(&channel);
+	free(late);
+}
+
+
+// Send iterations messages of 16 to 256 bytes each, first as one
+// packet per message, then coalesced into S_UDP_MTU_PAYLOAD packets,
+// and compare packets, bytes on the wire and send cost. The channel
+// acts as its own master, and sends to the jitter port.
+static void bench_coalesce(bench_args_t* args)
+{
+	static const uint32_t message_sizes[] = { 16, 32, 64, 128, 256 };
+	s_udp_channel_t channel;
+	s_udp_stats_t stats;
+	uint32_t ind = 0;
+	uint32_t iter = 0;
+
+	if (!args->iterations || args->data_length < 256) {
+		fprintf(stderr, "coalesce: Need at least one iteration and 256 bytes of data\n");
+		exit(255);
+	}
+
+	if (s_udp_init_channel(&channel, 1, JITTER_ADDRESS, JITTER_PORT, 1) != S_UDP_OK ||
+		s_udp_set_rt_config(&channel, &args->rt_config) != S_UDP_OK ||
+		s_udp_attach_channel(&channel) != S_UDP_OK)
+		exit(255);
+
+	// Master clock runs one usec behind the local clock.
+	channel.slot_count = JITTER_SLOT_COUNT;
+	channel.slot_width = JITTER_SLOT_WIDTH;
+	channel.master_clock_offset = 1;
+
+	printf("coalesce: messages[%u] coalesce_length[%u]\n", args->iterations, S_UDP_MTU_PAYLOAD);
+	printf("coalesce: %-7s %21s %17s %21s\n", "", "packets", "overhead", "ns/message");
+	printf("coalesce: %-7s %10s %10s %8s %8s %10s %10s\n",
+		   "message", "plain", "coalesced", "plain", "coalesced", "plain", "coalesced");
+
+	for (ind = 0; ind < sizeof(message_sizes) / sizeof(message_sizes[0]); ++ind) {
+		uint32_t size = message_sizes[ind];
+		uint64_t payload = (uint64_t) size * args->iterations;
+		uint64_t plain_wire = (uint64_t) (size + IP_UDP_HEADER_LENGTH +
+										  s_udp_get_header_length(S_UDP_HEADER_STANDARD)) * args->iterations;
+		uint64_t coalesced_wire = 0;
+		uint64_t plain_nsec = 0;
+		uint64_t coalesced_nsec = 0;
+		uint64_t start = 0;
+		uint32_t offset = 0;
+
+		start = get_nsec();
+		for (iter = 0; iter < args->iterations; ++iter) {
+			offset = (iter * size) % (args->data_length - size);
+			s_udp_send_packet_now(&channel, args->data + offset, size);
+		}
+		plain_nsec = get_nsec() - start;
+
+		s_udp_set_coalescing(&channel, S_UDP_MTU_PAYLOAD);
+		memset(&channel.stats, 0, sizeof(channel.stats));
+
+		start = get_nsec();
+		for (iter = 0; iter < args->iterations; ++iter) {
+			offset = (iter * size) % (args->data_length - size);
+
+			while(s_udp_queue_message(&channel, args->data + offset, size) == S_UDP_TRY_AGAIN)
+				s_udp_flush_messages(&channel, 0);
+		}
+
+		// Each flush sends at least one packet, even outside the window.
+		while(channel.coalesce_used)
+			s_udp_flush_messages(&channel, 0);
+
+		coalesced_nsec = get_nsec() - start;
+		s_udp_set_coalescing(&channel, 0);
+		s_udp_get_stats(&channel, &stats);
+
+		coalesced_wire = (uint64_t) (size + 2) * args->iterations +
+			(uint64_t) (IP_UDP_HEADER_LENGTH + s_udp_get_header_length(S_UDP_HEADER_STANDARD)) *
+			stats.coalesce_packets;
+
+		printf("coalesce: %-7u %10u %10lu %7.1f%% %8.1f%% %10.1f %10.1f\n",
+			   size,
+			   args->iterations,
+			   stats.coalesce_packets,
+			   100.0 * (plain_wire - payload) / plain_wire,
+			   100.0 * (coalesced_wire - payload) / coalesced_wire,
+			   (double) plain_nsec / args->iterations,
+			   (double) coalesced_nsec / args->iterations);
+	}
+
+	s_udp_destroy_channel(&channel);
+}
+
+
+// Transport that checks and drops everything sent on it, so that
+// mpsc measures the cost of sharing a channel rather than of the
+// network stack. Payloads start with the producer index and a
+// per producer sequence number.
+typedef struct _mpsc_sink_t {
+	uint64_t packets;
+	uint64_t last_transaction_id;
+	uint32_t next_seq[MPSC_MAX_PRODUCERS];
+	uint32_t out_of_order;
+} mpsc_sink_t;
+
+typedef struct _mpsc_producer_t {
+	pthread_t thread;
+	uint32_t index;
+	uint32_t count;              // Packets to send.
+	uint32_t packet_size;
+	uint8_t* data;
+	s_udp_channel_t* channel;
+	pthread_mutex_t* lock;       // Serialize on lock if set, queue otherwise.
+	s_udp_pool_t* pool;
+	s_udp_send_queue_t* queue;
+} mpsc_producer_t;
+
+static s_udp_err_t mpsc_attach(void* ctx, s_udp_channel_t* channel)
+{
+	return S_UDP_OK;
+}
+
+static ssize_t mpsc_sendmsg(void* ctx, s_udp_channel_t* channel,
+							const struct msghdr* message, int flags)
+{
+	mpsc_sink_t* sink = (mpsc_sink_t*) ctx;
+	const uint8_t* header = message->msg_iov[0].iov_base;
+	const uint32_t* payload = message->msg_iov[1].iov_base;
+	uint64_t transaction_id = be64toh(*((uint64_t*) (header + 4)));
+	uint32_t producer = 0;
+
+	// Join requests and other slot 0 packets.
+	if (message->msg_iov[1].iov_len < 2 * sizeof(uint32_t))
+		return message->msg_iov[0].iov_len;
+
+	producer = payload[0];
+	if (producer >= MPSC_MAX_PRODUCERS ||
+		payload[1] != sink->next_seq[producer] ||
+		transaction_id != sink->last_transaction_id + 1)
+		sink->out_of_order++;
+
+	sink->next_seq[producer] = payload[1] + 1;
+	sink->last_transaction_id = transaction_id;
+	sink->packets++;
+	return message->msg_iov[0].iov_len + message->msg_iov[1].iov_len;
+}
+
+static ssize_t mpsc_recvmsg(void* ctx, s_udp_channel_t* channel,
+							struct msghdr* message, int flags)
+{
+	errno = EAGAIN;
+	return -1;
+}
+
+static void mpsc_detach(void* ctx, s_udp_channel_t* channel)
+{
+}
+
+static const s_udp_transport_t mpsc_transport = {
+	mpsc_attach, mpsc_sendmsg, mpsc_recvmsg, mpsc_detach
+};
+
+
+static void* mpsc_produce(void* arg)
+{
+	mpsc_producer_t* prod = (mpsc_producer_t*) arg;
+	uint32_t seq = 0;
+
+	for (seq = 0; seq < prod->count; ++seq) {
+		s_udp_packet_t* packet = 0;
+		uint32_t* payload = 0;
+
+		if (prod->lock) {
+			// Build the payload on the stack of the producer, and
+			// send it with the channel to ourselves.
+			uint8_t buffer[S_UDP_MAX_PAYLOAD];
+
+			payload = (uint32_t*) buffer;
+			memcpy(buffer, prod->data, prod->packet_size);
+			payload[0] = prod->index;
+			payload[1] = seq;
+
+			pthread_mutex_lock(prod->lock);
+			s_udp_send_packet_now(prod->channel, buffer, prod->packet_size);
+			pthread_mutex_unlock(prod->lock);
+			continue;
+		}
+
+		// Wait for the consumer to free up slabs.
+		while(!(packet = s_udp_alloc_packet(prod->pool)))
+			sched_yield();
+
+		payload = (uint32_t*) packet->payload;
+		memcpy(packet->payload, prod->data, prod->packet_size);
+		payload[0] = prod->index;
+		payload[1] = seq;
+		packet->length = prod->packet_size;
+		s_udp_enqueue_packet(prod->queue, packet);
+	}
+
+	return 0;
+}
+
+
+// Run producers threads that each send count packets on channel,
+// and return elapsed nsec.
+static uint64_t mpsc_run(s_udp_channel_t* channel,
+						 mpsc_sink_t* sink,
+						 mpsc_producer_t* producers,
+						 uint32_t producer_count)
+{
+	uint64_t total = (uint64_t) producers[0].count * producer_count;
+	uint64_t start = 0;
+	uint32_t sent = 0;
+	uint32_t ind = 0;
+
+	memset(sink, 0, sizeof(*sink));
+	sink->last_transaction_id = channel->transaction_id;
+
+	start = get_nsec();
+	for (ind = 0; ind < producer_count; ++ind)
+		pthread_create(&producers[ind].thread, 0, mpsc_produce, &producers[ind]);
+
+	// This thread owns the channel, and sends what is queued.
+	if (!producers[0].lock)
+		while(sink->packets < total) {
+			if (s_udp_send_queued(channel, producers[0].queue, MPSC_BUDGET, &sent) == S_UDP_OK &&
+				!sent)
+				sched_yield();
+		}
+
+	for (ind = 0; ind < producer_count; ++ind)
+		pthread_join(producers[ind].thread, 0);
+
+	return get_nsec() - start;
+}
+
+
+// Have 1 to 16 threads share one sending channel, first by
+// serializing s_udp_send_packet_now() calls behind a mutex, then
+// by queueing pooled packets for the thread that owns the channel.
+// Each producer sends iterations packets. Packets are sent to a
+// transport that only checks transaction ID and per producer order.
+static void bench_mpsc(bench_args_t* args)
+{
+	static const uint32_t producer_counts[] = { 1, 2, 4, 8, 16 };
+	mpsc_producer_t producers[MPSC_MAX_PRODUCERS];
+	mpsc_sink_t sink;
+	s_udp_channel_t channel;
+	s_udp_send_queue_t* queue = 0;
+	s_udp_pool_t pool;
+	pthread_mutex_t lock;
+	uint32_t ind = 0;
+	uint32_t prod = 0;
+
+	if (args->packet_size < 2 * sizeof(uint32_t) || args->packet_size > args->data_length) {
+		fprintf(stderr, "mpsc: packet_size must be at least 8 bytes and fit in data\n");
+		exit(255);
+	}
+
+	// The queue must stay put, and is better off cache line aligned.
+	if (posix_memalign((void**) &queue, 64, sizeof(*queue))) {
+		perror("posix_memalign");
+		exit(255);
+	}
+
+	if (s_udp_init_pool(&pool, MPSC_POOL_SLABS, args->packet_size, 0) != S_UDP_OK ||
+		s_udp_init_send_queue(queue) != S_UDP_OK ||
+		s_udp_init_channel(&channel, 1, JITTER_ADDRESS, JITTER_PORT, 1) != S_UDP_OK ||
+		s_udp_set_transport(&channel, &mpsc_transport, &sink) != S_UDP_OK ||
+		s_udp_attach_channel(&channel) != S_UDP_OK)
+		exit(255);
+
+	// Master clock starts at the window of slot 1, which stays open
+	// for the whole run, as s_udp_send_queued() stops when it closes.
+	channel.slot_count = JITTER_SLOT_COUNT;
+	channel.slot_width = MPSC_SLOT_WIDTH;
+	channel.master_clock_offset = s_udp_get_local_clock() - MPSC_SLOT_WIDTH;
+	pthread_mutex_init(&lock, 0);
+
+	printf("mpsc: packet_size[%u] packets_per_producer[%u]\n",
+		   args->packet_size, args->iterations);
+
+	for (ind = 0; ind < sizeof(producer_counts) / sizeof(producer_counts[0]); ++ind) {
+		uint32_t count = producer_counts[ind];
+		uint64_t total = (uint64_t) count * args->iterations;
+		uint64_t mutex_nsec = 0;
+		uint64_t queue_nsec = 0;
+		uint32_t out_of_order = 0;
+
+		for (prod = 0; prod < count; ++prod) {
+			producers[prod].index = prod;
+			producers[prod].count = args->iterations;
+			producers[prod].packet_size = args->packet_size;
+			producers[prod].data = args->data;
+			producers[prod].channel = &channel;
+			producers[prod].lock = &lock;
+			producers[prod].pool = &pool;
+			producers[prod].queue = queue;
+		}
+
+		mutex_nsec = mpsc_run(&channel, &sink, producers, count);
+		out_of_order += sink.out_of_order;
+
+		for (prod = 0; prod < count; ++prod)
+			producers[prod].lock = 0;
+
+		queue_nsec = mpsc_run(&channel, &sink, producers, count);
+		out_of_order += sink.out_of_order;
+
+		printf("mpsc: producers[%2u] mutex[%7.1f ns/packet %5.2f Mpps] queue[%7.1f ns/packet %5.2f Mpps] out_of_order[%u]\n",
+			   count,
+			   total?(double) mutex_nsec / total:0.0,
+			   mutex_nsec?total * 1e3 / mutex_nsec:0.0,
+			   total?(double) queue_nsec / total:0.0,
+			   queue_nsec?total * 1e3 / queue_nsec:0.0,
+			   out_of_order);
+	}
+
+	pthread_mutex_destroy(&lock);
+	s_udp_destroy_channel(&channel);
+	s_udp_destroy_pool(&pool);
+	free(queue);
+}
+
+
+// Cycle start as computed before schedules were cached: one
+// division per lookup. Kept out of line, as the library call is.
+static __attribute__((noinline)) uint64_t schedule_reference(s_udp_channel_t* channel,
+															  uint64_t master_clock)
+{
+	uint64_t cycle_duration = (uint64_t) channel->slot_width * channel->slot_count;
+
+	return channel->cycle_epoch +
+		(master_clock - channel->cycle_epoch) / cycle_duration * cycle_duration;
+}
+
+
+// Time s_udp_get_cycle_start() against schedule_reference(), for a
+// cycle that is a power of two usec long and one that is not. The
+// sequential clocks advance a few usec per lookup, as a sender
+// would, and mostly hit the cached cycle. The random clocks miss
+// the cache on every lookup. Each clock depends on the previous
+// result, as in a send loop, so that lookups cannot overlap.
+#define SCHEDULE_CLOCKS 65536
+
+static void bench_schedule(bench_args_t* args)
+{
+	static const uint32_t slot_widths[] = { 256, 250 };
+	s_udp_channel_t channel;
+	uint64_t* clocks = 0;
+	uint64_t queries = (uint64_t) args->iterations * 10000;
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	uint64_t sum = 0;
+	uint32_t ind = 0;
+
+	if (!queries) {
+		fprintf(stderr, "schedule: Need at least one iteration\n");
+		exit(255);
+	}
+
+	if (!(clocks = malloc(SCHEDULE_CLOCKS * sizeof(*clocks)))) {
+		perror("malloc");
+		exit(255);
+	}
+
+	// Random clocks, up to 2^40 usec (12 days) past the epoch.
+	for (ind = 0; ind < SCHEDULE_CLOCKS; ++ind) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		clocks[ind] = seed & ((1ULL << 40) - 1);
+	}
+
+	if (s_udp_init_channel(&channel, 1, JITTER_ADDRESS, JITTER_PORT, 1) != S_UDP_OK)
+		exit(255);
+
+	printf("schedule: queries[%lu]\n", queries);
+	printf("schedule: %-6s %6s %21s %21s %12s %10s\n",
+		   "cycle", "", "sequential ns/query", "random ns/query", "sleep", "");
+	printf("schedule: %-6s %6s %10s %10s %10s %10s %12s %10s\n",
+		   "usec", "pow2", "division", "cached", "division", "cached", "ns/query", "mismatch");
+
+	for (ind = 0; ind < sizeof(slot_widths) / sizeof(slot_widths[0]); ++ind) {
+		uint64_t reference_seq = 0;
+		uint64_t cached_seq = 0;
+		uint64_t reference_rnd = 0;
+		uint64_t cached_rnd = 0;
+		uint64_t sleep_nsec = 0;
+		uint64_t mismatch = 0;
+		uint64_t clock = 0;
+		uint64_t cycle_start = 0;
+		uint64_t wait = 0;
+		uint64_t start = 0;
+		uint64_t query = 0;
+
+		channel.slot_count = JITTER_SLOT_COUNT;
+		channel.slot_width = slot_widths[ind];
+		channel.master_clock_offset = 1;
+
+		start = get_nsec();
+		for (query = 0, clock = 0; query < queries; ++query) {
+			cycle_start = schedule_reference(&channel, clock);
+			clock += 7 + (cycle_start & 1);
+		}
+		reference_seq = get_nsec() - start;
+		sum += clock + cycle_start;
+
+		start = get_nsec();
+		for (query = 0, clock = 0; query < queries; ++query) {
+			cycle_start = s_udp_get_cycle_start(&channel, clock);
+			clock += 7 + (cycle_start & 1);
+		}
+		cached_seq = get_nsec() - start;
+		sum += clock + cycle_start;
+
+		start = get_nsec();
+		for (query = 0; query < queries; ++query)
+			cycle_start = schedule_reference(&channel, clocks[(query + (cycle_start & 1)) % SCHEDULE_CLOCKS]);
+		reference_rnd = get_nsec() - start;
+		sum += clock + cycle_start;
+
+		start = get_nsec();
+		for (query = 0; query < queries; ++query)
+			cycle_start = s_udp_get_cycle_start(&channel, clocks[(query + (cycle_start & 1)) % SCHEDULE_CLOCKS]);
+		cached_rnd = get_nsec() - start;
+		sum += clock + cycle_start;
+
+		start = get_nsec();
+		for (query = 0; query < queries; ++query) {
+			s_udp_get_sleep_duration(&channel, &wait);
+			sum += wait;
+		}
+		sleep_nsec = get_nsec() - start;
+		sum += cycle_start;
+
+		// Check every random clock, and a few cycles of
+		// sequential ones, against the division.
+		for (query = 0; query < SCHEDULE_CLOCKS; ++query) {
+			if (s_udp_get_cycle_start(&channel, clocks[query]) !=
+				schedule_reference(&channel, clocks[query]))
+				mismatch++;
+
+			if (s_udp_get_cycle_start(&channel, query * 3) !=
+				schedule_reference(&channel, query * 3))
+				mismatch++;
+		}
+
+		printf("schedule: %-6u %6s %10.2f %10.2f %10.2f %10.2f %12.2f %10lu\n",
+			   channel.slot_width * channel.slot_count,
+			   channel.schedule.power_of_two?"yes":"no",
+			   (double) reference_seq / queries,
+			   (double) cached_seq / queries,
+			   (double) reference_rnd / queries,
+			   (double) cached_rnd / queries,
+			   (double) sleep_nsec / queries,
+			   mismatch);
+	}
+
+	// Keep the lookups from being optimized away.
+	if (sum == 1)
+		putchar(' ');
+
+	s_udp_destroy_channel(&channel);
+	free(clocks);
+}
+
+
+// Clock of the slots benchmark. Stands still until moved.
+static uint64_t slots_clock_now(void* ctx)
+{
+	return *((uint64_t*) ctx);
+}
+
+static void slots_clock_sleep(void* ctx, uint64_t usec)
+{
+	*((uint64_t*) ctx) += usec;
+}
+
+static const s_udp_clock_t slots_clock = { slots_clock_now, slots_clock_sleep };
+
+
+static void slots_setup(s_udp_channel_t* channel, uint32_t slot, uint64_t* now)
+{
+	if (s_udp_init_channel(channel, 1, JITTER_ADDRESS, JITTER_PORT, slot) != S_UDP_OK ||
+		s_udp_set_clock(channel, &slots_clock, now) != S_UDP_OK ||
+		s_udp_attach_channel(channel) != S_UDP_OK)
+		exit(255);
+
+	// Master clock is the local clock.
+	channel->slot_count = SLOTS_BENCH_SLOTS + 1;
+	channel->slot_width = SLOTS_BENCH_WIDTH;
+	channel->master_clock_offset = 1;
+}
+
+
+// Send iterations packets in each window of 12 slots for a number of
+// cycles, first with a channel and socket per slot, then with one
+// channel that owns all 12 and flushes their queues with sendmmsg().
+// The clock is moved to the middle of each window by hand.
+static void bench_slots(bench_args_t* args)
+{
+	s_udp_channel_t channels[SLOTS_BENCH_SLOTS];
+	s_udp_channel_t multi;
+	s_udp_pool_t pool;
+	uint64_t total = (uint64_t) SLOTS_BENCH_CYCLES * SLOTS_BENCH_SLOTS * args->iterations;
+	uint64_t now = 0;
+	uint64_t start = 0;
+	uint64_t channels_nsec = 0;
+	uint64_t multi_nsec = 0;
+	uint32_t errors = 0;
+	uint32_t cycle = 0;
+	uint32_t slot = 0;
+	uint32_t ind = 0;
+	uint32_t sent = 0;
+	uint64_t multi_sent = 0;
+	s_udp_stats_t stats;
+
+	if (s_udp_init_pool(&pool, args->iterations, args->packet_size, 0) != S_UDP_OK)
+		exit(255);
+
+	for (slot = 1; slot <= SLOTS_BENCH_SLOTS; ++slot)
+		slots_setup(&channels[slot - 1], slot, &now);
+
+	slots_setup(&multi, 1, &now);
+	for (slot = 1; slot <= SLOTS_BENCH_SLOTS; ++slot)
+		if (s_udp_add_slot(&multi, slot) != S_UDP_OK)
+			exit(255);
+
+	printf("slots: slots[%u] packet_size[%u] packets_per_window[%u] cycles[%u]\n",
+		   SLOTS_BENCH_SLOTS, args->packet_size, args->iterations, SLOTS_BENCH_CYCLES);
+
+	start = get_nsec();
+	for (cycle = 0; cycle < SLOTS_BENCH_CYCLES; ++cycle)
+		for (slot = 1; slot <= SLOTS_BENCH_SLOTS; ++slot) {
+			now = 1 + ((uint64_t) cycle * (SLOTS_BENCH_SLOTS + 1) + slot) * SLOTS_BENCH_WIDTH +
+				SLOTS_BENCH_WIDTH / 2;
+
+			for (ind = 0; ind < args->iterations; ++ind)
+				if (s_udp_send_packet_now(&channels[slot - 1], args->data, args->packet_size) != S_UDP_OK)
+					errors++;
+		}
+	channels_nsec = get_nsec() - start;
+
+	start = get_nsec();
+	for (cycle = 0; cycle < SLOTS_BENCH_CYCLES; ++cycle)
+		for (slot = 1; slot <= SLOTS_BENCH_SLOTS; ++slot) {
+			now = 1 + ((uint64_t) cycle * (SLOTS_BENCH_SLOTS + 1) + slot) * SLOTS_BENCH_WIDTH +
+				SLOTS_BENCH_WIDTH / 2;
+
+			for (ind = 0; ind < args->iterations; ++ind) {
+				s_udp_packet_t* packet = s_udp_alloc_packet(&pool);
+
+				memcpy(packet->payload, args->data, args->packet_size);
+				packet->length = args->packet_size;
+				s_udp_enqueue_slot_packet(&multi, slot, packet);
+			}
+
+			if (s_udp_flush_slots(&multi, args->iterations, &sent) != S_UDP_OK)
+				errors++;
+
+			multi_sent += sent;
+		}
+	multi_nsec = get_nsec() - start;
+
+	s_udp_get_stats(&multi, &stats);
+	printf("slots: channels[%7.1f ns/packet] multi-slot[%7.1f ns/packet] sendmmsg[%.1f packets/call] sent[%lu/%lu] errors[%u]\n",
+		   (double) channels_nsec / total,
+		   (double) multi_nsec / total,
+		   stats.batch_calls?(double) stats.batch_packets / stats.batch_calls:0.0,
+		   multi_sent, total, errors);
+
+	for (slot = 0; slot < SLOTS_BENCH_SLOTS; ++slot)
+		s_udp_destroy_channel(&channels[slot]);
+
+	s_udp_destroy_channel(&multi);
+	s_udp_destroy_pool(&pool);
+}
+
+// Reads of each clock per pass of the clock benchmark.
+typedef uint64_t (*clock_read_t)(void* ctx);
+
+static uint64_t clock_read_vdso(void* ctx)
+{
+	return s_udp_get_local_clock();
+}
+
+static uint64_t clock_read_tsc_nsec(void* ctx)
+{
+	return s_udp_tsc_read_nsec((s_udp_tsc_t*) ctx);
+}
+
+static uint64_t clock_read_master(void* ctx)
+{
+	return s_udp_get_master_clock((s_udp_channel_t*) ctx);
+}
+
+
+// Returns cycles per call of read.
+static double clock_cycles(clock_read_t read, void* ctx, uint32_t count)
+{
+	volatile uint64_t sink = 0;
+	uint64_t start = get_cycles();
+	uint32_t ind = 0;
+
+	for (ind = 0; ind < count; ++ind)
+		sink += read(ctx);
+
+	return (double) (get_cycles() - start) / count;
+}
+
+
+// Measure the cost of a clock read in TSC cycles, with the library
+// default and with the TSC clock, and the error of the TSC clock
+// against the vDSO CLOCK_MONOTONIC over iterations msec.
+static void bench_clock(bench_args_t* args)
+{
+	s_udp_channel_t channel;
+	s_udp_tsc_t tsc;
+	uint32_t count = args->iterations * 1000;
+	uint64_t error_sum = 0;
+	uint64_t error_max = 0;
+	uint32_t samples = 0;
+	uint64_t end = 0;
+
+	if (s_udp_tsc_init(&tsc, CLOCK_BENCH_RECALIBRATE_MSEC, 0) != S_UDP_OK ||
+		s_udp_init_channel(&channel, 0, JITTER_ADDRESS, JITTER_PORT, 1) != S_UDP_OK)
+		exit(255);
+
+	// Master clock runs one usec behind the local clock.
+	channel.slot_count = JITTER_SLOT_COUNT;
+	channel.slot_width = JITTER_SLOT_WIDTH;
+	channel.master_clock_offset = 1;
+
+	printf("clock: reads[%u] recalibrate[%u msec] tsc[%s]\n",
+		   count, CLOCK_BENCH_RECALIBRATE_MSEC,
+		   tsc.fallback?tsc.fallback_reason:"in use");
+
+	printf("clock: cycles/read vdso[%.1f] tsc[%.1f] tsc_nsec[%.1f]\n",
+		   clock_cycles(clock_read_vdso, 0, count),
+		   clock_cycles(s_udp_tsc_clock.now, &tsc, count),
+		   clock_cycles(clock_read_tsc_nsec, &tsc, count));
+
+	printf("clock: cycles/s_udp_get_master_clock() monotonic[%.1f]",
+		   clock_cycles(clock_read_master, &channel, count));
+
+	s_udp_set_clock(&channel, &s_udp_tsc_clock, &tsc);
+	printf(" tsc[%.1f]\n", clock_cycles(clock_read_master, &channel, count));
+
+	// Compare with the midpoint of two vDSO reads, once per msec.
+	end = get_nsec() + (uint64_t) args->iterations * 1000000;
+	while(get_nsec() < end) {
+		uint64_t before = get_nsec();
+		uint64_t clock = s_udp_tsc_read_nsec(&tsc);
+		uint64_t after = get_nsec();
+		uint64_t mono = before + (after - before) / 2;
+		uint64_t error = (clock > mono)?clock - mono:mono - clock;
+
+		error_sum += error;
+		if (error > error_max)
+			error_max = error;
+
+		samples++;
+		usleep(1000);
+	}
+
+	printf("clock: error vs vdso over %u msec: mean[%.0f ns] max[%lu ns] samples[%u] "
+		   "recalibrations[%lu] last[%ld ns] tsc[%s]\n",
+		   args->iterations,
+		   samples?(double) error_sum / samples:0.0,
+		   error_max, samples,
+		   tsc.calibrations, tsc.last_error_nsec,
+		   tsc.fallback?tsc.fallback_reason:"in use");
+
+	s_udp_destroy_channel(&channel);
+}
+
+// Packets captured from a sender channel, and the order that a
+// receiver channel reads them in, as (packet, path) pairs.
+typedef struct _dedupe_script_t {
+	uint8_t* packets;            // DEDUPE_BENCH_PACKET bytes each.
+	uint32_t* lengths;
+	uint32_t packet_count;
+	uint32_t packet_max;
+	uint32_t* reads;             // Packet index times 2, plus path.
+	uint32_t read_count;
+	uint32_t next_read;
+} dedupe_script_t;
+
+static s_udp_err_t dedupe_attach(void* ctx, s_udp_channel_t* channel)
+{
+	return S_UDP_OK;
+}
+
+static ssize_t dedupe_sendmsg(void* ctx, s_udp_channel_t* channel,
+							  const struct msghdr* message, int flags)
+{
+	dedupe_script_t* script = (dedupe_script_t*) ctx;
+	uint8_t* packet = script->packets + (size_t) script->packet_count * DEDUPE_BENCH_PACKET;
+	const uint8_t* header = message->msg_iov[0].iov_base;
+	uint32_t length = 0;
+	uint32_t ind = 0;
+
+	// Join requests and other slot 0 packets.
+	if (!(be32toh(*((uint32_t*) header)) & 0xFFFFFF))
+		return message->msg_iov[0].iov_len;
+
+	if (script->packet_count == script->packet_max) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	for (ind = 0; ind < message->msg_iovlen; ++ind) {
+		if (length + message->msg_iov[ind].iov_len > DEDUPE_BENCH_PACKET) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		memcpy(packet + length, message->msg_iov[ind].iov_base, message->msg_iov[ind].iov_len);
+		length += message->msg_iov[ind].iov_len;
+	}
+
+	script->lengths[script->packet_count++] = length;
+	return length;
+}
+
+// Hand out the next read of the script, on its path.
+static ssize_t dedupe_recvmsg(void* ctx, s_udp_channel_t* channel,
+							  struct msghdr* message, int flags)
+{
+	dedupe_script_t* script = (dedupe_script_t*) ctx;
+	uint32_t read = 0;
+	uint8_t* packet = 0;
+	uint32_t length = 0;
+	uint32_t copied = 0;
+	uint32_t ind = 0;
+
+	if (script->next_read == script->read_count) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	read = script->reads[script->next_read++];
+	packet = script->packets + (size_t) (read / 2) * DEDUPE_BENCH_PACKET;
+	length = script->lengths[read / 2];
+	channel->rx_path = read % 2;
+
+	for (ind = 0; ind < message->msg_iovlen && copied < length; ++ind) {
+		uint32_t chunk = length - copied;
+
+		if (chunk > message->msg_iov[ind].iov_len)
+			chunk = message->msg_iov[ind].iov_len;
+
+		memcpy(message->msg_iov[ind].iov_base, packet + copied, chunk);
+		copied += chunk;
+	}
+	return copied;
+}
+
+static void dedupe_detach(void* ctx, s_udp_channel_t* channel)
+{
+}
+
+static const s_udp_transport_t dedupe_transport = {
+	dedupe_attach, dedupe_sendmsg, dedupe_recvmsg, dedupe_detach
+};
+
+
+// Send count packets with sequence numbers first and up from a
+// sender channel into the script.
+static void dedupe_send(s_udp_channel_t* channel, uint32_t first, uint32_t count)
+{
+	uint32_t seq = 0;
+
+	for (seq = first; seq < first + count; ++seq)
+		if (s_udp_send_packet_now(channel, (uint8_t*) &seq, sizeof(seq)) != S_UDP_OK)
+			exit(255);
+}
+
+
+// Read the script through a receiver channel on two paths. Counts
+// deliveries of each sequence number in delivered, and loss reports.
+static uint64_t dedupe_receive(dedupe_script_t* script,
+							   uint8_t* delivered,
+							   uint32_t* loss_reports,
+							   s_udp_path_stats_t* stats)
+{
+	s_udp_channel_t channel;
+	uint64_t start = 0;
+	uint64_t nsec = 0;
+	uint32_t seq = 0;
+	ssize_t length = 0;
+	uint32_t latency = 0;
+	uint8_t loss = 0;
+
+	if (s_udp_init_channel(&channel, 0, JITTER_ADDRESS, JITTER_PORT, 1) != S_UDP_OK ||
+		s_udp_set_transport(&channel, &dedupe_transport, script) != S_UDP_OK ||
+		s_udp_attach_channel(&channel) != S_UDP_OK)
+		exit(255);
+
+	// Same open window of slot 1 as the sender, see bench_dedupe().
+	channel.slot_count = JITTER_SLOT_COUNT;
+	channel.slot_width = MPSC_SLOT_WIDTH;
+	channel.master_clock_offset = s_udp_get_local_clock() - MPSC_SLOT_WIDTH;
+	channel.path_count = 2;
+
+	*loss_reports = 0;
+	script->next_read = 0;
+	start = get_nsec();
+	while(script->next_read < script->read_count) {
+		if (s_udp_receive_packet(&channel, (uint8_t*) &seq, sizeof(seq),
+								 &length, &latency, &loss) != S_UDP_OK)
+			continue;
+
+		delivered[seq]++;
+		*loss_reports += loss;
+	}
+	nsec = get_nsec() - start;
+
+	s_udp_get_path_stats(&channel, 0, &stats[0]);
+	s_udp_get_path_stats(&channel, 1, &stats[1]);
+	s_udp_destroy_channel(&channel);
+	return nsec;
+}
+
+
+// Feed a receiver on a redundant channel with the second path
+// DEDUPE_BENCH_LAG packets behind the first, and with a sender that
+// restarts its transaction IDs. Each packet must be delivered once.
+static void bench_dedupe(bench_args_t* args)
+{
+	uint32_t count = args->iterations;
+	dedupe_script_t script;
+	s_udp_channel_t sender;
+	s_udp_path_stats_t stats[2];
+	uint8_t* delivered = 0;
+	uint32_t loss_reports = 0;
+	uint32_t once = 0;
+	uint32_t twice = 0;
+	uint64_t nsec = 0;
+	uint32_t ind = 0;
+
+	memset(&script, 0, sizeof(script));
+	script.packet_max = 2 * count;
+	script.packets = malloc((size_t) 2 * count * DEDUPE_BENCH_PACKET);
+	script.lengths = calloc(2 * count, sizeof(uint32_t));
+	script.reads = calloc(8 * count + 2 * DEDUPE_BENCH_LAG, sizeof(uint32_t));
+	delivered = malloc(2 * count);
+
+	if (!script.packets || !script.lengths || !script.reads || !delivered) {
+		perror("malloc");
+		exit(255);
+	}
+
+	if (s_udp_init_channel(&sender, 1, JITTER_ADDRESS, JITTER_PORT, 1) != S_UDP_OK ||
+		s_udp_set_transport(&sender, &dedupe_transport, &script) != S_UDP_OK ||
+		s_udp_attach_channel(&sender) != S_UDP_OK)
+		exit(255);
+
+	// Master clock starts at the window of slot 1, which stays open
+	// for the whole run.
+	sender.slot_count = JITTER_SLOT_COUNT;
+	sender.slot_width = MPSC_SLOT_WIDTH;
+	sender.master_clock_offset = s_udp_get_local_clock() - MPSC_SLOT_WIDTH;
+
+	// count packets, then half as many after a restart, so that the
+	// new transaction IDs stay below the old ones. The restart is at
+	// least a usec later, so that header clocks tell them apart.
+	dedupe_send(&sender, 0, count);
+	usleep(1000);
+	sender.transaction_id = 0;
+	dedupe_send(&sender, count, count / 2);
+
+	printf("dedupe: packets[%u] lag[%u packets]\n", count, DEDUPE_BENCH_LAG);
+
+	// Lagging path. Path 1 reads packet ind - lag as path 0 reads ind.
+	for (ind = 0; ind < count + DEDUPE_BENCH_LAG; ++ind) {
+		if (ind < count)
+			script.reads[script.read_count++] = 2 * ind;
+
+		if (ind >= DEDUPE_BENCH_LAG && ind - DEDUPE_BENCH_LAG < count)
+			script.reads[script.read_count++] = 2 * (ind - DEDUPE_BENCH_LAG) + 1;
+	}
+
+	memset(delivered, 0, 2 * count);
+	nsec = dedupe_receive(&script, delivered, &loss_reports, stats);
+
+	for (once = twice = ind = 0; ind < count; ++ind) {
+		once += delivered[ind] == 1;
+		twice += delivered[ind] > 1;
+	}
+
+	printf("dedupe: lagging    delivered[%u of %u] twice[%u] first[%lu %lu] lost[%lu %lu] "
+		   "loss_reports[%u] ns/read[%.1f]\n",
+		   once, count, twice,
+		   stats[0].first, stats[1].first, stats[0].lost, stats[1].lost,
+		   loss_reports, (double) nsec / script.read_count);
+
+	// Restart. Both paths in step, and one packet after the restart
+	// missing on both, which must be reported as loss.
+	script.read_count = 0;
+	for (ind = 0; ind < count + count / 2; ++ind) {
+		if (ind == count + count / 4)
+			continue;
+
+		script.reads[script.read_count++] = 2 * ind;
+		script.reads[script.read_count++] = 2 * ind + 1;
+	}
+
+	memset(delivered, 0, 2 * count);
+	nsec = dedupe_receive(&script, delivered, &loss_reports, stats);
+
+	for (once = twice = ind = 0; ind < count + count / 2; ++ind) {
+		once += delivered[ind] == 1;
+		twice += delivered[ind] > 1;
+	}
+
+	printf("dedupe: restarted  delivered[%u of %u] twice[%u] first[%lu %lu] lost[%lu %lu] "
+		   "loss_reports[%u of 1] ns/read[%.1f]\n",
+		   once, count + count / 2 - 1, twice,
+		   stats[0].first, stats[1].first, stats[0].lost, stats[1].lost,
+		   loss_reports, (double) nsec / script.read_count);
+
+	s_udp_destroy_channel(&sender);
+	free(script.packets);
+	free(script.lengths);
+	free(script.reads);
+	free(delivered);
+}
+
+static bench_mode_t modes[] = {
+	{ "lz", "Payload compression ratio and ns/byte", bench_lz },
+	{ "header", "Per-packet byte overhead of each header format", bench_header },
+	{ "pool", "Fan-out cost of copied vs pooled packets", bench_pool },
+	{ "jitter", "Lateness of slotted sends, with or without -X", bench_jitter },
+	{ "mpsc", "Threads sharing one slot: mutex vs send queue", bench_mpsc },
+	{ "coalesce", "Packets, overhead and send cost of coalesced messages", bench_coalesce },
+	{ "schedule", "ns/query of cached vs divided cycle start lookups", bench_schedule },
+	{ "slots", "One channel per slot vs one multi-slot channel", bench_slots },
+	{ "clock", "Cycles per clock read and TSC clock error", bench_clock },
+	{ "dedupe", "Redundant path copies with a lagging path and a restart", bench_dedupe },
+};
+
+
+void usage(const char* name)
+{
+	uint32_t ind = 0;
+
+	fprintf(stderr, "Usage: %s -m mode [-f file_name] [-p packet_size] [-n iterations] [-X rt_spec]\n", name);
+	fprintf(stderr, "  -m mode          Benchmark to run. One of:\n");
+	for (ind = 0; ind < sizeof(modes) / sizeof(modes[0]); ++ind)
+		fprintf(stderr, "                     %-10s %s\n", modes[ind].name, modes[ind].description);
+
+	fprintf(stderr, "\n  -f file_name     Use file_name as payload data.\n");
+	fprintf(stderr, "                   Default is synthetic telemetry records.\n\n");
+	fprintf(stderr, "  -p packet_size   Payload size, in bytes. Default: %d\n\n", DEFAULT_PACKET_SIZE);
+	fprintf(stderr, "  -n iterations    Number of passes over the data. Default: %d\n\n", DEFAULT_ITERATIONS);
+	fprintf(stderr, "  -X rt_spec       Real time profile for jitter. Comma separated\n");
+	fprintf(stderr, "                   cpu=N, fifo=PRIORITY, mlock, busy_poll=USEC,\n");
+	fprintf(stderr, "                   rcvbuf=BYTES, sndbuf=BYTES, prio=SO_PRIORITY.\n");
+}
+
+
+int main(int argc, char* argv[])
+{
+	bench_args_t args;
+	bench_mode_t* mode = 0;
+	char data_file[256];
+	int opt;
+	uint32_t ind = 0;
+
+	data_file[0] = 0;
+	args.packet_size = DEFAULT_PACKET_SIZE;
+	args.iterations = DEFAULT_ITERATIONS;
+	s_udp_init_rt_config(&args.rt_config);
+
+	while ((opt = getopt(argc, argv, "m:f:p:n:X:")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (ind = 0; ind < sizeof(modes) / sizeof(modes[0]); ++ind)
+				if (!strcmp(optarg, modes[ind].name))
+					mode = &modes[ind];
+			break;
+
+		case 'f':
+			strncpy(data_file, optarg, sizeof(data_file));
+			data_file[sizeof(data_file)-1] = 0;
+			break;
+
+		case 'p':
+			args.packet_size = atoi(optarg);
+			break;
+
+		case 'n':
+			args.iterations = atoi(optarg);
+			break;
+
+		case 'X':
+			if (s_udp_parse_rt_config(optarg, &args.rt_config) != S_UDP_OK) {
+				usage(argv[0]);
+				exit(255);
+			}
+			break;
+
+		default: /* '?' */
+			usage(argv[0]);
+			exit(255);
+		}
+	}
+
+	if (!mode) {
+		fprintf(stderr, "Please specify a valid -m mode\n\n");
+		usage(argv[0]);
+		exit(255);
+	}
+
+	if (args.packet_size == 0 || args.packet_size > S_UDP_MAX_PAYLOAD) {
+		fprintf(stderr, "Packet size must be 1-%d\n\n", S_UDP_MAX_PAYLOAD);
+		exit(255);
+	}
+
+	if (data_file[0])
+		args.data = read_file(data_file, &args.data_length);
+	else {
+		args.data_length = SYNTHETIC_DATA_SIZE;
+		args.data = synthetic_data(args.data_length);
+	}
+
+	mode->run(&args);
+
+	free(args.data);
+	return 0;
+}
@@ -0,0 +1,354 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP redundant dual path transport
+
+   Every packet is sent twice, once on each of two paths, in the
+   spirit of the Parallel Redundancy Protocol. A path is a multicast
+   group, and optionally the interface to use for it, so two paths
+   can run over separate NICs and switches, or over two groups on
+   the same network.
+
+   Each path has a socket of its own, which only receives its own
+   group on its own interface. Receivers read whichever socket has
+   a packet, alternating between them, and report the path that it
+   came on in channel->rx_path. The library then delivers the first
+   copy of each packet and drops the second, matching them on slot
+   and transaction ID. See _is_duplicate() in slotted_udp.c.
+
+   channel->socket_des is an epoll descriptor holding both sockets,
+   so that callers can poll the channel as usual.
+*/
+
+#include "slotted_udp.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <stdio.h>
+#include <errno.h>
+#include <poll.h>
+#include <net/if.h>
+#include <sys/epoll.h>
+
+// Older headers lack IP_MULTICAST_ALL.
+#ifndef IP_MULTICAST_ALL
+#define IP_MULTICAST_ALL 49
+#endif
+
+typedef struct _s_udp_dual_path_t {
+	struct sockaddr_in group; // Multicast group and port of the path.
+	char interface[IF_NAMESIZE]; // Interface name. Empty for the routed one.
+	uint32_t ifindex;        // Index of interface, or 0.
+	int32_t socket_des;
+} s_udp_dual_path_t;
+
+typedef struct _s_udp_dual_t {
+	s_udp_dual_path_t paths[S_UDP_MAX_PATHS];
+	uint32_t next_path;      // Path to read first.
+} s_udp_dual_t;
+
+
+// Parse GROUP[%IFNAME] into path.
+static s_udp_err_t _dual_parse_path(s_udp_dual_path_t* path,
+									const char* spec,
+									in_port_t port)
+{
+	char group[INET_ADDRSTRLEN];
+	const char* interface = strchr(spec, '%');
+	size_t length = interface?interface - spec:strlen(spec);
+
+	if (length >= sizeof(group) ||
+		(interface && strlen(interface + 1) >= sizeof(path->interface))) {
+		fprintf(stderr, "s_udp_dual_init(): %s: Illegal address\n", spec);
+		return S_UDP_ILLEGAL_ADDRESS;
+	}
+
+	memcpy(group, spec, length);
+	group[length] = 0;
+
+	memset(&path->group, 0, sizeof(path->group));
+	path->group.sin_family = AF_INET;
+	path->group.sin_port = port;
+
+	if (!inet_aton(group, &path->group.sin_addr)) {
+		fprintf(stderr, "s_udp_dual_init(): inet_aton(%s): Illegal address\n", group);
+		return S_UDP_ILLEGAL_ADDRESS;
+	}
+
+	path->interface[0] = 0;
+	path->ifindex = 0;
+	path->socket_des = -1;
+
+	if (!interface)
+		return S_UDP_OK;
+
+	strcpy(path->interface, interface + 1);
+	if (!(path->ifindex = if_nametoindex(path->interface))) {
+		fprintf(stderr, "s_udp_dual_init(): %s: ", path->interface);
+		perror("if_nametoindex()");
+		return S_UDP_ILLEGAL_ADDRESS;
+	}
+
+	return S_UDP_OK;
+}
+
+
+// Open a socket that sends to, and only receives, the group of
+// path on its interface.
+static s_udp_err_t _dual_open_path(s_udp_channel_t* channel,
+								   s_udp_dual_path_t* path)
+{
+	struct ip_mreqn mreq;
+	struct sockaddr_in local_address;
+	int flag = 0;
+
+	path->socket_des = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (path->socket_des == -1) {
+		perror("s_udp_attach_channel(): socket()");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	flag = 1;
+	if (setsockopt(path->socket_des, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) < 0) {
+		perror("s_udp_attach_channel(): setsockopt(REUSEADDR)");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	// Both sockets are bound to the same port. Without this, each
+	// would also receive the group joined by the other.
+	flag = 0;
+	if (setsockopt(path->socket_des, IPPROTO_IP, IP_MULTICAST_ALL, &flag, sizeof(flag)) < 0) {
+		perror("s_udp_attach_channel(): setsockopt(IP_MULTICAST_ALL)");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	memset(&local_address, 0 , sizeof(local_address));
+	local_address.sin_family = AF_INET;
+	local_address.sin_addr.s_addr = htonl(INADDR_ANY);
+	local_address.sin_port = path->group.sin_port;
+
+	if (bind(path->socket_des,
+			 (struct sockaddr *) &local_address, sizeof(local_address)) < 0) {
+		perror("s_udp_attach_channel(): bind()");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.imr_multiaddr.s_addr = path->group.sin_addr.s_addr;
+	mreq.imr_address.s_addr = htonl(INADDR_ANY);
+	mreq.imr_ifindex = path->ifindex;
+
+	if (setsockopt(path->socket_des, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+		perror("s_udp_attach_channel(): setsockopt(IP_ADD_MEMBERSHIP)");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	if (path->ifindex &&
+		setsockopt(path->socket_des, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) < 0) {
+		perror("s_udp_attach_channel(): setsockopt(IP_MULTICAST_IF)");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	return s_udp_apply_socket_config(channel, path->socket_des);
+}
+
+
+// Close the sockets of dual, and the epoll descriptor of channel.
+static void _dual_close(s_udp_dual_t* dual, s_udp_channel_t* channel)
+{
+	uint32_t ind = 0;
+
+	for (ind = 0; ind < S_UDP_MAX_PATHS; ++ind) {
+		if (dual->paths[ind].socket_des != -1)
+			close(dual->paths[ind].socket_des);
+
+		dual->paths[ind].socket_des = -1;
+	}
+
+	if (channel->socket_des != -1)
+		close(channel->socket_des);
+
+	channel->socket_des = -1;
+}
+
+
+static s_udp_err_t _dual_attach(void* ctx, s_udp_channel_t* channel)
+{
+	s_udp_dual_t* dual = (s_udp_dual_t*) ctx;
+	struct epoll_event ev;
+	s_udp_err_t res = S_UDP_OK;
+	uint32_t ind = 0;
+
+	channel->socket_des = epoll_create1(0);
+	if (channel->socket_des == -1) {
+		perror("s_udp_attach_channel(): epoll_create1()");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	for (ind = 0; ind < S_UDP_MAX_PATHS; ++ind) {
+		if ((res = _dual_open_path(channel, &dual->paths[ind])) != S_UDP_OK) {
+			_dual_close(dual, channel);
+			return res;
+		}
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = ind;
+
+		if (epoll_ctl(channel->socket_des, EPOLL_CTL_ADD,
+					  dual->paths[ind].socket_des, &ev) == -1) {
+			perror("s_udp_attach_channel(): epoll_ctl()");
+			_dual_close(dual, channel);
+			return S_UDP_SUBSCRIPTION_FAILURE;
+		}
+	}
+
+	return S_UDP_OK;
+}
+
+
+// Send message on one path. Returns -1, with errno set, on failure.
+static ssize_t _dual_send_path(s_udp_dual_path_t* path,
+							   const struct msghdr* message,
+							   int flags)
+{
+	struct msghdr path_message = *message;
+	struct pollfd pfd;
+	ssize_t res = 0;
+
+	path_message.msg_name = &path->group;
+	path_message.msg_namelen = sizeof(path->group);
+
+	while((res = sendmsg(path->socket_des, &path_message, flags)) == -1 &&
+		  (errno == EAGAIN || errno == EWOULDBLOCK) && !(flags & MSG_DONTWAIT)) {
+		pfd.fd = path->socket_des;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
+
+		if (poll(&pfd, 1, -1) == -1)
+			return -1;
+	}
+
+	return res;
+}
+
+
+// The packet counts as sent if it went out on either path.
+static ssize_t _dual_sendmsg(void* ctx,
+							 s_udp_channel_t* channel,
+							 const struct msghdr* message,
+							 int flags)
+{
+	s_udp_dual_t* dual = (s_udp_dual_t*) ctx;
+	ssize_t res = -1;
+	ssize_t path_res = 0;
+	int path_errno = 0;
+	uint32_t ind = 0;
+
+	for (ind = 0; ind < S_UDP_MAX_PATHS; ++ind) {
+		if ((path_res = _dual_send_path(&dual->paths[ind], message, flags)) < 0) {
+			path_errno = errno;
+			channel->path_stats[ind].send_errors++;
+			continue;
+		}
+
+		channel->path_stats[ind].sent++;
+		res = path_res;
+	}
+
+	if (res < 0)
+		errno = path_errno;
+
+	return res;
+}
+
+
+static ssize_t _dual_recvmsg(void* ctx,
+							 s_udp_channel_t* channel,
+							 struct msghdr* message,
+							 int flags)
+{
+	s_udp_dual_t* dual = (s_udp_dual_t*) ctx;
+	struct epoll_event ev;
+	ssize_t res = 0;
+	uint32_t path = 0;
+	uint32_t ind = 0;
+
+	while(1) {
+		// Start with the path that was not read last, so that a
+		// busy path cannot hold up the copies on the other.
+		for (ind = 0; ind < S_UDP_MAX_PATHS; ++ind) {
+			path = (dual->next_path + ind) % S_UDP_MAX_PATHS;
+			res = recvmsg(dual->paths[path].socket_des, message, flags | MSG_DONTWAIT);
+
+			if (res >= 0) {
+				channel->rx_path = path;
+				dual->next_path = (path + 1) % S_UDP_MAX_PATHS;
+				return res;
+			}
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+		}
+
+		if (flags & MSG_DONTWAIT)
+			return -1;
+
+		if (epoll_wait(channel->socket_des, &ev, 1, -1) == -1)
+			return -1;
+	}
+}
+
+
+static void _dual_detach(void* ctx, s_udp_channel_t* channel)
+{
+	s_udp_dual_t* dual = (s_udp_dual_t*) ctx;
+
+	if (!dual)
+		return;
+
+	_dual_close(dual, channel);
+	free(dual);
+	channel->transport_ctx = 0;
+}
+
+
+const s_udp_transport_t s_udp_dual_transport = {
+	_dual_attach,
+	_dual_sendmsg,
+	_dual_recvmsg,
+	_dual_detach
+};
+
+
+s_udp_err_t s_udp_dual_init(s_udp_channel_t* channel,
+							const char* path_a,
+							const char* path_b)
+{
+	s_udp_dual_t* dual = 0;
+	s_udp_err_t res = S_UDP_OK;
+
+	if (!channel || !path_a || !path_b) {
+		fprintf(stderr, "s_udp_dual_init(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (!(dual = calloc(1, sizeof(*dual)))) {
+		perror("s_udp_dual_init(): calloc()");
+		return S_UDP_BUFFER_TOO_SMALL;
+	}
+
+	if ((res = _dual_parse_path(&dual->paths[0], path_a, channel->address.sin_port)) != S_UDP_OK ||
+		(res = _dual_parse_path(&dual->paths[1], path_b, channel->address.sin_port)) != S_UDP_OK) {
+		free(dual);
+		return res;
+	}
+
+	channel->path_count = S_UDP_MAX_PATHS;
+	return s_udp_set_transport(channel, &s_udp_dual_transport, dual);
+}
@@ -0,0 +1,259 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP payload compression
+
+   A small LZ77 byte codec in the spirit of LZ4, tuned for
+   single datagram payloads.
+
+   A compressed payload is a list of sequences:
+
+   Byte   | Name     | Description
+   -------|----------|---------------------------------------------
+   0      | token    | Upper nibble: literal count. Lower nibble: match length - 4
+   1-...  | lit_ext  | Present if literal count == 15. Bytes are added to the
+          |          | count until a byte != 255 is read.
+   ...    | literals | Literal bytes copied to output.
+   ...    | offset   | Little endian uint16_t. Distance back in output to copy from.
+   ...    | ml_ext   | Present if match length - 4 == 15. Encoded as lit_ext.
+
+   The last sequence has no offset and no match. It ends when the
+   input ends right after its literals.
+*/
+
+#include "slotted_udp_lz.h"
+#include <memory.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 0xFFFF
+
+// Number of consecutive misses before the search starts to skip
+// ahead faster. Keeps the cost down on incompressible payloads.
+#define LZ_SKIP_TRIGGER 5
+
+static inline uint32_t _read32(const uint8_t* ptr)
+{
+	uint32_t res;
+
+	memcpy(&res, ptr, sizeof(res));
+	return res;
+}
+
+static inline uint32_t _hash(uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Write a length extension (values above 15 in a token nibble)
+// Returns new output position, or 0 on overflow.
+static uint32_t _write_length(uint8_t* dst,
+							  uint32_t op,
+							  uint32_t dst_cap,
+							  uint32_t length)
+{
+	while(length >= 255) {
+		if (op >= dst_cap)
+			return 0;
+
+		dst[op++] = 255;
+		length -= 255;
+	}
+
+	if (op >= dst_cap)
+		return 0;
+
+	dst[op++] = (uint8_t) length;
+	return op;
+}
+
+// Emit a sequence of literals followed by an optional match.
+// match_length == 0 means no match (last sequence).
+// Returns new output position, or 0 on overflow.
+static uint32_t _write_sequence(uint8_t* dst,
+								uint32_t op,
+								uint32_t dst_cap,
+								const uint8_t* literals,
+								uint32_t literal_count,
+								uint32_t offset,
+								uint32_t match_length)
+{
+	uint32_t match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+	uint8_t token = 0;
+
+	token = (literal_count < 15 ? literal_count : 15) << 4;
+	token |= (match_code < 15 ? match_code : 15);
+
+	if (op >= dst_cap)
+		return 0;
+
+	dst[op++] = token;
+
+	if (literal_count >= 15 &&
+		!(op = _write_length(dst, op, dst_cap, literal_count - 15)))
+		return 0;
+
+	if (op + literal_count > dst_cap)
+		return 0;
+
+	memcpy(dst + op, literals, literal_count);
+	op += literal_count;
+
+	// Last sequence?
+	if (!match_length)
+		return op;
+
+	if (op + 2 > dst_cap)
+		return 0;
+
+	dst[op++] = offset & 0xFF;
+	dst[op++] = offset >> 8;
+
+	if (match_code >= 15 &&
+		!(op = _write_length(dst, op, dst_cap, match_code - 15)))
+		return 0;
+
+	return op;
+}
+
+
+uint32_t s_udp_lz_compress(const uint8_t* src,
+						   uint32_t src_len,
+						   uint8_t* dst,
+						   uint32_t dst_cap)
+{
+	uint16_t table[1 << LZ_HASH_BITS];
+	uint32_t pos = 1;
+	uint32_t anchor = 0;
+	uint32_t op = 0;
+	uint32_t misses = 0;
+
+	if (src_len < LZ_MIN_MATCH + 1 || src_len > S_UDP_LZ_MAX_INPUT)
+		return 0;
+
+	// Never produce anything that is not smaller than the input.
+	if (dst_cap >= src_len)
+		dst_cap = src_len - 1;
+
+	memset(table, 0, sizeof(table));
+
+	while(pos + LZ_MIN_MATCH <= src_len) {
+		uint32_t sequence = _read32(src + pos);
+		uint32_t hash = _hash(sequence);
+		uint32_t candidate = table[hash];
+		uint32_t match_length = 0;
+
+		table[hash] = (uint16_t) pos;
+
+		if (pos - candidate > LZ_MAX_OFFSET ||
+			_read32(src + candidate) != sequence) {
+			pos += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+			continue;
+		}
+
+		// Extend the match as far as it goes
+		match_length = LZ_MIN_MATCH;
+		while(pos + match_length < src_len &&
+			  src[candidate + match_length] == src[pos + match_length])
+			match_length++;
+
+		op = _write_sequence(dst, op, dst_cap,
+							 src + anchor, pos - anchor,
+							 pos - candidate, match_length);
+		if (!op)
+			return 0;
+
+		pos += match_length;
+		anchor = pos;
+		misses = 0;
+	}
+
+	// Trailing literals
+	op = _write_sequence(dst, op, dst_cap,
+						 src + anchor, src_len - anchor,
+						 0, 0);
+	return op;
+}
+
+
+int32_t s_udp_lz_decompress(const uint8_t* src,
+							uint32_t src_len,
+							uint8_t* dst,
+							uint32_t dst_cap)
+{
+	uint32_t ip = 0;
+	uint32_t op = 0;
+
+	while(ip < src_len) {
+		uint8_t token = src[ip++];
+		uint32_t literal_count = token >> 4;
+		uint32_t match_length = token & 0x0F;
+		uint32_t offset = 0;
+		uint8_t ext = 0;
+
+		if (literal_count == 15) {
+			do {
+				if (ip >= src_len)
+					return S_UDP_LZ_ERR_MALFORMED;
+
+				ext = src[ip++];
+				literal_count += ext;
+			} while(ext == 255);
+		}
+
+		if (ip + literal_count > src_len)
+			return S_UDP_LZ_ERR_MALFORMED;
+
+		if (op + literal_count > dst_cap)
+			return S_UDP_LZ_ERR_OVERFLOW;
+
+		memcpy(dst + op, src + ip, literal_count);
+		ip += literal_count;
+		op += literal_count;
+
+		// Last sequence?
+		if (ip == src_len)
+			break;
+
+		if (ip + 2 > src_len)
+			return S_UDP_LZ_ERR_MALFORMED;
+
+		offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+
+		if (!offset || offset > op)
+			return S_UDP_LZ_ERR_MALFORMED;
+
+		if (match_length == 15) {
+			do {
+				if (ip >= src_len)
+					return S_UDP_LZ_ERR_MALFORMED;
+
+				ext = src[ip++];
+				match_length += ext;
+			} while(ext == 255);
+		}
+		match_length += LZ_MIN_MATCH;
+
+		if (op + match_length > dst_cap)
+			return S_UDP_LZ_ERR_OVERFLOW;
+
+		// Matches may overlap their own output. Copy forward.
+		if (offset >= match_length)
+			memcpy(dst + op, dst + op - offset, match_length);
+		else {
+			uint32_t i;
+
+			for (i = 0; i < match_length; ++i)
+				dst[op + i] = dst[op + i - offset];
+		}
+		op += match_length;
+	}
+
+	return (int32_t) op;
+}
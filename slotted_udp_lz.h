@@ -0,0 +1,42 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP payload compression header file
+*/
+
+#include <stdint.h>
+
+// Largest input that s_udp_lz_compress() will accept.
+// Match offsets are encoded as 16 bit values.
+#define S_UDP_LZ_MAX_INPUT 0xFFFF
+
+// Returned by s_udp_lz_decompress()
+#define S_UDP_LZ_ERR_MALFORMED -1 // Corrupt or truncated input
+#define S_UDP_LZ_ERR_OVERFLOW  -2 // Output does not fit in dst_cap
+
+// Compress src_len bytes from src into dst.
+//
+// Returns the number of bytes written to dst, or 0 if the compressed
+// result would not be smaller than src_len or does not fit in dst_cap.
+// In that case the payload should be sent uncompressed.
+//
+// Cost is a single pass over src with a fixed size hash table,
+// making the per-packet cost bounded by the packet length.
+extern uint32_t s_udp_lz_compress(const uint8_t* src,
+								  uint32_t src_len,
+								  uint8_t* dst,
+								  uint32_t dst_cap);
+
+// Decompress src_len bytes from src into dst.
+//
+// Returns the number of bytes written to dst, or one of the
+// S_UDP_LZ_ERR_XXX codes.
+extern int32_t s_udp_lz_decompress(const uint8_t* src,
+								   uint32_t src_len,
+								   uint8_t* dst,
+								   uint32_t dst_cap);
@@ -17,6 +17,10 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <poll.h>
+#include <errno.h>
+#include <signal.h>
+#include <arpa/inet.h>
 
 
 #define CHANNEL_DEFAULT_ADDRESS "224.0.0.123"
@@ -24,10 +28,68 @@
 #define DEFAULT_MASTER_TRANSMIT_INTERVAL 500000 // Clock transmit interval, in usec.
 #define DEFAULT_SLOT_COUNT 10 // Clock transmit interval, in usec.
 #define DEFAULT_SLOT_WIDTH 10000 // Default slot width, in usec. (10msec)
+#define DEFAULT_MIN_SLOT_WIDTH 1000 // Narrowest adapted slot width, in usec.
+#define DEFAULT_MAX_SLOT_WIDTH 100000 // Widest adapted slot width, in usec.
+#define DEFAULT_TARGET_UTILIZATION 50 // Percent of the busiest send window to fill.
+#define REPORT_MAX_AGE 8 // Ignore slots that have not reported in this many transmit intervals.
+#define DEFAULT_JOIN_BURST 4 // Extra master packets, one per send cycle, for joining nodes.
+#define DEFAULT_LEASE_DURATION 5000000 // Slot lease granted to senders, in usec.
+#define MAX_PENDING_GRANTS 64 // Grants queued for the next slot 0 window.
+#define COLLISION_REORDER 16 // Transaction IDs that threads of one sender may send out of order.
+
+// Slot width adaptation. See adapt_schedule().
+typedef struct _adapt_t {
+	uint64_t bit_rate;       // Link bit rate, bits/sec. 0 is no adaptation.
+	uint32_t min_width;
+	uint32_t max_width;
+	uint32_t target;         // Target utilization, in percent.
+	uint32_t* peak_bytes;    // Last reported peak window bytes, per slot.
+	uint64_t* reported_at;   // Master clock of last report, per slot.
+} adapt_t;
+
+// Master packets sent to nodes that join. See read_control().
+typedef struct _join_t {
+	uint32_t burst;          // Master packets per burst. 0 is none.
+	uint32_t pending;        // Master packets left in the current burst.
+	uint64_t started_at;     // Master clock that the last burst started at.
+	uint64_t bursts;         // Bursts started.
+	uint64_t requests;       // Join requests received.
+} join_t;
+
+// Master view of a slot. See grant_lease() and track_slot().
+typedef struct _slot_t {
+	uint32_t node_id;        // Lease holder, or last holder once expired. 0 if never leased.
+	uint64_t expires_at;     // Master clock that the lease runs out at. 0 once reclaimed.
+	uint32_t bandwidth;      // Bandwidth hint of the holder, bytes/sec.
+	uint64_t active_at;      // Master clock of the last data packet. 0 if none.
+	uint64_t cycle;          // Send cycle of the last data packet.
+	struct in_addr source;   // Sender of the last data packet. 0 if not known.
+	uint64_t transaction_id; // Of the last data packet with a standard header.
+	uint64_t collisions;     // Packets from a second sender within a send cycle.
+	uint64_t logged_at;      // Master clock that a collision was last printed at.
+} slot_t;
+
+typedef struct _grant_t {
+	uint32_t node_id;
+	uint32_t slot;           // 0 if no slot was free.
+} grant_t;
+
+// Slot leases. See read_control().
+typedef struct _lease_t {
+	uint32_t duration;       // Usec of master clock per grant. 0 disables leases.
+	slot_t* slots;           // slot_count entries.
+	grant_t pending[MAX_PENDING_GRANTS];
+	uint32_t pending_count;  // Grants to send in the next slot 0 window.
+	uint64_t requests;       // Lease requests received.
+	uint64_t denials;        // Requests that found no free slot.
+} lease_t;
+
+static volatile sig_atomic_t stop = 0;
 
 void usage(const char* name)
 {
-	fprintf(stderr, "Usage: %s -c slot_count\n", name);
+	fprintf(stderr, "Usage: %s -c slot_count [-w slot_width] [-i interval] [-a address] [-J burst] [-L lease] [-X rt_spec]\n", name);
+	fprintf(stderr, "       [-b bit_rate [-m min_width] [-M max_width] [-u percent]]\n");
 	fprintf(stderr, "  -c slot_count   Number of slots to provision on the given\n");
 	fprintf(stderr, "                  multicast address. Default: %d\n\n", DEFAULT_SLOT_COUNT);
 
@@ -37,27 +99,409 @@ void usage(const char* name)
 	fprintf(stderr, "  -i interval     How often to transmit master clock, in usec.\n");
 	fprintf(stderr, "                  Default: %d\n\n", DEFAULT_MASTER_TRANSMIT_INTERVAL);
 
-	fprintf(stderr, "FIXME: Command line arguments for port and address\n");
+	fprintf(stderr, "  -J burst        Master packets sent, one per send cycle, when a\n");
+	fprintf(stderr, "                  node joins. At most one burst per interval.\n");
+	fprintf(stderr, "                  0 disables. Default: %d\n\n", DEFAULT_JOIN_BURST);
+
+	fprintf(stderr, "  -L lease        Usec that a slot is leased to a sender for.\n");
+	fprintf(stderr, "                  0 disables leases. Default: %d\n\n", DEFAULT_LEASE_DURATION);
+
+	fprintf(stderr, "  -b bit_rate     Adapt the slot width to utilization reported by\n");
+	fprintf(stderr, "                  senders, for a link of bit_rate bits/sec.\n");
+	fprintf(stderr, "                  Default: Fixed slot width\n\n");
+
+	fprintf(stderr, "  -m min_width    Narrowest adapted slot width, in usec. Default: %d\n\n",
+			DEFAULT_MIN_SLOT_WIDTH);
+
+	fprintf(stderr, "  -M max_width    Widest adapted slot width, in usec. Default: %d\n\n",
+			DEFAULT_MAX_SLOT_WIDTH);
+
+	fprintf(stderr, "  -u percent      Share of the busiest send window to fill when\n");
+	fprintf(stderr, "                  adapting. Default: %d\n\n", DEFAULT_TARGET_UTILIZATION);
+
+	fprintf(stderr, "  -a address      Multicast address, shm:name[@address] to\n");
+	fprintf(stderr, "                  also serve same host subscribers, or dual:path,path\n");
+	fprintf(stderr, "                  to send on two redundant paths. Default: %s\n\n", CHANNEL_DEFAULT_ADDRESS);
+
+	fprintf(stderr, "  -X rt_spec      Real time profile for the master clock thread.\n");
+	fprintf(stderr, "                  Comma separated cpu=N, fifo=PRIORITY, mlock,\n");
+	fprintf(stderr, "                  busy_poll=USEC, rcvbuf=BYTES, sndbuf=BYTES,\n");
+	fprintf(stderr, "                  prio=SO_PRIORITY.\n\n");
+
+	fprintf(stderr, "FIXME: Command line argument for port\n");
 	fprintf(stderr, "FIXME: Ensure that slot 0 sends are only sent during slot 0 send period\n");
 }
 
+// Can slot be leased to a new node? A slot that has carried data
+// within the last half lease is in use, by a sender that does not
+// lease or by a holder whose lease has just run out.
+static int is_slot_free(lease_t* lease,
+						slot_t* slot,
+						uint64_t master_clock)
+{
+	if (slot->node_id && slot->expires_at > master_clock)
+		return 0;
+
+	return !slot->active_at ||
+		master_clock - slot->active_at >= lease->duration / 2;
+}
+
+
+// Pick a slot for the node that sent request, and queue the grant
+// for the next slot 0 window. A node keeps the slot that it holds.
+// It gets back the slot that it held last, if that has not been
+// leased or used by anyone since, or else the slot that it prefers
+// if that is free, and otherwise the first free slot.
+static void grant_lease(s_udp_channel_t* channel,
+						lease_t* lease,
+						adapt_t* adapt,
+						const s_udp_lease_request_t* request,
+						uint32_t interval)
+{
+	uint64_t master_clock = s_udp_get_master_clock(channel);
+	slot_t* slots = lease->slots;
+	uint32_t slot = 0;
+	uint32_t ind = 0;
+
+	lease->requests++;
+
+	// Once the lease has run out, a sender that does not lease may
+	// have moved in.
+	for (ind = 1; ind < channel->slot_count && !slot; ++ind)
+		if (slots[ind].node_id == request->node_id &&
+			(slots[ind].expires_at > master_clock ||
+			 is_slot_free(lease, &slots[ind], master_clock)))
+			slot = ind;
+
+	if (!slot && request->slot > 0 && request->slot < channel->slot_count &&
+		is_slot_free(lease, &slots[request->slot], master_clock))
+		slot = request->slot;
+
+	for (ind = 1; ind < channel->slot_count && !slot; ++ind)
+		if (is_slot_free(lease, &slots[ind], master_clock))
+			slot = ind;
+
+	if (!slot)
+		lease->denials++;
+	else {
+		if (slots[slot].node_id != request->node_id || !slots[slot].expires_at) {
+			printf("Lease: slot %u to node %08x\n", slot, request->node_id);
+			fflush(stdout);
+		}
+
+		// Forget the slot that the node held last, if it moves.
+		for (ind = 1; ind < channel->slot_count; ++ind)
+			if (ind != slot && slots[ind].node_id == request->node_id) {
+				slots[ind].node_id = 0;
+				slots[ind].expires_at = 0;
+			}
+
+		slots[slot].node_id = request->node_id;
+		slots[slot].expires_at = master_clock + lease->duration;
+		slots[slot].bandwidth = request->bandwidth;
+
+		// The hint stands in for reports until the sender sends some.
+		if (adapt->bit_rate && request->bandwidth &&
+			(!adapt->reported_at[slot] ||
+			 master_clock - adapt->reported_at[slot] >= (uint64_t) REPORT_MAX_AGE * interval)) {
+			adapt->peak_bytes[slot] = (uint64_t) request->bandwidth *
+				channel->slot_count * channel->slot_width / 1000000;
+			adapt->reported_at[slot] = master_clock;
+		}
+	}
+
+	// A repeated request replaces the queued grant.
+	for (ind = 0; ind < lease->pending_count; ++ind)
+		if (lease->pending[ind].node_id == request->node_id)
+			break;
+
+	if (ind == MAX_PENDING_GRANTS)
+		return;
+
+	lease->pending[ind].node_id = request->node_id;
+	lease->pending[ind].slot = slot;
+	if (ind == lease->pending_count)
+		lease->pending_count++;
+}
+
+
+// Send the queued grants. Called in the slot 0 window.
+static void send_grants(s_udp_channel_t* channel, lease_t* lease)
+{
+	uint64_t master_clock = s_udp_get_master_clock(channel);
+	grant_t* grant = 0;
+	uint32_t ind = 0;
+
+	for (ind = 0; ind < lease->pending_count; ++ind) {
+		grant = &lease->pending[ind];
+
+		// The node counts the lease from now.
+		if (grant->slot)
+			lease->slots[grant->slot].expires_at = master_clock + lease->duration;
+
+		s_udp_send_lease_grant(channel,
+							   grant->node_id,
+							   grant->slot,
+							   grant->slot?lease->duration:0);
+	}
+
+	lease->pending_count = 0;
+}
+
+
+// Free the slots of senders that have stopped renewing.
+static void reclaim_leases(s_udp_channel_t* channel, lease_t* lease)
+{
+	uint64_t master_clock = s_udp_get_master_clock(channel);
+	uint32_t slot = 0;
+
+	for (slot = 1; slot < channel->slot_count; ++slot) {
+		if (!lease->slots[slot].expires_at || lease->slots[slot].expires_at > master_clock)
+			continue;
+
+		printf("Lease: slot %u reclaimed from node %08x\n", slot, lease->slots[slot].node_id);
+		fflush(stdout);
+		lease->slots[slot].expires_at = 0;
+	}
+}
+
+
+// Note a data packet from source, and count a collision if its send
+// cycle already had data in the same slot from another sender: from
+// another address, or with a transaction ID well below the last one.
+// Senders on the same host share an address, so only the latter
+// tells them apart.
+static void track_slot(s_udp_channel_t* channel,
+					   lease_t* lease,
+					   const s_udp_header_t* header,
+					   struct in_addr source,
+					   uint32_t interval)
+{
+	uint64_t master_clock = s_udp_get_master_clock(channel);
+	uint64_t cycle = s_udp_get_cycle_start(channel, master_clock);
+	char last_address[INET_ADDRSTRLEN];
+	char address[INET_ADDRSTRLEN];
+	uint8_t collided = 0;
+	slot_t* slot = 0;
+
+	if (header->slot >= channel->slot_count)
+		return;
+
+	slot = &lease->slots[header->slot];
+
+	if (slot->active_at && cycle == slot->cycle) {
+		// Each path of a redundant channel has an address of its own.
+		if (channel->path_count < 2 &&
+			source.s_addr && slot->source.s_addr && source.s_addr != slot->source.s_addr)
+			collided = 1;
+
+		if (!(header->flags & S_UDP_FLAG_COMPACT) &&
+			header->transaction_id + COLLISION_REORDER < slot->transaction_id)
+			collided = 1;
+	}
+
+	if (collided) {
+		slot->collisions++;
+
+		if (!slot->logged_at || master_clock - slot->logged_at >= interval) {
+			inet_ntop(AF_INET, &slot->source, last_address, sizeof(last_address));
+			inet_ntop(AF_INET, &source, address, sizeof(address));
+			printf("Collision in slot %u: %s and %s. %lu packets so far\n",
+				   header->slot, last_address, address, slot->collisions);
+			fflush(stdout);
+			slot->logged_at = master_clock;
+		}
+	}
+
+	slot->active_at = master_clock;
+	slot->cycle = cycle;
+	slot->source = source;
+
+	if (!(header->flags & S_UDP_FLAG_COMPACT))
+		slot->transaction_id = header->transaction_id;
+}
+
+
+// Read sender reports, join and lease requests, and data, for
+// duration usec.
+//
+// A join request starts a burst of join->burst master packets,
+// unless a burst has started within the last interval usec. Nodes
+// that join meanwhile are served by that burst, or by the next
+// regular master packet.
+static void read_control(s_udp_channel_t* channel,
+						 adapt_t* adapt,
+						 join_t* join,
+						 lease_t* lease,
+						 uint32_t interval,
+						 uint64_t duration)
+{
+	static uint8_t packet[S_UDP_MAX_PAYLOAD + 20];
+	uint64_t deadline = s_udp_get_local_clock() + duration;
+	int32_t socket_des = -1;
+	struct pollfd pfd;
+	struct msghdr message;
+	struct iovec iov;
+	s_udp_header_t header;
+	s_udp_report_t report;
+	s_udp_lease_request_t request;
+	struct sockaddr_in source;
+	ssize_t length = 0;
+	uint64_t master_clock = 0;
+	uint64_t now = 0;
+
+	s_udp_get_socket_descriptor(channel, &socket_des);
+	pfd.fd = socket_des;
+	pfd.events = POLLIN;
+
+	while((now = s_udp_get_local_clock()) < deadline) {
+		// Shared memory only masters have nothing to poll.
+		if (socket_des == -1)
+			usleep((deadline - now < 1000)?deadline - now:1000);
+		else if (poll(&pfd, 1, (deadline - now + 999) / 1000) == -1 && errno != EINTR) {
+			perror("poll");
+			exit(255);
+		}
+
+		// Our own master packets are read here too, and skipped.
+		while(1) {
+			iov.iov_base = packet;
+			iov.iov_len = sizeof(packet);
+			memset(&message, 0, sizeof(message));
+			message.msg_iov = &iov;
+			message.msg_iovlen = 1;
+			message.msg_name = &source;
+			message.msg_namelen = sizeof(source);
+
+			length = channel->transport->recvmsg(channel->transport_ctx,
+												 channel, &message, MSG_DONTWAIT);
+			if (length < 0)
+				break;
+
+			// Shared memory has no source address.
+			if (message.msg_namelen < sizeof(source))
+				source.sin_addr.s_addr = 0;
+
+			if (s_udp_decode_header(0, packet, length, &header) != S_UDP_OK)
+				continue;
+
+			if (header.slot != 0) {
+				track_slot(channel, lease, &header, source.sin_addr, interval);
+				continue;
+			}
+
+			master_clock = s_udp_get_master_clock(channel);
+
+			if ((header.flags & S_UDP_CONTROL_MASK) == S_UDP_CONTROL_JOIN) {
+				join->requests++;
+
+				if (join->burst && !join->pending &&
+					(!join->bursts || master_clock - join->started_at >= interval)) {
+					join->pending = join->burst;
+					join->started_at = master_clock;
+					join->bursts++;
+				}
+				continue;
+			}
+
+			if (lease->duration &&
+				s_udp_decode_lease_request(packet, length, &request) == S_UDP_OK) {
+				grant_lease(channel, lease, adapt, &request, interval);
+				continue;
+			}
+
+			if (!adapt->bit_rate ||
+				s_udp_decode_report(packet, length, &report) != S_UDP_OK ||
+				report.slot == 0 || report.slot >= channel->slot_count)
+				continue;
+
+			adapt->peak_bytes[report.slot] = report.peak_bytes;
+			adapt->reported_at[report.slot] = master_clock;
+		}
+	}
+}
+
+
+// Pick the slot width that fills target percent of the busiest
+// send window, and announce it if it differs enough from the
+// current one. Windows are widened as soon as they are too
+// narrow, but only narrowed when a quarter of them is unused, so
+// that the width does not flap.
+static void adapt_schedule(s_udp_channel_t* channel,
+						   adapt_t* adapt,
+						   uint32_t interval)
+{
+	uint64_t master_clock = s_udp_get_master_clock(channel);
+	uint64_t peak_bytes = 0;
+	uint64_t width = 0;
+	uint32_t slot = 0;
+
+	for (slot = 1; slot < channel->slot_count; ++slot)
+		if (adapt->reported_at[slot] &&
+			master_clock - adapt->reported_at[slot] < (uint64_t) REPORT_MAX_AGE * interval &&
+			adapt->peak_bytes[slot] > peak_bytes)
+			peak_bytes = adapt->peak_bytes[slot];
+
+	if (!peak_bytes)
+		return;
+
+	// Transmission time of the busiest window, scaled to target.
+	width = peak_bytes * 8 * 1000000 / adapt->bit_rate * 100 / adapt->target;
+
+	if (width < adapt->min_width)
+		width = adapt->min_width;
+
+	if (width > adapt->max_width)
+		width = adapt->max_width;
+
+	if (width == channel->slot_width ||
+		(width < channel->slot_width && width > channel->slot_width * 3 / 4))
+		return;
+
+	// Give nodes two master packets to hear about it.
+	if (s_udp_set_schedule(channel, width, 2 * (uint64_t) interval) != S_UDP_OK)
+		return;
+
+	printf("Schedule %u: slot_width %u -> %lu usec at master clock %lu. Peak window %lu bytes\n",
+		   channel->schedule_version,
+		   channel->slot_width,
+		   width,
+		   channel->schedule_switch,
+		   peak_bytes);
+	fflush(stdout);
+}
+
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+
+// Send a master packet in the slot 0 window every interval usec,
+// and in each of the following send cycles while a join burst
+// is pending, until interrupted.
 void send_clock(s_udp_channel_t* channel,
+				adapt_t* adapt,
+				join_t* join,
+				lease_t* lease,
 				uint32_t interval)
 {
-	uint64_t start_clock = s_udp_get_local_clock();
-	uint64_t slot_stats = 0;
 	uint64_t sleep_duration = 0;
+	uint64_t broadcast_at = 0;
+	uint64_t master_clock = 0;
+	uint64_t sent_cycle = 0;
+	uint8_t sent = 0;
+	uint8_t regular = 0;
 	s_udp_err_t res = S_UDP_OK;
 
-	channel->master_clock_offset = start_clock;
-	while(1) {
-
-		// Transaction ID is replaced by total slot count (upper 32 bits)
-		// followed by slot_width in usec (lower 32 bits)
-		//
-		slot_stats = (uint64_t) ((((uint64_t) htobe32(channel->slot_count)) << 32) |
-								 htobe32(channel->slot_width));
-		
+	// Master clock starts at 0.
+	channel->master_clock_offset = s_udp_get_local_clock();
+	while(!stop) {
+		// Grants follow the master packet, if any, in the slot 0
+		// window, so that nodes still set their clock by a master
+		// packet that wakes them up.
+		send_grants(channel, lease);
 
 		// Retrieve number of microseconds to sleep
 		res = s_udp_get_sleep_duration(channel,
@@ -68,17 +512,33 @@ void send_clock(s_udp_channel_t* channel,
 					s_udp_error_string(res));
 			exit(255);
 		}
-		   
-		usleep(sleep_duration);
 
-		s_udp_send_packet_raw(channel->socket_des,
-							  &channel->address,
-							  channel->slot, // Always 0
-							  slot_stats,  // Transaction
-							  s_udp_get_local_clock() - start_clock, // Clock
-							  (uint8_t*) "", 0);
+		read_control(channel, adapt, join, lease, interval, sleep_duration);
+
+		// Only one master packet per slot 0 window.
+		master_clock = s_udp_get_master_clock(channel);
+		if (sent && s_udp_get_cycle_start(channel, master_clock) == sent_cycle)
+			continue;
+
+		regular = (master_clock >= broadcast_at);
+		if (!regular && !join->pending)
+			continue;
+
+		if (regular)
+			broadcast_at = master_clock + interval;
+		else
+			join->pending--;
 
-		usleep(interval);
+		// Slot count and width are sent in place of a transaction ID.
+		s_udp_send_master_clock(channel);
+		sent_cycle = s_udp_get_cycle_start(channel, master_clock);
+		sent = 1;
+
+		if (regular && adapt->bit_rate)
+			adapt_schedule(channel, adapt, interval);
+
+		if (regular && lease->duration)
+			reclaim_leases(channel, lease);
 	}
 	return;
 }
@@ -90,9 +550,25 @@ int main(int argc, char* argv[])
 	uint32_t transmit_interval = DEFAULT_MASTER_TRANSMIT_INTERVAL;
 	int opt;
 	s_udp_channel_t channel;
+	adapt_t adapt;
+	join_t join;
+	lease_t lease;
+	char address[256] = CHANNEL_DEFAULT_ADDRESS;
+	s_udp_rt_config_t rt_config;
+	struct sigaction act;
 
 
- 	while ((opt = getopt(argc, argv, "c:i:w:")) != -1) {
+	memset(&adapt, 0, sizeof(adapt));
+	adapt.min_width = DEFAULT_MIN_SLOT_WIDTH;
+	adapt.max_width = DEFAULT_MAX_SLOT_WIDTH;
+	adapt.target = DEFAULT_TARGET_UTILIZATION;
+	s_udp_init_rt_config(&rt_config);
+	memset(&join, 0, sizeof(join));
+	join.burst = DEFAULT_JOIN_BURST;
+	memset(&lease, 0, sizeof(lease));
+	lease.duration = DEFAULT_LEASE_DURATION;
+
+ 	while ((opt = getopt(argc, argv, "c:i:w:a:b:m:M:u:J:L:X:")) != -1) {
 		switch (opt) {
 		case 'c':
 			slot_count = atoi(optarg);
@@ -106,6 +582,42 @@ int main(int argc, char* argv[])
 			slot_width = atoi(optarg);
 			break;
 
+		case 'a':
+			strncpy(address, optarg, sizeof(address));
+			address[sizeof(address)-1] = 0;
+			break;
+
+		case 'b':
+			adapt.bit_rate = strtoull(optarg, 0, 10);
+			break;
+
+		case 'm':
+			adapt.min_width = atoi(optarg);
+			break;
+
+		case 'M':
+			adapt.max_width = atoi(optarg);
+			break;
+
+		case 'u':
+			adapt.target = atoi(optarg);
+			break;
+
+		case 'J':
+			join.burst = atoi(optarg);
+			break;
+
+		case 'L':
+			lease.duration = atoi(optarg);
+			break;
+
+		case 'X':
+			if (s_udp_parse_rt_config(optarg, &rt_config) != S_UDP_OK) {
+				usage(argv[0]);
+				exit(255);
+			}
+			break;
+
 		default: /* '?' */
 			usage(argv[0]);
 			exit(255);
@@ -118,20 +630,50 @@ int main(int argc, char* argv[])
 		exit(255);
 	}
 
+	if (adapt.bit_rate &&
+		(!adapt.min_width || adapt.min_width > adapt.max_width ||
+		 !adapt.target || adapt.target > 100)) {
+		fprintf(stderr, "Please specify 0 < min_width <= max_width and 0 < percent <= 100\n\n");
+		usage(argv[0]);
+		exit(255);
+	}
+
+	adapt.peak_bytes = calloc(slot_count, sizeof(uint32_t));
+	adapt.reported_at = calloc(slot_count, sizeof(uint64_t));
+	lease.slots = calloc(slot_count, sizeof(slot_t));
+	if (!adapt.peak_bytes || !adapt.reported_at || !lease.slots) {
+		perror("calloc");
+		exit(255);
+	}
+
 	if (s_udp_init_channel(&channel,
 						   1,
-						   CHANNEL_DEFAULT_ADDRESS,
+						   address,
 						   CHANNEL_DEFAULT_PORT,
 						   0) != S_UDP_OK)
 		exit(255);
 
+	if (s_udp_set_rt_config(&channel, &rt_config) != S_UDP_OK)
+		exit(255);
+
 	if (s_udp_attach_channel(&channel) != S_UDP_OK)
 		exit(255);
 
 	channel.slot = 0;
 	channel.slot_count = slot_count;
 	channel.slot_width = slot_width;
-	send_clock(&channel, transmit_interval);
+
+	// Stop on ctrl-c, so that the channel, and a shared memory ring
+	// that no one else uses, are cleaned up.
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = on_signal;
+	sigaction(SIGINT, &act, 0);
+	sigaction(SIGTERM, &act, 0);
+
+	send_clock(&channel, &adapt, &join, &lease, transmit_interval);
 
 	s_udp_destroy_channel(&channel);
+	free(adapt.peak_bytes);
+	free(adapt.reported_at);
+	free(lease.slots);
 }
@@ -0,0 +1,598 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP bus monitor program
+
+   Subscribes to all slots and shows per slot rates, send window
+   use and timing once per interval, as a table or as JSON lines.
+
+   Datagrams are read in batches with recvmmsg(), truncated to their
+   headers, and stamped by the kernel on arrival. Per packet work is
+   limited to decoding the header and updating counters. All
+   formatting is done once per interval.
+*/
+
+#define _GNU_SOURCE
+#include "slotted_udp.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <stdint.h>
+#include <poll.h>
+
+#define CHANNEL_DEFAULT_ADDRESS "224.0.0.123"
+#define CHANNEL_DEFAULT_PORT 49234
+#define DEFAULT_INTERVAL 1000         // Display interval, in msec.
+#define DEFAULT_BIT_RATE 1000000000ULL // Link bit rate for window occupancy.
+#define RECV_BATCH 256                // Datagrams per recvmmsg() call
+#define POLL_MSEC 100                 // Longest wait for packets
+#define HEADER_BYTES 64               // Bytes read of each datagram. Holds any header and schedule.
+#define MAX_SLOTS 4096                // Slots tracked individually. Others are summed as "other".
+#define RECV_BUFFER_SIZE (8*1024*1024) // Socket buffer to absorb bursts. Capped by net.core.rmem_max.
+
+static volatile sig_atomic_t stop = 0;
+
+// Counters for one slot over one display interval.
+typedef struct _slot_stats_t {
+	uint64_t packets;
+	uint64_t bytes;          // Datagram bytes, headers included.
+	uint64_t windows;        // Send windows with at least one packet.
+	uint64_t last_window;    // Cycle start of the last counted window.
+	uint64_t window_bytes;   // Bytes in the current window.
+	uint64_t peak_window_bytes;
+	uint64_t timed;          // Packets with offset and latency below. Needs a master clock.
+	int64_t offset_min;      // Send offset from start of slot window, in usec.
+	int64_t offset_max;
+	double offset_sum;
+	double offset_sum_sq;
+	uint64_t out_of_window;  // Packets that arrived outside their slot window.
+	int64_t latency_min;     // Arrival master clock minus packet clock, in usec.
+	int64_t latency_max;
+	uint64_t lost;           // Gaps in transaction IDs.
+
+	// Kept across intervals.
+	uint64_t last_transaction_id;
+	uint8_t seen;
+} slot_stats_t;
+
+typedef struct _monitor_t {
+	s_udp_channel_t* channel;
+	slot_stats_t* slots;     // MAX_SLOTS + 1. The last one is "other".
+	uint64_t bit_rate;
+	uint8_t json;
+	uint8_t clear;           // Redraw the table in place.
+	uint64_t interval_start; // Local clock, usec.
+	uint64_t malformed;
+	uint64_t reports;        // Utilization reports from senders.
+	uint64_t joins;          // Join requests from nodes.
+	uint64_t leases;         // Lease requests and grants.
+} monitor_t;
+
+void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s [-a address] [-i interval] [-b bit_rate] [-j] [-G slots]\n", name);
+	fprintf(stderr, "  -a address       Multicast address to monitor. Default %s\n\n", CHANNEL_DEFAULT_ADDRESS);
+	fprintf(stderr, "  -G slots         Join the multicast group of each group of slots.\n");
+	fprintf(stderr, "                   Must match the senders.\n\n");
+	fprintf(stderr, "  -i interval      Display interval, in msec. Default %d\n\n", DEFAULT_INTERVAL);
+	fprintf(stderr, "  -b bit_rate      Link bit rate, in bits/sec, that window occupancy\n");
+	fprintf(stderr, "                   is calculated for. Default %llu\n\n", DEFAULT_BIT_RATE);
+	fprintf(stderr, "  -j               Write one JSON object per interval instead of a table.\n\n");
+	fprintf(stderr, "Columns, per slot and interval:\n");
+	fprintf(stderr, "  pkt/s, byte/s    Packets and bytes, headers included, per second.\n");
+	fprintf(stderr, "  win%%             Share of send cycles in which the slot sent.\n");
+	fprintf(stderr, "  occ%%             Transmission time of the busiest window, as a share\n");
+	fprintf(stderr, "                   of slot_width.\n");
+	fprintf(stderr, "  offset           Send time from start of slot window, in usec.\n");
+	fprintf(stderr, "                   Mean, standard deviation (jitter) and max.\n");
+	fprintf(stderr, "  late             Packets that arrived outside their slot window.\n");
+	fprintf(stderr, "  lost             Packets missing from the transaction ID sequence.\n");
+	fprintf(stderr, "  clk_err          Smallest arrival time minus send time, in usec.\n");
+	fprintf(stderr, "                   The sender's clock error plus the network delay.\n");
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static uint64_t get_clock(clockid_t id)
+{
+	struct timespec tp;
+
+	clock_gettime(id, &tp);
+	return ((uint64_t) tp.tv_sec) * 1000000LL + tp.tv_nsec / 1000;
+}
+
+// Kernel receive time of a datagram, in CLOCK_REALTIME usec.
+static uint64_t get_timestamp(struct msghdr* message, uint64_t fallback)
+{
+	struct cmsghdr* cmsg = 0;
+	struct timespec tp;
+
+	for (cmsg = CMSG_FIRSTHDR(message); cmsg; cmsg = CMSG_NXTHDR(message, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&tp, CMSG_DATA(cmsg), sizeof(tp));
+			return ((uint64_t) tp.tv_sec) * 1000000LL + tp.tv_nsec / 1000;
+		}
+	}
+	return fallback;
+}
+
+static void reset_stats(slot_stats_t* stats)
+{
+	stats->packets = 0;
+	stats->bytes = 0;
+	stats->windows = 0;
+	stats->window_bytes = 0;
+	stats->peak_window_bytes = 0;
+	stats->timed = 0;
+	stats->offset_min = INT64_MAX;
+	stats->offset_max = INT64_MIN;
+	stats->offset_sum = 0.0;
+	stats->offset_sum_sq = 0.0;
+	stats->out_of_window = 0;
+	stats->latency_min = INT64_MAX;
+	stats->latency_max = INT64_MIN;
+	stats->lost = 0;
+}
+
+// Count the gap between the last and this transaction ID of a slot.
+// Compact headers carry the lower 16 or 32 bits.
+static void track_loss(slot_stats_t* stats, const s_udp_header_t* header)
+{
+	uint64_t mask = ~0ULL;
+	uint64_t delta = 0;
+
+	if (header->flags & S_UDP_FLAG_COMPACT)
+		mask = (header->flags & S_UDP_FLAG_SEQ32)?0xFFFFFFFFULL:0xFFFFULL;
+
+	delta = (header->transaction_id - stats->last_transaction_id) & mask;
+
+	// Forward gaps only. Duplicates, reordering and restarted senders
+	// (a step back) are not loss.
+	if (stats->seen && delta > 1 && delta <= mask / 2)
+		stats->lost += delta - 1;
+
+	stats->last_transaction_id = header->transaction_id;
+	stats->seen = 1;
+}
+
+static void track_timing(monitor_t* mon,
+						 slot_stats_t* stats,
+						 const s_udp_header_t* header,
+						 uint32_t length,
+						 uint64_t arrival)
+{
+	s_udp_channel_t* channel = mon->channel;
+	uint64_t slot_offset = (uint64_t) channel->slot_width * header->slot;
+	uint64_t send_start = s_udp_get_cycle_start(channel, header->clock) + slot_offset;
+	uint64_t arrival_start = s_udp_get_cycle_start(channel, arrival) + slot_offset;
+	int64_t offset = (int64_t) (header->clock - send_start);
+	int64_t latency = (int64_t) (arrival - header->clock);
+
+	// Windows are counted on send time, so that a window is only
+	// counted once however its packets arrive.
+	if (send_start != stats->last_window) {
+		stats->last_window = send_start;
+		stats->windows++;
+		stats->window_bytes = 0;
+	}
+
+	stats->window_bytes += length;
+	if (stats->window_bytes > stats->peak_window_bytes)
+		stats->peak_window_bytes = stats->window_bytes;
+
+	stats->timed++;
+	stats->offset_sum += offset;
+	stats->offset_sum_sq += (double) offset * offset;
+	if (offset < stats->offset_min)
+		stats->offset_min = offset;
+	if (offset > stats->offset_max)
+		stats->offset_max = offset;
+
+	if (latency < stats->latency_min)
+		stats->latency_min = latency;
+	if (latency > stats->latency_max)
+		stats->latency_max = latency;
+
+	if (arrival < arrival_start || arrival >= arrival_start + channel->slot_width)
+		stats->out_of_window++;
+}
+
+static void process_packet(monitor_t* mon,
+						   const uint8_t* packet,
+						   uint32_t read_length,
+						   uint32_t length,
+						   uint64_t arrival)
+{
+	s_udp_channel_t* channel = mon->channel;
+	s_udp_header_t header;
+	slot_stats_t* stats = 0;
+
+	if (s_udp_decode_header(channel, packet, read_length, &header) != S_UDP_OK) {
+		mon->malformed++;
+		return;
+	}
+
+	stats = &mon->slots[(header.slot < MAX_SLOTS)?header.slot:MAX_SLOTS];
+	stats->packets++;
+	stats->bytes += length;
+
+	if (header.slot == 0) {
+		if ((header.flags & S_UDP_CONTROL_MASK) == S_UDP_CONTROL_REPORT)
+			mon->reports++;
+		else if ((header.flags & S_UDP_CONTROL_MASK) == S_UDP_CONTROL_JOIN)
+			mon->joins++;
+		else if ((header.flags & S_UDP_CONTROL_MASK) == S_UDP_CONTROL_LEASE_REQUEST ||
+				 (header.flags & S_UDP_CONTROL_MASK) == S_UDP_CONTROL_LEASE_GRANT)
+			mon->leases++;
+		else
+			s_udp_process_master_packet(channel, &header,
+										packet + header.header_length,
+										read_length - header.header_length);
+		return;
+	}
+
+	if (header.slot >= MAX_SLOTS)
+		return;
+
+	track_loss(stats, &header);
+
+	// Timing needs the slot layout from the master.
+	if (arrival && channel->slot_width && channel->slot_count)
+		track_timing(mon, stats, &header, length, arrival);
+}
+
+static double get_mean(const slot_stats_t* stats)
+{
+	return stats->timed?stats->offset_sum / stats->timed:0.0;
+}
+
+static double get_jitter(const slot_stats_t* stats)
+{
+	double mean = get_mean(stats);
+	double variance = 0.0;
+
+	if (!stats->timed)
+		return 0.0;
+
+	variance = stats->offset_sum_sq / stats->timed - mean * mean;
+	return (variance > 0.0)?sqrt(variance):0.0;
+}
+
+// Transmission time of the busiest window, in percent of slot_width.
+static double get_occupancy(monitor_t* mon, const slot_stats_t* stats)
+{
+	if (!mon->channel->slot_width)
+		return 0.0;
+
+	return stats->peak_window_bytes * 8.0 * 1e6 / mon->bit_rate /
+		mon->channel->slot_width * 100.0;
+}
+
+// Share of the send cycles in elapsed usec that the slot sent in, in percent.
+static double get_window_use(monitor_t* mon, const slot_stats_t* stats, uint64_t elapsed)
+{
+	uint64_t cycle_duration = (uint64_t) mon->channel->slot_width * mon->channel->slot_count;
+	double cycles = cycle_duration?(double) elapsed / cycle_duration:0.0;
+	double use = (cycles > 0.0)?stats->windows * 100.0 / cycles:0.0;
+
+	return (use > 100.0)?100.0:use;
+}
+
+static void print_table(monitor_t* mon, uint64_t elapsed)
+{
+	s_udp_channel_t* channel = mon->channel;
+	double seconds = elapsed / 1e6;
+	uint32_t slot = 0;
+
+	if (mon->clear)
+		fputs("\033[H\033[2J", stdout);
+
+	printf("master_clock[%.3f sec] slot_count[%u] slot_width[%u usec] schedule[%u] reports[%lu] joins[%lu] leases[%lu] malformed[%lu]\n",
+		   s_udp_get_master_clock(channel) / 1e6,
+		   channel->slot_count,
+		   channel->slot_width,
+		   channel->schedule_version,
+		   mon->reports,
+		   mon->joins,
+		   mon->leases,
+		   mon->malformed);
+
+	printf("%6s %9s %11s %6s %6s %9s %8s %8s %7s %7s %8s\n",
+		   "slot", "pkt/s", "byte/s", "win%", "occ%",
+		   "offset", "jitter", "max", "late", "lost", "clk_err");
+
+	for (slot = 0; slot <= MAX_SLOTS; ++slot) {
+		slot_stats_t* stats = &mon->slots[slot];
+
+		if (!stats->packets)
+			continue;
+
+		if (slot == MAX_SLOTS)
+			printf("%6s", "other");
+		else
+			printf("%6u", slot);
+
+		printf(" %9.0f %11.0f", stats->packets / seconds, stats->bytes / seconds);
+
+		if (!stats->timed) {
+			putchar('\n');
+			continue;
+		}
+
+		printf(" %6.1f %6.1f %9.1f %8.1f %8ld %7lu %7lu %8ld\n",
+			   get_window_use(mon, stats, elapsed),
+			   get_occupancy(mon, stats),
+			   get_mean(stats),
+			   get_jitter(stats),
+			   stats->offset_max,
+			   stats->out_of_window,
+			   stats->lost,
+			   stats->latency_min);
+	}
+	fflush(stdout);
+}
+
+static void print_json(monitor_t* mon, uint64_t elapsed)
+{
+	s_udp_channel_t* channel = mon->channel;
+	double seconds = elapsed / 1e6;
+	const char* separator = "";
+	uint32_t slot = 0;
+
+	printf("{\"master_clock\":%lu,\"interval_usec\":%lu,\"slot_count\":%u,\"slot_width\":%u,"
+		   "\"schedule\":%u,\"reports\":%lu,\"joins\":%lu,\"leases\":%lu,\"malformed\":%lu,\"slots\":[",
+		   s_udp_get_master_clock(channel),
+		   elapsed,
+		   channel->slot_count,
+		   channel->slot_width,
+		   channel->schedule_version,
+		   mon->reports,
+		   mon->joins,
+		   mon->leases,
+		   mon->malformed);
+
+	for (slot = 0; slot <= MAX_SLOTS; ++slot) {
+		slot_stats_t* stats = &mon->slots[slot];
+
+		if (!stats->packets)
+			continue;
+
+		if (slot == MAX_SLOTS)
+			printf("%s{\"slot\":\"other\"", separator);
+		else
+			printf("%s{\"slot\":%u", separator, slot);
+
+		printf(",\"packets\":%lu,\"bytes\":%lu,\"packets_per_sec\":%.1f,\"bytes_per_sec\":%.1f",
+			   stats->packets, stats->bytes,
+			   stats->packets / seconds, stats->bytes / seconds);
+
+		if (stats->timed)
+			printf(",\"windows\":%lu,\"window_use\":%.2f,\"occupancy\":%.2f,"
+				   "\"offset_mean\":%.1f,\"offset_jitter\":%.1f,\"offset_min\":%ld,\"offset_max\":%ld,"
+				   "\"out_of_window\":%lu,\"lost\":%lu,\"latency_min\":%ld,\"latency_max\":%ld",
+				   stats->windows,
+				   get_window_use(mon, stats, elapsed),
+				   get_occupancy(mon, stats),
+				   get_mean(stats),
+				   get_jitter(stats),
+				   stats->offset_min,
+				   stats->offset_max,
+				   stats->out_of_window,
+				   stats->lost,
+				   stats->latency_min,
+				   stats->latency_max);
+
+		putchar('}');
+		separator = ",";
+	}
+	puts("]}");
+	fflush(stdout);
+}
+
+void monitor(monitor_t* mon, uint32_t interval)
+{
+	static uint8_t packets[RECV_BATCH][HEADER_BYTES];
+	static uint8_t controls[RECV_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+	struct mmsghdr messages[RECV_BATCH];
+	struct iovec iovs[RECV_BATCH];
+	struct pollfd pfd;
+	int32_t socket_des = -1;
+	uint64_t now = 0;
+	uint32_t slot = 0;
+	int ind = 0;
+
+	s_udp_get_socket_descriptor(mon->channel, &socket_des);
+	pfd.fd = socket_des;
+	pfd.events = POLLIN;
+
+	for (slot = 0; slot <= MAX_SLOTS; ++slot)
+		reset_stats(&mon->slots[slot]);
+
+	for (ind = 0; ind < RECV_BATCH; ++ind) {
+		iovs[ind].iov_base = packets[ind];
+		iovs[ind].iov_len = sizeof(packets[ind]);
+	}
+
+	mon->interval_start = s_udp_get_local_clock();
+
+	while(!stop) {
+		uint64_t realtime_offset = 0;
+		int count = 0;
+
+		for (ind = 0; ind < RECV_BATCH; ++ind) {
+			memset(&messages[ind].msg_hdr, 0, sizeof(messages[ind].msg_hdr));
+			messages[ind].msg_hdr.msg_iov = &iovs[ind];
+			messages[ind].msg_hdr.msg_iovlen = 1;
+			messages[ind].msg_hdr.msg_control = controls[ind];
+			messages[ind].msg_hdr.msg_controllen = sizeof(controls[ind]);
+		}
+
+		// Wake up at least every POLL_MSEC to show idle intervals too.
+		// The channel socket is non-blocking.
+		if (poll(&pfd, 1, POLL_MSEC) == -1 && errno != EINTR) {
+			perror("poll");
+			exit(255);
+		}
+
+		// MSG_TRUNC has msg_len report the full datagram length.
+		count = recvmmsg(socket_des, messages, RECV_BATCH, MSG_WAITFORONE | MSG_TRUNC, 0);
+
+		if (count < 0 && errno != EINTR && errno != EAGAIN) {
+			perror("recvmmsg");
+			exit(255);
+		}
+
+		// Kernel timestamps are CLOCK_REALTIME. Master clock is
+		// derived from CLOCK_MONOTONIC.
+		now = s_udp_get_local_clock();
+		realtime_offset = get_clock(CLOCK_REALTIME) - now;
+
+		for (ind = 0; ind < count; ++ind) {
+			uint64_t arrival = 0;
+			uint32_t length = messages[ind].msg_len;
+
+			if (mon->channel->master_clock_offset)
+				arrival = get_timestamp(&messages[ind].msg_hdr, now + realtime_offset) -
+					realtime_offset - mon->channel->master_clock_offset;
+
+			process_packet(mon,
+						   packets[ind],
+						   (length < HEADER_BYTES)?length:HEADER_BYTES,
+						   length,
+						   arrival);
+		}
+
+		if (now - mon->interval_start < (uint64_t) interval * 1000)
+			continue;
+
+		if (mon->json)
+			print_json(mon, now - mon->interval_start);
+		else
+			print_table(mon, now - mon->interval_start);
+
+		for (slot = 0; slot <= MAX_SLOTS; ++slot)
+			reset_stats(&mon->slots[slot]);
+
+		mon->reports = 0;
+		mon->joins = 0;
+		mon->leases = 0;
+		mon->malformed = 0;
+		mon->interval_start = now;
+	}
+}
+
+
+int main(int argc, char* argv[])
+{
+	s_udp_channel_t channel;
+	monitor_t mon;
+	struct sigaction act;
+	char address[256] = CHANNEL_DEFAULT_ADDRESS;
+	uint32_t interval = DEFAULT_INTERVAL;
+	int32_t socket_des = -1;
+	uint32_t flag = 1;
+	int buffer_size = RECV_BUFFER_SIZE;
+	uint32_t slots_per_group = 0;
+	int opt;
+
+	memset(&mon, 0, sizeof(mon));
+	mon.bit_rate = DEFAULT_BIT_RATE;
+
+	while ((opt = getopt(argc, argv, "a:i:b:jG:")) != -1) {
+		switch (opt) {
+		case 'a':
+			strncpy(address, optarg, sizeof(address));
+			address[sizeof(address)-1] = 0;
+			break;
+
+		case 'i':
+			interval = atoi(optarg);
+			break;
+
+		case 'b':
+			mon.bit_rate = strtoull(optarg, 0, 10);
+			break;
+
+		case 'j':
+			mon.json = 1;
+			break;
+
+		case 'G':
+			slots_per_group = atoi(optarg);
+			break;
+
+		default: /* '?' */
+			usage(argv[0]);
+			exit(255);
+		}
+	}
+
+	if (!interval || !mon.bit_rate) {
+		usage(argv[0]);
+		exit(255);
+	}
+
+	mon.clear = !mon.json && isatty(STDOUT_FILENO);
+	mon.slots = calloc(MAX_SLOTS + 1, sizeof(slot_stats_t));
+	if (!mon.slots) {
+		perror("calloc");
+		exit(255);
+	}
+
+	if (s_udp_init_channel(&channel,
+						   0,
+						   address,
+						   CHANNEL_DEFAULT_PORT,
+						   S_UDP_ALL_SLOTS) != S_UDP_OK)
+		exit(255);
+
+	// recvmmsg() and SO_TIMESTAMPNS need a socket, not the epoll
+	// descriptor of a dual channel.
+	if (channel.transport == &s_udp_dual_transport) {
+		fprintf(stderr, "%s: dual: addresses can not be monitored. Monitor one of the paths instead\n", address);
+		exit(255);
+	}
+
+	if (slots_per_group && s_udp_set_slot_groups(&channel, slots_per_group) != S_UDP_OK)
+		exit(255);
+
+	if (s_udp_attach_channel(&channel) != S_UDP_OK)
+		exit(255);
+
+	// recvmmsg() needs the socket.
+	if (s_udp_get_socket_descriptor(&channel, &socket_des) != S_UDP_OK) {
+		fprintf(stderr, "%s: Only network addresses can be monitored\n", address);
+		exit(255);
+	}
+
+	if (setsockopt(socket_des, SOL_SOCKET, SO_TIMESTAMPNS, &flag, sizeof(flag)) < 0)
+		perror("setsockopt(SO_TIMESTAMPNS)");
+
+	if (setsockopt(socket_des, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size)) < 0)
+		perror("setsockopt(SO_RCVBUF)");
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = on_signal;
+	sigaction(SIGINT, &act, 0);
+	sigaction(SIGTERM, &act, 0);
+
+	mon.channel = &channel;
+	monitor(&mon, interval);
+
+	s_udp_destroy_channel(&channel);
+	free(mon.slots);
+}
@@ -0,0 +1,287 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP packet pool
+
+   Free slabs are kept on a lock free stack (Treiber stack) of
+   handle indexes, so that packets handed to consumers in other
+   threads can be released without taking a lock.
+
+   The stack head packs a 32 bit tag above the index + 1 of the top
+   handle (0 is empty). The tag is bumped on every update, so that a
+   compare and swap fails if the head was popped and pushed back
+   between reading it and swapping it (ABA).
+
+   Send queues are intrusive multi producer, single consumer queues
+   (Vyukov), linked through the packet handles. A producer swaps
+   itself in as the new head with a single atomic exchange and then
+   links the previous head to it, so queueing never retries. The
+   consumer walks from the tail. A stub handle keeps the queue
+   non-empty, so that the last packet can be taken off without
+   racing the producers.
+*/
+
+#include "slotted_udp.h"
+#include <stdlib.h>
+#include <memory.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+#define _S_UDP_SLAB_ALIGN 64                  // Cache line
+#define _S_UDP_HUGE_PAGE_SIZE (2*1024*1024)
+
+#define _free_index(head) ((uint32_t) (head))
+#define _free_head(tag, index) ((((uint64_t) (tag)) << 32) | (index))
+
+
+static void _push_free(s_udp_pool_t* pool, s_udp_packet_t* packet)
+{
+	uint32_t index = packet - pool->packets + 1;
+	uint64_t head = __atomic_load_n(&pool->free_head, __ATOMIC_RELAXED);
+	uint64_t new_head = 0;
+
+	do {
+		__atomic_store_n(&packet->next_free, _free_index(head), __ATOMIC_RELAXED);
+		new_head = _free_head((head >> 32) + 1, index);
+	} while(!__atomic_compare_exchange_n(&pool->free_head, &head, new_head, 1,
+										 __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+static s_udp_packet_t* _pop_free(s_udp_pool_t* pool)
+{
+	uint64_t head = __atomic_load_n(&pool->free_head, __ATOMIC_ACQUIRE);
+	uint64_t new_head = 0;
+	s_udp_packet_t* packet = 0;
+
+	do {
+		if (!_free_index(head))
+			return 0;
+
+		// next_free may be stale if another thread got here first.
+		// The tag then makes the swap below fail.
+		packet = &pool->packets[_free_index(head) - 1];
+		new_head = _free_head((head >> 32) + 1,
+							  __atomic_load_n(&packet->next_free, __ATOMIC_RELAXED));
+	} while(!__atomic_compare_exchange_n(&pool->free_head, &head, new_head, 1,
+										 __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+
+	return packet;
+}
+
+
+s_udp_err_t s_udp_init_pool(s_udp_pool_t* pool,
+							uint32_t slab_count,
+							uint32_t slab_size,
+							uint8_t huge_pages)
+{
+	uint32_t ind = 0;
+
+	if (!pool || !slab_count || !slab_size) {
+		fprintf(stderr, "s_udp_init_pool(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	memset(pool, 0, sizeof(*pool));
+	pool->slab_size = (slab_size + _S_UDP_SLAB_ALIGN - 1) & ~(_S_UDP_SLAB_ALIGN - 1);
+	pool->slab_count = slab_count;
+	pool->memory = MAP_FAILED;
+
+	if (huge_pages) {
+		// Huge page mappings must be a multiple of the huge page size.
+		pool->memory_size = ((size_t) pool->slab_size * slab_count + _S_UDP_HUGE_PAGE_SIZE - 1) &
+			~((size_t) _S_UDP_HUGE_PAGE_SIZE - 1);
+
+		pool->memory = mmap(0, pool->memory_size, PROT_READ | PROT_WRITE,
+							MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+
+		if (pool->memory != MAP_FAILED)
+			pool->huge_pages = 1;
+		else
+			fprintf(stderr, "s_udp_init_pool(): No huge pages available. Using regular pages\n");
+	}
+
+	if (pool->memory == MAP_FAILED) {
+		pool->memory_size = (size_t) pool->slab_size * slab_count;
+		pool->memory = mmap(0, pool->memory_size, PROT_READ | PROT_WRITE,
+							MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	}
+
+	if (pool->memory == MAP_FAILED) {
+		perror("s_udp_init_pool(): mmap()");
+		pool->memory = 0;
+		return S_UDP_BUFFER_TOO_SMALL;
+	}
+
+	pool->packets = calloc(slab_count, sizeof(s_udp_packet_t));
+
+	if (!pool->packets) {
+		perror("s_udp_init_pool(): calloc()");
+		munmap(pool->memory, pool->memory_size);
+		pool->memory = 0;
+		return S_UDP_BUFFER_TOO_SMALL;
+	}
+
+	// Chain all handles, with the first slab on top.
+	for (ind = 0; ind < slab_count; ++ind) {
+		pool->packets[ind].slab = pool->memory + (size_t) ind * pool->slab_size;
+		pool->packets[ind].pool = pool;
+		pool->packets[ind].next_free = (ind + 1 < slab_count)?ind + 2:0;
+	}
+	pool->free_head = _free_head(0, 1);
+
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_destroy_pool(s_udp_pool_t* pool)
+{
+	if (!pool) {
+		fprintf(stderr, "s_udp_destroy_pool(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (pool->memory)
+		munmap(pool->memory, pool->memory_size);
+
+	free(pool->packets);
+	memset(pool, 0, sizeof(*pool));
+	return S_UDP_OK;
+}
+
+
+s_udp_packet_t* s_udp_alloc_packet(s_udp_pool_t* pool)
+{
+	s_udp_packet_t* packet = _pop_free(pool);
+
+	if (!packet)
+		return 0;
+
+	memset(&packet->header, 0, sizeof(packet->header));
+	packet->payload = packet->slab;
+	packet->length = 0;
+	packet->latency = 0;
+	packet->packet_loss_detected = 0;
+	__atomic_store_n(&packet->ref_count, 1, __ATOMIC_RELAXED);
+
+	return packet;
+}
+
+
+void s_udp_ref_packet(s_udp_packet_t* packet)
+{
+	__atomic_add_fetch(&packet->ref_count, 1, __ATOMIC_RELAXED);
+}
+
+
+void s_udp_release_packet(s_udp_packet_t* packet)
+{
+	// Make all writes to the slab by this consumer visible before
+	// the slab can be handed out again.
+	if (__atomic_sub_fetch(&packet->ref_count, 1, __ATOMIC_ACQ_REL) == 0)
+		_push_free(packet->pool, packet);
+}
+
+
+static void _push_queued(s_udp_send_queue_t* queue, s_udp_packet_t* packet)
+{
+	s_udp_packet_t* prev = 0;
+
+	__atomic_store_n(&packet->next_queued, 0, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&queue->head, packet, __ATOMIC_ACQ_REL);
+
+	// The queue is cut here until the link is set. The consumer
+	// sees an empty queue rather than waiting for it.
+	__atomic_store_n(&prev->next_queued, packet, __ATOMIC_RELEASE);
+}
+
+
+s_udp_err_t s_udp_init_send_queue(s_udp_send_queue_t* queue)
+{
+	if (!queue) {
+		fprintf(stderr, "s_udp_init_send_queue(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	memset(queue, 0, sizeof(*queue));
+	queue->head = &queue->stub;
+	queue->tail = &queue->stub;
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_enqueue_packet(s_udp_send_queue_t* queue,
+								 s_udp_packet_t* packet)
+{
+	if (!queue || !packet) {
+		fprintf(stderr, "s_udp_enqueue_packet(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	_push_queued(queue, packet);
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_requeue_packet(s_udp_send_queue_t* queue,
+								 s_udp_packet_t* packet)
+{
+	if (!queue || !packet || queue->front) {
+		fprintf(stderr, "s_udp_requeue_packet(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	queue->front = packet;
+	return S_UDP_OK;
+}
+
+
+s_udp_packet_t* s_udp_dequeue_packet(s_udp_send_queue_t* queue)
+{
+	s_udp_packet_t* tail = queue->tail;
+	s_udp_packet_t* next = 0;
+
+	if (queue->front) {
+		tail = queue->front;
+		queue->front = 0;
+		return tail;
+	}
+
+	next = __atomic_load_n(&tail->next_queued, __ATOMIC_ACQUIRE);
+
+	// Step over the stub.
+	if (tail == &queue->stub) {
+		if (!next)
+			return 0;
+
+		queue->tail = next;
+		tail = next;
+		next = __atomic_load_n(&tail->next_queued, __ATOMIC_ACQUIRE);
+	}
+
+	if (next) {
+		queue->tail = next;
+		return tail;
+	}
+
+	// tail is the last linked packet. If it is not the head, a
+	// producer is between the exchange and the link.
+	if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE))
+		return 0;
+
+	// Put the stub back behind tail so that tail can be taken off.
+	_push_queued(queue, &queue->stub);
+
+	next = __atomic_load_n(&tail->next_queued, __ATOMIC_ACQUIRE);
+	if (next) {
+		queue->tail = next;
+		return tail;
+	}
+
+	return 0;
+}
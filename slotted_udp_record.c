@@ -0,0 +1,286 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP traffic capture program
+*/
+
+#define _GNU_SOURCE
+#include "slotted_udp.h"
+#include "slotted_udp_record.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+
+#define CHANNEL_DEFAULT_ADDRESS "224.0.0.123"
+#define CHANNEL_DEFAULT_PORT 49234
+#define RECV_BATCH 64                 // Datagrams per recvmmsg() call
+#define WRITE_BUFFER_SIZE (1024*1024) // Records are written in chunks of this size
+
+static volatile sig_atomic_t stop = 0;
+
+typedef struct _write_buffer_t {
+	int fd;
+	uint8_t* data;
+	uint32_t length;
+} write_buffer_t;
+
+void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s -f file_name [-G slots]\n", name);
+	fprintf(stderr, "  -f file_name     Append all slotted traffic to file_name\n");
+	fprintf(stderr, "                   until interrupted with ctrl-c.\n\n");
+	fprintf(stderr, "  -G slots         Join the multicast group of each group of slots.\n");
+	fprintf(stderr, "                   Must match the senders.\n\n");
+	fprintf(stderr, "Master (slot 0) packets are processed but not recorded.\n");
+}
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void flush_buffer(write_buffer_t* buf)
+{
+	uint32_t ind = 0;
+
+	while(ind < buf->length) {
+		ssize_t wr_len = write(buf->fd, buf->data + ind, buf->length - ind);
+
+		if (wr_len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("write");
+			exit(255);
+		}
+		ind += wr_len;
+	}
+	buf->length = 0;
+}
+
+static void append_record(write_buffer_t* buf,
+						  s_udp_record_t* record,
+						  const uint8_t* payload)
+{
+	uint64_t size = S_UDP_RECORD_SIZE(record->payload_length);
+
+	if (buf->length + size > WRITE_BUFFER_SIZE)
+		flush_buffer(buf);
+
+	memcpy(buf->data + buf->length, record, sizeof(*record));
+	memcpy(buf->data + buf->length + sizeof(*record), payload, record->payload_length);
+	memset(buf->data + buf->length + sizeof(*record) + record->payload_length, 0,
+		   size - sizeof(*record) - record->payload_length);
+	buf->length += size;
+}
+
+// Open file_name for appending, writing a file header if it is new.
+static int open_capture_file(const char* file_name)
+{
+	s_udp_record_file_t file_header;
+	struct stat st;
+	int fd = open(file_name, O_WRONLY | O_CREAT | O_APPEND, 0666);
+
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		perror(file_name);
+		exit(255);
+	}
+
+	if (st.st_size > 0)
+		return fd;
+
+	memset(&file_header, 0, sizeof(file_header));
+	file_header.magic = S_UDP_RECORD_MAGIC;
+	file_header.record_size = sizeof(s_udp_record_t);
+
+	if (write(fd, &file_header, sizeof(file_header)) != sizeof(file_header)) {
+		perror(file_name);
+		exit(255);
+	}
+	return fd;
+}
+
+static uint64_t get_timestamp(struct msghdr* message)
+{
+	struct cmsghdr* cmsg = 0;
+	struct timespec tp;
+
+	for (cmsg = CMSG_FIRSTHDR(message); cmsg; cmsg = CMSG_NXTHDR(message, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(&tp, CMSG_DATA(cmsg), sizeof(tp));
+			return ((uint64_t) tp.tv_sec) * 1000000000LL + (uint64_t) tp.tv_nsec;
+		}
+	}
+
+	// No kernel timestamp. Fall back to user space.
+	clock_gettime(CLOCK_REALTIME, &tp);
+	return ((uint64_t) tp.tv_sec) * 1000000000LL + (uint64_t) tp.tv_nsec;
+}
+
+void record_data(s_udp_channel_t* channel, int output_fd)
+{
+	static uint8_t packets[RECV_BATCH][S_UDP_MAX_PAYLOAD + 20];
+	static uint8_t controls[RECV_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+	struct mmsghdr messages[RECV_BATCH];
+	struct iovec iovs[RECV_BATCH];
+	write_buffer_t buf;
+	struct pollfd pfd;
+	uint64_t record_count = 0;
+	int32_t socket_des = -1;
+	int ind = 0;
+
+	buf.fd = output_fd;
+	buf.length = 0;
+	buf.data = malloc(WRITE_BUFFER_SIZE);
+	if (!buf.data) {
+		perror("malloc");
+		exit(255);
+	}
+
+	s_udp_get_socket_descriptor(channel, &socket_des);
+	pfd.fd = socket_des;
+	pfd.events = POLLIN;
+
+	while(!stop) {
+		int count = 0;
+
+		for (ind = 0; ind < RECV_BATCH; ++ind) {
+			iovs[ind].iov_base = packets[ind];
+			iovs[ind].iov_len = sizeof(packets[ind]);
+			memset(&messages[ind], 0, sizeof(messages[ind]));
+			messages[ind].msg_hdr.msg_iov = &iovs[ind];
+			messages[ind].msg_hdr.msg_iovlen = 1;
+			messages[ind].msg_hdr.msg_control = controls[ind];
+			messages[ind].msg_hdr.msg_controllen = sizeof(controls[ind]);
+		}
+
+		// The channel socket is non-blocking.
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror("poll");
+			exit(255);
+		}
+
+		count = recvmmsg(socket_des, messages, RECV_BATCH, MSG_WAITFORONE, 0);
+
+		if (count < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+
+			perror("recvmmsg");
+			exit(255);
+		}
+
+		for (ind = 0; ind < count; ++ind) {
+			s_udp_header_t header;
+			s_udp_record_t record;
+
+			if (s_udp_decode_header(channel,
+									packets[ind],
+									messages[ind].msg_len,
+									&header) != S_UDP_OK)
+				continue;
+
+			if (header.slot == 0) {
+				s_udp_process_master_packet(channel, &header,
+											packets[ind] + header.header_length,
+											messages[ind].msg_len - header.header_length);
+				continue;
+			}
+
+			record.timestamp = get_timestamp(&messages[ind].msg_hdr);
+			record.transaction_id = header.transaction_id;
+			record.clock = header.clock;
+			record.slot = header.slot | (header.flags & S_UDP_FLAG_COMPRESSED);
+			record.payload_length = messages[ind].msg_len - header.header_length;
+
+			append_record(&buf, &record, packets[ind] + header.header_length);
+			record_count++;
+		}
+	}
+
+	flush_buffer(&buf);
+	free(buf.data);
+	fprintf(stderr, "Recorded %lu packets\n", record_count);
+}
+
+
+int main(int argc, char* argv[])
+{
+	s_udp_channel_t channel;
+	struct sigaction act;
+	char record_file[256];
+	int32_t socket_des = -1;
+	uint32_t flag = 1;
+	int write_fd = -1;
+	uint32_t slots_per_group = 0;
+	int opt;
+
+	record_file[0] = 0;
+	while ((opt = getopt(argc, argv, "f:G:")) != -1) {
+		switch (opt) {
+		case 'f':
+			strncpy(record_file, optarg, sizeof(record_file));
+			record_file[sizeof(record_file)-1] = 0;
+			break;
+
+		case 'G':
+			slots_per_group = atoi(optarg);
+			break;
+
+		default: /* '?' */
+			usage(argv[0]);
+			exit(255);
+		}
+	}
+
+	if (!record_file[0]) {
+		fprintf(stderr, "Please specify -f file_name\n\n");
+		usage(argv[0]);
+		exit(255);
+	}
+
+	if (s_udp_init_channel(&channel,
+						   0,
+						   CHANNEL_DEFAULT_ADDRESS,
+						   CHANNEL_DEFAULT_PORT,
+						   S_UDP_ALL_SLOTS) != S_UDP_OK)
+		exit(255);
+
+	if (slots_per_group && s_udp_set_slot_groups(&channel, slots_per_group) != S_UDP_OK)
+		exit(255);
+
+	if (s_udp_attach_channel(&channel) != S_UDP_OK)
+		exit(255);
+
+	s_udp_get_socket_descriptor(&channel, &socket_des);
+	if (setsockopt(socket_des, SOL_SOCKET, SO_TIMESTAMPNS, &flag, sizeof(flag)) < 0)
+		perror("setsockopt(SO_TIMESTAMPNS)");
+
+	// Interrupt recvmmsg() on ctrl-c so that we can flush.
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = on_signal;
+	sigaction(SIGINT, &act, 0);
+	sigaction(SIGTERM, &act, 0);
+
+	write_fd = open_capture_file(record_file);
+	record_data(&channel, write_fd);
+	close(write_fd);
+
+	s_udp_destroy_channel(&channel);
+}
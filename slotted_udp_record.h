@@ -0,0 +1,42 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP capture file format header file
+
+   A capture file is a file header followed by records appended
+   in receive order. All fields are in host byte order, and every
+   record starts at an 8 byte boundary so that the file can be
+   mmap()ed and read in place.
+
+   Each record is a s_udp_record_t followed by payload_length bytes
+   of payload, padded to S_UDP_RECORD_ALIGN.
+*/
+
+#include <stdint.h>
+
+#define S_UDP_RECORD_MAGIC 0x3143455250445553ULL // "SUDPREC1"
+#define S_UDP_RECORD_ALIGN 8
+
+// Size of a record carrying payload_length bytes
+#define S_UDP_RECORD_SIZE(payload_length)						\
+	((sizeof(s_udp_record_t) + (payload_length) + S_UDP_RECORD_ALIGN - 1) & \
+	 ~((uint64_t) S_UDP_RECORD_ALIGN - 1))
+
+typedef struct _s_udp_record_file_t {
+	uint64_t magic;          // S_UDP_RECORD_MAGIC
+	uint32_t record_size;    // sizeof(s_udp_record_t), for forward compatibility.
+	uint32_t reserved;
+} s_udp_record_file_t;
+
+typedef struct _s_udp_record_t {
+	uint64_t timestamp;      // Kernel receive timestamp, in nsec (CLOCK_REALTIME).
+	uint64_t transaction_id; // Transaction ID as sent. Wraps for compact headers.
+	uint64_t clock;          // Master clock of sender, in usec.
+	uint32_t slot;           // Slot, with S_UDP_FLAG_COMPRESSED kept if set.
+	uint32_t payload_length; // Number of payload bytes following this record.
+} s_udp_record_t;
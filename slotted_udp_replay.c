@@ -0,0 +1,207 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP traffic replay program
+*/
+
+#include "slotted_udp.h"
+#include "slotted_udp_record.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+
+#define CHANNEL_DEFAULT_ADDRESS "224.0.0.123"
+#define CHANNEL_DEFAULT_PORT 49234
+#define SPIN_THRESHOLD 100000 // Busy wait the last nsec before a packet is due
+
+void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s -f file_name [-x speed] [-t] [-G slots]\n", name);
+	fprintf(stderr, "  -f file_name     Capture file written by slotted_udp_record.\n\n");
+	fprintf(stderr, "  -x speed         Replay speed relative to original timing.\n");
+	fprintf(stderr, "                   0 replays as fast as possible. Default: 1\n\n");
+	fprintf(stderr, "  -t               Restamp clock with the current master clock.\n");
+	fprintf(stderr, "                   Waits for a master before replaying.\n\n");
+	fprintf(stderr, "  -G slots         Send each group of slots to a multicast group of\n");
+	fprintf(stderr, "                   its own, as the recorded nodes did.\n");
+}
+
+static uint64_t get_nsec(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return ((uint64_t) tp.tv_sec) * 1000000000LL + (uint64_t) tp.tv_nsec;
+}
+
+// Sleep until shortly before deadline, then spin for accuracy.
+static void wait_until(uint64_t deadline)
+{
+	uint64_t now = get_nsec();
+
+	if (deadline > now + SPIN_THRESHOLD) {
+		struct timespec tp;
+
+		tp.tv_sec = (deadline - SPIN_THRESHOLD) / 1000000000LL;
+		tp.tv_nsec = (deadline - SPIN_THRESHOLD) % 1000000000LL;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &tp, 0);
+	}
+
+	while(get_nsec() < deadline)
+		;
+}
+
+void replay_data(s_udp_channel_t* channel,
+				 const uint8_t* capture,
+				 uint64_t capture_length,
+				 double speed,
+				 uint8_t restamp)
+{
+	const s_udp_record_file_t* file_header = (const s_udp_record_file_t*) capture;
+	uint64_t pos = sizeof(*file_header);
+	uint64_t first_timestamp = 0;
+	uint64_t start = 0;
+	uint64_t packets = 0;
+	uint64_t bytes = 0;
+	uint64_t elapsed = 0;
+	int32_t socket_des = -1;
+	struct sockaddr_in address;
+
+	if (capture_length < sizeof(*file_header) ||
+		file_header->magic != S_UDP_RECORD_MAGIC ||
+		file_header->record_size != sizeof(s_udp_record_t)) {
+		fprintf(stderr, "Not a slotted udp capture file\n");
+		exit(255);
+	}
+
+	s_udp_get_socket_descriptor(channel, &socket_des);
+	start = get_nsec();
+
+	while(pos + sizeof(s_udp_record_t) <= capture_length) {
+		const s_udp_record_t* record = (const s_udp_record_t*) (capture + pos);
+		uint64_t size = S_UDP_RECORD_SIZE(record->payload_length);
+
+		if (pos + sizeof(s_udp_record_t) + record->payload_length > capture_length) {
+			fprintf(stderr, "Truncated record at offset %lu\n", pos);
+			break;
+		}
+
+		if (!packets)
+			first_timestamp = record->timestamp;
+
+		if (speed > 0)
+			wait_until(start + (uint64_t) ((record->timestamp - first_timestamp) / speed));
+
+		// Payload is sent straight from the mapping.
+		s_udp_get_slot_address(channel, record->slot & S_UDP_SLOT_MASK, &address);
+		s_udp_send_packet_raw(socket_des,
+							  &address,
+							  record->slot,
+							  record->transaction_id,
+							  restamp?s_udp_get_master_clock(channel):record->clock,
+							  (const uint8_t*) (record + 1),
+							  record->payload_length);
+		packets++;
+		bytes += record->payload_length;
+		pos += size;
+	}
+
+	elapsed = get_nsec() - start;
+	fprintf(stderr, "Replayed %lu packets, %lu bytes in %.3f sec. %.0f packets/sec\n",
+			packets, bytes, elapsed / 1e9,
+			elapsed?packets * 1e9 / elapsed:0.0);
+}
+
+
+int main(int argc, char* argv[])
+{
+	s_udp_channel_t channel;
+	char replay_file[256];
+	struct stat st;
+	uint8_t* capture = 0;
+	double speed = 1.0;
+	uint8_t restamp = 0;
+	uint32_t slots_per_group = 0;
+	int read_fd = -1;
+	int opt;
+
+	replay_file[0] = 0;
+	while ((opt = getopt(argc, argv, "f:x:tG:")) != -1) {
+		switch (opt) {
+		case 'f':
+			strncpy(replay_file, optarg, sizeof(replay_file));
+			replay_file[sizeof(replay_file)-1] = 0;
+			break;
+
+		case 'x':
+			speed = atof(optarg);
+			break;
+
+		case 't':
+			restamp = 1;
+			break;
+
+		case 'G':
+			slots_per_group = atoi(optarg);
+			break;
+
+		default: /* '?' */
+			usage(argv[0]);
+			exit(255);
+		}
+	}
+
+	if (!replay_file[0] || speed < 0) {
+		fprintf(stderr, "Please specify -f file_name and a positive speed\n\n");
+		usage(argv[0]);
+		exit(255);
+	}
+
+	read_fd = open(replay_file, O_RDONLY);
+	if (read_fd == -1 || fstat(read_fd, &st) == -1) {
+		perror(replay_file);
+		exit(255);
+	}
+
+	capture = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, read_fd, 0);
+	if (capture == MAP_FAILED) {
+		perror("mmap");
+		exit(255);
+	}
+	madvise(capture, st.st_size, MADV_SEQUENTIAL);
+
+	if (s_udp_init_channel(&channel,
+						   1,
+						   CHANNEL_DEFAULT_ADDRESS,
+						   CHANNEL_DEFAULT_PORT,
+						   0) != S_UDP_OK)
+		exit(255);
+
+	if (slots_per_group && s_udp_set_slot_groups(&channel, slots_per_group) != S_UDP_OK)
+		exit(255);
+
+	if (s_udp_attach_channel(&channel) != S_UDP_OK)
+		exit(255);
+
+	if (restamp) {
+		puts("Waiting for master");
+		s_udp_wait_for_channel_ready(&channel, -1);
+	}
+
+	replay_data(&channel, capture, st.st_size, speed, restamp);
+
+	munmap(capture, st.st_size);
+	close(read_fd);
+	s_udp_destroy_channel(&channel);
+}
@@ -0,0 +1,500 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP shared memory transport
+
+   Packets are written to a broadcast ring in a POSIX shared memory
+   segment, /s_udp_NAME, that all processes using the same NAME map.
+   Each packet, header included, is stored as it would have been
+   sent on the network, so the library decodes it the same way.
+
+   The ring holds _S_UDP_SHM_ENTRIES fixed size entries. Writers claim
+   packet number n by incrementing write_seq, and store it in entry
+   n % _S_UDP_SHM_ENTRIES. Each entry is a seqlock: its seq is 2n + 1
+   while packet n is being written, and 2n + 2 when it is complete.
+
+   Each reader keeps its own cursor, the number of the next packet to
+   read, in process memory. Writers never wait for readers. A reader
+   that falls more than a ring behind skips ahead, which shows up as
+   packet loss through the transaction ID.
+
+   Readers sleep on a futex in the segment, which writers bump and
+   wake after each packet.
+
+   The segment counts the channels that have it mapped. The last one
+   to detach removes it, so that the next run starts from a new ring.
+*/
+
+#include "slotted_udp.h"
+#include <unistd.h>
+#include <stdlib.h>
+#include <memory.h>
+#include <stdio.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define _S_UDP_SHM_MAGIC 0x324D485350445553ULL // "SUDPSHM2"
+#define _S_UDP_SHM_ENTRIES 1024
+#define _S_UDP_SHM_ENTRY_SIZE 2048 // Including the entry header.
+#define _S_UDP_SHM_HEADER_LENGTH 20 // Standard header, used by all master packets.
+#define _S_UDP_SHM_MAX_IOV 4
+
+typedef struct _s_udp_shm_entry_t {
+	uint64_t seq;            // 2n + 1 while packet n is written, 2n + 2 when done.
+	uint32_t length;         // Packet length, header included.
+	uint32_t reserved;
+	uint8_t data[_S_UDP_SHM_ENTRY_SIZE - 16];
+} s_udp_shm_entry_t;
+
+typedef struct _s_udp_shm_ring_t {
+	uint64_t magic;          // Set last by the creator.
+	uint32_t entry_count;
+	uint32_t entry_size;
+	uint64_t master_clock;   // Clock of the last master packet forwarded to the ring.
+	uint32_t users;          // Channels that have the segment mapped.
+	uint8_t pad0[36];
+
+	// Written by every writer. Kept on a cache line of its own.
+	uint64_t write_seq;      // Number of the next packet to be written.
+	uint32_t futex;          // Bumped after each packet.
+	uint32_t waiters;        // Readers sleeping on futex.
+	uint8_t pad1[48];
+
+	s_udp_shm_entry_t entries[_S_UDP_SHM_ENTRIES];
+} s_udp_shm_ring_t;
+
+typedef struct _s_udp_shm_t {
+	char name[NAME_MAX];     // Segment name, /s_udp_NAME.
+	uint8_t network;         // Senders also use the network.
+	s_udp_shm_ring_t* ring;
+	uint64_t cursor;         // Number of the next packet to read.
+} s_udp_shm_t;
+
+
+static long _futex(uint32_t* addr, int op, uint32_t val)
+{
+	return syscall(SYS_futex, addr, op, val, 0, 0, 0);
+}
+
+
+static void _shm_unmap(s_udp_shm_t* shm)
+{
+	munmap(shm->ring, sizeof(s_udp_shm_ring_t));
+	shm->ring = 0;
+}
+
+
+// Open and map the segment, creating and initializing it if we are
+// first. The creator counts itself as a user.
+static s_udp_err_t _shm_open_ring(s_udp_shm_t* shm, int* created)
+{
+	struct stat st;
+	int retry = 0;
+	int fd = shm_open(shm->name, O_RDWR | O_CREAT | O_EXCL, 0666);
+
+	*created = 1;
+	if (fd == -1 && errno == EEXIST) {
+		*created = 0;
+		fd = shm_open(shm->name, O_RDWR, 0666);
+	}
+
+	if (fd == -1) {
+		perror("s_udp_attach_channel(): shm_open()");
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	if (*created && ftruncate(fd, sizeof(s_udp_shm_ring_t)) == -1) {
+		perror("s_udp_attach_channel(): ftruncate()");
+		close(fd);
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	// Wait for the creator to size the segment.
+	while(!*created && (fstat(fd, &st) == -1 || st.st_size < sizeof(s_udp_shm_ring_t))) {
+		if (++retry > 1000) {
+			fprintf(stderr, "s_udp_attach_channel(): %s: Segment not initialized\n", shm->name);
+			close(fd);
+			return S_UDP_SUBSCRIPTION_FAILURE;
+		}
+		usleep(1000);
+	}
+
+	shm->ring = mmap(0, sizeof(s_udp_shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (shm->ring == MAP_FAILED) {
+		perror("s_udp_attach_channel(): mmap()");
+		shm->ring = 0;
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	if (*created) {
+		shm->ring->entry_count = _S_UDP_SHM_ENTRIES;
+		shm->ring->entry_size = _S_UDP_SHM_ENTRY_SIZE;
+		shm->ring->users = 1;
+		__atomic_store_n(&shm->ring->magic, _S_UDP_SHM_MAGIC, __ATOMIC_RELEASE);
+	}
+
+	for (retry = 0; __atomic_load_n(&shm->ring->magic, __ATOMIC_ACQUIRE) != _S_UDP_SHM_MAGIC; ++retry) {
+		if (retry > 1000) {
+			fprintf(stderr, "s_udp_attach_channel(): %s: Segment not initialized\n", shm->name);
+			_shm_unmap(shm);
+			return S_UDP_SUBSCRIPTION_FAILURE;
+		}
+		usleep(1000);
+	}
+
+	if (shm->ring->entry_count != _S_UDP_SHM_ENTRIES ||
+		shm->ring->entry_size != _S_UDP_SHM_ENTRY_SIZE) {
+		fprintf(stderr, "s_udp_attach_channel(): %s: Incompatible ring geometry\n", shm->name);
+		_shm_unmap(shm);
+		return S_UDP_SUBSCRIPTION_FAILURE;
+	}
+
+	return S_UDP_OK;
+}
+
+
+// Map the segment and count ourselves as a user of it.
+static s_udp_err_t _shm_map(s_udp_shm_t* shm)
+{
+	s_udp_err_t res = S_UDP_OK;
+	int created = 0;
+	int retry = 0;
+
+	while(1) {
+		if ((res = _shm_open_ring(shm, &created)) != S_UDP_OK)
+			return res;
+
+		if (created || __atomic_fetch_add(&shm->ring->users, 1, __ATOMIC_ACQ_REL) != 0)
+			break;
+
+		// No users left: the last one is removing the segment. Let
+		// go of it, and create a new one once it is gone.
+		__atomic_sub_fetch(&shm->ring->users, 1, __ATOMIC_ACQ_REL);
+		_shm_unmap(shm);
+
+		if (++retry > 1000) {
+			fprintf(stderr, "s_udp_attach_channel(): %s: Segment not removed\n", shm->name);
+			return S_UDP_SUBSCRIPTION_FAILURE;
+		}
+		usleep(1000);
+	}
+
+	// Start with the next packet written.
+	shm->cursor = __atomic_load_n(&shm->ring->write_seq, __ATOMIC_ACQUIRE);
+	return S_UDP_OK;
+}
+
+
+// Gather the message into the next ring entry and wake readers.
+static ssize_t _shm_write(s_udp_shm_ring_t* ring, const struct msghdr* message)
+{
+	s_udp_shm_entry_t* entry = 0;
+	uint32_t length = 0;
+	uint32_t ind = 0;
+	uint64_t seq = 0;
+
+	for (ind = 0; ind < message->msg_iovlen; ++ind)
+		length += message->msg_iov[ind].iov_len;
+
+	if (length > sizeof(entry->data)) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	seq = __atomic_fetch_add(&ring->write_seq, 1, __ATOMIC_RELAXED);
+	entry = &ring->entries[seq % _S_UDP_SHM_ENTRIES];
+
+	__atomic_store_n(&entry->seq, 2 * seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	entry->length = 0;
+	for (ind = 0; ind < message->msg_iovlen; ++ind) {
+		memcpy(entry->data + entry->length,
+			   message->msg_iov[ind].iov_base,
+			   message->msg_iov[ind].iov_len);
+		entry->length += message->msg_iov[ind].iov_len;
+	}
+
+	__atomic_store_n(&entry->seq, 2 * seq + 2, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&ring->futex, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiters, __ATOMIC_SEQ_CST))
+		_futex(&ring->futex, FUTEX_WAKE, INT_MAX);
+
+	return length;
+}
+
+
+// Copy the next packet into message. Fails with EAGAIN if there is none.
+static ssize_t _shm_read(s_udp_shm_t* shm, struct msghdr* message, int flags)
+{
+	s_udp_shm_ring_t* ring = shm->ring;
+
+	while(1) {
+		uint64_t write_seq = __atomic_load_n(&ring->write_seq, __ATOMIC_ACQUIRE);
+		s_udp_shm_entry_t* entry = 0;
+		uint64_t seq = 0;
+		uint32_t length = 0;
+		uint32_t copied = 0;
+		uint32_t ind = 0;
+
+		if (shm->cursor >= write_seq) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		// Overrun by writers. Skip to the oldest packet still in the ring.
+		if (write_seq - shm->cursor > _S_UDP_SHM_ENTRIES)
+			shm->cursor = write_seq - _S_UDP_SHM_ENTRIES;
+
+		entry = &ring->entries[shm->cursor % _S_UDP_SHM_ENTRIES];
+		seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+
+		// Claimed, but still being written. The writer wakes us.
+		if (seq < 2 * shm->cursor + 2) {
+			errno = EAGAIN;
+			return -1;
+		}
+
+		// Overwritten by a later packet.
+		if (seq > 2 * shm->cursor + 2) {
+			shm->cursor++;
+			continue;
+		}
+
+		length = entry->length;
+		if (length > sizeof(entry->data))
+			length = sizeof(entry->data);
+
+		for (ind = 0; ind < message->msg_iovlen && copied < length; ++ind) {
+			uint32_t chunk = length - copied;
+
+			if (chunk > message->msg_iov[ind].iov_len)
+				chunk = message->msg_iov[ind].iov_len;
+
+			memcpy(message->msg_iov[ind].iov_base, entry->data + copied, chunk);
+			copied += chunk;
+		}
+
+		// Did a writer lap us while copying?
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq) {
+			shm->cursor++;
+			continue;
+		}
+
+		shm->cursor++;
+		message->msg_flags = (copied < length)?MSG_TRUNC:0;
+		message->msg_namelen = 0;
+		return (flags & MSG_TRUNC)?length:copied;
+	}
+}
+
+
+// Record the clock of a master packet in the ring. Returns 1 if it
+// is newer than any master packet already there, 0 if it is not, or
+// if the message is not a master packet.
+static int _shm_claim_master(s_udp_shm_ring_t* ring,
+							 const struct msghdr* message,
+							 ssize_t length)
+{
+	const uint8_t* header = (const uint8_t*) message->msg_iov[0].iov_base;
+	uint64_t clock = 0;
+	uint64_t last = 0;
+
+	// Slot 0, S_UDP_CONTROL_SYNC. Reports from senders are only
+	// of interest to the master.
+	if (length < _S_UDP_SHM_HEADER_LENGTH ||
+		message->msg_iov[0].iov_len < _S_UDP_SHM_HEADER_LENGTH ||
+		*((uint32_t*) header) != 0)
+		return 0;
+
+	clock = be64toh(*((uint64_t*) (header + 12)));
+	last = __atomic_load_n(&ring->master_clock, __ATOMIC_RELAXED);
+
+	do {
+		if (clock <= last)
+			return 0;
+	} while(!__atomic_compare_exchange_n(&ring->master_clock, &last, clock, 0,
+										 __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 1;
+}
+
+
+// Forward a master packet received from the network to the ring,
+// unless it was written by a master, or forwarded by another sender,
+// on this host.
+static void _shm_forward_master(s_udp_shm_ring_t* ring,
+								const struct msghdr* message,
+								ssize_t length)
+{
+	struct iovec iov[_S_UDP_SHM_MAX_IOV];
+	struct msghdr forward;
+
+	if (message->msg_iovlen > _S_UDP_SHM_MAX_IOV ||
+		!_shm_claim_master(ring, message, length))
+		return;
+
+	// Only the received part of each buffer. A schedule, if any,
+	// follows the header.
+	memset(&forward, 0, sizeof(forward));
+	forward.msg_iov = iov;
+	for (forward.msg_iovlen = 0;
+		 length > 0 && forward.msg_iovlen < message->msg_iovlen;
+		 ++forward.msg_iovlen) {
+		iov[forward.msg_iovlen] = message->msg_iov[forward.msg_iovlen];
+		if (iov[forward.msg_iovlen].iov_len > length)
+			iov[forward.msg_iovlen].iov_len = length;
+
+		length -= iov[forward.msg_iovlen].iov_len;
+	}
+	_shm_write(ring, &forward);
+}
+
+
+static s_udp_err_t _shm_attach(void* ctx, s_udp_channel_t* channel)
+{
+	s_udp_shm_t* shm = (s_udp_shm_t*) ctx;
+	s_udp_err_t res = S_UDP_OK;
+
+	if ((res = _shm_map(shm)) != S_UDP_OK)
+		return res;
+
+	// Senders also reach network receivers, and hear the master.
+	if (shm->network && channel->is_sender)
+		return s_udp_socket_transport.attach(0, channel);
+
+	return S_UDP_OK;
+}
+
+
+static ssize_t _shm_sendmsg(void* ctx,
+							s_udp_channel_t* channel,
+							const struct msghdr* message,
+							int flags)
+{
+	s_udp_shm_t* shm = (s_udp_shm_t*) ctx;
+	ssize_t length = 0;
+	uint32_t ind = 0;
+
+	for (ind = 0; ind < message->msg_iovlen; ++ind)
+		length += message->msg_iov[ind].iov_len;
+
+	_shm_claim_master(shm->ring, message, length);
+	length = _shm_write(shm->ring, message);
+
+	if (channel->socket_des == -1)
+		return length;
+
+	// Packets too large for the ring still go to the network.
+	return s_udp_socket_transport.sendmsg(0, channel, message, flags);
+}
+
+
+static ssize_t _shm_recvmsg(void* ctx,
+							s_udp_channel_t* channel,
+							struct msghdr* message,
+							int flags)
+{
+	s_udp_shm_t* shm = (s_udp_shm_t*) ctx;
+	s_udp_shm_ring_t* ring = shm->ring;
+	ssize_t length = 0;
+
+	// Network senders read their socket, where the master is heard.
+	if (channel->socket_des != -1) {
+		length = s_udp_socket_transport.recvmsg(0, channel, message, flags);
+
+		if (length > 0)
+			_shm_forward_master(ring, message, length);
+
+		return length;
+	}
+
+	// Senders only read the ring to hear the master between their
+	// own sends, and must never block on it.
+	if (channel->is_sender)
+		flags |= MSG_DONTWAIT;
+
+	while(1) {
+		uint32_t futex = __atomic_load_n(&ring->futex, __ATOMIC_SEQ_CST);
+
+		if ((length = _shm_read(shm, message, flags)) >= 0 ||
+			(flags & MSG_DONTWAIT))
+			return length;
+
+		__atomic_add_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ring->futex, __ATOMIC_SEQ_CST) == futex &&
+			_futex(&ring->futex, FUTEX_WAIT, futex) == -1 &&
+			errno == EINTR) {
+			__atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+			return -1;
+		}
+		__atomic_sub_fetch(&ring->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+
+static void _shm_detach(void* ctx, s_udp_channel_t* channel)
+{
+	s_udp_shm_t* shm = (s_udp_shm_t*) ctx;
+
+	if (!shm)
+		return;
+
+	s_udp_socket_transport.detach(0, channel);
+
+	if (shm->ring) {
+		if (__atomic_sub_fetch(&shm->ring->users, 1, __ATOMIC_ACQ_REL) == 0)
+			shm_unlink(shm->name);
+
+		_shm_unmap(shm);
+	}
+
+	free(shm);
+	channel->transport_ctx = 0;
+}
+
+
+const s_udp_transport_t s_udp_shm_transport = {
+	_shm_attach,
+	_shm_sendmsg,
+	_shm_recvmsg,
+	_shm_detach
+};
+
+
+s_udp_err_t s_udp_shm_init(s_udp_channel_t* channel,
+						   const char* name,
+						   uint8_t network)
+{
+	s_udp_shm_t* shm = 0;
+
+	if (!channel || !name || !name[0] || strchr(name, '/') ||
+		strlen(name) + sizeof("/s_udp_") > NAME_MAX) {
+		fprintf(stderr, "s_udp_shm_init(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ADDRESS;
+	}
+
+	if (!(shm = calloc(1, sizeof(*shm)))) {
+		perror("s_udp_shm_init(): calloc()");
+		return S_UDP_BUFFER_TOO_SMALL;
+	}
+
+	snprintf(shm->name, sizeof(shm->name), "/s_udp_%s", name);
+	shm->network = network;
+
+	return s_udp_set_transport(channel, &s_udp_shm_transport, shm);
+}
@@ -0,0 +1,561 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP simulated network
+
+   See slotted_udp_sim.h for a description.
+*/
+
+#include "slotted_udp.h"
+#include "slotted_udp_sim.h"
+#include <stdlib.h>
+#include <memory.h>
+#include <stdio.h>
+#include <errno.h>
+
+// Local clocks start somewhere after this, so that they are
+// always ahead of the master clock, as s_udp_get_master_clock()
+// requires.
+#define _S_UDP_SIM_CLOCK_BASE 1000000000ULL
+#define _S_UDP_SIM_CLOCK_SPREAD 1000000ULL
+
+// Packet payload is shared by all copies delivered to nodes.
+struct _s_udp_sim_packet_t {
+	uint32_t ref_count;
+	uint32_t length;
+	uint32_t source;        // Sending node id
+	uint8_t data[];
+};
+
+// A packet copy on its way to, or queued on, a node.
+// A wakeup if packet is 0.
+struct _s_udp_sim_event_t {
+	uint64_t time;
+	s_udp_sim_node_t* node;
+	s_udp_sim_packet_t* packet;
+	s_udp_sim_event_t* next; // Node receive queue link.
+};
+
+// Sort keys are kept in the heap itself, so that sifting
+// does not touch the events.
+struct _s_udp_sim_heap_entry_t {
+	uint64_t time;
+	uint64_t seq;           // Orders events at the same time.
+	s_udp_sim_event_t* event;
+};
+
+
+// xorshift64*. Deterministic for a given seed.
+static uint64_t _random(s_udp_sim_t* sim)
+{
+	sim->seed ^= sim->seed >> 12;
+	sim->seed ^= sim->seed << 25;
+	sim->seed ^= sim->seed >> 27;
+	return sim->seed * 0x2545F4914F6CDD1DULL;
+}
+
+
+// Return a value in [0, 1)
+static double _random_unit(s_udp_sim_t* sim)
+{
+	return (_random(sim) >> 11) * (1.0 / (1ULL << 53));
+}
+
+
+static uint32_t _random_jitter(s_udp_sim_t* sim, uint32_t jitter)
+{
+	return jitter?_random(sim) % (jitter + 1):0;
+}
+
+
+static void _release_packet(s_udp_sim_packet_t* packet)
+{
+	if (packet && --packet->ref_count == 0)
+		free(packet);
+}
+
+
+// ----
+// Event heap
+// ----
+static uint8_t _event_before(const s_udp_sim_heap_entry_t* a, const s_udp_sim_heap_entry_t* b)
+{
+	return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+
+static s_udp_err_t _push_event(s_udp_sim_t* sim,
+							   s_udp_sim_node_t* node,
+							   uint64_t time,
+							   s_udp_sim_packet_t* packet)
+{
+	s_udp_sim_heap_entry_t entry;
+	s_udp_sim_event_t* event = 0;
+	uint32_t ind = 0;
+
+	if (sim->event_count == sim->event_size) {
+		uint32_t size = sim->event_size?sim->event_size * 2:1024;
+		s_udp_sim_heap_entry_t* events = realloc(sim->events, size * sizeof(*events));
+
+		if (!events) {
+			perror("s_udp_sim: realloc()");
+			return S_UDP_BUFFER_TOO_SMALL;
+		}
+		sim->events = events;
+		sim->event_size = size;
+	}
+
+	if (!(event = malloc(sizeof(*event)))) {
+		perror("s_udp_sim: malloc()");
+		return S_UDP_BUFFER_TOO_SMALL;
+	}
+
+	event->time = time;
+	event->node = node;
+	event->packet = packet;
+	event->next = 0;
+
+	entry.time = time;
+	entry.seq = sim->event_seq++;
+	entry.event = event;
+
+	// Sift up
+	ind = sim->event_count++;
+	while(ind > 0 && _event_before(&entry, &sim->events[(ind - 1) / 2])) {
+		sim->events[ind] = sim->events[(ind - 1) / 2];
+		ind = (ind - 1) / 2;
+	}
+	sim->events[ind] = entry;
+
+	return S_UDP_OK;
+}
+
+
+static s_udp_sim_event_t* _pop_event(s_udp_sim_t* sim)
+{
+	s_udp_sim_event_t* top = 0;
+	s_udp_sim_heap_entry_t last;
+	uint32_t ind = 0;
+
+	if (!sim->event_count)
+		return 0;
+
+	top = sim->events[0].event;
+	last = sim->events[--sim->event_count];
+
+	// Sift down
+	while(ind * 2 + 1 < sim->event_count) {
+		uint32_t child = ind * 2 + 1;
+
+		if (child + 1 < sim->event_count &&
+			_event_before(&sim->events[child + 1], &sim->events[child]))
+			child++;
+
+		if (!_event_before(&sim->events[child], &last))
+			break;
+
+		sim->events[ind] = sim->events[child];
+		ind = child;
+	}
+	sim->events[ind] = last;
+
+	return top;
+}
+
+
+// Queue a delivered packet on its node.
+static void _enqueue(s_udp_sim_event_t* event)
+{
+	s_udp_sim_node_t* node = event->node;
+
+	event->next = 0;
+	if (node->rx_tail)
+		node->rx_tail->next = event;
+	else
+		node->rx_head = event;
+
+	node->rx_tail = event;
+	node->rx_count++;
+}
+
+
+// Deliver packets due at or before until, and advance virtual time to it.
+// Wakeups that fall due are put back to be returned by s_udp_sim_next().
+static void _advance(s_udp_sim_t* sim, uint64_t until)
+{
+	s_udp_sim_event_t* wakeups = 0;
+	s_udp_sim_event_t* event = 0;
+
+	while(sim->event_count && sim->events[0].time <= until) {
+		event = _pop_event(sim);
+
+		if (event->packet) {
+			_enqueue(event);
+			continue;
+		}
+
+		event->next = wakeups;
+		wakeups = event;
+	}
+
+	if (until > sim->now)
+		sim->now = until;
+
+	while((event = wakeups)) {
+		wakeups = event->next;
+		_push_event(sim, event->node, event->time, 0);
+		free(event);
+	}
+}
+
+
+// ----
+// Transport
+// ----
+static s_udp_err_t _sim_attach(void* ctx, s_udp_channel_t* channel)
+{
+	s_udp_sim_node_t* node = (s_udp_sim_node_t*) ctx;
+
+	node->attached = 1;
+	return S_UDP_OK;
+}
+
+
+static ssize_t _sim_sendmsg(void* ctx,
+							s_udp_channel_t* channel,
+							const struct msghdr* message,
+							int flags)
+{
+	s_udp_sim_node_t* node = (s_udp_sim_node_t*) ctx;
+	s_udp_sim_t* sim = node->sim;
+	const struct sockaddr_in* address = (const struct sockaddr_in*) message->msg_name;
+	s_udp_sim_packet_t* packet = 0;
+	uint64_t tx_time = 0;
+	uint32_t length = 0;
+	uint32_t ind = 0;
+
+	if (!node->attached || !address) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	for (ind = 0; ind < message->msg_iovlen; ++ind)
+		length += message->msg_iov[ind].iov_len;
+
+	if (!(packet = malloc(sizeof(*packet) + length))) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	packet->ref_count = 1; // Released at the end of this function.
+	packet->length = 0;
+	packet->source = node->id;
+	for (ind = 0; ind < message->msg_iovlen; ++ind) {
+		memcpy(packet->data + packet->length,
+			   message->msg_iov[ind].iov_base,
+			   message->msg_iov[ind].iov_len);
+		packet->length += message->msg_iov[ind].iov_len;
+	}
+
+	// Account for the segment. Another node's packet still
+	// being transmitted is a collision.
+	if (sim->bit_rate)
+		tx_time = ((uint64_t) length + 28) * 8 * 1000000 / sim->bit_rate;
+
+	if (sim->now < sim->busy_until && sim->busy_node != node->id)
+		sim->collisions++;
+
+	if (sim->now + tx_time > sim->busy_until) {
+		sim->busy_until = sim->now + tx_time;
+		sim->busy_node = node->id;
+	}
+
+	node->sent++;
+	sim->sent++;
+
+	// Multicast to every node on the same group, ourselves included.
+	for (ind = 0; ind < sim->node_count; ++ind) {
+		s_udp_sim_node_t* dest = sim->nodes[ind];
+		uint64_t latency = 0;
+
+		if (!dest->attached ||
+			dest->channel->address.sin_addr.s_addr != address->sin_addr.s_addr ||
+			dest->channel->address.sin_port != address->sin_port)
+			continue;
+
+		// Looped back packets never touch the wire.
+		if (dest != node) {
+			if (_random_unit(sim) < node->link.loss ||
+				_random_unit(sim) < dest->link.loss) {
+				dest->dropped++;
+				sim->dropped++;
+				continue;
+			}
+
+			latency = tx_time +
+				node->link.latency + _random_jitter(sim, node->link.jitter) +
+				dest->link.latency + _random_jitter(sim, dest->link.jitter);
+		}
+
+		packet->ref_count++;
+		if (_push_event(sim, dest, sim->now + latency, packet) != S_UDP_OK) {
+			packet->ref_count--;
+			continue;
+		}
+		sim->delivered++;
+	}
+
+	_release_packet(packet);
+	return length;
+}
+
+
+static ssize_t _sim_recvmsg(void* ctx,
+							s_udp_channel_t* channel,
+							struct msghdr* message,
+							int flags)
+{
+	s_udp_sim_node_t* node = (s_udp_sim_node_t*) ctx;
+	s_udp_sim_event_t* event = node->rx_head;
+	s_udp_sim_packet_t* packet = 0;
+	uint32_t copied = 0;
+	uint32_t ind = 0;
+
+	if (!event) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	node->rx_head = event->next;
+	if (!node->rx_head)
+		node->rx_tail = 0;
+	node->rx_count--;
+	node->received++;
+
+	packet = event->packet;
+	message->msg_flags = 0;
+
+	// Scatter into the caller's buffers, like recvmsg().
+	for (ind = 0; ind < message->msg_iovlen && copied < packet->length; ++ind) {
+		uint32_t chunk = packet->length - copied;
+
+		if (chunk > message->msg_iov[ind].iov_len)
+			chunk = message->msg_iov[ind].iov_len;
+
+		memcpy(message->msg_iov[ind].iov_base, packet->data + copied, chunk);
+		copied += chunk;
+	}
+
+	if (copied < packet->length)
+		message->msg_flags |= MSG_TRUNC;
+
+	if (message->msg_name && message->msg_namelen >= sizeof(struct sockaddr_in)) {
+		memcpy(message->msg_name,
+			   &node->sim->nodes[packet->source]->source_address,
+			   sizeof(struct sockaddr_in));
+		message->msg_namelen = sizeof(struct sockaddr_in);
+	}
+
+	copied = (flags & MSG_TRUNC)?packet->length:copied;
+	_release_packet(packet);
+	free(event);
+
+	return copied;
+}
+
+
+static void _sim_detach(void* ctx, s_udp_channel_t* channel)
+{
+	s_udp_sim_node_t* node = (s_udp_sim_node_t*) ctx;
+	s_udp_sim_event_t* event = 0;
+
+	node->attached = 0;
+
+	while((event = node->rx_head)) {
+		node->rx_head = event->next;
+		_release_packet(event->packet);
+		free(event);
+	}
+	node->rx_tail = 0;
+	node->rx_count = 0;
+}
+
+
+const s_udp_transport_t s_udp_sim_transport = {
+	_sim_attach,
+	_sim_sendmsg,
+	_sim_recvmsg,
+	_sim_detach
+};
+
+
+// ----
+// Clock
+// ----
+static uint64_t _sim_now(void* ctx)
+{
+	s_udp_sim_node_t* node = (s_udp_sim_node_t*) ctx;
+	uint64_t now = node->sim->now;
+
+	return node->clock_base + now + (int64_t) now * node->drift_ppm / 1000000;
+}
+
+
+// Sleeping advances virtual time for all nodes, which only makes
+// sense for a single node driven outside of s_udp_sim_next().
+static void _sim_sleep(void* ctx, uint64_t usec)
+{
+	s_udp_sim_node_t* node = (s_udp_sim_node_t*) ctx;
+
+	_advance(node->sim, node->sim->now + usec);
+}
+
+
+const s_udp_clock_t s_udp_sim_clock = {
+	_sim_now,
+	_sim_sleep
+};
+
+
+s_udp_err_t s_udp_sim_init(s_udp_sim_t* sim,
+						   uint64_t seed,
+						   uint64_t bit_rate)
+{
+	if (!sim) {
+		fprintf(stderr, "s_udp_sim_init(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	memset(sim, 0, sizeof(*sim));
+
+	// xorshift state must not be 0.
+	sim->seed = seed?seed:0x9E3779B97F4A7C15ULL;
+	sim->bit_rate = bit_rate;
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_sim_destroy(s_udp_sim_t* sim)
+{
+	s_udp_sim_event_t* event = 0;
+	uint32_t ind = 0;
+
+	if (!sim) {
+		fprintf(stderr, "s_udp_sim_destroy(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	while((event = _pop_event(sim))) {
+		_release_packet(event->packet);
+		free(event);
+	}
+
+	for (ind = 0; ind < sim->node_count; ++ind) {
+		_sim_detach(sim->nodes[ind], sim->nodes[ind]->channel);
+		free(sim->nodes[ind]);
+	}
+
+	free(sim->nodes);
+	free(sim->events);
+	memset(sim, 0, sizeof(*sim));
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_sim_add_node(s_udp_sim_t* sim,
+							   s_udp_channel_t* channel,
+							   const s_udp_sim_link_t* link,
+							   int32_t drift_ppm,
+							   s_udp_sim_node_t** result)
+{
+	s_udp_sim_node_t** nodes = 0;
+	s_udp_sim_node_t* node = 0;
+
+	if (!sim || !channel || !link) {
+		fprintf(stderr, "s_udp_sim_add_node(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	nodes = realloc(sim->nodes, (sim->node_count + 1) * sizeof(*nodes));
+	node = calloc(1, sizeof(*node));
+
+	if (!nodes || !node) {
+		perror("s_udp_sim_add_node(): malloc()");
+		free(node);
+		if (nodes)
+			sim->nodes = nodes;
+		return S_UDP_BUFFER_TOO_SMALL;
+	}
+
+	sim->nodes = nodes;
+	node->sim = sim;
+	node->channel = channel;
+	node->id = sim->node_count;
+	node->link = *link;
+	node->drift_ppm = drift_ppm;
+	node->clock_base = _S_UDP_SIM_CLOCK_BASE + _random(sim) % _S_UDP_SIM_CLOCK_SPREAD;
+
+	node->source_address.sin_family = AF_INET;
+	node->source_address.sin_addr.s_addr = htonl(0x0A000000 | (node->id + 1));
+	node->source_address.sin_port = channel->address.sin_port;
+
+	sim->nodes[sim->node_count++] = node;
+
+	s_udp_set_transport(channel, &s_udp_sim_transport, node);
+	s_udp_set_clock(channel, &s_udp_sim_clock, node);
+
+	if (result)
+		*result = node;
+
+	return S_UDP_OK;
+}
+
+
+s_udp_err_t s_udp_sim_wake_at(s_udp_sim_node_t* node,
+							  uint64_t time)
+{
+	if (!node) {
+		fprintf(stderr, "s_udp_sim_wake_at(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	return _push_event(node->sim, node, time, 0);
+}
+
+
+s_udp_err_t s_udp_sim_next(s_udp_sim_t* sim,
+						   s_udp_sim_node_t** result)
+{
+	s_udp_sim_event_t* event = 0;
+
+	if (!sim || !result) {
+		fprintf(stderr, "s_udp_sim_next(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	if (!(event = _pop_event(sim)))
+		return S_UDP_TRY_AGAIN;
+
+	if (event->time > sim->now)
+		sim->now = event->time;
+
+	*result = event->node;
+
+	if (event->packet)
+		_enqueue(event);
+	else
+		free(event);
+
+	return S_UDP_OK;
+}
+
+
+uint32_t s_udp_sim_pending(s_udp_sim_node_t* node)
+{
+	return node?node->rx_count:0;
+}
@@ -0,0 +1,131 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP simulated network header file
+
+   A deterministic, discrete event network that channels can be
+   attached to instead of a socket. All channels in a simulation run
+   in one thread, on a virtual clock that advances from event to
+   event, so any number of nodes can be simulated faster than real
+   time. The same seed always gives the same run.
+
+   Each channel is a node with its own local clock, which runs at
+   a configurable drift from virtual time, and a link to a shared
+   multicast segment. A packet sent by a node is delivered to all
+   nodes attached to the same address and port, the sender
+   included, after the latency of the sending and the receiving
+   link, plus a random jitter from each. Each link drops packets
+   with its own probability.
+
+   The segment carries one packet at a time at a fixed bit rate.
+   Packets from different nodes that are on the segment at the same
+   time are counted as collisions. Packets are still delivered.
+
+   Usage:
+
+	s_udp_sim_init(&sim, seed, bit_rate);
+	s_udp_init_channel(&channel, ...);
+	s_udp_sim_add_node(&sim, &channel, &link, drift_ppm, &node);
+	s_udp_attach_channel(&channel);
+	node->user = ...;
+	s_udp_sim_wake_at(node, time);
+
+	while(s_udp_sim_next(&sim, &node) == S_UDP_OK) {
+		// node has been woken up, or has packets queued.
+		while(s_udp_sim_pending(node))
+			s_udp_receive_packet(node->channel, ...);
+		...
+	}
+
+   Include slotted_udp.h before this file.
+*/
+
+// A node's connection to the multicast segment.
+typedef struct _s_udp_sim_link_t {
+	uint32_t latency;       // Base one way latency, in usec.
+	uint32_t jitter;        // Random extra latency, 0 to jitter usec.
+	double loss;            // Probability of a packet being dropped. 0.0 - 1.0
+} s_udp_sim_link_t;
+
+typedef struct _s_udp_sim_packet_t s_udp_sim_packet_t;
+typedef struct _s_udp_sim_event_t s_udp_sim_event_t;
+typedef struct _s_udp_sim_heap_entry_t s_udp_sim_heap_entry_t;
+
+typedef struct _s_udp_sim_node_t {
+	struct _s_udp_sim_t* sim;
+	s_udp_channel_t* channel;
+	uint32_t id;            // Index in sim->nodes.
+	struct sockaddr_in source_address; // Address that receivers see, 10.x.y.z.
+	s_udp_sim_link_t link;
+	int32_t drift_ppm;      // Local clock rate error, in parts per million.
+	uint64_t clock_base;    // Local clock at virtual time 0.
+	uint8_t attached;       // Set by s_udp_attach_channel().
+	s_udp_sim_event_t* rx_head; // Delivered packets, oldest first.
+	s_udp_sim_event_t* rx_tail;
+	uint32_t rx_count;
+
+	uint64_t sent;          // Packets sent.
+	uint64_t received;      // Packets read by the channel.
+	uint64_t dropped;       // Packets to this node lost on a link.
+	void* user;             // Free for use by the caller.
+} s_udp_sim_node_t;
+
+typedef struct _s_udp_sim_t {
+	uint64_t now;           // Virtual time, in usec.
+	uint64_t seed;          // Random state.
+	uint64_t bit_rate;      // Segment bit rate, in bits/sec. 0 is infinite.
+	s_udp_sim_node_t** nodes;
+	uint32_t node_count;
+	s_udp_sim_heap_entry_t* events; // Heap, ordered on time, then insertion order.
+	uint32_t event_count;
+	uint32_t event_size;
+	uint64_t event_seq;
+
+	uint64_t busy_until;    // Virtual time that the segment becomes idle.
+	uint32_t busy_node;     // Node id of last packet on segment.
+	uint64_t sent;          // Packets sent by all nodes.
+	uint64_t delivered;     // Packet copies queued on nodes.
+	uint64_t dropped;       // Packet copies lost on links.
+	uint64_t collisions;    // Packets sent while the segment was busy with another node's packet.
+} s_udp_sim_t;
+
+extern const s_udp_transport_t s_udp_sim_transport;
+extern const s_udp_clock_t s_udp_sim_clock;
+
+// bit_rate is the segment bit rate in bits/sec, or 0 for
+// zero transmission time.
+extern s_udp_err_t s_udp_sim_init(s_udp_sim_t* sim,
+								  uint64_t seed,
+								  uint64_t bit_rate);
+
+// Free all nodes and queued packets. Channels must be destroyed first.
+extern s_udp_err_t s_udp_sim_destroy(s_udp_sim_t* sim);
+
+// Make channel, which has been initialized but not attached, a node
+// of sim. Its transport and clock are replaced with simulated ones.
+// The local clock of the node runs drift_ppm faster than virtual time.
+extern s_udp_err_t s_udp_sim_add_node(s_udp_sim_t* sim,
+									  s_udp_channel_t* channel,
+									  const s_udp_sim_link_t* link,
+									  int32_t drift_ppm,
+									  s_udp_sim_node_t** result);
+
+// Have s_udp_sim_next() return node at virtual time time, in usec.
+// Times in the past are treated as now.
+extern s_udp_err_t s_udp_sim_wake_at(s_udp_sim_node_t* node,
+									 uint64_t time);
+
+// Advance virtual time to the next event and store the node that
+// it concerns in result. Packets that arrive are queued on the
+// receiving node, to be read with s_udp_receive_packet().
+// Returns S_UDP_TRY_AGAIN if there are no more events.
+extern s_udp_err_t s_udp_sim_next(s_udp_sim_t* sim,
+								  s_udp_sim_node_t** result);
+
+// Number of packets queued on node.
+extern uint32_t s_udp_sim_pending(s_udp_sim_node_t* node);
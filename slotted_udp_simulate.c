@@ -0,0 +1,459 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP network simulation program
+
+   Runs a master, a number of senders and receivers on a simulated
+   network (see slotted_udp_sim.h), and reports slot collisions,
+   packet loss and clock synchronization.
+*/
+
+#include "slotted_udp.h"
+#include "slotted_udp_sim.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#define CHANNEL_DEFAULT_ADDRESS "224.0.0.123"
+#define CHANNEL_DEFAULT_PORT 49234
+#define DEFAULT_SENDERS 10
+#define DEFAULT_RECEIVERS 10
+#define DEFAULT_SLOT_WIDTH 1000           // usec
+#define DEFAULT_MASTER_INTERVAL 100000    // usec
+#define DEFAULT_DURATION 10               // sec
+#define DEFAULT_LATENCY 50                // usec
+#define DEFAULT_JITTER 10                 // usec
+#define DEFAULT_BIT_RATE 100000000ULL     // 100 Mbit/s
+#define DEFAULT_PAYLOAD_SIZE 64
+#define SEND_GUARD 10 // Wake up this many usec into a slot, as a scheduler would.
+
+typedef enum _actor_type_t {
+	ACTOR_MASTER,
+	ACTOR_SENDER,
+	ACTOR_RECEIVER
+} actor_type_t;
+
+typedef struct _actor_t {
+	actor_type_t type;
+	s_udp_channel_t channel;
+	s_udp_sim_node_t* node;
+	uint64_t next_wake;     // Virtual time of scheduled wakeup. 0 if none.
+	uint8_t aligned;        // Master: next wakeup is at the start of slot 0.
+	uint64_t synced_at;     // Virtual time that the master clock was first received.
+
+	uint64_t sent;
+	uint64_t send_errors;
+	uint64_t received;
+	uint64_t lost;
+	uint64_t out_of_sync;
+} actor_t;
+
+typedef struct _sim_args_t {
+	uint32_t senders;
+	uint32_t receivers;
+	uint32_t slot_width;
+	uint32_t switch_width;  // Slot width to switch to halfway through. 0 is none.
+	uint32_t interval;
+	uint32_t duration;
+	uint32_t payload_size;
+	int32_t drift;
+	uint64_t seed;
+	uint64_t bit_rate;
+	s_udp_sim_link_t link;
+} sim_args_t;
+
+
+void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s [-s senders] [-r receivers] [-w slot_width] [-i interval]\n", name);
+	fprintf(stderr, "          [-t duration] [-l latency] [-j jitter] [-L loss] [-d drift]\n");
+	fprintf(stderr, "          [-b bit_rate] [-p size] [-W slot_width] [-S seed] [-v]\n");
+	fprintf(stderr, "  -s senders       Number of senders, in slots 1-senders. Default: %d\n", DEFAULT_SENDERS);
+	fprintf(stderr, "  -r receivers     Number of receivers, spread over the slots. Default: %d\n", DEFAULT_RECEIVERS);
+	fprintf(stderr, "  -w slot_width    Slot width, in usec. Default: %d\n", DEFAULT_SLOT_WIDTH);
+	fprintf(stderr, "  -i interval      Master clock interval, in usec. Default: %d\n", DEFAULT_MASTER_INTERVAL);
+	fprintf(stderr, "  -t duration      Virtual seconds to simulate. Default: %d\n", DEFAULT_DURATION);
+	fprintf(stderr, "  -l latency       Link latency, in usec. Default: %d\n", DEFAULT_LATENCY);
+	fprintf(stderr, "  -j jitter        Link jitter, in usec. Default: %d\n", DEFAULT_JITTER);
+	fprintf(stderr, "  -L loss          Link loss, in percent. Default: 0\n");
+	fprintf(stderr, "  -d drift         Maximum clock drift of a node, in ppm. Default: 0\n");
+	fprintf(stderr, "  -b bit_rate      Segment bit rate, in bits/sec. 0 is infinite. Default: %llu\n",
+			DEFAULT_BIT_RATE);
+	fprintf(stderr, "  -p size          Payload size. Default: %d\n", DEFAULT_PAYLOAD_SIZE);
+	fprintf(stderr, "  -W slot_width    Have the master switch to slot_width halfway through.\n");
+	fprintf(stderr, "  -S seed          Random seed. Default: 1\n");
+	fprintf(stderr, "  -v               Show library messages.\n");
+}
+
+
+static void wake_at(actor_t* actor, uint64_t time)
+{
+	actor->next_wake = time;
+	s_udp_sim_wake_at(actor->node, time);
+}
+
+
+// Read all queued packets the way slotted_udp_record does, only
+// processing master packets. Avoids a message per packet for
+// other slots on nodes that do not care about them.
+static void drain_master(actor_t* actor)
+{
+	static uint8_t packet[S_UDP_MAX_PAYLOAD + 20];
+	struct msghdr message;
+	struct iovec iov;
+	s_udp_header_t header;
+	ssize_t length = 0;
+
+	while(s_udp_sim_pending(actor->node)) {
+		iov.iov_base = packet;
+		iov.iov_len = sizeof(packet);
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+
+		length = actor->channel.transport->recvmsg(actor->channel.transport_ctx,
+													&actor->channel, &message, 0);
+
+		if (length < 0 ||
+			s_udp_decode_header(&actor->channel, packet, length, &header) != S_UDP_OK ||
+			header.slot != 0 ||
+			actor->type == ACTOR_MASTER)
+			continue;
+
+		s_udp_process_master_packet(&actor->channel, &header,
+									packet + header.header_length,
+									length - header.header_length);
+	}
+}
+
+
+static void drain_receiver(actor_t* actor)
+{
+	static uint8_t buffer[S_UDP_MAX_PAYLOAD];
+	ssize_t length = 0;
+	uint32_t latency = 0;
+	uint8_t packet_loss_detected = 0;
+
+	while(s_udp_sim_pending(actor->node)) {
+		s_udp_err_t res = s_udp_receive_packet(&actor->channel,
+											   buffer,
+											   sizeof(buffer),
+											   &length,
+											   &latency,
+											   &packet_loss_detected);
+
+		if (res == S_UDP_OK) {
+			actor->received++;
+			actor->lost += packet_loss_detected;
+		} else if (res == S_UDP_OUT_OF_SYNC)
+			actor->out_of_sync++;
+	}
+}
+
+
+static void run_master(actor_t* actor, sim_args_t* args, uint64_t now)
+{
+	uint64_t wait = 0;
+
+	drain_master(actor);
+
+	if (now < actor->next_wake)
+		return;
+
+	// Align to the start of slot 0, as slotted_udp_master does.
+	if (!actor->aligned) {
+		s_udp_get_sleep_duration(&actor->channel, &wait);
+		actor->aligned = 1;
+		wake_at(actor, now + wait);
+		return;
+	}
+
+	s_udp_send_master_clock(&actor->channel);
+	actor->sent++;
+	actor->aligned = 0;
+
+	// Announced as slotted_udp_master -b does.
+	if (args->switch_width && !actor->channel.schedule_version &&
+		now >= (uint64_t) args->duration * 500000)
+		s_udp_set_schedule(&actor->channel, args->switch_width, 2 * (uint64_t) args->interval);
+
+	wake_at(actor, now + args->interval);
+}
+
+
+static void run_sender(actor_t* actor, sim_args_t* args, uint64_t now)
+{
+	static uint8_t payload[S_UDP_MAX_PAYLOAD];
+	uint64_t wait = 0;
+
+	drain_master(actor);
+
+	if (s_udp_is_channel_ready(&actor->channel) != S_UDP_OK)
+		return;
+
+	if (!actor->synced_at)
+		actor->synced_at = now;
+
+	if (actor->next_wake && now >= actor->next_wake) {
+		if (s_udp_send_packet_now(&actor->channel, payload, args->payload_size) == S_UDP_OK)
+			actor->sent++;
+		else
+			actor->send_errors++;
+
+		actor->next_wake = 0;
+	}
+
+	// Sleep until our next slot, as s_udp_wait_and_send_packet() does.
+	if (!actor->next_wake) {
+		s_udp_get_sleep_duration(&actor->channel, &wait);
+		wake_at(actor, now + wait + SEND_GUARD);
+	}
+}
+
+
+static int32_t random_drift(sim_args_t* args)
+{
+	if (!args->drift)
+		return 0;
+
+	return (int32_t) (random() % (2 * args->drift + 1)) - args->drift;
+}
+
+
+// Distance between the master clock of each sender and that of the master.
+static void get_clock_error(actor_t* actors, uint32_t count,
+							double* mean, uint64_t* max)
+{
+	uint64_t master_clock = s_udp_get_master_clock(&actors[0].channel);
+	uint64_t total = 0;
+	uint32_t synced = 0;
+	uint32_t ind = 0;
+
+	*max = 0;
+	for (ind = 1; ind < count; ++ind) {
+		uint64_t clock = s_udp_get_master_clock(&actors[ind].channel);
+		uint64_t error = 0;
+
+		if (!clock)
+			continue;
+
+		error = (clock > master_clock)?clock - master_clock:master_clock - clock;
+		total += error;
+		synced++;
+		if (error > *max)
+			*max = error;
+	}
+
+	*mean = synced?(double) total / synced:0.0;
+}
+
+
+int main(int argc, char* argv[])
+{
+	s_udp_sim_t sim;
+	s_udp_sim_node_t* node = 0;
+	sim_args_t args;
+	actor_t* actors = 0;
+	uint32_t actor_count = 0;
+	uint32_t slot_count = 0;
+	uint64_t end = 0;
+	uint64_t worst_error = 0;
+	uint64_t sample_at = 0;
+	uint64_t max_error = 0;
+	double mean_error = 0.0;
+	struct timespec wall_start;
+	struct timespec wall_stop;
+	double wall = 0.0;
+	uint8_t verbose = 0;
+	uint32_t ind = 0;
+	int opt;
+
+	args.senders = DEFAULT_SENDERS;
+	args.receivers = DEFAULT_RECEIVERS;
+	args.slot_width = DEFAULT_SLOT_WIDTH;
+	args.switch_width = 0;
+	args.interval = DEFAULT_MASTER_INTERVAL;
+	args.duration = DEFAULT_DURATION;
+	args.payload_size = DEFAULT_PAYLOAD_SIZE;
+	args.drift = 0;
+	args.seed = 1;
+	args.bit_rate = DEFAULT_BIT_RATE;
+	args.link.latency = DEFAULT_LATENCY;
+	args.link.jitter = DEFAULT_JITTER;
+	args.link.loss = 0.0;
+
+	while ((opt = getopt(argc, argv, "s:r:w:i:t:l:j:L:d:b:p:W:S:v")) != -1) {
+		switch (opt) {
+		case 's': args.senders = atoi(optarg); break;
+		case 'r': args.receivers = atoi(optarg); break;
+		case 'w': args.slot_width = atoi(optarg); break;
+		case 'i': args.interval = atoi(optarg); break;
+		case 't': args.duration = atoi(optarg); break;
+		case 'l': args.link.latency = atoi(optarg); break;
+		case 'j': args.link.jitter = atoi(optarg); break;
+		case 'L': args.link.loss = atof(optarg) / 100.0; break;
+		case 'd': args.drift = atoi(optarg); break;
+		case 'b': args.bit_rate = strtoull(optarg, 0, 0); break;
+		case 'p': args.payload_size = atoi(optarg); break;
+		case 'W': args.switch_width = atoi(optarg); break;
+		case 'S': args.seed = strtoull(optarg, 0, 0); break;
+		case 'v': verbose = 1; break;
+
+		default: /* '?' */
+			usage(argv[0]);
+			exit(255);
+		}
+	}
+
+	if (!args.senders || !args.slot_width || !args.interval ||
+		args.payload_size > S_UDP_MAX_PAYLOAD || args.drift < 0) {
+		fprintf(stderr, "Please specify at least one sender, a slot width and an interval\n\n");
+		usage(argv[0]);
+		exit(255);
+	}
+
+	// Slot mismatch and out of sync are reported by the library for
+	// every packet. Keep them out of the way unless asked for.
+	if (!verbose) {
+		if (!freopen("/dev/null", "w", stderr))
+			exit(255);
+		setvbuf(stderr, 0, _IOFBF, BUFSIZ);
+	}
+
+	srandom(args.seed);
+	s_udp_sim_init(&sim, args.seed, args.bit_rate);
+
+	slot_count = args.senders + 1;
+	actor_count = 1 + args.senders + args.receivers;
+	actors = calloc(actor_count, sizeof(actor_t));
+	if (!actors) {
+		perror("calloc");
+		exit(255);
+	}
+
+	for (ind = 0; ind < actor_count; ++ind) {
+		actor_t* actor = &actors[ind];
+		uint32_t slot = 0;
+
+		if (ind == 0)
+			actor->type = ACTOR_MASTER;
+		else if (ind <= args.senders) {
+			actor->type = ACTOR_SENDER;
+			slot = ind;
+		} else {
+			actor->type = ACTOR_RECEIVER;
+			slot = 1 + (ind - args.senders - 1) % args.senders;
+		}
+
+		if (s_udp_init_channel(&actor->channel,
+							   actor->type != ACTOR_RECEIVER,
+							   CHANNEL_DEFAULT_ADDRESS,
+							   CHANNEL_DEFAULT_PORT,
+							   slot) != S_UDP_OK)
+			exit(255);
+
+		// The master defines time, and does not drift.
+		if (s_udp_sim_add_node(&sim, &actor->channel, &args.link,
+							   ind?random_drift(&args):0, &actor->node) != S_UDP_OK ||
+			s_udp_attach_channel(&actor->channel) != S_UDP_OK)
+			exit(255);
+
+		actor->node->user = actor;
+	}
+
+	// Master clock starts at 1, since 0 means no clock.
+	actors[0].channel.slot_count = slot_count;
+	actors[0].channel.slot_width = args.slot_width;
+	actors[0].channel.master_clock_offset =
+		actors[0].channel.clock->now(actors[0].channel.clock_ctx) - 1;
+	wake_at(&actors[0], 0);
+
+	end = (uint64_t) args.duration * 1000000;
+	sample_at = args.interval;
+	clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+	while(s_udp_sim_next(&sim, &node) == S_UDP_OK && sim.now < end) {
+		actor_t* actor = (actor_t*) node->user;
+
+		switch(actor->type) {
+		case ACTOR_MASTER:
+			run_master(actor, &args, sim.now);
+			break;
+
+		case ACTOR_SENDER:
+			run_sender(actor, &args, sim.now);
+			break;
+
+		case ACTOR_RECEIVER:
+			drain_receiver(actor);
+			break;
+		}
+
+		// Track the worst clock error over the run.
+		if (sim.now >= sample_at) {
+			get_clock_error(actors, 1 + args.senders, &mean_error, &max_error);
+			if (max_error > worst_error)
+				worst_error = max_error;
+			sample_at += args.interval;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &wall_stop);
+	wall = (wall_stop.tv_sec - wall_start.tv_sec) +
+		(wall_stop.tv_nsec - wall_start.tv_nsec) / 1e9;
+
+	get_clock_error(actors, 1 + args.senders, &mean_error, &max_error);
+
+	{
+		uint64_t sent = 0, send_errors = 0, received = 0, lost = 0, out_of_sync = 0;
+		uint64_t last_sync = 0;
+		uint32_t unsynced = 0;
+
+		for (ind = 1; ind < actor_count; ++ind) {
+			sent += actors[ind].sent;
+			send_errors += actors[ind].send_errors;
+			received += actors[ind].received;
+			lost += actors[ind].lost;
+			out_of_sync += actors[ind].out_of_sync;
+
+			if (actors[ind].type != ACTOR_SENDER)
+				continue;
+
+			if (!actors[ind].synced_at)
+				unsynced++;
+			else if (actors[ind].synced_at > last_sync)
+				last_sync = actors[ind].synced_at;
+		}
+
+		printf("simulated:   %.3f sec in %.3f sec wall clock (%.1fx)\n",
+			   sim.now / 1e6, wall, wall > 0?sim.now / 1e6 / wall:0.0);
+		printf("nodes:       1 master, %u senders, %u receivers. slot_count[%u] slot_width[%u]\n",
+			   args.senders, args.receivers, slot_count, args.slot_width);
+		if (actors[0].channel.schedule_version)
+			printf("schedule:    slot_width[%u] from master clock [%.3f sec]\n",
+				   actors[0].channel.next_slot_width, actors[0].channel.schedule_switch / 1e6);
+		printf("network:     sent[%lu] delivered[%lu] dropped[%lu] collisions[%lu]\n",
+			   sim.sent, sim.delivered, sim.dropped, sim.collisions);
+		printf("senders:     sent[%lu] errors[%lu] unsynced[%u] last_synced_at[%.3f sec]\n",
+			   sent, send_errors, unsynced, last_sync / 1e6);
+		printf("receivers:   received[%lu] loss_detected[%lu] out_of_sync[%lu]\n",
+			   received, lost, out_of_sync);
+		printf("clock error: mean[%.1f usec] max[%lu usec] worst[%lu usec]\n",
+			   mean_error, max_error, worst_error);
+	}
+
+	for (ind = 0; ind < actor_count; ++ind)
+		s_udp_destroy_channel(&actors[ind].channel);
+
+	s_udp_sim_destroy(&sim);
+	free(actors);
+	return 0;
+}
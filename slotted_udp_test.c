@@ -18,32 +18,227 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
 
 #define CHANNEL_DEFAULT_ADDRESS "224.0.0.123"
 #define CHANNEL_DEFAULT_PORT 49234
+#define DEFAULT_PACKET_SIZE 1024
+#define SINK_BUFFER_SIZE (1024*1024) // Size of each output buffer
+#define SINK_BUFFER_COUNT 8          // Buffers that can be filled while writes are pending
+#define SINK_BUFFER_ALIGN 4096
+#define DRAIN_BUDGET 64              // Packets read per s_udp_drain() call
+#define TSC_RECALIBRATE_MSEC 1000    // See -T
+
+static volatile sig_atomic_t stop = 0;
+
+// Batched output to a file, written by a background thread.
+//
+// The receiver fills buffers in order and hands full ones over to
+// the writer thread, which writes all handed over buffers with a
+// single writev(). The receiver only blocks if all buffers are
+// waiting to be written.
+typedef struct _sink_t {
+	int fd;
+	uint8_t* buffers[SINK_BUFFER_COUNT];
+	uint32_t lengths[SINK_BUFFER_COUNT];
+	uint32_t head;          // Buffer being filled. Only advanced by receiver.
+	uint32_t tail;          // Next buffer to write. Only advanced by writer.
+	uint8_t done;           // Set when the receiver has handed over the last buffer.
+	uint64_t written;       // Number of bytes committed to the sink.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+} sink_t;
+
+// Sidecar index record written for each received packet with -i.
+typedef struct _index_record_t {
+	uint64_t transaction_id;
+	uint64_t offset;        // Offset of payload in output file.
+	uint32_t length;        // Payload length.
+	uint32_t latency;       // In usec.
+	uint8_t packet_loss_detected;
+	uint8_t reserved[7];
+} index_record_t;
 
 void usage(const char* name)
 {
-	fprintf(stderr, "Usage: %s -s [file_name] | -r [file_name]  [-S slot]\n", name);
+	fprintf(stderr, "Usage: %s -s [file_name] | -r [file_name] [-i index_file] [-a address] [-S slot] [-z] [-H format] [-p size] [-Z] [-R interval] [-X rt_spec] [-V count] [-C length] [-G slots] [-L bandwidth] [-M count] [-T]\n", name);
+	fprintf(stderr, "  -a address       Multicast address, shm:name[@address] for\n");
+	fprintf(stderr, "                   shared memory, or dual:path,path for two\n");
+	fprintf(stderr, "                   redundant paths. Default is %s\n\n", CHANNEL_DEFAULT_ADDRESS);
 	fprintf(stderr, "  -S slot          Attach to the given slot. Default is 1\n\n");
+	fprintf(stderr, "  -p size          Max payload bytes per packet. Default is %d\n\n", DEFAULT_PACKET_SIZE);
+	fprintf(stderr, "  -Z               Send file_name from an mmap() with MSG_ZEROCOPY.\n\n");
+	fprintf(stderr, "  -z               Compress sent payloads.\n\n");
+	fprintf(stderr, "  -R interval      Report slot utilization to the master every\n");
+	fprintf(stderr, "                   interval usec. For slotted_udp_master -b.\n\n");
+	fprintf(stderr, "  -X rt_spec       Real time profile for the I/O thread. Comma separated\n");
+	fprintf(stderr, "                   cpu=N, fifo=PRIORITY, mlock, busy_poll=USEC,\n");
+	fprintf(stderr, "                   rcvbuf=BYTES, sndbuf=BYTES, prio=SO_PRIORITY.\n\n");
+	fprintf(stderr, "  -V count         Send and receive each payload as count separate\n");
+	fprintf(stderr, "                   buffers, 1-%d, with the scatter-gather calls.\n\n", S_UDP_MAX_IOV);
+	fprintf(stderr, "  -C length        Send -p size messages coalesced into packets of\n");
+	fprintf(stderr, "                   up to length bytes. %d fits an Ethernet frame.\n\n", S_UDP_MTU_PAYLOAD);
+	fprintf(stderr, "  -G slots         Send each group of slots to a multicast group of\n");
+	fprintf(stderr, "                   its own, above the -a address. All nodes must agree.\n\n");
+	fprintf(stderr, "  -L bandwidth     Send in a slot leased from the master, -S if free,\n");
+	fprintf(stderr, "                   for bandwidth bytes/sec. 0 if not known.\n\n");
+	fprintf(stderr, "  -M count         Send file_name on each of count slots, -S and up,\n");
+	fprintf(stderr, "                   from one channel and one timing loop. One packet\n");
+	fprintf(stderr, "                   per slot and window, so sends are not batched.\n");
+	fprintf(stderr, "                   slotted_udp_bench -m slots measures batching.\n\n");
+	fprintf(stderr, "  -T               Read the local clock from the TSC. Falls back to\n");
+	fprintf(stderr, "                   CLOCK_MONOTONIC if the TSC cannot be trusted.\n\n");
+	fprintf(stderr, "  -H format        Header format to send with. One of\n");
+	fprintf(stderr, "                   standard, compact16 or compact32. Default is standard\n\n");
 	fprintf(stderr, "  -s [file_name]   Send file_name over the given slot.\n");
 	fprintf(stderr, "                   Use '-' to stream from stdin. End with ctrl-d.\n\n");
 	fprintf(stderr, "  -r file_name     Receive data from sender and write to file_name\n");
 	fprintf(stderr, "                   Use '-' to stream to stdout.\n\n");
+	fprintf(stderr, "  -i index_file    With -r file_name, write binary per packet metadata\n");
+	fprintf(stderr, "                   (transaction ID, offset, length, latency, loss) to index_file.\n\n");
 
-	fprintf(stderr, "FIXME: Command line arguments for port and address\n");
-	fprintf(stderr, "FIXME: Command line argument for max packet size\n");
+	fprintf(stderr, "FIXME: Command line argument for port\n");
 	fprintf(stderr, "FIXME: TDMA slotting for sender\n");
 }
 
-void send_data(s_udp_channel_t* channel, int input_fd)
+static uint64_t get_usec(void)
 {
-	uint8_t buffer[1024];
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return ((uint64_t) tp.tv_sec) * 1000000LL + (uint64_t) tp.tv_nsec / 1000LL;
+}
+
+static uint64_t get_cpu_usec(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL +
+		usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Send input_fd in packet_size chunks.
+//
+// If zerocopy is set, input_fd is mmap()ed and each chunk is sent
+// straight from the mapping with MSG_ZEROCOPY. The mapping is kept
+// until the kernel has reported all sends as complete.
+// Split length bytes of data into iov_count about equally sized
+// buffers in iov.
+static void split_iov(uint8_t* data,
+					  uint32_t length,
+					  uint32_t iov_count,
+					  struct iovec* iov)
+{
+	uint32_t ind = 0;
+
+	for (ind = 0; ind < iov_count; ++ind) {
+		uint32_t chunk = length / (iov_count - ind);
+
+		iov[ind].iov_base = data;
+		iov[ind].iov_len = chunk;
+		data += chunk;
+		length -= chunk;
+	}
+}
+
+// Queue packet_size messages read from input_fd until as much as
+// can be sent in one cycle is queued. A message that did not fit is
+// kept in buffer, with its length in held, for the next cycle.
+// Returns the number of bytes queued.
+static ssize_t queue_messages(s_udp_channel_t* channel,
+							  int input_fd,
+							  uint8_t* buffer,
+							  uint32_t packet_size,
+							  ssize_t* held)
+{
+	ssize_t queued = 0;
+	ssize_t rd_len = *held;
+
+	if (!rd_len)
+		rd_len = read(input_fd, buffer, packet_size);
+
+	while(rd_len > 0 && s_udp_queue_message(channel, buffer, rd_len) == S_UDP_OK) {
+		queued += rd_len;
+		rd_len = read(input_fd, buffer, packet_size);
+	}
+
+	*held = (rd_len > 0)?rd_len:0;
+	return queued;
+}
+
+// If our slot lease has run out, wait for a new one and return 1.
+static int renew_lease(s_udp_channel_t* channel)
+{
+	if (s_udp_is_channel_ready(channel) != S_UDP_NO_LEASE)
+		return 0;
+
+	fprintf(stderr, "Lease lost\n");
+	s_udp_wait_for_channel_ready(channel, -1);
+	fprintf(stderr, "Leased slot %u\n", channel->slot);
+	return 1;
+}
+
+
+void send_data(s_udp_channel_t* channel,
+			   int input_fd,
+			   uint32_t packet_size,
+			   uint8_t zerocopy,
+			   uint32_t iov_count)
+{
+	struct iovec iov[S_UDP_MAX_IOV];
+	uint8_t* buffer = malloc(packet_size);
+	uint8_t* mapping = 0;
+	uint64_t map_length = 0;
+	uint64_t map_offset = 0;
+	uint64_t sent_bytes = 0;
+	uint64_t start_usec = 0;
+	uint64_t start_cpu = 0;
+	uint64_t elapsed = 0;
+	uint64_t send_at = 0;
+	uint64_t now = 0;
+	uint32_t pending = 0;
+	uint32_t packets = 0;
 	ssize_t rd_len = 0;
+	ssize_t held = 0;
 	struct epoll_event ev;
 	int epoll_des;
-	int nfds =0;
 	int32_t send_wait = -1;
+	int32_t socket_des = -1;
+
+	if (!buffer) {
+		perror("malloc");
+		exit(255);
+	}
+
+	if (zerocopy) {
+		struct stat st;
+
+		if (fstat(input_fd, &st) == -1) {
+			perror("fstat");
+			exit(255);
+		}
+
+		map_length = st.st_size;
+		if (map_length) {
+			mapping = mmap(0, map_length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, input_fd, 0);
+
+			if (mapping == MAP_FAILED) {
+				perror("mmap");
+				exit(255);
+			}
+		}
+
+		if (s_udp_set_zerocopy(channel, 1) != S_UDP_OK)
+			exit(255);
+	}
 
 	epoll_des = epoll_create1(0);
 	if (epoll_des == -1) {
@@ -51,26 +246,41 @@ void send_data(s_udp_channel_t* channel, int input_fd)
 		exit(255);
 	}
 
-	ev.events = EPOLLIN;
-	ev.data.fd = channel->socket_des;
+	// Shared memory only channels have no socket to wait on.
+	if (s_udp_get_socket_descriptor(channel, &socket_des) == S_UDP_OK) {
+		ev.events = EPOLLIN;
+		ev.data.fd = socket_des;
 
-	if (epoll_ctl(epoll_des, EPOLL_CTL_ADD, channel->socket_des, &ev) == -1) {
-		perror("epoll_ctl: channel desc");
-		exit(EXIT_FAILURE);
+		if (epoll_ctl(epoll_des, EPOLL_CTL_ADD, socket_des, &ev) == -1) {
+			perror("epoll_ctl: channel desc");
+			exit(EXIT_FAILURE);
+		}
 	}
 
+	start_usec = get_usec();
+	start_cpu = get_cpu_usec();
+
 	// We need to read packet data from the channel to process
 	// slot 0 pacekts sent by the master.
 	while(1) {
 		uint64_t tmp_wait = 0;
-		ssize_t length = 0;
-		uint32_t latency = 0;
-		uint8_t packet_loss_detected = 0;
+		const uint8_t* payload = buffer;
+		s_udp_err_t res = S_UDP_OK;
 
+		if (zerocopy) {
+			payload = mapping + map_offset;
+			rd_len = map_length - map_offset;
+			if (rd_len > packet_size)
+				rd_len = packet_size;
 
-		rd_len = read(input_fd, buffer, sizeof(buffer));
+			map_offset += rd_len;
+		} else if (channel->coalesce_length)
+			rd_len = queue_messages(channel, input_fd, buffer, packet_size, &held);
+		else
+			rd_len = read(input_fd, buffer, packet_size);
 
-		if (rd_len == 0) {
+		// Messages left from the last window still need to go.
+		if (rd_len <= 0 && !channel->coalesce_used) {
 			puts("Done reading");
 			break;
 		}
@@ -79,39 +289,377 @@ void send_data(s_udp_channel_t* channel, int input_fd)
 		// for the send window to come into play?
 		printf("rd_len = %ld\n", rd_len);
 
-		s_udp_get_sleep_duration(channel, &tmp_wait);
+		// Woken up with less than half the send window left?
+		// Wait for the window of the next cycle instead.
+		do {
+			now = s_udp_get_master_clock(channel);
+			s_udp_get_sleep_duration(channel, &tmp_wait);
+			send_at = now + tmp_wait;
+
+			send_wait = (int32_t) (tmp_wait / 1000) + 1;
+			printf("Will wait %d msec. master_clock[%lu]\n",
+				   send_wait, now);
+
+			// Process everything queued on every wakeup until the send
+			// window opens. Master packets may move the master clock.
+			while((now = s_udp_get_master_clock(channel)) < send_at) {
+				// epoll_wait() has msec resolution.
+				if (socket_des == -1 || send_at - now < 1000)
+					usleep(send_at - now);
+				else if (epoll_wait(epoll_des, &ev, 1, (send_at - now) / 1000) == -1 &&
+						 errno != EINTR) {
+					perror("epoll_wait");
+					exit(EXIT_FAILURE);
+				}
+
+				while(s_udp_drain(channel, DRAIN_BUDGET, 0, 0, 0) == S_UDP_OK)
+					;
+
+				// Completions raise EPOLLERR until they are read.
+				if (zerocopy)
+					s_udp_reap_zerocopy(channel, 0, &pending);
+			}
+		} while(now - send_at > channel->slot_width / 2 || renew_lease(channel));
+
+		printf("Sending %ld bytes master_clock[%lu]\n", rd_len, now);
+
+		if (channel->coalesce_length) {
+			res = s_udp_flush_messages(channel, &packets);
+			printf("Sent %u coalesced packets\n", packets);
+
+			// The rest goes in the next window.
+			if (res == S_UDP_TRY_AGAIN)
+				res = S_UDP_OK;
+		} else if (iov_count > 1) {
+			split_iov((uint8_t*) payload, rd_len, iov_count, iov);
+
+			// Too many zero copy sends in flight? Wait for some to complete.
+			while((res = s_udp_send_packetv_now(channel, iov, iov_count)) == S_UDP_TRY_AGAIN)
+				s_udp_reap_zerocopy(channel, -1, &pending);
+		} else {
+			// Too many zero copy sends in flight? Wait for some to complete.
+			while((res = s_udp_send_packet_now(channel, payload, rd_len)) == S_UDP_TRY_AGAIN)
+				s_udp_reap_zerocopy(channel, -1, &pending);
+		}
 
-		send_wait = (int32_t) (tmp_wait / 1000) + 1;
-		printf("Will wait %d msec. master_clock[%lu]\n",
-			   send_wait, s_udp_get_master_clock(channel));
+		if (res == S_UDP_OK)
+			sent_bytes += rd_len;
 
-		nfds = epoll_wait(epoll_des, &ev, 1, send_wait);
-		if (nfds == -1) {
-			perror("epoll_wait");
-			exit(EXIT_FAILURE);
+		if (zerocopy)
+			s_udp_reap_zerocopy(channel, 0, &pending);
+	}
+
+	// The kernel may still reference the mapping.
+	if (zerocopy) {
+		s_udp_reap_zerocopy(channel, -1, &pending);
+		if (mapping)
+			munmap(mapping, map_length);
+	}
+
+	elapsed = get_usec() - start_usec;
+	fprintf(stderr, "Sent %lu bytes in %.3f sec: %.0f bytes/sec, %.1f%% CPU\n",
+			sent_bytes,
+			elapsed / 1e6,
+			elapsed?sent_bytes * 1e6 / elapsed:0.0,
+			elapsed?100.0 * (get_cpu_usec() - start_cpu) / elapsed:0.0);
+
+	free(buffer);
+	return;
+}
+
+
+// Send input_fd in packet_size chunks on each slot owned by channel,
+// one chunk per slot and cycle, from a single timing loop.
+void send_slots(s_udp_channel_t* channel,
+				int input_fd,
+				uint32_t packet_size)
+{
+	uint8_t* buffer = malloc(packet_size);
+	s_udp_pool_t pool;
+	uint64_t sent_bytes = 0;
+	uint64_t start_usec = 0;
+	uint64_t start_cpu = 0;
+	uint64_t elapsed = 0;
+	uint32_t sent = 0;
+	uint32_t ind = 0;
+	ssize_t rd_len = 0;
+
+	if (!buffer) {
+		perror("malloc");
+		exit(255);
+	}
+
+	if (s_udp_init_pool(&pool, 2 * channel->owned_slot_count, packet_size, 0) != S_UDP_OK)
+		exit(255);
+
+	start_usec = get_usec();
+	start_cpu = get_cpu_usec();
+
+	while((rd_len = read(input_fd, buffer, packet_size)) > 0) {
+		for (ind = 0; ind < channel->owned_slot_count; ++ind) {
+			s_udp_packet_t* packet = 0;
+
+			// A late wakeup may have left some slots unflushed. Those
+			// hold the last chunk, which was a full one.
+			while(!(packet = s_udp_alloc_packet(&pool))) {
+				s_udp_wait_and_flush_slots(channel, 1, &sent);
+				sent_bytes += (uint64_t) sent * packet_size;
+			}
+
+			memcpy(packet->payload, buffer, rd_len);
+			packet->length = rd_len;
+			s_udp_enqueue_slot_packet(channel, channel->owned_slots[ind].slot, packet);
 		}
 
-		printf("Sending %ld bytes master_clock[%lu]\n", rd_len,
-			   s_udp_get_master_clock(channel));
-		s_udp_send_packet_now(channel, buffer, rd_len);
-		
-		if (nfds == 1) {
-			//printf("Will read packet\n");
-			s_udp_receive_packet(channel,
-								 buffer,
-								 sizeof(buffer),
-								 &length,
-								 &latency,
-								 &packet_loss_detected);
+		// One window per slot. Master packets may move the master clock.
+		for (ind = 0; ind < channel->owned_slot_count; ++ind) {
+			while(s_udp_drain(channel, DRAIN_BUDGET, 0, 0, 0) == S_UDP_OK)
+				;
+
+			if (s_udp_wait_and_flush_slots(channel, 1, &sent) != S_UDP_OK)
+				exit(255);
+
+			sent_bytes += (uint64_t) sent * rd_len;
 		}
 	}
-	return;
+
+	puts("Done reading");
+
+	elapsed = get_usec() - start_usec;
+	fprintf(stderr, "Sent %lu bytes on %u slots in %.3f sec: %.0f bytes/sec, %.1f%% CPU\n",
+			sent_bytes,
+			channel->owned_slot_count,
+			elapsed / 1e6,
+			elapsed?sent_bytes * 1e6 / elapsed:0.0,
+			elapsed?100.0 * (get_cpu_usec() - start_cpu) / elapsed:0.0);
+
+	// Whatever is still queued is released with the channel.
+	free(buffer);
+}
+
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}
+
+static void* sink_writer(void* arg)
+{
+	sink_t* sink = (sink_t*) arg;
+	struct iovec iov[SINK_BUFFER_COUNT];
+
+	pthread_mutex_lock(&sink->lock);
+	while(1) {
+		uint32_t head = 0;
+		uint32_t tail = sink->tail;
+		int iov_count = 0;
+		int ind = 0;
+
+		while(sink->tail == sink->head && !sink->done)
+			pthread_cond_wait(&sink->cond, &sink->lock);
+
+		// The buffer at head is only handed over when done is set.
+		head = sink->done?sink->head + 1:sink->head;
+		if (tail == head)
+			break;
+
+		pthread_mutex_unlock(&sink->lock);
+
+		for (; tail != head; ++tail, ++iov_count) {
+			iov[iov_count].iov_base = sink->buffers[tail % SINK_BUFFER_COUNT];
+			iov[iov_count].iov_len = sink->lengths[tail % SINK_BUFFER_COUNT];
+		}
+
+		while(ind < iov_count) {
+			ssize_t wr_len = writev(sink->fd, iov + ind, iov_count - ind);
+
+			if (wr_len < 0) {
+				if (errno == EINTR)
+					continue;
+
+				perror("writev");
+				exit(255);
+			}
+
+			// Skip over what was written.
+			while(ind < iov_count && wr_len >= iov[ind].iov_len)
+				wr_len -= iov[ind++].iov_len;
+
+			if (ind < iov_count) {
+				iov[ind].iov_base = (uint8_t*) iov[ind].iov_base + wr_len;
+				iov[ind].iov_len -= wr_len;
+			}
+		}
+
+		pthread_mutex_lock(&sink->lock);
+		sink->tail = tail;
+		pthread_cond_broadcast(&sink->cond);
+	}
+	pthread_mutex_unlock(&sink->lock);
+	return 0;
+}
+
+static void sink_open(sink_t* sink, int fd)
+{
+	int ind = 0;
+
+	memset(sink, 0, sizeof(*sink));
+	sink->fd = fd;
+
+	for (ind = 0; ind < SINK_BUFFER_COUNT; ++ind) {
+		if (posix_memalign((void**) &sink->buffers[ind], SINK_BUFFER_ALIGN, SINK_BUFFER_SIZE)) {
+			perror("posix_memalign");
+			exit(255);
+		}
+	}
+
+	pthread_mutex_init(&sink->lock, 0);
+	pthread_cond_init(&sink->cond, 0);
+
+	if (pthread_create(&sink->thread, 0, sink_writer, sink)) {
+		perror("pthread_create");
+		exit(255);
+	}
+}
+
+// Return a pointer where at least length bytes can be stored.
+// Hands the current buffer over to the writer if it is too full.
+static uint8_t* sink_reserve(sink_t* sink, uint32_t length)
+{
+	uint32_t head = sink->head % SINK_BUFFER_COUNT;
+
+	if (sink->lengths[head] + length <= SINK_BUFFER_SIZE)
+		return sink->buffers[head] + sink->lengths[head];
+
+	pthread_mutex_lock(&sink->lock);
+	sink->head++;
+	pthread_cond_broadcast(&sink->cond);
+
+	// Wait for the next buffer to be written out.
+	while(sink->head - sink->tail >= SINK_BUFFER_COUNT)
+		pthread_cond_wait(&sink->cond, &sink->lock);
+	pthread_mutex_unlock(&sink->lock);
+
+	head = sink->head % SINK_BUFFER_COUNT;
+	sink->lengths[head] = 0;
+	return sink->buffers[head];
+}
+
+// Commit length bytes stored at the pointer returned by sink_reserve().
+static void sink_commit(sink_t* sink, uint32_t length)
+{
+	sink->lengths[sink->head % SINK_BUFFER_COUNT] += length;
+	sink->written += length;
+}
+
+// Write out everything and stop the writer.
+static void sink_close(sink_t* sink)
+{
+	int ind = 0;
+
+	pthread_mutex_lock(&sink->lock);
+	sink->done = 1;
+	pthread_cond_broadcast(&sink->cond);
+	pthread_mutex_unlock(&sink->lock);
+
+	pthread_join(sink->thread, 0);
+
+	for (ind = 0; ind < SINK_BUFFER_COUNT; ++ind)
+		free(sink->buffers[ind]);
+
+	pthread_mutex_destroy(&sink->lock);
+	pthread_cond_destroy(&sink->cond);
+}
+
+// Receive into batched output buffers that are written to output_fd
+// in the background. Per packet metadata is written to index_fd
+// as index_record_t entries, if index_fd is not -1.
+void recv_data_batched(s_udp_channel_t* channel,
+					   int output_fd,
+					   int index_fd,
+					   uint32_t iov_count)
+{
+	struct iovec iov[S_UDP_MAX_IOV];
+	sink_t output;
+	sink_t index;
+	struct sigaction act;
+	ssize_t rd_len = 0;
+	uint32_t latency = 0;
+	uint8_t packet_loss_detected = 0;
+
+	// Interrupt the receive on ctrl-c so that buffered data
+	// can be written out.
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = on_signal;
+	sigaction(SIGINT, &act, 0);
+	sigaction(SIGTERM, &act, 0);
+
+	sink_open(&output, output_fd);
+	if (index_fd != -1)
+		sink_open(&index, index_fd);
+
+	while(1) {
+		s_udp_err_t res = S_UDP_OK;
+		uint8_t* buffer = sink_reserve(&output, S_UDP_MAX_PAYLOAD);
+
+		// Receive straight into the output buffer.
+		if (iov_count > 1) {
+			split_iov(buffer, S_UDP_MAX_PAYLOAD, iov_count, iov);
+			res = s_udp_receive_packetv(channel,
+										iov,
+										iov_count,
+										&rd_len,
+										&latency,
+										&packet_loss_detected);
+		} else
+			res = s_udp_receive_packet(channel,
+									   buffer,
+									   S_UDP_MAX_PAYLOAD,
+									   &rd_len,
+									   &latency,
+									   &packet_loss_detected);
+
+		if (stop)
+			break;
+
+		// Packets of other slots share the group unless -G is given.
+		if (res == S_UDP_TRY_AGAIN || res == S_UDP_SLOT_MISMATCH)
+			continue;
+
+		if (rd_len == 0)
+			break;
+
+		if (res != S_UDP_OK) {
+			fprintf(stderr, "Packet receive failed: %s\n",
+					s_udp_error_string(res));
+			break;
+		}
+
+		if (index_fd != -1) {
+			index_record_t* record = (index_record_t*) sink_reserve(&index, sizeof(*record));
+
+			memset(record, 0, sizeof(*record));
+			record->transaction_id = channel->transaction_id;
+			record->offset = output.written;
+			record->length = rd_len;
+			record->latency = latency;
+			record->packet_loss_detected = packet_loss_detected;
+			sink_commit(&index, sizeof(*record));
+		}
+
+		sink_commit(&output, rd_len);
+	}
+
+	sink_close(&output);
+	if (index_fd != -1)
+		sink_close(&index);
 }
 
 
-void recv_data(s_udp_channel_t* channel, int output_fd)
+// Print received data, with per packet metadata, to stdout.
+void recv_data(s_udp_channel_t* channel)
 {
-	uint8_t buffer[1024];
+	static uint8_t buffer[S_UDP_MAX_PAYLOAD + 1];
 	ssize_t rd_len = 0;
 	uint32_t latency = 0;
 	uint8_t packet_loss_detected = 0;
@@ -121,14 +669,14 @@ void recv_data(s_udp_channel_t* channel, int output_fd)
 
 		res = s_udp_receive_packet(channel,
 								   buffer,
-								   sizeof(buffer),
+								   sizeof(buffer) - 1,
 								   &rd_len,
 								   &latency,
 								   &packet_loss_detected);
 
-		// This may have been loopback read, or a
-		// master packet that was internally processed.
-		if (res == S_UDP_TRY_AGAIN)
+		// This may have been loopback read, a master packet
+		// that was internally processed, or another slot.
+		if (res == S_UDP_TRY_AGAIN || res == S_UDP_SLOT_MISMATCH)
 			continue;
 		
 		if (rd_len == 0)
@@ -140,25 +688,14 @@ void recv_data(s_udp_channel_t* channel, int output_fd)
 			exit(255);
 		}
 
-		if (output_fd != 1) {
-			printf("t_id[%.9lu] lat[%.5u] len[%.4ld] p_loss[%c]\n",
-				   channel->transaction_id,
-				   latency,
-				   rd_len,
-				   packet_loss_detected?'Y':'N');
-
-			write(output_fd, buffer, rd_len);
-		}
-		else {
-			buffer[rd_len] = 0;
-			printf("t_id[%.9lu] lat[%.5u] len[%.4ld] p_loss[%c]: %s%c",
-				   channel->transaction_id,
-				   latency,
-				   rd_len,
-				   packet_loss_detected?'Y':'N',
-				   buffer,
-				   (buffer[rd_len-1]=='\n')?0:'\n');
-		}
+		buffer[rd_len] = 0;
+		printf("t_id[%.9lu] lat[%.5u] len[%.4ld] p_loss[%c]: %s%c",
+			   channel->transaction_id,
+			   latency,
+			   rd_len,
+			   packet_loss_detected?'Y':'N',
+			   buffer,
+			   (buffer[rd_len-1]=='\n')?0:'\n');
 	}
 	return;
 }
@@ -170,12 +707,31 @@ int main(int argc, char* argv[])
 	int slot = 1;
 	int opt;
 	s_udp_channel_t channel;
+	s_udp_stats_t stats;
+	uint8_t compression = 0;
+	uint8_t zerocopy = 0;
+	uint32_t report_interval = 0;
+	uint32_t packet_size = DEFAULT_PACKET_SIZE;
+	uint32_t iov_count = 1;
+	uint32_t coalesce_length = 0;
+	uint32_t slots_per_group = 0;
+	int64_t lease_bandwidth = -1;
+	uint32_t slot_count = 0;
+	uint8_t use_tsc = 0;
+	s_udp_tsc_t tsc;
+	uint32_t ind = 0;
+	s_udp_header_format_t header_format = S_UDP_HEADER_STANDARD;
 	char recv_file[256];
 	char send_file[256];
+	char index_file[256];
+	char address[256] = CHANNEL_DEFAULT_ADDRESS;
+	s_udp_rt_config_t rt_config;
 
+	s_udp_init_rt_config(&rt_config);
 	recv_file[0] = 0;
 	send_file[0] = 0;
-	while ((opt = getopt(argc, argv, "s:r:S:")) != -1) {
+	index_file[0] = 0;
+	while ((opt = getopt(argc, argv, "s:r:S:zH:p:Zi:a:R:X:V:C:G:L:M:T")) != -1) {
 		switch (opt) {
 		case 'r':
 			is_sender = 0;
@@ -194,6 +750,82 @@ int main(int argc, char* argv[])
 			slot = atoi(optarg);
 			break;
 
+		case 'a':
+			strncpy(address, optarg, sizeof(address));
+			address[sizeof(address)-1] = 0;
+			break;
+
+		case 'z':
+			compression = 1;
+			break;
+
+		case 'Z':
+			zerocopy = 1;
+			break;
+
+		case 'R':
+			report_interval = atoi(optarg);
+			break;
+
+		case 'i':
+			strncpy(index_file, optarg, sizeof(index_file));
+			index_file[sizeof(index_file)-1] = 0;
+			break;
+
+		case 'p':
+			packet_size = atoi(optarg);
+			if (packet_size == 0 || packet_size > S_UDP_MAX_PAYLOAD) {
+				fprintf(stderr, "Packet size must be 1-%d\n", S_UDP_MAX_PAYLOAD);
+				exit(255);
+			}
+			break;
+
+		case 'V':
+			iov_count = atoi(optarg);
+			if (iov_count == 0 || iov_count > S_UDP_MAX_IOV) {
+				fprintf(stderr, "Buffer count must be 1-%d\n", S_UDP_MAX_IOV);
+				exit(255);
+			}
+			break;
+
+		case 'C':
+			coalesce_length = atoi(optarg);
+			break;
+
+		case 'G':
+			slots_per_group = atoi(optarg);
+			break;
+
+		case 'L':
+			lease_bandwidth = strtoul(optarg, 0, 10);
+			break;
+
+		case 'M':
+			slot_count = atoi(optarg);
+			break;
+
+		case 'T':
+			use_tsc = 1;
+			break;
+
+		case 'H':
+			if (!strcmp(optarg, "compact16"))
+				header_format = S_UDP_HEADER_COMPACT16;
+			else if (!strcmp(optarg, "compact32"))
+				header_format = S_UDP_HEADER_COMPACT32;
+			else if (strcmp(optarg, "standard")) {
+				usage(argv[0]);
+				exit(255);
+			}
+			break;
+
+		case 'X':
+			if (s_udp_parse_rt_config(optarg, &rt_config) != S_UDP_OK) {
+				usage(argv[0]);
+				exit(255);
+			}
+			break;
+
 		default: /* '?' */
 			usage(argv[0]);
 			exit(255);
@@ -205,19 +837,75 @@ int main(int argc, char* argv[])
 		usage(argv[0]);
 		exit(255);
 	}
+
+	if (coalesce_length && (zerocopy || packet_size + 2 > coalesce_length)) {
+		fprintf(stderr, "-C needs a length of at least -p size + 2, and cannot be used with -Z\n\n");
+		usage(argv[0]);
+		exit(255);
+	}
 		
 
+	if (slot_count && (!is_sender || zerocopy || compression || coalesce_length ||
+					   iov_count > 1 || lease_bandwidth >= 0)) {
+		fprintf(stderr, "-M needs -s, and cannot be used with -Z, -z, -V, -C or -L\n\n");
+		usage(argv[0]);
+		exit(255);
+	}
+
 	if (s_udp_init_channel(&channel,
 						   is_sender,
-						   CHANNEL_DEFAULT_ADDRESS,
+						   address,
 						   CHANNEL_DEFAULT_PORT,
 						   slot) != S_UDP_OK)
 			exit(255);
 
+	if (s_udp_set_rt_config(&channel, &rt_config) != S_UDP_OK)
+		exit(255);
+
+	if (use_tsc) {
+		if (s_udp_tsc_init(&tsc, TSC_RECALIBRATE_MSEC, 0) != S_UDP_OK ||
+			s_udp_set_clock(&channel, &s_udp_tsc_clock, &tsc) != S_UDP_OK)
+			exit(255);
+
+		if (tsc.fallback)
+			fprintf(stderr, "TSC clock: %s. Using CLOCK_MONOTONIC\n", tsc.fallback_reason);
+	}
+
+	if (slots_per_group && s_udp_set_slot_groups(&channel, slots_per_group) != S_UDP_OK)
+		exit(255);
+
+	if (lease_bandwidth >= 0 &&
+		(!is_sender || s_udp_request_lease(&channel, (uint32_t) lease_bandwidth) != S_UDP_OK)) {
+		fprintf(stderr, "-L needs -s\n\n");
+		usage(argv[0]);
+		exit(255);
+	}
+
+	for (ind = 0; ind < slot_count; ++ind)
+		if (s_udp_add_slot(&channel, slot + ind) != S_UDP_OK)
+			exit(255);
+
 	if (s_udp_attach_channel(&channel) != S_UDP_OK)
 		exit(255);
 
-	s_udp_wait_for_channel_ready(&channel);
+	if (s_udp_set_compression(&channel, compression) != S_UDP_OK)
+		exit(255);
+
+	if (s_udp_set_header_format(&channel, header_format) != S_UDP_OK)
+		exit(255);
+
+	if (report_interval && s_udp_set_report_interval(&channel, report_interval) != S_UDP_OK)
+		exit(255);
+
+	if (coalesce_length && s_udp_set_coalescing(&channel, coalesce_length) != S_UDP_OK)
+		exit(255);
+
+	puts("Waiting for master");
+	s_udp_wait_for_channel_ready(&channel, -1);
+	puts("We have master clock");
+
+	if (channel.node_id)
+		fprintf(stderr, "Leased slot %u\n", channel.slot);
 
 	if (is_sender) {
 		int read_fd = -1;
@@ -227,12 +915,16 @@ int main(int argc, char* argv[])
 			perror(send_file);
 			exit(255);
 		}
-		send_data(&channel, read_fd);
+		if (slot_count)
+			send_slots(&channel, read_fd, packet_size);
+		else
+			send_data(&channel, read_fd, packet_size, zerocopy, iov_count);
 
 		close(read_fd);
 	} else {
 
 		int write_fd = -1;
+		int index_fd = -1;
 
 		if (strcmp(recv_file, "-")) {
 			write_fd = creat(recv_file, 0666);
@@ -242,12 +934,60 @@ int main(int argc, char* argv[])
 				exit(255);
 			}
 
-		} else
-			write_fd = 1; // Stream to stdout.
+			if (index_file[0] && (index_fd = creat(index_file, 0666)) == -1) {
+				perror(index_file);
+				exit(255);
+			}
 
-		recv_data(&channel, write_fd);
+			recv_data_batched(&channel, write_fd, index_fd, iov_count);
+
+			if (index_fd != -1)
+				close(index_fd);
+			close(write_fd);
+		} else
+			recv_data(&channel); // Stream to stdout.
+	}
 
-		close(write_fd);
+	s_udp_get_stats(&channel, &stats);
+	if (stats.compress_in_bytes)
+		fprintf(stderr, "Compression: ratio[%.3f] %.3f ns/byte\n",
+				(double) stats.compress_in_bytes / stats.compress_out_bytes,
+				(double) stats.compress_nsec / stats.compress_in_bytes);
+
+	if (stats.coalesce_packets)
+		fprintf(stderr, "Coalescing: messages[%lu] packets[%lu] %.1f messages/packet\n",
+				stats.coalesce_messages, stats.coalesce_packets,
+				(double) stats.coalesce_messages / stats.coalesce_packets);
+
+	if (stats.foreign_packets)
+		fprintf(stderr, "Other slots: packets[%lu] read and dropped\n", stats.foreign_packets);
+
+	if (use_tsc && !tsc.fallback)
+		fprintf(stderr, "TSC clock: recalibrations[%lu] error last[%ld ns] max[%lu ns]\n",
+				tsc.calibrations, tsc.last_error_nsec, tsc.max_error_nsec);
+
+	if (stats.batch_calls)
+		fprintf(stderr, "Batched sends: calls[%lu] packets[%lu] %.1f packets/call\n",
+				stats.batch_calls, stats.batch_packets,
+				(double) stats.batch_packets / stats.batch_calls);
+
+	if (stats.zerocopy_sent)
+		fprintf(stderr, "Zero copy: sent[%lu] copied by kernel[%lu]\n",
+				stats.zerocopy_sent, stats.zerocopy_copied);
+
+	if (stats.decompress_out_bytes)
+		fprintf(stderr, "Decompression: ratio[%.3f] %.3f ns/byte\n",
+				(double) stats.decompress_out_bytes / stats.decompress_in_bytes,
+				(double) stats.decompress_nsec / stats.decompress_out_bytes);
+
+	for (ind = 0; ind < channel.path_count && channel.path_count > 1; ++ind) {
+		s_udp_path_stats_t path;
+
+		s_udp_get_path_stats(&channel, ind, &path);
+		fprintf(stderr, "Path %u: sent[%lu] send_errors[%lu] received[%lu] first[%lu] lost[%lu] latency[%.1f usec mean, %u max]\n",
+				ind, path.sent, path.send_errors, path.received, path.first, path.lost,
+				path.received?(double) path.latency_sum / path.received:0.0,
+				path.latency_max);
 	}
 	s_udp_destroy_channel(&channel);
 }
@@ -0,0 +1,334 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP TSC clock
+
+   A local clock that reads the time stamp counter instead of calling
+   clock_gettime(), scaled to CLOCK_MONOTONIC nsec:
+
+     nsec = base_nsec + ((tsc - base_tsc) * mult) >> 32
+
+   The rate is measured from the first calibration sample, so it gets
+   more accurate with every recalibration. At each recalibration, the
+   clock is compared with CLOCK_MONOTONIC, and the next scale starts
+   where the current one is, with a rate that makes up for the error
+   by the end of the next interval. The clock therefore never steps,
+   even though it can be ahead of or behind CLOCK_MONOTONIC by the
+   error last found.
+
+   Scales are double buffered. The thread that recalibrates fills in
+   the scale not in use, and then switches current over to it.
+   Readers never wait, and only one thread recalibrates at a time.
+*/
+
+#define _GNU_SOURCE
+#include "slotted_udp.h"
+#include <unistd.h>
+#include <memory.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#define _S_UDP_TSC_CALIBRATE_NSEC 10000000 // Length of each initial calibration.
+#define _S_UDP_TSC_MAX_RATE_PPM 500         // Allowed difference between initial calibrations.
+#define _S_UDP_TSC_MAX_ERROR_PPM 1000       // Allowed error, relative to the interval.
+#define _S_UDP_TSC_SAMPLE_TRIES 5
+
+
+static uint64_t _monotonic_nsec(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return ((uint64_t) tp.tv_sec) * 1000000000LL + (uint64_t) tp.tv_nsec;
+}
+
+
+#if defined(__x86_64__)
+
+static uint64_t _read_tsc(void)
+{
+	return __rdtsc();
+}
+
+
+// Invariant TSC: CPUID leaf 0x80000007, EDX bit 8.
+static uint8_t _is_tsc_invariant(void)
+{
+	unsigned int eax = 0;
+	unsigned int ebx = 0;
+	unsigned int ecx = 0;
+	unsigned int edx = 0;
+
+	if (__get_cpuid_max(0x80000000, 0) < 0x80000007)
+		return 0;
+
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	return (edx & (1 << 8))?1:0;
+}
+
+#else
+
+static uint64_t _read_tsc(void)
+{
+	return 0;
+}
+
+static uint8_t _is_tsc_invariant(void)
+{
+	return 0;
+}
+
+#endif
+
+
+// Read the TSC and CLOCK_MONOTONIC as close together as we can.
+// The TSC is the midpoint of the reads around the one that took
+// the fewest ticks.
+static void _sample(uint64_t* tsc, uint64_t* nsec)
+{
+	uint64_t best = ~0ULL;
+	uint32_t ind = 0;
+
+	for (ind = 0; ind < _S_UDP_TSC_SAMPLE_TRIES; ++ind) {
+		uint64_t before = _read_tsc();
+		uint64_t mono = _monotonic_nsec();
+		uint64_t after = _read_tsc();
+
+		if (after - before < best) {
+			best = after - before;
+			*tsc = before + (after - before) / 2;
+			*nsec = mono;
+		}
+	}
+}
+
+
+// nsec per tick from tsc_delta ticks over nsec_delta nsec,
+// in 32.32 fixed point.
+static uint64_t _get_mult(uint64_t tsc_delta, uint64_t nsec_delta)
+{
+	return (uint64_t) (((unsigned __int128) nsec_delta << 32) / tsc_delta);
+}
+
+
+static uint64_t _scale(const s_udp_tsc_scale_t* scale, uint64_t tsc)
+{
+	// Another thread may have started a new scale after we read tsc.
+	if (tsc < scale->base_tsc)
+		return scale->base_nsec -
+			(uint64_t) (((unsigned __int128) (scale->base_tsc - tsc) * scale->mult) >> 32);
+
+	return scale->base_nsec +
+		(uint64_t) (((unsigned __int128) (tsc - scale->base_tsc) * scale->mult) >> 32);
+}
+
+
+static void _fall_back(s_udp_tsc_t* tsc, const char* reason)
+{
+	tsc->fallback_reason = reason;
+	__atomic_store_n(&tsc->fallback, 1, __ATOMIC_RELEASE);
+}
+
+
+// Start the next scale at the current clock, with a rate that
+// cancels out its error against CLOCK_MONOTONIC over the next interval.
+static void _recalibrate(s_udp_tsc_t* tsc)
+{
+	const s_udp_tsc_scale_t* scale = 0;
+	s_udp_tsc_scale_t* next = 0;
+	uint64_t now_tsc = 0;
+	uint64_t now_nsec = 0;
+	uint64_t clock_nsec = 0;
+	uint64_t rate = 0;
+	uint64_t interval_ticks = 0;
+	uint64_t abs_error = 0;
+	int64_t error = 0;
+	int64_t correction = 0;
+	uint32_t current = 0;
+
+	if (__atomic_exchange_n(&tsc->recalibrating, 1, __ATOMIC_ACQUIRE))
+		return;
+
+	current = __atomic_load_n(&tsc->current, __ATOMIC_ACQUIRE);
+	scale = &tsc->scales[current];
+	next = &tsc->scales[current ^ 1];
+
+	_sample(&now_tsc, &now_nsec);
+
+	// Not synchronized between CPUs, or reset.
+	if (now_tsc < scale->base_tsc) {
+		_fall_back(tsc, "TSC ran backwards");
+		goto out;
+	}
+
+	clock_nsec = _scale(scale, now_tsc);
+	error = (int64_t) (clock_nsec - now_nsec);
+	abs_error = (error < 0)?-error:error;
+
+	tsc->calibrations++;
+	tsc->last_error_nsec = error;
+	if (abs_error > tsc->max_error_nsec)
+		tsc->max_error_nsec = abs_error;
+
+	// Allow for the resolution of the comparison over short intervals.
+	if (abs_error > (clock_nsec - scale->base_nsec) / (1000000 / _S_UDP_TSC_MAX_ERROR_PPM) &&
+		abs_error > 1000) {
+		_fall_back(tsc, "TSC drifted from CLOCK_MONOTONIC");
+		goto out;
+	}
+
+	rate = _get_mult(now_tsc - tsc->anchor_tsc, now_nsec - tsc->anchor_nsec);
+	interval_ticks = ((unsigned __int128) tsc->interval_nsec << 32) / rate;
+
+	// After a long time without reads, the error may take more
+	// than one interval to slew out.
+	correction = error;
+	if (correction > (int64_t) tsc->interval_nsec / 2)
+		correction = tsc->interval_nsec / 2;
+	else if (correction < -(int64_t) tsc->interval_nsec / 2)
+		correction = -(int64_t) tsc->interval_nsec / 2;
+
+	next->base_tsc = now_tsc;
+	next->base_nsec = clock_nsec;
+	next->mult = _get_mult(interval_ticks, tsc->interval_nsec - correction);
+	next->recalibrate_at = now_tsc + interval_ticks;
+
+	__atomic_store_n(&tsc->current, current ^ 1, __ATOMIC_RELEASE);
+
+out:
+	__atomic_store_n(&tsc->recalibrating, 0, __ATOMIC_RELEASE);
+}
+
+
+uint64_t s_udp_tsc_read_nsec(s_udp_tsc_t* tsc)
+{
+	const s_udp_tsc_scale_t* scale = 0;
+	uint64_t now_tsc = 0;
+
+	if (__atomic_load_n(&tsc->fallback, __ATOMIC_ACQUIRE))
+		return _monotonic_nsec();
+
+	now_tsc = _read_tsc();
+	scale = &tsc->scales[__atomic_load_n(&tsc->current, __ATOMIC_ACQUIRE)];
+
+	if (now_tsc >= scale->recalibrate_at) {
+		_recalibrate(tsc);
+
+		if (__atomic_load_n(&tsc->fallback, __ATOMIC_ACQUIRE))
+			return _monotonic_nsec();
+
+		scale = &tsc->scales[__atomic_load_n(&tsc->current, __ATOMIC_ACQUIRE)];
+	}
+
+	return _scale(scale, now_tsc);
+}
+
+
+static uint64_t _tsc_now(void* ctx)
+{
+	return s_udp_tsc_read_nsec((s_udp_tsc_t*) ctx) / 1000;
+}
+
+
+static void _tsc_sleep(void* ctx, uint64_t usec)
+{
+	s_udp_tsc_t* tsc = (s_udp_tsc_t*) ctx;
+	uint64_t wake_at = s_udp_tsc_read_nsec(tsc) + usec * 1000;
+
+	if (usec > tsc->spin_usec)
+		usleep(usec - tsc->spin_usec);
+
+	while(s_udp_tsc_read_nsec(tsc) < wake_at)
+#if defined(__x86_64__)
+		_mm_pause();
+#else
+		;
+#endif
+}
+
+
+const s_udp_clock_t s_udp_tsc_clock = {
+	_tsc_now,
+	_tsc_sleep
+};
+
+
+s_udp_err_t s_udp_tsc_init(s_udp_tsc_t* tsc,
+						   uint32_t recalibrate_msec,
+						   uint32_t spin_usec)
+{
+	struct timespec pause = { 0, _S_UDP_TSC_CALIBRATE_NSEC };
+	uint64_t tsc_sample[3];
+	uint64_t nsec_sample[3];
+	uint64_t first = 0;
+	uint64_t second = 0;
+	uint64_t interval_ticks = 0;
+	uint32_t ind = 0;
+
+	if (!tsc) {
+		fprintf(stderr, "s_udp_tsc_init(): Illegal argument\n");
+		return S_UDP_ILLEGAL_ARGUMENT;
+	}
+
+	memset(tsc, 0, sizeof(*tsc));
+	tsc->interval_nsec = (uint64_t) recalibrate_msec * 1000000;
+	tsc->spin_usec = spin_usec;
+
+#if !defined(__x86_64__)
+	_fall_back(tsc, "no TSC on this architecture");
+	return S_UDP_OK;
+#endif
+
+	if (!_is_tsc_invariant()) {
+		_fall_back(tsc, "TSC is not invariant");
+		return S_UDP_OK;
+	}
+
+	// Two back to back calibrations must agree on the rate.
+	for (ind = 0; ind < 3; ++ind) {
+		if (ind)
+			nanosleep(&pause, 0);
+
+		_sample(&tsc_sample[ind], &nsec_sample[ind]);
+	}
+
+	if (tsc_sample[1] <= tsc_sample[0] || tsc_sample[2] <= tsc_sample[1]) {
+		_fall_back(tsc, "TSC ran backwards");
+		return S_UDP_OK;
+	}
+
+	first = _get_mult(tsc_sample[1] - tsc_sample[0], nsec_sample[1] - nsec_sample[0]);
+	second = _get_mult(tsc_sample[2] - tsc_sample[1], nsec_sample[2] - nsec_sample[1]);
+
+	if ((first > second?first - second:second - first) >
+		first / (1000000 / _S_UDP_TSC_MAX_RATE_PPM)) {
+		_fall_back(tsc, "TSC rate is unstable");
+		return S_UDP_OK;
+	}
+
+	tsc->anchor_tsc = tsc_sample[0];
+	tsc->anchor_nsec = nsec_sample[0];
+
+	tsc->scales[0].base_tsc = tsc_sample[2];
+	tsc->scales[0].base_nsec = nsec_sample[2];
+	tsc->scales[0].mult = _get_mult(tsc_sample[2] - tsc_sample[0],
+									nsec_sample[2] - nsec_sample[0]);
+	tsc->scales[0].recalibrate_at = ~0ULL;
+
+	if (tsc->interval_nsec) {
+		interval_ticks = ((unsigned __int128) tsc->interval_nsec << 32) / tsc->scales[0].mult;
+		tsc->scales[0].recalibrate_at = tsc_sample[2] + interval_ticks;
+	}
+
+	return S_UDP_OK;
+}
@@ -0,0 +1,361 @@
+/*
+   Copyright (C) 2016, Jaguar Land Rover
+
+   This program is licensed under the terms and conditions of the
+   Mozilla Public License, version 2.0.  The full text of the
+   Mozilla Public License is at https://www.mozilla.org/MPL/2.0/
+
+
+   Slotted UDP typed channel benchmark program
+
+   Sends messages from one channel to another, in the same thread,
+   and compares hand written serialization against typed_channel.
+
+   manual: Each field is copied into a buffer, the buffer is sent
+           with s_udp_send_packet_now() and received with
+           s_udp_receive_packet(), and each field is copied back out.
+
+   typed:  The message is sent from where it is with
+           typed_channel::send(), and read in place through the
+           message_view returned by typed_channel::receive().
+
+   Both channels use a transport that hands each packet over in
+   memory, and a clock that stands still inside the send window of
+   the slot, so that only the cost of the library calls and the
+   copies is measured.
+*/
+
+#include "slotted_udp.hpp"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#define DEFAULT_ITERATIONS 1000000
+#define BENCH_ADDRESS "224.0.0.123"
+#define BENCH_PORT 49235
+#define BENCH_SLOT 1
+#define BENCH_SLOT_COUNT 4
+#define BENCH_SLOT_WIDTH 1000000
+#define BENCH_POOL_SLABS 16
+
+// Local clock of both channels, and master clock offset that puts
+// the master clock in the middle of the slot.
+#define BENCH_LOCAL_CLOCK 10000000
+#define BENCH_MASTER_CLOCK ((BENCH_SLOT + 1) * BENCH_SLOT_WIDTH - BENCH_SLOT_WIDTH / 2)
+
+// Telemetry record with a small fixed part and samples_count samples.
+template <uint32_t samples_count>
+struct telemetry_t {
+	uint32_t sequence;
+	uint32_t sensor_id;
+	uint32_t status;
+	float position[3];
+	float velocity[3];
+	int32_t samples[samples_count];
+};
+
+typedef telemetry_t<4> small_t;
+typedef telemetry_t<240> large_t;
+
+// Last packet sent, waiting to be received.
+typedef struct _loopback_t {
+	uint8_t data[S_UDP_MAX_PAYLOAD + s_udp::header_length];
+	ssize_t length;   // -1 if empty.
+} loopback_t;
+
+
+static uint64_t get_nsec(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return ((uint64_t) tp.tv_sec) * 1000000000LL + (uint64_t) tp.tv_nsec;
+}
+
+
+static s_udp_err_t loopback_attach(void* ctx, s_udp_channel_t* channel)
+{
+	return S_UDP_OK;
+}
+
+// A newer packet replaces one that has not been received, as the
+// join requests sent on attach are.
+static ssize_t loopback_sendmsg(void* ctx, s_udp_channel_t* channel,
+								const struct msghdr* message, int flags)
+{
+	loopback_t* loop = (loopback_t*) ctx;
+	size_t ind = 0;
+
+	loop->length = 0;
+	for (ind = 0; ind < message->msg_iovlen; ++ind) {
+		memcpy(loop->data + loop->length,
+			   message->msg_iov[ind].iov_base,
+			   message->msg_iov[ind].iov_len);
+		loop->length += message->msg_iov[ind].iov_len;
+	}
+
+	return loop->length;
+}
+
+static ssize_t loopback_recvmsg(void* ctx, s_udp_channel_t* channel,
+								struct msghdr* message, int flags)
+{
+	loopback_t* loop = (loopback_t*) ctx;
+	ssize_t length = loop->length;
+	ssize_t offset = 0;
+	size_t ind = 0;
+
+	if (length < 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	for (ind = 0; ind < message->msg_iovlen && offset < length; ++ind) {
+		size_t chunk = message->msg_iov[ind].iov_len;
+
+		if (chunk > (size_t) (length - offset))
+			chunk = length - offset;
+
+		memcpy(message->msg_iov[ind].iov_base, loop->data + offset, chunk);
+		offset += chunk;
+	}
+
+	loop->length = -1;
+	return (flags & MSG_TRUNC)?length:offset;
+}
+
+static void loopback_detach(void* ctx, s_udp_channel_t* channel)
+{
+}
+
+static const s_udp_transport_t loopback_transport = {
+	loopback_attach, loopback_sendmsg, loopback_recvmsg, loopback_detach
+};
+
+
+static uint64_t still_now(void* ctx)
+{
+	return BENCH_LOCAL_CLOCK;
+}
+
+static void still_sleep(void* ctx, uint64_t usec)
+{
+}
+
+static const s_udp_clock_t still_clock = { still_now, still_sleep };
+
+
+static void setup_channel(s_udp_channel_t* channel,
+						  uint8_t is_sender,
+						  loopback_t* loop,
+						  s_udp_pool_t* pool)
+{
+	if (s_udp_init_channel(channel, is_sender, BENCH_ADDRESS, BENCH_PORT, BENCH_SLOT) != S_UDP_OK ||
+		s_udp_set_transport(channel, &loopback_transport, loop) != S_UDP_OK ||
+		s_udp_set_clock(channel, &still_clock, 0) != S_UDP_OK ||
+		(pool && s_udp_set_pool(channel, pool) != S_UDP_OK) ||
+		s_udp_attach_channel(channel) != S_UDP_OK)
+		exit(255);
+
+	channel->slot_count = BENCH_SLOT_COUNT;
+	channel->slot_width = BENCH_SLOT_WIDTH;
+	channel->master_clock_offset = BENCH_LOCAL_CLOCK - BENCH_MASTER_CLOCK;
+}
+
+
+template <typename T>
+static void fill(T* message, uint32_t sequence)
+{
+	uint32_t ind = 0;
+
+	memset(message, 0, sizeof(*message));
+	message->sequence = sequence;
+	message->sensor_id = 7;
+	for (ind = 0; ind < 3; ++ind) {
+		message->position[ind] = ind * 1.5f;
+		message->velocity[ind] = ind * 0.25f;
+	}
+
+	for (ind = 0; ind < sizeof(message->samples) / sizeof(message->samples[0]); ++ind)
+		message->samples[ind] = ind;
+}
+
+
+// Hand written wire format: fields back to back, in declaration order.
+template <typename T>
+static uint32_t serialize(const T* message, uint8_t* buffer)
+{
+	uint8_t* cursor = buffer;
+
+	memcpy(cursor, &message->sequence, sizeof(message->sequence));
+	cursor += sizeof(message->sequence);
+	memcpy(cursor, &message->sensor_id, sizeof(message->sensor_id));
+	cursor += sizeof(message->sensor_id);
+	memcpy(cursor, &message->status, sizeof(message->status));
+	cursor += sizeof(message->status);
+	memcpy(cursor, message->position, sizeof(message->position));
+	cursor += sizeof(message->position);
+	memcpy(cursor, message->velocity, sizeof(message->velocity));
+	cursor += sizeof(message->velocity);
+	memcpy(cursor, message->samples, sizeof(message->samples));
+	cursor += sizeof(message->samples);
+	return cursor - buffer;
+}
+
+template <typename T>
+static void deserialize(const uint8_t* buffer, T* message)
+{
+	const uint8_t* cursor = buffer;
+
+	memcpy(&message->sequence, cursor, sizeof(message->sequence));
+	cursor += sizeof(message->sequence);
+	memcpy(&message->sensor_id, cursor, sizeof(message->sensor_id));
+	cursor += sizeof(message->sensor_id);
+	memcpy(&message->status, cursor, sizeof(message->status));
+	cursor += sizeof(message->status);
+	memcpy(message->position, cursor, sizeof(message->position));
+	cursor += sizeof(message->position);
+	memcpy(message->velocity, cursor, sizeof(message->velocity));
+	cursor += sizeof(message->velocity);
+	memcpy(message->samples, cursor, sizeof(message->samples));
+}
+
+
+// Returns elapsed nsec. Counts messages that did not arrive intact
+// in errors.
+template <typename T>
+static uint64_t run_manual(s_udp_channel_t* sender,
+						   s_udp_channel_t* receiver,
+						   uint32_t iterations,
+						   uint32_t* errors)
+{
+	static uint8_t send_buffer[sizeof(T)];
+	static uint8_t receive_buffer[sizeof(T)];
+	T message;
+	T received;
+	ssize_t length = 0;
+	uint32_t latency = 0;
+	uint8_t packet_loss_detected = 0;
+	uint64_t start = 0;
+	uint32_t ind = 0;
+
+	fill(&message, 0);
+	start = get_nsec();
+
+	for (ind = 0; ind < iterations; ++ind) {
+		message.sequence = ind;
+
+		if (s_udp_send_packet_now(sender, send_buffer, serialize(&message, send_buffer)) != S_UDP_OK ||
+			s_udp_receive_packet(receiver, receive_buffer, sizeof(receive_buffer), &length,
+								 &latency, &packet_loss_detected) != S_UDP_OK ||
+			length != sizeof(T)) {
+			(*errors)++;
+			continue;
+		}
+
+		deserialize(receive_buffer, &received);
+		if (received.sequence != ind)
+			(*errors)++;
+	}
+
+	return get_nsec() - start;
+}
+
+template <typename T>
+static uint64_t run_typed(s_udp_channel_t* sender,
+						  s_udp_channel_t* receiver,
+						  uint32_t iterations,
+						  uint32_t* errors)
+{
+	s_udp::typed_channel<T> tx(sender);
+	s_udp::typed_channel<T> rx(receiver);
+	s_udp::message_view<T> view;
+	T message;
+	uint64_t start = 0;
+	uint32_t ind = 0;
+
+	fill(&message, 0);
+	start = get_nsec();
+
+	for (ind = 0; ind < iterations; ++ind) {
+		message.sequence = ind;
+
+		if (tx.send(message) != S_UDP_OK ||
+			rx.receive(view) != S_UDP_OK) {
+			(*errors)++;
+			continue;
+		}
+
+		if (view->sequence != ind)
+			(*errors)++;
+	}
+
+	view.reset();
+	return get_nsec() - start;
+}
+
+
+template <typename T>
+static void bench(const char* name, uint32_t iterations)
+{
+	static loopback_t loop;
+	s_udp_channel_t sender;
+	s_udp_channel_t receiver;
+	s_udp_pool_t pool;
+	uint64_t manual_nsec = 0;
+	uint64_t typed_nsec = 0;
+	uint32_t errors = 0;
+
+	loop.length = -1;
+	if (s_udp_init_pool(&pool, BENCH_POOL_SLABS, s_udp::typed_channel<T>::slab_size, 0) != S_UDP_OK)
+		exit(255);
+
+	setup_channel(&sender, 1, &loop, 0);
+	setup_channel(&receiver, 0, &loop, &pool);
+
+	manual_nsec = run_manual<T>(&sender, &receiver, iterations, &errors);
+	typed_nsec = run_typed<T>(&sender, &receiver, iterations, &errors);
+
+	printf("typed: %s[%4zu bytes] manual[%6.1f ns/message] typed[%6.1f ns/message] errors[%u]\n",
+		   name, sizeof(T),
+		   iterations?(double) manual_nsec / iterations:0.0,
+		   iterations?(double) typed_nsec / iterations:0.0,
+		   errors);
+
+	s_udp_destroy_channel(&sender);
+	s_udp_destroy_channel(&receiver);
+	s_udp_destroy_pool(&pool);
+}
+
+
+void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s [-n iterations]\n\n", name);
+	fprintf(stderr, "-n iterations  Messages to send of each size. Default %d\n", DEFAULT_ITERATIONS);
+}
+
+
+int main(int argc, char* argv[])
+{
+	uint32_t iterations = DEFAULT_ITERATIONS;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+
+		default: /* '?' */
+			usage(argv[0]);
+			exit(255);
+		}
+	}
+
+	bench<small_t>("small", iterations);
+	bench<large_t>("large", iterations);
+	exit(0);
+}